@@ -0,0 +1,101 @@
+/*
+* CPU interpreter benchmark. Runs the official opcode part of nestest.nes (automation mode, starting at $C000)
+* over and over on a flat 64KB memory and reports the number of emulated instructions per second.
+*
+* Usage: BenchCPU [path to nestest.nes] [seconds] [--decode-cache]
+*/
+#include "cpu.h"
+#include "rom.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//nestest runs 5003 official opcodes before the first illegal opcode test
+#define NESTEST_OFFICIAL_INSTRUCTIONS 5003
+
+static uint8_t memory[0x10000];
+static uint8_t* codePages[0x100];
+static CPUDecodeCache decodeCache;
+static CPU cpu;
+
+static uint8_t BenchRead(void* context, uint16_t addr) {
+    if (addr < 0x2000)
+        addr &= 0x7FF;
+    return memory[addr];
+}
+
+static void BenchWrite(void* context, uint16_t addr, uint8_t data) {
+    if (addr < 0x2000)
+        addr &= 0x7FF;
+    memory[addr] = data;
+    if (decodeCache.page_has_code[addr >> 8])
+        CPU_InvalidateDecodedMemory(&cpu, addr);
+}
+
+static void BenchTick(void* context, uint16_t addr) {}
+
+//Processor time used, so the result is less affected by other processes running on the machine
+static double GetSeconds() {
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char** argv) {
+    const char* rompath = (argc > 1) ? argv[1] : "nestest.nes";
+    double seconds = (argc > 2) ? atof(argv[2]) : 3.0;
+    bool useDecodeCache = (argc > 3) && strcmp(argv[3], "--decode-cache") == 0;
+
+    FILE* romFile = fopen(rompath, "rb");
+    if (romFile == NULL) {
+        perror("Error opening nestest.nes");
+        return 1;
+    }
+    INESHeader ines;
+    if (INES_ReadHeader(&ines, romFile) != 0) {
+        fprintf(stderr, "Error reading %s: Invalid iNES ROM file format.\n", rompath);
+        fclose(romFile);
+        return 1;
+    }
+    char* prg = INES_ReadPRG(&ines, romFile);
+    fclose(romFile);
+
+    CPU_Init(&cpu, (CPUCallbacks){
+        .onread = &BenchRead,
+        .onwrite = &BenchWrite,
+        .ontick = &BenchTick
+    });
+    if (useDecodeCache) {
+        for (int p = 0; p < 0x100; p++)
+            codePages[p] = &memory[(p < 0x20) ? (p * 0x100) % 0x800 : p * 0x100];
+        CPU_SetDecodeCache(&cpu, &decodeCache, codePages);
+    }
+
+    unsigned long long instructions = 0, cycles = 0;
+    double start = GetSeconds(), elapsed;
+    do {
+        //Reload RAM and ROM, then run nestest from the automation entry point
+        memset(memory, 0, sizeof(memory));
+        memcpy(memory + 0xC000, prg, ines.prg_bytes);
+        memory[0xFFFC] = 0x00;
+        memory[0xFFFD] = 0xC0;
+        CPU_InvalidateDecodeCache(&cpu, 0x00, 0xFF);
+        CPU_PowerOn(&cpu);
+
+        for (int i = 0; i < NESTEST_OFFICIAL_INSTRUCTIONS; i++) {
+            if (CPU_Exec(&cpu) != 0) {
+                fprintf(stderr, "CPU crashed at $%04X\n", cpu.state.pc);
+                return 1;
+            }
+        }
+        instructions += NESTEST_OFFICIAL_INSTRUCTIONS;
+        cycles += cpu.state.cycles;
+        elapsed = GetSeconds() - start;
+    } while (elapsed < seconds);
+
+    printf("Decode cache: %s\n", useDecodeCache ? "on" : "off");
+    printf("%llu instructions, %llu cycles in %.3f s\n", instructions, cycles, elapsed);
+    printf("%.2f M instructions/s, %.2f M cycles/s\n", instructions / elapsed / 1e6, cycles / elapsed / 1e6);
+
+    free(prg);
+    return 0;
+}
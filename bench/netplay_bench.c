@@ -0,0 +1,148 @@
+/*
+* Netplay benchmark. Runs two players in one process, connected by a transport with artificial latency and jitter,
+* each pressing random buttons. Reports the snapshot (save state) cost, the rollbacks needed and what they cost, and
+* checks that the players never desynced and end in the same console state.
+*
+* Usage: BenchNetplay <rom.nes> [frames] [latency] [jitter] [input delay] [--udp]
+* Latency and jitter are in frames with the in-process loopback, or in milliseconds with --udp (ports 27910-27911).
+*/
+#include "netplay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SNAPSHOT_ITERATIONS 10000
+#define UDP_PORT 27910
+
+//Processor time used, so the result is less affected by other processes running on the machine
+static double GetSeconds() {
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+//Random buttons that change every 8 frames
+static uint8_t RandomButtons(uint64_t* rng, unsigned long frame, uint8_t* buttons) {
+    if (frame % 8 == 0) {
+        *rng = *rng * 6364136223846793005ULL + 1442695040888963407ULL;
+        *buttons = (uint8_t)(*rng >> 56);
+    }
+    return *buttons;
+}
+
+static void PrintStats(int player, Netplay* np) {
+    NetplayStats s;
+    Netplay_GetStats(np, &s);
+    printf("Player %d: %llu frames, %llu stalls, %llu mispredictions, %llu rollbacks, %llu frames resimulated\n",
+        player + 1, s.frames, s.stalls, s.mispredictions, s.rollbacks, s.frames_resimulated);
+    if (s.rollbacks > 0 && s.resim_seconds > 0) {
+        printf("  %.2f frames per rollback, %.1f us per rollback, %.0f frames resimulated per second\n",
+            (double)s.frames_resimulated / s.rollbacks, s.resim_seconds * 1e6 / s.rollbacks,
+            s.frames_resimulated / s.resim_seconds);
+    }
+    printf("  %llu checksums compared, %llu desyncs\n", s.checksums_compared, s.desyncs);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage: %s <rom.nes> [frames] [latency] [jitter] [input delay] [--udp]\n", argv[0]);
+        return 1;
+    }
+    bool udp = strcmp(argv[argc - 1], "--udp") == 0;
+    if (udp)
+        argc--;
+    unsigned long frames = (argc > 2) ? strtoul(argv[2], NULL, 10) : 3000;
+    unsigned latency = (argc > 3) ? (unsigned)atoi(argv[3]) : (udp ? 30 : 4);
+    unsigned jitter = (argc > 4) ? (unsigned)atoi(argv[4]) : (udp ? 10 : 2);
+    int inputDelay = (argc > 5) ? atoi(argv[5]) : 1;
+
+    Emulator* emus[2] = { Emu_Create(), Emu_Create() };
+    for (int i = 0; i < 2; i++) {
+        if (Emu_LoadROM(emus[i], argv[1]) != 0)
+            return 1;
+    }
+
+    //Snapshot cost: One save per frame, plus a load and a save per resimulated frame on rollback
+    size_t size = Emu_SaveStateSize(emus[0]);
+    uint8_t* state = malloc(size);
+    double start = GetSeconds();
+    for (int i = 0; i < SNAPSHOT_ITERATIONS; i++)
+        Emu_SaveState(emus[0], state, size);
+    double saveTime = GetSeconds() - start;
+    start = GetSeconds();
+    for (int i = 0; i < SNAPSHOT_ITERATIONS; i++)
+        Emu_LoadState(emus[0], state, size);
+    double loadTime = GetSeconds() - start;
+    printf("Snapshot: %zu bytes, save %.3f us, load %.3f us\n", size,
+        saveTime * 1e6 / SNAPSHOT_ITERATIONS, loadTime * 1e6 / SNAPSHOT_ITERATIONS);
+
+    NetLoopback* loopback = NULL;
+    NetUDP* sockets[2] = { NULL, NULL };
+    NetTransport transports[2];
+    if (udp) {
+        sockets[0] = NetUDP_Create(UDP_PORT, UDP_PORT + 1, latency, jitter);
+        sockets[1] = NetUDP_Create(UDP_PORT + 1, UDP_PORT, latency, jitter);
+        if (sockets[0] == NULL || sockets[1] == NULL)
+            return 1;
+        for (int i = 0; i < 2; i++)
+            transports[i] = NetUDP_GetTransport(sockets[i]);
+    } else {
+        loopback = NetLoopback_Create(latency, jitter, 1);
+        for (int i = 0; i < 2; i++)
+            transports[i] = NetLoopback_GetTransport(loopback, i);
+    }
+    printf("%s, latency %u, jitter %u %s, input delay %d\n", udp ? "UDP" : "Loopback", latency, jitter,
+        udp ? "ms" : "frames", inputDelay);
+
+    Netplay* players[2];
+    uint64_t rngs[2] = { 1, 2 };
+    uint8_t buttons[2] = { 0, 0 };
+    for (int i = 0; i < 2; i++)
+        players[i] = Netplay_Create(emus[i], transports[i], i, inputDelay);
+
+    //Run both players, then keep polling until both have the other's input for all frames, so their states are final
+    start = GetSeconds();
+    for (;;) {
+        bool done = true;
+        for (int i = 0; i < 2; i++) {
+            Netplay* np = players[i];
+            int result = (np->frame < frames) ?
+                Netplay_RunFrame(np, RandomButtons(&rngs[i], np->frame, &buttons[i])) : Netplay_Poll(np);
+            if (result < 0)
+                return 1;
+            Emu_ClearAudioBuffer(emus[i]);
+            if (np->frame < frames || np->remote_count < frames || np->remote_ack < frames)
+                done = false;
+        }
+        if (done)
+            break;
+        if (loopback)
+            NetLoopback_Tick(loopback);
+    }
+    double runTime = GetSeconds() - start;
+
+    int result = 0;
+    for (int i = 0; i < 2; i++) {
+        PrintStats(i, players[i]);
+        if (players[i]->stats.desyncs > 0)
+            result = 1;
+    }
+    printf("Total: %.3f s, %.1f frames per second per player\n", runTime, frames * 2 / runTime);
+
+    uint8_t* state2 = malloc(size);
+    Emu_SaveState(emus[0], state, size);
+    Emu_SaveState(emus[1], state2, size);
+    bool same = memcmp(state, state2, size) == 0;
+    printf("Final state after frame %lu: %s\n", frames, same ? "Same" : "FAIL: Different");
+    if (!same)
+        result = 1;
+    free(state2);
+
+    for (int i = 0; i < 2; i++) {
+        Netplay_Free(players[i]);
+        NetUDP_Free(sockets[i]);
+        Emu_Free(emus[i]);
+    }
+    NetLoopback_Free(loopback);
+    free(state);
+    return result;
+}
@@ -0,0 +1,128 @@
+/*
+* Audio ring buffer benchmark. Streams bytes through the ring the way the front-end does: a frame of 16-bit samples
+* queued at a time (735 samples at 44.1 kHz and 60 fps), and consumed in chunks the size of an audio callback.
+* Reports the throughput of RingBuffer and of the byte-at-a-time ring it replaced, and checks that both pass the bytes
+* through unchanged.
+*
+* Both are run on one thread, so this measures the cost of the copies and not of sharing the ring between threads.
+*
+* Usage: BenchRingBuffer [megabytes]
+*/
+#include "ring_buffer.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RING_SIZE (2048 * 8)
+#define QUEUE_CHUNK (735 * 2)
+#define CONSUME_CHUNK 2048
+
+//The ring buffer before it was made lock-free: Copies a byte at a time, with a modulo per byte
+typedef struct {
+    void* buffer;
+    size_t size;
+    size_t head;
+    size_t tail;
+    size_t space;
+} OldRingBuffer;
+
+static void OldRingBuffer_Init(OldRingBuffer* buffer, size_t size)
+{
+    buffer->buffer = malloc(size);
+    buffer->size = size;
+    buffer->head = buffer->tail = 0;
+    buffer->space = size;
+}
+
+static void OldRingBuffer_Queue(OldRingBuffer* buffer, const void* src, size_t* len)
+{
+    if (*len > buffer->space)
+        *len = buffer->space;
+    char* dst = buffer->buffer;
+    for (size_t i = 0; i < *len; i++) {
+        dst[buffer->head] = ((char*)src)[i];
+        buffer->head = (buffer->head + 1) % buffer->size;
+    }
+    buffer->space -= *len;
+}
+
+static void OldRingBuffer_Consume(OldRingBuffer* buffer, void* dst, size_t* len)
+{
+    if (*len > (buffer->size - buffer->space))
+        *len = buffer->size - buffer->space;
+    char* src = buffer->buffer;
+    for (size_t i = 0; i < *len; i++) {
+        ((char*)dst)[i] = src[buffer->tail];
+        buffer->tail = (buffer->tail + 1) % buffer->size;
+    }
+    buffer->space += *len;
+}
+
+//Processor time used, so the result is less affected by other processes running on the machine
+static double GetSeconds() {
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+#define PATTERN_PERIOD 65521 //Prime, so chunks don't line up with the ring
+
+//The stream repeats this pattern, with enough extra bytes to copy a chunk from any point
+static uint8_t pattern[PATTERN_PERIOD + CONSUME_CHUNK + QUEUE_CHUNK];
+static uint8_t consumeData[CONSUME_CHUNK];
+
+typedef void (*QueueFunc)(void* ring, const void* src, size_t* len);
+typedef void (*ConsumeFunc)(void* ring, void* dst, size_t* len);
+
+static void NewQueue(void* ring, const void* src, size_t* len) { RingBuffer_Queue(ring, src, len); }
+static void NewConsume(void* ring, void* dst, size_t* len) { RingBuffer_Consume(ring, dst, len); }
+static void OldQueue(void* ring, const void* src, size_t* len) { OldRingBuffer_Queue(ring, src, len); }
+static void OldConsume(void* ring, void* dst, size_t* len) { OldRingBuffer_Consume(ring, dst, len); }
+
+//Stream total bytes through a ring. Returns the time taken, or -1 if the bytes didn't come out unchanged.
+static double Stream(QueueFunc queue, ConsumeFunc consume, void* ring, size_t total) {
+    size_t queued = 0, consumed = 0;
+    bool ok = true;
+    double start = GetSeconds();
+    while (consumed < total) {
+        //Queue a frame of samples, like the emulator
+        size_t len = total - queued < QUEUE_CHUNK ? total - queued : QUEUE_CHUNK;
+        queue(ring, &pattern[queued % PATTERN_PERIOD], &len);
+        queued += len;
+        //Consume a chunk, like the audio callback
+        len = CONSUME_CHUNK;
+        consume(ring, consumeData, &len);
+        ok &= memcmp(consumeData, &pattern[consumed % PATTERN_PERIOD], len) == 0;
+        consumed += len;
+    }
+    double time = GetSeconds() - start;
+    return ok ? time : -1;
+}
+
+int main(int argc, char** argv) {
+    long megabytes = (argc > 1) ? atol(argv[1]) : 256;
+    size_t total = (size_t)megabytes << 20;
+
+    RingBuffer ring;
+    RingBuffer_Init(&ring, RING_SIZE);
+    OldRingBuffer oldRing;
+    OldRingBuffer_Init(&oldRing, RING_SIZE);
+
+    for (size_t i = 0; i < sizeof(pattern); i++)
+        pattern[i] = (uint8_t)((i % PATTERN_PERIOD) * 7 + (i % PATTERN_PERIOD >> 8));
+
+    double newTime = Stream(NewQueue, NewConsume, &ring, total);
+    double oldTime = Stream(OldQueue, OldConsume, &oldRing, total);
+    if (newTime < 0 || oldTime < 0) {
+        printf("FAIL: %s output differs from its input.\n", newTime < 0 ? "RingBuffer" : "Old ring buffer");
+        return 1;
+    }
+
+    printf("Streamed %ld MB through a %d byte ring\n", megabytes, RING_SIZE);
+    printf("RingBuffer: %.0f MB/s\n", megabytes / newTime);
+    printf("Old ring buffer: %.0f MB/s\n", megabytes / oldTime);
+
+    RingBuffer_Destroy(&ring);
+    free(oldRing.buffer);
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+* Save state benchmark. Runs a ROM for a while, then reports the size of a save state and the time to save and load it.
+* Also checks that running from a loaded state reproduces the same video and audio output.
+*
+* Usage: BenchSaveState <rom.nes> [iterations]
+*/
+#include "emulator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define WARMUP_FRAMES 120
+#define CHECK_FRAMES 60
+
+//Processor time used, so the result is less affected by other processes running on the machine
+static double GetSeconds() {
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+//FNV-1a hash of the video and audio output of a number of frames
+static uint64_t RunFrames(Emulator* emu, int frames) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int f = 0; f < frames; f++) {
+        Emu_RunFrame(emu);
+        int w, h;
+        size_t len;
+        const uint8_t* pixels = (const uint8_t*)Emu_GetPixelBuffer(emu, &w, &h);
+        const uint8_t* audio = Emu_GetAudioBuffer(emu, &len);
+        for (size_t i = 0; i < (size_t)w * h * sizeof(RGBAPixel); i++)
+            hash = (hash ^ pixels[i]) * 0x100000001B3ULL;
+        for (size_t i = 0; i < len; i++)
+            hash = (hash ^ audio[i]) * 0x100000001B3ULL;
+        Emu_ClearAudioBuffer(emu);
+    }
+    return hash;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage: %s <rom.nes> [iterations]\n", argv[0]);
+        return 1;
+    }
+    long iterations = (argc > 2) ? atol(argv[2]) : 100000;
+
+    Emulator* emu = Emu_Create();
+    if (Emu_LoadROM(emu, argv[1]) != 0) {
+        Emu_Free(emu);
+        return 1;
+    }
+    RunFrames(emu, WARMUP_FRAMES);
+
+    size_t size = Emu_SaveStateSize(emu);
+    uint8_t* state = malloc(size);
+    uint8_t* state2 = malloc(size);
+    if (Emu_SaveState(emu, state, size) != size) {
+        printf("FAIL: Could not save state.\n");
+        return 1;
+    }
+
+    //Running from a loaded state must give the same output and end in the same state
+    uint64_t first = RunFrames(emu, CHECK_FRAMES);
+    Emu_SaveState(emu, state2, size);
+    if (Emu_LoadState(emu, state, size) != 0) {
+        printf("FAIL: Could not load state.\n");
+        return 1;
+    }
+    uint64_t second = RunFrames(emu, CHECK_FRAMES);
+    Emu_SaveState(emu, state, size);
+    if (first != second || memcmp(state, state2, size) != 0) {
+        printf("FAIL: Output differs after loading a state.\n");
+        return 1;
+    }
+
+    double start = GetSeconds();
+    for (long i = 0; i < iterations; i++)
+        Emu_SaveState(emu, state, size);
+    double saveTime = GetSeconds() - start;
+
+    start = GetSeconds();
+    for (long i = 0; i < iterations; i++)
+        Emu_LoadState(emu, state, size);
+    double loadTime = GetSeconds() - start;
+
+    printf("State size: %zu bytes\n", size);
+    printf("Save: %.3f us\n", saveTime * 1e6 / iterations);
+    printf("Load: %.3f us\n", loadTime * 1e6 / iterations);
+
+    free(state);
+    free(state2);
+    Emu_Free(emu);
+    return 0;
+}
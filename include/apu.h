@@ -3,9 +3,20 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <limits.h>
 
 #define APU_SAMPLE_CAPACITY 1024 //Max number of samples in buffer
 
+//Band-limited synthesis: Each step is spread over APU_BLIP_TAPS output samples, with the kernel picked from
+//APU_BLIP_PHASES sub-sample positions. Kernel values are fixed-point with APU_BLIP_SHIFT fraction bits.
+#define APU_BLIP_TAPS 16
+#define APU_BLIP_PHASES 32
+#define APU_BLIP_SHIFT 12
+#define APU_BLIP_SIZE (APU_SAMPLE_CAPACITY + APU_BLIP_TAPS)
+
+#define APU_MIX_SHIFT 15 //Fraction bits of the mixer tables
+#define APU_LEVEL_SHIFT 8 //Fraction bits of the channel levels, so lowered channel volumes keep their sub-step detail
+
 
 //Callback to schedule a DMC DMA
 typedef void(*APUDMAFn)(void *context, uint16_t addr);
@@ -45,6 +56,13 @@ static const int16_t DMC_RATE_TABLE[2][16] = {
 };
 
 
+//Frame counter sequencer step timings in CPU cycles since the frame counter was reset, for the 4-step and 5-step sequence.
+//The 5-step sequence's 4th step (29829) does nothing and is left out.
+static const unsigned APU_FC_STEP_CYCLES[2][4] = {
+    {7457, 14913, 22371, 29829},
+    {7457, 14913, 22371, 37281}
+};
+
 typedef enum {
     APU_CH_PULSE1 = 0,
     APU_CH_PULSE2,
@@ -56,6 +74,11 @@ typedef enum {
     APU_NUM_VOL_SETTINGS
 } APU_Channel;
 
+typedef enum {
+    APU_SYNTH_POINT, //Mix all channels and take a sample every time the sample timer runs out
+    APU_SYNTH_BANDLIMITED //Record the steps of the mixed output and turn them into band-limited samples each frame
+} APU_Synthesis;
+
 typedef enum {
     FC_IRQ_INHIBIT  = 1 << 6, //IRQ inhibit
     FC_5STEP         = 1 << 7  //Sequencer mode (0 = 4-step, 1 = 5-step)
@@ -157,6 +180,7 @@ typedef struct {
     bool fc_irq;
     uint8_t fc_ctrl; //Frame counter control ($4017)
     unsigned fc_cycles; //Frame counter cycle count (CPU cycles, divide by 2 for APU cycles)
+    uint8_t fc_step; //Index of the next frame counter sequencer step in APU_FC_STEP_CYCLES
 } APUState;
 
 
@@ -166,13 +190,50 @@ typedef struct {
 
     APUState state;
 
+    /*
+    * Catch-up: APU_CPUCycle() only counts cycles, and APU_Sync() runs them when the APU's state is needed, advancing
+    * each channel's timer over all of them at once. It's needed when a register is accessed, when a DMC sample is
+    * loaded and at frame counter steps, which all sync first, and at syncDeadline, when the DMC must ask for a DMA.
+    */
+    unsigned pendingCycles; //Cycles counted by APU_CPUCycle() that haven't run yet
+    unsigned syncDeadline; //Sync when this many cycles are pending
+
     double volume[APU_NUM_VOL_SETTINGS]; //Volume levels of each channel between 0.0 and 1.0
     bool mute[APU_NUM_VOL_SETTINGS];
 
+    /*
+    * Nonlinear mixer lookup tables, rebuilt by _APU_BuildMixer() when a volume or mute setting changes.
+    * levelTable maps a channel's output to its level with the channel's volume and mute applied, with APU_LEVEL_SHIFT
+    * fraction bits. pulseTable is indexed by the whole part of the sum of the pulse levels, tndTable by the whole part
+    * of 3 * triangle + 2 * noise + DMC, and the fraction interpolates to the next entry. Their entries are samples with
+    * APU_MIX_SHIFT fraction bits, with the master volume and mute applied. The last entry is only interpolated to.
+    */
+    uint16_t levelTable[APU_NUM_CHANNELS][128];
+    int32_t pulseTable[32];
+    int32_t tndTable[204];
+
     double cpuCyclesPerSample;
     double cycleSampleTimer; //Increments every CPU cycle. When cpuCyclesPerSample cycles have run, output a sample.
     short sampleBuffer[APU_SAMPLE_CAPACITY]; //Sample output buffer
     size_t sampleBufferSize;
+    bool skipOutput; //Don't mix or output samples. The sample timer still runs, so output resumes in step.
+
+    /*
+    * Band-limited synthesis. The mixed output is only recomputed when a channel's output changed, and each
+    * change is added to blipBuffer as the derivative of a band-limited step at its position in output samples.
+    * APU_EndFrame() sums the buffer up to the frame's end into samples. Frames with skipOutput set are not counted
+    * in the time, so frames run and then undone (run-ahead, netplay rollback) leave no trace in the audio.
+    */
+    APU_Synthesis synthesis;
+    double samplesPerCycle;
+    unsigned blipCycles; //CPU cycles run in frames with output since the last APU_EndFrame()
+    double blipOffset; //Position of the first of those cycles in output samples, between 0 and 1
+    uint8_t blipChannels[APU_NUM_CHANNELS]; //Channel outputs blipLevel was mixed from
+    unsigned blipActive; //Channels whose output can change when their waveform moves, as bits 1 << APU_Channel
+    int16_t blipLevel; //Output level after the last recorded step
+    int32_t blipSum; //Output level of the last sample made, with APU_BLIP_SHIFT fraction bits
+    int32_t blipBuffer[APU_BLIP_SIZE];
+    int16_t blipKernel[APU_BLIP_PHASES][APU_BLIP_TAPS];
 } APU;
 
 
@@ -186,10 +247,49 @@ void APU_Reset(APU* apu);
 
 uint8_t APU_Read(APU* apu, uint16_t addr);
 void APU_Write(APU* apu, uint16_t addr, uint8_t data);
-void APU_CPUCycle(APU* apu);
+/*
+* Run the cycles counted by APU_CPUCycle() that haven't run yet, making samples on the way. Call it before accessing
+* the APU state directly, and after changing it directly.
+*/
+void APU_Sync(APU* apu);
+//Count a CPU cycle. Only syncs when it's due; the APU functions sync first when they need to.
+static inline void APU_CPUCycle(APU* apu)
+{
+    if (++apu->pendingCycles >= apu->syncDeadline)
+        APU_Sync(apu);
+}
+//Count a number of CPU cycles, syncing on the same cycles as APU_CPUCycle() would
+static inline void APU_CPUCycles(APU* apu, unsigned cycles)
+{
+    while (cycles >= apu->syncDeadline - apu->pendingCycles) {
+        cycles -= apu->syncDeadline - apu->pendingCycles;
+        apu->pendingCycles = apu->syncDeadline;
+        APU_Sync(apu);
+    }
+    apu->pendingCycles += cycles;
+}
+/*
+* End an emulated frame. In band-limited mode, the samples up to now are made and added to the audio buffer.
+* Does nothing in point sampling mode, where samples are made as the CPU cycles run.
+*/
+void APU_EndFrame(APU* apu);
+
+//Set how audio samples are made. Can be changed at any time; band-limited output starts from silence.
+void APU_SetSynthesis(APU* apu, APU_Synthesis synthesis);
 
 bool APU_IRQSignal(APU *apu);
 
+/*
+* Get the number of APU_CPUCycle() calls, counting the next one, after which the next frame counter
+* sequencer step is due. The frame counter is reset by writing $4017, so this changes after $4017 writes.
+*/
+unsigned APU_CyclesUntilFrameStep(APU* apu);
+/*
+* Run the next frame counter sequencer step (quarter frame, half frame and frame interrupt).
+* Call this right after the APU_CPUCycle() call that APU_CyclesUntilFrameStep() counted to.
+*/
+void APU_FrameCounterStep(APU* apu);
+
 void* APU_GetAudioBuffer(APU* apu, size_t* len);
 void APU_ClearAudioBuffer(APU* apu);
 
@@ -206,11 +306,32 @@ bool APU_GetChannelMute(APU* apu, APU_Channel channel);
 void APU_SetChannelMute(APU* apu, APU_Channel channel, bool mute);
 
 
-//Mix output of all channels and return audio output as a value between 0.0 and 1.0
-double _APU_MixAudio(APU* apu);
-
-//Clock frame counter by 1 CPU cycle
-void _APU_FC_Clock(APU* apu);
+//Build the mixer lookup tables from the volume and mute settings
+void _APU_BuildMixer(APU* apu);
+//Mix channel outputs (as returned by _APU_ChannelOutput()) into an audio sample
+int16_t _APU_MixOutputs(APU* apu, const uint8_t outputs[APU_NUM_CHANNELS]);
+//Mix the output of all channels into an audio sample
+int16_t _APU_MixAudio(APU* apu);
+
+//Get the output of a channel (not the master volume), 0-15 or 0-127 for the DMC
+uint8_t _APU_ChannelOutput(APU* apu, APU_Channel channel);
+//Band-limited mode: Mix the output again, and if it changed, record the step at the current time
+void _APU_UpdateOutput(APU* apu);
+//Band-limited mode: Add a step of delta to the output at cpuCycles since the start of the frame
+void _APU_AddStep(APU* apu, unsigned cpuCycles, int delta);
+
+//Run cycles CPU cycles in point sampling mode, taking samples on the way
+void _APU_RunPoint(APU* apu, unsigned cycles);
+//Run cycles CPU cycles in band-limited mode, recording the steps of the output on the way
+void _APU_RunBandlimited(APU* apu, unsigned cycles);
+//Band-limited mode: Get the number of cycles until the waveform of a channel in blipActive next moves, or UINT_MAX
+unsigned _APU_CyclesUntilMove(APU* apu);
+//Get the number of cycles after which the DMC must ask for a DMA, or UINT_MAX if it has no bytes left to fetch
+unsigned _APU_CyclesUntilDMCFetch(APU* apu);
+
+//Clock channel timers and frame counter by cycles CPU cycles. The sequencer steps are run separately by APU_FrameCounterStep().
+//Returns the channels whose waveform moved, as bits 1 << APU_Channel, so their output may have changed.
+unsigned _APU_FC_Clock(APU* apu, unsigned cycles);
 //APU frame counter "quarter frame" clock: Clock envelopes & triangle linear counter
 void _APU_FC_ClockQuarterFrame(APU* apu);
 //APU frame counter "half frame" clock: Clock length counters & sweep units
@@ -223,22 +344,25 @@ void _APULength_Clock(APULength* length);
 
 //Clock APU envelope. Clocked by frame counter every quarter frame.
 void _APUEnv_Clock(APUEnvelope* env, bool loop);
-//Clock pulse wave timer. Clocked every APU cycle.
-void _APUPulse_ClockWave(APUPulse* pulse);
+//Clock pulse wave timer clocks times. Clocked every APU cycle. Returns the number of times the sequencer moved.
+unsigned _APUPulse_ClockWave(APUPulse* pulse, unsigned clocks);
 //Clock pulse sweep timer. Clocked by frame counter. Pulse channels 1 and 2 add the sweep period change differently.
 void _APUPulse_ClockSweep(APUPulse* pulse, bool isCh1);
 
-//Clock triangle wave timer. Clocked every CPU cycle.
-void _APUTriangle_ClockWave(APUTriangle* tri);
+//Clock triangle wave timer clocks times. Clocked every CPU cycle. Returns the number of times the sequencer moved.
+unsigned _APUTriangle_ClockWave(APUTriangle* tri, unsigned clocks);
 //Clock triangle linear counter.  Clocked by frame counter every quarter frame.
 void _APUTriangle_ClockLinearCtr(APUTriangle* tri);
 
-//Clock noise LFSR timer. Clocked every CPU cycle.
-void _APUNoise_ClockLFSR(APUNoise* noise);
+//Clock noise LFSR timer clocks times. Clocked every CPU cycle. Returns the number of times the LFSR shifted.
+unsigned _APUNoise_ClockLFSR(APUNoise* noise, unsigned clocks);
 
 void _APUDMC_RestartSample(APU_DMC* dmc);
-//Clocked every CPU cycle.
-void _APUDMC_Clock(APU* apu);
+//Clock the DMC output unit, when its timer runs out. Returns true if the output unit was clocked while not silenced, or was unsilenced.
+bool _APUDMC_ClockOutput(APU_DMC* dmc);
+//Clocked every CPU cycle, run for cycles CPU cycles. Returns true if the output unit was clocked while not silenced,
+//or was unsilenced.
+bool _APUDMC_Clock(APU* apu, unsigned cycles);
 
 /*Returns the pulse channel target period calculated by the sweep unit.
 * Channels 1 and 2 negate the period change amount (period >> sweep.shift) differently:
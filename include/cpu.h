@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include "trace.h"
 
 //Opcode names for disassembly
 static const char* OPCODE_NAMES[256] = {
@@ -87,19 +88,71 @@ typedef struct CPU CPU;
 typedef uint8_t(*CPUReadFn)(void* context, uint16_t addr);
 typedef void(*CPUWriteFn)(void* context, uint16_t addr, uint8_t data);
 typedef CPUReadFn CPUPeekFn;
+typedef void(*CPUTickFn)(void* context, uint16_t addr);
 /*
 * @param nextAddr The address the CPU was going to read before it halted. Use this address to perform DMA dummy read cycles.
 */
 typedef void(*CPUHaltFn)(void* context, CPU *cpu, uint16_t nextAddr);
 
+#define CPU_IDLE_LOOP_MAX 4 //Maximum number of instructions in an idle loop, including the jump back
+
+/*
+* A loop of memory reads (LDA/LDX/LDY/BIT/CMP/CPX/CPY/AND/ORA/EOR, immediate, zero page or absolute) ending with a JMP or
+* branch back to its start, e.g. "wait: BIT $2002; BPL wait" or "wait: LDA flag; BEQ wait".
+* The CPU has run it twice in a row with the same registers and cycle count, so every further iteration is identical
+* until the memory it reads changes or an interrupt happens.
+*/
+typedef struct {
+    uint16_t start;
+    int length; //Number of instructions
+    uint8_t opcodes[CPU_IDLE_LOOP_MAX];
+    int32_t addrs[CPU_IDLE_LOOP_MAX]; //Address read by each instruction, -1 for immediate operands and the jump back
+    unsigned cycles; //Cycles per iteration
+} CPUIdleLoop;
+
+/*
+* Called at the start of an idle loop. The host can skip whole iterations by running their bus cycles itself, as long as
+* nothing during them could end the loop. The skipped reads are not done, so loops that read registers with side effects
+* should only be skipped if repeating those reads changes nothing.
+*
+* @return The number of iterations skipped. The CPU cycle counter is advanced by their cycles.
+*/
+typedef unsigned long(*CPUIdleFn)(void* context, CPU *cpu, const CPUIdleLoop *loop);
+
 typedef struct {
     void *context; //Context pointer that is passed to every callback
     CPUReadFn onread; //Called on CPU memory read cycles. This function should read from memory at the address passed to it, and return the read value.
     CPUWriteFn onwrite; //Called on CPU memory write cycles. This function should write to memory at the address passed to it.
     CPUPeekFn onpeek; //Peek at values in memory without side-effects. Not required for normal execution, but used by functions like CPU_Disassemble().
     CPUHaltFn onhalt; //Called when the CPU is halted. Use this to implement DMAs.
+    CPUTickFn ontick; //Called instead of onread for instruction fetches served from the decode cache. Optional; onread is called if not set.
+    CPUIdleFn onidle; //Called when an idle loop is detected. Optional; requires the decode cache.
 } CPUCallbacks;
 
+//An instruction decoded from a code page
+typedef struct {
+    uint32_t gen; //Generation of the code page when the instruction was decoded. The entry is valid while it matches the page's generation.
+    uint8_t opcode;
+    uint8_t operands[2];
+    uint8_t length;
+    uint8_t cycles; //Base cycle count, without page crossing and branch cycles
+} CPUDecodedInstr;
+
+/*
+* Decoded instruction cache, indexed by CPU address.
+* Only instructions that lie entirely in one code page are cached. Code pages are 256 byte CPU memory pages that can be
+* read directly without side effects (RAM, PRG ROM). Opcode and operand fetches of cached instructions still take a bus
+* cycle each, but skip the memory read.
+*/
+typedef struct {
+    uint8_t* const* code_pages; //Pointers to the memory of each CPU page, NULL if the page can't be read directly
+    uint32_t page_gen[0x100]; //Incremented when a page is invalidated. Also used to validate cached blocks.
+    bool page_has_code[0x100]; //Set if instructions have been cached from the page or a page mirroring the same memory
+    CPUDecodedInstr entries[0x10000];
+} CPUDecodeCache;
+
+typedef struct CPUBlockCache CPUBlockCache;
+
 struct CPU {
     //Callback functions
     CPUCallbacks callbacks;
@@ -111,8 +164,17 @@ struct CPU {
     bool nmi_detected; //Set when NMI signal goes from low to high
     bool halt;
 
-    //Log file
-    FILE* log;
+    CPUDecodeCache* decode_cache;
+    const uint8_t* cached_operands; //Operands of the current instruction if it came from the decode cache
+    CPUBlockCache* block_cache; //Block cache used by CPU_ExecBlock(), see cpu_block_cache.h
+    bool block_exit; //Set to end the running block after the current instruction
+
+    //Idle loop detection
+    CPUState idle_state; //Registers and cycle counter at the start of the last iteration of a backward jump or branch
+    unsigned idle_cycles; //Cycle count of the last iteration, 0 if the last jump back went somewhere else
+
+    //Trace, NULL if tracing is off
+    CPUTrace* trace;
 
     //Debug info
     uint16_t instr_addr; //Address of current instruction being executed
@@ -181,6 +243,28 @@ uint8_t CPU_Read(CPU *cpu, uint16_t addr, AccessType access);
 void CPU_Write(CPU *cpu, uint16_t addr, uint8_t data, AccessType access);
 
 
+/*
+* Enable the decoded instruction cache, or disable it if cache is NULL.
+* The host must call CPU_InvalidateDecodeCache() when code pages are remapped, and CPU_InvalidateDecodedMemory()
+* after writing to memory that instructions may have been cached from.
+*
+* @param codePages 256 entry table of directly readable CPU memory pages. Must stay valid while the cache is enabled.
+*/
+void CPU_SetDecodeCache(CPU *cpu, CPUDecodeCache *cache, uint8_t* const* codePages);
+
+//Invalidate cached instructions in a range of CPU pages.
+void CPU_InvalidateDecodeCache(CPU *cpu, uint8_t startPage, uint8_t endPage);
+
+//Invalidate cached instructions decoded from the same memory as the page containing addr, including mirrors of the page.
+void CPU_InvalidateDecodedMemory(CPU *cpu, uint16_t addr);
+
+/*
+* End the running block after the current instruction, so the host sees the CPU state at the next instruction boundary.
+* Call this from a bus callback when the host's run loop has to stop, e.g. at the end of a frame.
+*/
+void CPU_EndBlock(CPU *cpu);
+
+
 /*
 * Print the disassembly of an instruction at an address to a string buffer of size n.
 * Requires the CPU Peek callback to be set with CPU_SetPeekFn().
@@ -191,10 +275,9 @@ void CPU_Write(CPU *cpu, uint16_t addr, uint8_t data, AccessType access);
 int CPU_Disassemble(CPU* cpu, uint16_t instr_addr, char* buffer, size_t n);
 
 /*
-* Set log file stream.
-*
-* @param log Log file stream
+* Record executed instructions, interrupts and optionally bus accesses to a trace, or stop tracing if trace is NULL.
+* The block cache and idle loop detection are off while tracing, so every instruction is recorded.
 */
-void CPU_SetLogFile(CPU* cpu, FILE* logfile);
+void CPU_SetTrace(CPU* cpu, CPUTrace* trace);
 
 #endif
\ No newline at end of file
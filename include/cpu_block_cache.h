@@ -0,0 +1,54 @@
+#ifndef CPU_BLOCK_CACHE_H
+#define CPU_BLOCK_CACHE_H
+
+#include "cpu.h"
+
+/*
+* Optional basic block cache for the CPU.
+*
+* Hot basic blocks in PRG ROM are stored as lists of per-opcode step functions with their operands, so running one
+* skips the decode cache lookup and the opcode switch of every instruction. The step functions do the same bus accesses
+* as the interpreter, so cycle timing and I/O behavior are unchanged. Consecutive cached blocks run without returning to
+* the caller. Blocks are validated against the decode cache page generations, so they are dropped when their pages are
+* remapped. Code outside ROM pages (RAM, PRG RAM) always runs in the interpreter.
+*/
+
+/*
+* Create a block cache.
+*
+* @return NULL if memory could not be allocated.
+*/
+CPUBlockCache* CPUBlockCache_Create();
+
+void CPUBlockCache_Free(CPUBlockCache* cache);
+
+//Drop all cached blocks.
+void CPUBlockCache_Flush(CPUBlockCache* cache);
+
+/*
+* Attach a block cache to a CPU, or detach it if cache is NULL. Requires the decode cache to be enabled.
+*
+* @param romPages 256 entry table, true for CPU pages that are read-only memory. Must stay valid while the cache is attached.
+*/
+void CPU_SetBlockCache(CPU* cpu, CPUBlockCache* cache, const bool* romPages);
+
+/*
+* Execute basic blocks from the block cache, until one isn't cached. Runs one instruction with the interpreter instead if
+* no block cache is attached, the code at PC is not in ROM, or it has not run often enough to be cached yet.
+* Stops early after an interrupt or a call to CPU_EndBlock().
+*
+* @return 0 on success, -1 if CPU executes an unimplemented or "crash" opcode.
+*/
+int CPU_ExecBlock(CPU* cpu);
+
+
+/* Internal functions used by the block cache, defined in cpu.c */
+
+//Run one instruction with pre-fetched operands. Returns nonzero if the block has to be exited after it.
+typedef int(*CPUBlockStepFn)(CPU* cpu, const uint8_t* operands);
+//Step functions of the official opcodes, NULL for other opcodes
+extern const CPUBlockStepFn _CPU_BLOCK_STEPS[256];
+//Decode the instruction at addr through the decode cache. Returns NULL if it can't be cached.
+const CPUDecodedInstr* _CPU_Decode(CPU* cpu, uint16_t addr);
+
+#endif
@@ -9,10 +9,35 @@ extern "C" {
 #include "rom.h"
 #include "mapper/mapper.h"
 #include "cpu.h"
+#include "cpu_block_cache.h"
 #include "ppu.h"
 #include "apu.h"
 #include "dma.h"
 #include "standard_controller.h"
+#include "scheduler.h"
+
+typedef enum {
+    //Run the PPU only when its state is needed: PPU register access, cartridge writes, vblank/NMI and frame end (default)
+    PPU_SYNC_CATCHUP = 0,
+    //Run 3 PPU cycles on every CPU cycle
+    PPU_SYNC_CYCLE
+} PPUSyncMode;
+
+typedef enum {
+    //Render the picture of every frame (default)
+    RENDER_EVERY_FRAME = 0,
+    //Render only every Nth frame, like when fast-forwarding
+    RENDER_EVERY_NTH_FRAME,
+    //Never render, for headless runs that don't look at the picture
+    RENDER_NEVER
+} RenderMode;
+
+//Emulation statistics
+typedef struct {
+    unsigned long long cpu_cycles; //CPU cycles run since power on
+    unsigned long long idle_skips; //Number of times idle loop iterations were skipped
+    unsigned long long idle_cycles; //CPU cycles spent in skipped idle loop iterations (not run by the CPU core)
+} EmuStats;
 
 struct Emulator {
     INESHeader rom_ines;
@@ -20,13 +45,48 @@ struct Emulator {
     PPU ppu;
     APU apu;
     DMAController dma;
-    StandardController controller;
+    StandardController controller; //Port 1
+    StandardController controller2; //Port 2
     Mapper mapper;
     uint8_t ram[0x800];
 
+    //CPU memory map by 256 byte page. Reads and writes to a page that is NULL go through the bus handlers
+    //(PPU/APU/IO registers, mapper registers); all other pages are plain memory accessed directly.
+    uint8_t* cpu_read_pages[0x100];
+    uint8_t* cpu_write_pages[0x100];
+    CPUDecodeCache decode_cache; //Decoded instructions from cpu_read_pages
+    CPUBlockCache* block_cache; //NULL if the block cache is disabled
+    unsigned long long run_frame; //Frame that Emu_RunFrame() is running. Blocks are ended when the PPU finishes it.
+
+    Scheduler scheduler;
+    PPUSyncMode ppu_sync_mode;
+    unsigned long long ppu_cycle; //Scheduler cycle the PPU has been run up to
+
+    bool idle_skip; //Skip iterations of idle loops (polling loops waiting for vblank or an NMI)
+    EmuStats stats;
+    unsigned long long input_polls; //Number of times the controller was strobed (button state latched) since power on
+
+    int run_ahead; //Frames Emu_RunFrame() runs ahead of the console state, 0 if run-ahead is disabled
+    Emulator* run_ahead_instance; //Second instance that runs the frames ahead, NULL to run them on this one and restore
+    bool is_run_ahead_instance; //This is the second instance of another emulator
+    uint8_t* run_ahead_state; //Save state buffer
+    size_t run_ahead_state_size;
+    bool run_ahead_synced; //The second instance is run_ahead frames ahead, run with run_ahead_buttons held
+    uint8_t run_ahead_buttons;
+
+    RGBAPixel* pixel_buffer; //Picture converted by Emu_GetPixelBuffer(), allocated on first use
+    void* framebuffer; //Caller's buffer each rendered frame is written to, see Emu_SetFramebuffer()
+    int framebuffer_pitch;
+    PixelFormat framebuffer_format;
+
+    RenderMode render_mode;
+    int render_interval; //N for RENDER_EVERY_NTH_FRAME
+    int render_counter; //Frames run since the last rendered frame
+
     char save_dir[256];
 
     int is_rom_loaded;
+    char rom_path[256];
 
     char save_path[256];
     FILE *save_file;
@@ -59,6 +119,11 @@ int Emu_IsROMLoaded(Emulator* emu);
 */
 void Emu_PowerOn(Emulator* emu);
 
+/**
+* Get a hash of the loaded ROM's PRG and CHR ROM, to check that a movie or another player's emulator uses the same ROM.
+*/
+uint64_t Emu_GetROMHash(Emulator* emu);
+
 /**
 * Run one frame.
 *
@@ -66,6 +131,97 @@ void Emu_PowerOn(Emulator* emu);
 */
 int Emu_RunFrame(Emulator* emu);
 
+/**
+* Set run-ahead, which hides the input lag of games. Each Emu_RunFrame() runs a frame, then runs more frames ahead with
+* the buttons held now and shows the picture of the last of them, so the result of a button press is seen that many
+* frames sooner. The console state stays at the first frame, and the audio is from it. Video and audio are not generated
+* for frames that aren't shown.
+*
+* @param frames Number of frames to run ahead, 0 to disable. Should not be more than the game's input lag.
+* @param secondInstance Run the frames ahead on a second emulator instead of saving and restoring the state every frame.
+* While the buttons don't change, the second instance only runs one frame per frame and no state is copied, at the cost
+* of the memory of a second emulator.
+*
+* @return 0 on success, -1 if the second instance couldn't be created.
+*/
+int Emu_SetRunAhead(Emulator* emu, int frames, bool secondInstance);
+
+/**
+* Set which frames have their picture rendered. Frames that aren't rendered skip pixel composition entirely, and the
+* pixel buffer keeps the last rendered picture. Sprite 0 hit and sprite overflow are still emulated exactly, so games
+* run the same whatever the mode.
+*
+* @param interval N for RENDER_EVERY_NTH_FRAME: The Nth frame run after this call is rendered, then every Nth frame.
+*/
+void Emu_SetRenderMode(Emulator* emu, RenderMode mode, int interval);
+
+/**
+* Get which of the next frames run will be rendered, so a front-end can skip preparing a framebuffer it won't get.
+*
+* @return 1 if the next frame is rendered, N if the Nth frame from now is the first rendered, -1 if none will be.
+*/
+int Emu_FramesUntilRender(Emulator* emu);
+
+/**
+* Set how the PPU is synchronized with the CPU. Both modes produce identical output.
+*/
+void Emu_SetPPUSyncMode(Emulator* emu, PPUSyncMode mode);
+
+/**
+* Enable or disable the CPU block cache, see cpu_block_cache.h. Output is identical to the interpreter.
+*
+* @return 0 on success, -1 if the block cache could not be allocated.
+*/
+int Emu_SetBlockCache(Emulator* emu, bool enable);
+
+/**
+* Enable or disable skipping of idle loops (enabled by default). Loops that poll memory without side effects, like
+* "BIT $2002; BPL" or waiting for a RAM flag set by the NMI handler, are run ahead to the next event that could end them
+* without executing their instructions. Output is identical either way.
+*/
+void Emu_SetIdleSkip(Emulator* emu, bool enable);
+
+//Get emulation statistics. Skipped idle loop cycles can be compared to the total to see how much CPU work was saved.
+void Emu_GetStats(Emulator* emu, EmuStats* stats);
+
+/**
+* Get the size in bytes of a save state of the loaded ROM.
+*/
+size_t Emu_SaveStateSize(Emulator* emu);
+
+/**
+* Save the console state (CPU, PPU, APU, DMA, controllers, RAM and the mapper registers, memory and bank mappings)
+* to a buffer. Call between frames or instructions, not from a bus callback.
+*
+* @return The number of bytes written, or 0 if no ROM is loaded or the buffer is smaller than Emu_SaveStateSize().
+*/
+size_t Emu_SaveState(Emulator* emu, void* buffer, size_t size);
+
+/**
+* Load a save state made with the same ROM. The buttons currently held on the controllers are kept, since they are
+* input rather than console state.
+*
+* @return 0 on success, -1 if the state is from another save state version or ROM, or is invalid. The console state
+* is unchanged on error.
+*/
+int Emu_LoadState(Emulator* emu, const void* buffer, size_t size);
+
+/**
+* Run one frame without generating video or audio, for frames that are never shown (like frames resimulated after
+* a rollback). Run-ahead is not used.
+*
+* @return 0 on success, -1 on error.
+*/
+int Emu_RunFrameHidden(Emulator* emu);
+
+/**
+* Set all buttons held on the standard controller connected to a port.
+*
+* @param port 0 for port 1, 1 for port 2
+* @param buttons ControllerButton flags
+*/
+void Emu_SetButtons(Emulator* emu, int port, uint8_t buttons);
+
 /**
 * Press a button on the standard controller connected to port 1.
 */
@@ -83,12 +239,33 @@ void Emu_SetAudioChannelVolume(Emulator* emu, APU_Channel channel, double volume
 bool Emu_GetAudioChannelMute(Emulator* emu, APU_Channel channel);
 //Set the output volume mute status of an APU channel.
 void Emu_SetAudioChannelMute(Emulator* emu, APU_Channel channel, bool mute);
+/*
+* Set how audio samples are made. APU_SYNTH_BANDLIMITED only mixes when a channel's output changes and turns the steps
+* into band-limited samples once per frame, which is faster and doesn't alias. The default APU_SYNTH_POINT samples the
+* mixed output directly.
+*/
+void Emu_SetAudioSynthesis(Emulator* emu, APU_Synthesis synthesis);
 
+/**
+* Write the picture of each rendered frame straight to a buffer of the caller's, such as the pixels of a locked
+* streaming texture, in the format the renderer prefers. This saves copying it from Emu_GetPixelBuffer().
+* Emu_RunFrame() writes the buffer at the end of each frame it renders; frames that aren't rendered leave it as it is.
+*
+* @param buffer NES_SCREEN_H rows of NES_SCREEN_W pixels, or NULL to stop writing.
+* @param pitch Bytes from the start of one row to the next
+*/
+void Emu_SetFramebuffer(Emulator* emu, void* buffer, int pitch, PixelFormat format);
+
+//Get the last picture rendered, converted to RGBA. The buffer is reused, so it is valid until the next call.
 RGBAPixel* Emu_GetPixelBuffer(Emulator* emu, int* width, int* height);
 
 void* Emu_GetAudioBuffer(Emulator* emu, size_t* len);
 void Emu_ClearAudioBuffer(Emulator* emu);
 
+
+//Update the CPU page table entries for a range of cartridge pages. Called by the mapper when PRG banks are switched.
+void _Emu_UpdateCPUPages(Emulator* emu, uint8_t startPage, uint8_t endPage);
+
 #endif //#ifndef EMULATOR_H
 #ifdef __cplusplus
 }
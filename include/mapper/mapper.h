@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "rom.h"
+#include "ppu.h"
 #include "nrom.h"
 #include "mmc1.h"
 #include "uxrom.h"
@@ -50,6 +51,12 @@ typedef struct {
     bool prg_page_is_rom[0x100];
     char* chr_pages[0x40];
     bool chr_page_is_rom[0x40];
+
+    //CHR ROM and RAM decoded for the PPU, kept up to date with CHR RAM writes
+    PPUDecodedPage* chr_rom_decoded;
+    PPUDecodedPage* chr_ram_decoded;
+    //Decoded copy of each pattern table page, NULL if it isn't CHR ROM or RAM or the mapper reads CHR itself
+    PPUDecodedPage* chr_decoded_pages[0x20];
 } MapperMemory;
 
 typedef struct Mapper Mapper;
@@ -86,6 +93,25 @@ struct Mapper {
 int Mapper_Init(Mapper* mapper, const INESHeader* ines, FILE* romFile);
 void Mapper_Cleanup(Mapper* mapper);
 
+/*
+* Get the memory mapped to a 256 byte CPU page, if reading it has no side effects and can bypass the CPURead method.
+* Returns NULL if the page is unmapped or the mapper handles its own reads.
+*/
+uint8_t* Mapper_GetCPUReadPage(Mapper* mapper, uint8_t page);
+
+/*
+* Size of the mapper's save state: Its registers, PRG RAM, CHR RAM and VRAM, and the bank mappings.
+* Page pointers are saved as offsets into the memory they point to, so a state can be loaded into any mapper
+* instance with the same ROM.
+*/
+size_t Mapper_StateSize(Mapper* mapper);
+void Mapper_SaveState(Mapper* mapper, uint8_t* dst);
+/*
+* Load a state saved by Mapper_SaveState() with the same ROM.
+* @return 0 on success, -1 if a bank mapping is out of range (nothing is loaded then).
+*/
+int Mapper_LoadState(Mapper* mapper, const uint8_t* src);
+
 /* Helper functions for use by mappers */
 
 void Mapper_ResizePRGRAM(Mapper* mapper, unsigned size);
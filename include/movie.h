@@ -0,0 +1,92 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include "emulator.h"
+
+/*
+* Input movies. A movie records the buttons held on controller 1 in each frame, from power on or from a save state,
+* so running the same ROM with the same input reproduces the session exactly. Input is applied between frames, so
+* the buttons a game sees when it strobes the controller are always the ones recorded for that frame.
+*
+* The console state the movie starts from is saved in the movie, even when it starts from power on, since RAM and
+* battery backed PRG RAM keep their contents through a power cycle.
+*
+* File format (little endian): A MovieHeader, the save state to start from, then the input as runs of frames with the
+* same buttons held: a varint frame count followed by the button state byte.
+* The movie is written and read as a stream, so memory use doesn't depend on its length.
+*/
+
+#define MOVIE_MAGIC "EPNMOVIE"
+#define MOVIE_VERSION 1
+
+typedef enum {
+    MOVIE_START_POWER_ON,
+    MOVIE_START_SAVESTATE
+} MovieStart;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t start; //MovieStart, for information
+    uint64_t rom_hash; //Emu_GetROMHash() of the ROM the movie was recorded with
+    uint64_t frames; //Length of the movie in frames
+    uint64_t input_polls; //Number of times the game read the controller, to check that playback stayed in sync
+    uint32_t state_size; //Size of the save state after the header
+    uint32_t reserved;
+} MovieHeader;
+
+typedef struct {
+    FILE* file;
+    bool recording;
+    MovieHeader header;
+
+    uint8_t buttons; //Buttons of the current run
+    unsigned long long run; //Recording: frames in the current run (not written yet). Playback: frames left in it.
+    unsigned long long frame; //Frames recorded or played
+    unsigned long long polls_start; //Emulator input poll count when the movie started
+} Movie;
+
+/*
+* Start recording a movie. Powers on the console first for MOVIE_START_POWER_ON, or starts from the current state for
+* MOVIE_START_SAVESTATE.
+*
+* @return The movie, or NULL if no ROM is loaded or the file couldn't be written.
+*/
+Movie* Movie_Record(Emulator* emu, const char* path, MovieStart start);
+
+/*
+* Start playing a movie. Loads the state the movie starts from.
+*
+* @return The movie, or NULL if the file can't be read, is not a movie or was recorded with another ROM.
+*/
+Movie* Movie_Play(Emulator* emu, const char* path);
+
+/*
+* Call before each Emu_RunFrame(). When recording, records the buttons held now. When playing, sets the buttons held
+* with Emu_PressButton() and Emu_ReleaseButton().
+*
+* @return 0 on success, 1 if playback has reached the end of the movie, -1 on a file error.
+*/
+int Movie_Frame(Movie* movie, Emulator* emu);
+
+/*
+* Stop recording or playback and close the movie. A recording is finished by writing the frame and poll counts to its
+* header.
+*
+* @return 0 on success. -1 if a recording couldn't be written, or if the game read the controller a different number
+* of times than when a played movie was recorded, which means playback went out of sync. The poll count is only
+* checked if the whole movie was played.
+*/
+int Movie_Close(Movie* movie, Emulator* emu);
+
+#endif //#ifndef MOVIE_H
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,117 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef NET_TRANSPORT_H
+#define NET_TRANSPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+* Packet transports for netplay. A transport sends and receives whole packets without blocking, and may lose, delay
+* or reorder them like UDP does. Netplay only uses the send and receive functions, so any way of moving packets
+* between two players can be plugged in.
+*
+* Two transports are included, both able to add artificial latency and jitter to test netplay under bad conditions:
+* - Loopback: Two ends connected in memory, in the same process. Delays are counted in ticks (frames) and jitter comes
+*   from a seeded random number generator, so runs are reproducible.
+* - UDP: A socket on 127.0.0.1 sending to another port on 127.0.0.1. Delays are in milliseconds of real time.
+*/
+
+#define NET_MAX_PACKET 512 //Maximum packet size in bytes
+#define NET_MAX_QUEUED 256 //Maximum packets waiting for delivery in each direction
+
+typedef struct {
+    void* context;
+    /*
+    * Send a packet of at most NET_MAX_PACKET bytes.
+    * @return 0 on success, -1 on error. A packet that was sent may still be lost.
+    */
+    int (*send)(void* context, const void* data, size_t len);
+    /*
+    * Receive the next packet that has arrived.
+    * @return The packet length, 0 if no packet is waiting, -1 on error.
+    */
+    int (*receive)(void* context, void* buffer, size_t size);
+} NetTransport;
+
+//A packet waiting for delivery
+typedef struct {
+    uint8_t data[NET_MAX_PACKET];
+    size_t len;
+    uint64_t deliver_time; //Ticks or milliseconds
+    uint64_t sequence; //Order of packets with the same delivery time
+} NetQueuedPacket;
+
+//Packets delayed by latency and jitter
+typedef struct {
+    NetQueuedPacket packets[NET_MAX_QUEUED];
+    size_t count;
+    uint64_t sequence;
+} NetDelayQueue;
+
+
+/* LOOPBACK */
+
+typedef struct NetLoopback NetLoopback;
+
+typedef struct {
+    NetLoopback* loopback;
+    int end; //0 or 1
+} NetLoopbackEnd;
+
+struct NetLoopback {
+    NetDelayQueue queues[2]; //Packets sent to each end
+    NetLoopbackEnd ends[2];
+    unsigned latency; //Ticks
+    unsigned jitter; //Ticks
+    uint64_t now; //Current tick
+    uint64_t rng;
+};
+
+/*
+* Create an in-memory connection between two ends. A packet sent at tick t arrives at the other end at tick
+* t + latency + a random 0 to jitter ticks, so packets can arrive out of order when jitter is used.
+*
+* @param seed Seed of the jitter random number generator
+* @return The loopback, or NULL if out of memory.
+*/
+NetLoopback* NetLoopback_Create(unsigned latency, unsigned jitter, uint64_t seed);
+
+void NetLoopback_Free(NetLoopback* loopback);
+
+//Get the transport of one end (0 or 1)
+NetTransport NetLoopback_GetTransport(NetLoopback* loopback, int end);
+
+//Advance time by one tick. Call once per frame.
+void NetLoopback_Tick(NetLoopback* loopback);
+
+
+/* UDP */
+
+typedef struct {
+    intptr_t socket;
+    unsigned short remote_port;
+    unsigned latency; //Milliseconds
+    unsigned jitter; //Milliseconds
+    uint64_t rng;
+    NetDelayQueue queue; //Received packets
+} NetUDP;
+
+/*
+* Open a UDP socket on 127.0.0.1:localPort that sends to 127.0.0.1:remotePort. Received packets are held back for
+* latency + a random 0 to jitter milliseconds before they are returned.
+*
+* @return The UDP transport, or NULL if the socket couldn't be opened.
+*/
+NetUDP* NetUDP_Create(unsigned short localPort, unsigned short remotePort, unsigned latency, unsigned jitter);
+
+void NetUDP_Free(NetUDP* udp);
+
+NetTransport NetUDP_GetTransport(NetUDP* udp);
+
+#endif //#ifndef NET_TRANSPORT_H
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,122 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef NETPLAY_H
+#define NETPLAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "emulator.h"
+#include "net_transport.h"
+
+/*
+* Two player rollback netplay. Each player runs the whole console and sends their own controller input to the other.
+* Frames are run without waiting for the remote input: It is predicted to be the same as the last input received.
+* When the real input arrives and differs from the prediction, the console is rolled back to a save state from before
+* that frame and the frames since are resimulated (without video and audio) with the right input.
+*
+* A save state is kept for each of the last NETPLAY_MAX_ROLLBACK frames. If the remote input falls further behind than
+* that, Netplay_RunFrame() stalls until it catches up.
+*
+* To detect desyncs, every NETPLAY_CHECKSUM_INTERVAL-th frame a checksum of the save state is sent, once the input of
+* both players up to that frame is known, and compared with the same frame's checksum on the other side.
+*
+* Packet format (little endian): type (1 byte), sender's controller port (1), ROM hash (8), frame of the first input
+* (4), number of remote inputs received (4), number of inputs (1), inputs (1 byte each), checksum frame (4), checksum
+* (8). The inputs sent are all the ones the other player hasn't acknowledged, so lost packets need no resending.
+*/
+
+#define NETPLAY_MAX_ROLLBACK 15 //Frames
+#define NETPLAY_INPUT_FRAMES 128 //Size of the input rings, must be a power of 2
+#define NETPLAY_MAX_PACKET_INPUTS 64
+#define NETPLAY_CHECKSUM_INTERVAL 32 //Frames
+#define NETPLAY_CHECKSUMS 8 //Checksums kept for comparison
+
+#define NETPLAY_STALLED 1 //Netplay_RunFrame() result: Waiting for the remote input, no frame was run
+
+typedef struct {
+    unsigned long long frames; //Frames run (not counting resimulated frames)
+    unsigned long long stalls; //Calls to Netplay_RunFrame() that waited for the remote input
+    unsigned long long mispredictions; //Remote inputs that differed from the prediction
+    unsigned long long rollbacks;
+    unsigned long long frames_resimulated;
+    double resim_seconds; //Time spent rolling back and resimulating
+    unsigned long long checksums_compared;
+    unsigned long long desyncs; //Checksums that didn't match
+} NetplayStats;
+
+typedef struct {
+    uint32_t frame;
+    uint64_t checksum;
+    bool valid;
+} NetplayChecksum;
+
+typedef struct {
+    Emulator* emu;
+    NetTransport transport;
+    int local_port; //Controller port of the local player (0 or 1)
+    int input_delay; //Frames
+    uint64_t rom_hash;
+
+    uint32_t frame; //Next frame to run
+
+    //Input by frame, in rings of NETPLAY_INPUT_FRAMES
+    uint8_t local_inputs[NETPLAY_INPUT_FRAMES];
+    uint32_t local_count; //Local input is known for frames before this
+    uint8_t remote_inputs[NETPLAY_INPUT_FRAMES];
+    uint32_t remote_count; //Remote input is known for frames before this
+    uint8_t used_inputs[NETPLAY_INPUT_FRAMES]; //Remote input (received or predicted) each frame was run with
+    uint32_t remote_ack; //Number of local inputs the other player has received
+    int64_t rollback_frame; //First frame run with a wrong prediction, -1 if none
+
+    //Save state at the start of each of the last frames, by frame % (NETPLAY_MAX_ROLLBACK + 1)
+    uint8_t* snapshots[NETPLAY_MAX_ROLLBACK + 1];
+    size_t state_size;
+
+    uint32_t checksum_frame; //Next frame to checksum
+    NetplayChecksum local_checksums[NETPLAY_CHECKSUMS];
+    NetplayChecksum remote_checksums[NETPLAY_CHECKSUMS];
+    NetplayChecksum last_checksum; //Newest local checksum, sent in every packet
+
+    NetplayStats stats;
+} Netplay;
+
+/*
+* Start a netplay session. Both players must start from the same console state, for example by loading the same ROM
+* (which powers on the console) or the same save state, and use the same input delay. Run-ahead must be disabled.
+*
+* @param transport Transport connected to the other player
+* @param localPort Controller port of the local player, 0 or 1. The other player uses the other port.
+* @param inputDelay Frames local input is delayed by. Each frame of delay hides a frame of network latency, so fewer
+* frames need to be rolled back.
+* @return The session, or NULL if no ROM is loaded or out of memory.
+*/
+Netplay* Netplay_Create(Emulator* emu, NetTransport transport, int localPort, int inputDelay);
+
+void Netplay_Free(Netplay* netplay);
+
+/*
+* Exchange input with the other player, roll back if a prediction was wrong, then run a frame with the buttons the
+* local player holds now (applied after the input delay). Call instead of Emu_RunFrame(), once per frame.
+*
+* @return 0 if a frame was run, NETPLAY_STALLED if the frame can't be run until more remote input arrives, -1 on error
+* (the other player uses another ROM, or a save state couldn't be loaded).
+*/
+int Netplay_RunFrame(Netplay* netplay, uint8_t localButtons);
+
+/*
+* Exchange input with the other player and roll back if a prediction was wrong, without running a frame.
+* Netplay_RunFrame() does this first; call it instead while the game is paused, so the other player can keep going.
+*
+* @return 0 on success, -1 on error.
+*/
+int Netplay_Poll(Netplay* netplay);
+
+void Netplay_GetStats(Netplay* netplay, NetplayStats* stats);
+
+#endif //#ifndef NETPLAY_H
+#ifdef __cplusplus
+}
+#endif
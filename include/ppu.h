@@ -14,6 +14,14 @@ typedef struct {
     uint8_t a;
 } RGBAPixel;
 
+//Pixel formats a picture can be converted to
+typedef enum {
+    PIXEL_FORMAT_RGBA8888, //Bytes R, G, B, A (RGBAPixel)
+    PIXEL_FORMAT_BGRA8888, //Bytes B, G, R, A
+    PIXEL_FORMAT_RGB565, //16-bit words: 5 bits red (top), 6 bits green, 5 bits blue
+    PIXEL_FORMAT_INDEXED8 //NES color indexes (0x00-0x3F) into PPUCOLORS
+} PixelFormat;
+
 static const RGBAPixel PPUCOLORS[64] = {
 	{84,84,84,255},   {0,30,116,255},   {8,16,144,255},   {48,0,136,255},   {68,0,100,255},   {92,0,48,255},    {84,4,0,255},     {60,24,0,255},    
     {32,42,0,255},    {8,58,0,255},     {0,64,0,255},     {0,60,0,255},     {0,50,60,255},    {0,0,0,255},      {0,0,0,255},      {0,0,0,255},
@@ -70,6 +78,14 @@ typedef struct {
     uint8_t x;
 } OAMSprite;
 
+/*
+* Pattern table memory decoded into pixels, one 256 byte page (16 tiles) at a time. rows[tile][y][x] is the 2-bit
+* pixel at (x, y) of a tile, so a row of a tile can be copied instead of combining its 2 bit planes pixel by pixel.
+*/
+typedef struct {
+    uint8_t rows[16][8][8];
+} PPUDecodedPage;
+
 typedef struct {
     uint8_t paletteRam[32];
     union {
@@ -121,8 +137,8 @@ typedef struct {
 } PPUState;
 
 typedef struct {
-    //PPU pixel output buffer
-    RGBAPixel pixelBuffer[NES_SCREEN_H][NES_SCREEN_W];
+    //PPU pixel output buffer, as indexes into PPUCOLORS (0x00-0x3F). Converted to RGBA with PPU_ConvertFrame().
+    uint8_t pixelBuffer[NES_SCREEN_H][NES_SCREEN_W];
 
     //Callbacks
 
@@ -130,6 +146,12 @@ typedef struct {
     PPUWriteFn writefn;
     void* fndata;
 
+    //Decoded pattern table pages by PPU page (0x00-0x1F), see PPU_SetCHRCache(). NULL if not used.
+    PPUDecodedPage* const* decodedPages;
+
+    //Don't draw pixels to pixelBuffer. Only the parts of rendering that affect the PPU state (sprite 0 hit) are done.
+    bool skipRender;
+
     //State
     PPUState state;
 } PPU;
@@ -137,6 +159,19 @@ typedef struct {
 
 void PPU_Init(PPU* ppu, PPUReadFn readfn, PPUWriteFn writefn, void* fndata);
 
+/*
+* Read background patterns from decoded pattern table pages instead of through readfn. The owner of the memory keeps
+* pages[0x00-0x1F] pointing at the decoded copy of what is mapped there (NULL where there is none, which is read through
+* readfn) and decodes memory again when it is written.
+*/
+void PPU_SetCHRCache(PPU* ppu, PPUDecodedPage* const* pages);
+
+//Decode size bytes (a multiple of 0x100) of pattern data into size / 0x100 pages
+void PPU_DecodeCHR(PPUDecodedPage* dst, const uint8_t* src, unsigned size);
+
+//Decode the tile row containing byte addr of pattern data decoded with PPU_DecodeCHR() again, after it was written
+void PPU_DecodeCHRRow(PPUDecodedPage* dst, const uint8_t* src, unsigned addr);
+
 void PPU_PowerOn(PPU* ppu);
 
 void PPU_Reset(PPU* ppu);
@@ -147,6 +182,33 @@ void PPU_RegWrite(PPU* ppu, uint16_t addr, uint8_t data);
 
 void PPU_Cycle(PPU* ppu);
 
+/*
+* Run a number of PPU cycles, with the same result as calling PPU_Cycle() that many times. Whole scanlines are
+* rendered at once rather than dot by dot, so PPU registers and memory (including the mapper's CHR mapping) must not
+* change during the call: Split the run at any write that could, and the scanline it falls in is run dot by dot.
+*/
+void PPU_Run(PPU* ppu, int dots);
+
+/*
+* Get the number of PPU_Cycle() calls needed until the dot at (scanline, cycle) has been run.
+* If the dot is only reached after the pre-render scanline and rendering is enabled, the count
+* assumes the odd frame cycle skip happens, so it may be 1 less than the actual count but never more.
+*/
+int PPU_DotsUntil(PPU* ppu, int scanline, int cycle);
+
 bool PPU_NMISignal(PPU* ppu);
 
+/*
+* Convert the picture in pixelBuffer to a pixel format. 32-bit formats use AVX2 when the CPU has it.
+* @param pitch Bytes from the start of one row of dst to the next
+*/
+void PPU_ConvertFrame(const PPU* ppu, void* dst, int pitch, PixelFormat format);
+
+/*
+* Convert a picture of NES color indexes, such as one saved in PIXEL_FORMAT_INDEXED8, like PPU_ConvertFrame().
+* Only the low 6 bits of each index are used, so any byte is safe to pass.
+* @param srcPitch Bytes from the start of one row of src to the next
+*/
+void PPU_ConvertIndexed(const uint8_t* src, int srcPitch, void* dst, int pitch, PixelFormat format);
+
 #endif
\ No newline at end of file
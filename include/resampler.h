@@ -0,0 +1,55 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+* Dynamic rate control resampler for 16-bit mono audio. Sits between the emulator's audio output and an output buffer
+* drained at the sound card's rate. Frames are paced by a timer that doesn't match the sound card's clock, so at a
+* fixed rate the buffer would slowly drain (and crackle) or fill up (and lag).
+*
+* Before each block, the resampling ratio is nudged by up to RESAMPLER_MAX_ADJUST depending on how far the buffer's
+* fill is from the target: More samples are made while it's below, fewer while it's above. The nudge is the sum of a
+* part proportional to the error and the error integrated over time, so once the clocks' difference has been learned
+* the buffer settles at the target fill rather than short of or over it. A pitch change of 0.5% or less can't be heard.
+* Samples are linearly interpolated.
+*/
+
+#define RESAMPLER_MAX_ADJUST 0.005 //Largest change of the ratio, as a fraction
+
+typedef struct {
+    double step; //Input samples per output sample at the nominal rates
+    size_t target_fill; //Output buffer fill to hold, in samples
+    double adjust; //Current change of the ratio, between -RESAMPLER_MAX_ADJUST and RESAMPLER_MAX_ADJUST
+    double integral; //Integrated fill error, between -1 and 1, in units of RESAMPLER_MAX_ADJUST
+    double position; //Position of the next output sample in the input, counting from the last sample of the previous block
+    int16_t last; //Last sample of the previous block
+} Resampler;
+
+/**
+* Initialize a resampler.
+*
+* @param inRate Sample rate of the input in Hz
+* @param outRate Sample rate of the output in Hz
+* @param targetFill Number of samples to keep in the output buffer
+*/
+void Resampler_Init(Resampler* resampler, double inRate, double outRate, size_t targetFill);
+
+/**
+* Resample a block of input samples.
+*
+* @param fill Number of samples in the output buffer now. Sets the ratio for this block.
+* @param outCapacity Size of out in samples. Enough for any block when at least inCount * outRate / inRate * 1.01 + 2.
+* @return Number of samples written to out
+*/
+size_t Resampler_Process(Resampler* resampler, const int16_t* in, size_t inCount, int16_t* out, size_t outCapacity, size_t fill);
+
+#endif //#ifndef RESAMPLER_H
+#ifdef __cplusplus
+}
+#endif
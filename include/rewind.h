@@ -0,0 +1,106 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "emulator.h"
+
+/*
+* Rewind buffer. Holds a save state for every frame pushed, within a memory budget. Every keyframe_interval-th state
+* is stored whole, the states in between as the XOR of the state and the one before it, run-length encoded so the
+* bytes that didn't change take almost no space. When the budget or the frame limit is exceeded, the oldest keyframe
+* and its deltas are dropped.
+*
+* The newest state is kept decoded, and since XOR deltas work both ways, stepping back one frame only decodes one
+* delta into it. Only stepping back past a keyframe decodes the previous keyframe and its deltas again.
+*
+* Entry encoding: A sequence of runs, each a varint count of unchanged bytes, a varint count of changed bytes, and
+* the changed bytes XORed with the previous state. Keyframes are encoded against a state of all zeroes.
+*/
+
+#define REWIND_DEFAULT_BUDGET (32 << 20) //Bytes
+#define REWIND_DEFAULT_KEYFRAME_INTERVAL 30 //Frames
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    bool keyframe;
+} RewindEntry;
+
+typedef struct {
+    size_t budget; //Maximum bytes of encoded states and buffers
+    unsigned long max_frames; //Maximum number of states kept, 0 for no limit
+    unsigned keyframe_interval;
+
+    size_t state_size; //Save state size of the ROM the states are from
+    uint8_t* state; //Newest state, decoded
+    uint8_t* next; //Buffer for the state being pushed
+    uint8_t* encoded; //Buffer for encoding an entry (worst case size)
+
+    //Entries, oldest first, in a ring that grows as needed
+    RewindEntry* entries;
+    size_t capacity;
+    size_t first;
+    size_t count;
+    unsigned since_keyframe; //Number of deltas after the newest keyframe
+
+    size_t entry_bytes; //Encoded bytes in all entries
+    unsigned long keyframes;
+} Rewind;
+
+//Rewind buffer memory usage
+typedef struct {
+    unsigned long frames; //States in the buffer
+    unsigned long keyframes;
+    size_t bytes_used; //Encoded states, entry ring and decode buffers
+    size_t budget;
+    size_t state_size; //Size of one uncompressed state
+} RewindStats;
+
+/*
+* Create a rewind buffer.
+*
+* @param budget Memory budget in bytes, or 0 for REWIND_DEFAULT_BUDGET.
+* @param maxFrames Maximum number of frames kept (60 per second of gameplay), or 0 to keep as many as fit the budget.
+* @param keyframeInterval Frames per keyframe, or 0 for REWIND_DEFAULT_KEYFRAME_INTERVAL. Longer intervals use less
+* memory, but make stepping back past a keyframe slower.
+*
+* @return The rewind buffer, or NULL if out of memory.
+*/
+Rewind* Rewind_Create(size_t budget, unsigned long maxFrames, unsigned keyframeInterval);
+
+void Rewind_Free(Rewind* rewind);
+
+//Drop all states. Call when a ROM is loaded or the console is reset.
+void Rewind_Clear(Rewind* rewind);
+
+//Change the memory budget and frame limit, dropping the oldest states if needed.
+void Rewind_SetBudget(Rewind* rewind, size_t budget, unsigned long maxFrames);
+
+/*
+* Save the emulator state and add it as the newest state. Call after each frame.
+*
+* @return 0 on success, -1 if no ROM is loaded or out of memory.
+*/
+int Rewind_Push(Rewind* rewind, Emulator* emu);
+
+/*
+* Drop the newest state and load the one before it into the emulator. The picture isn't part of the state, so to
+* show the frame, run one frame after stepping back (without pushing it).
+*
+* @return 0 on success, -1 if there is no older state to go back to or it can't be loaded. The emulator and the
+* buffer are unchanged on error.
+*/
+int Rewind_StepBack(Rewind* rewind, Emulator* emu);
+
+void Rewind_GetStats(Rewind* rewind, RewindStats* stats);
+
+#endif //#ifndef REWIND_H
+#ifdef __cplusplus
+}
+#endif
@@ -1,21 +1,61 @@
+#ifdef __cplusplus
+#include <atomic>
+extern "C" {
+#endif
+
 #ifndef RING_BUFFER_H
-#define RING_BUFFER_C
+#define RING_BUFFER_H
+
 #include <stdint.h>
 #include <stddef.h>
 
+/*
+* Lock-free byte ring for one producer thread and one consumer thread, such as the emulator queueing audio and the
+* audio callback consuming it. No locks are needed as long as only one thread queues and only one thread consumes.
+*
+* head and tail count the bytes queued and consumed in total. Each is written by only one side and published with
+* release/acquire ordering, so the other side sees the bytes copied before an index moved. They are kept on separate
+* cache lines, so the two threads don't slow each other down by writing the same line. The size is a power of 2, so
+* positions are found by masking, and each transfer is at most two memcpy() calls: up to the end and from the start.
+*/
+
+#define RING_BUFFER_CACHE_LINE 64
+
+//The indices are C11 atomics, and std::atomic to C++ code that includes the struct. Both must be laid out like a plain
+//lock-free size_t for the struct to be the same in both languages.
+#ifdef __cplusplus
+#define RING_BUFFER_ATOMIC_SIZE std::atomic<size_t>
+static_assert(sizeof(std::atomic<size_t>) == sizeof(size_t) && alignof(std::atomic<size_t>) == alignof(size_t) &&
+    std::atomic<size_t>::is_always_lock_free, "std::atomic<size_t> is not laid out like size_t");
+#else
+#include <stdatomic.h>
+#define RING_BUFFER_ATOMIC_SIZE _Atomic size_t
+_Static_assert(sizeof(_Atomic size_t) == sizeof(size_t) && _Alignof(_Atomic size_t) == _Alignof(size_t),
+    "_Atomic size_t is not laid out like size_t");
+#endif
+
 typedef struct {
-    void* buffer;
-    size_t size;
-    size_t head;
-    size_t tail;
-    size_t space;
+    uint8_t* buffer;
+    size_t size; //Power of 2
+    size_t mask; //size - 1
+
+    char pad0[RING_BUFFER_CACHE_LINE];
+    RING_BUFFER_ATOMIC_SIZE head; //Bytes queued, written by the producer
+    char pad1[RING_BUFFER_CACHE_LINE - sizeof(size_t)];
+    RING_BUFFER_ATOMIC_SIZE tail; //Bytes consumed, written by the consumer
+    char pad2[RING_BUFFER_CACHE_LINE - sizeof(size_t)];
 } RingBuffer;
 
+/**
+* Initialize an empty ring buffer.
+*
+* @param size Capacity in bytes. Rounded up to a power of 2.
+*/
 void RingBuffer_Init(RingBuffer* buffer, size_t size);
 void RingBuffer_Destroy(RingBuffer* buffer);
 
 /**
-* Queue up to len bytes to the buffer from src.
+* Producer: Queue up to len bytes to the buffer from src.
 * The actual number of queued bytes will be written back to len.
 *
 * @param src The source buffer to copy up to len bytes from
@@ -24,7 +64,7 @@ void RingBuffer_Destroy(RingBuffer* buffer);
 */
 void RingBuffer_Queue(RingBuffer* buffer, const void* src, size_t* len);
 /**
-* Consume up to len bytes from the buffer and write them to dst.
+* Consumer: Consume up to len bytes from the buffer and write them to dst.
 * The actual number of consumed bytes will be written back to len.
 *
 * @param dst The destination buffer to write up to len bytes to
@@ -33,5 +73,16 @@ void RingBuffer_Queue(RingBuffer* buffer, const void* src, size_t* len);
 */
 void RingBuffer_Consume(RingBuffer* buffer, void* dst, size_t* len);
 
+/**
+* Get the number of bytes queued and not consumed yet. Can be called from either thread. While the other thread is
+* queueing or consuming, the result is a snapshot that may already be out of date.
+*/
+size_t RingBuffer_GetFill(RingBuffer* buffer);
+
+//Capacity in bytes
+size_t RingBuffer_GetSize(const RingBuffer* buffer);
 
-#endif
\ No newline at end of file
+#endif //#ifndef RING_BUFFER_H
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,49 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+
+#define SCHED_NEVER (~0ULL) //Scheduler next cycle when no event is pending
+
+//Events that can be scheduled. Each event can be pending at most once.
+typedef enum {
+    SCHED_PPU_SYNC,         //Catch the PPU up to the CPU (vblank set/clear, frame end)
+    SCHED_APU_FRAME_STEP,   //APU frame counter sequencer step
+    SCHED_NUM_EVENTS
+} SchedulerEvent;
+
+typedef struct {
+    unsigned long long cycle;
+    SchedulerEvent event;
+} SchedulerEntry;
+
+/*
+* Timestamped event queue. Components post the CPU cycle of their next deadline, and the emulator
+* only has to compare the current cycle with the cycle of the earliest event every CPU cycle.
+* There are only a few event types, so pending events are kept in a small array sorted by cycle.
+*/
+typedef struct {
+    unsigned long long cycle; //Current cycle (number of CPU cycles run since power on)
+    unsigned long long next; //Cycle of the earliest pending event, or SCHED_NEVER
+
+    SchedulerEntry entries[SCHED_NUM_EVENTS]; //Pending events, sorted by cycle
+    int count;
+} Scheduler;
+
+//Reset the current cycle to 0 and remove all pending events.
+void Scheduler_Reset(Scheduler* sched);
+
+//Schedule an event to happen at the end of a cycle. If the event is already pending, it is rescheduled.
+void Scheduler_Post(Scheduler* sched, SchedulerEvent event, unsigned long long cycle);
+
+//Remove a pending event.
+void Scheduler_Cancel(Scheduler* sched, SchedulerEvent event);
+
+/*
+* Remove the earliest pending event if it is due (its cycle is at or before the current cycle).
+*
+* @return The removed event, or -1 if no event is due.
+*/
+int Scheduler_PopDue(Scheduler* sched);
+
+#endif
@@ -6,11 +6,29 @@ extern "C" {
 #define SDL_AUDIO_BUFFER_H
 
 #include <SDL.h>
+#include <stdbool.h>
 #include "ring_buffer.h"
+#include "resampler.h"
+
+#define SDL_AUDIO_BUFFER_DEFAULT_LATENCY 40 //Milliseconds
+
+typedef struct {
+    size_t fill; //Samples queued and not played yet
+    size_t capacity; //Samples the ring buffer can hold
+    unsigned long underruns; //Times the ring buffer ran dry while playing
+    double latency_ms; //Time from queueing a sample to the sound card playing it: The ring buffer and the sound card's buffer
+} SDLAudioBufferStats;
 
 typedef struct {
     SDL_AudioSpec audiospec;
     RingBuffer buffer;
+    Resampler resampler; //Only used for 16-bit mono audio, which is what the emulator outputs
+    bool resample;
+    size_t target_bytes; //Ring buffer fill to keep
+
+    //Audio callback state
+    bool waiting; //The ring buffer ran dry. Play silence until it's filled to the target again.
+    SDL_atomic_t underruns;
 } SDLAudioBuffer;
 
 /**
@@ -18,18 +36,29 @@ typedef struct {
  * 
  * @param audioSpec The SDL_AudioSpec to open audio with.
  * @param ringBufferScale The ring buffer scale. The ring buffer will hold audioSpec.samples * ringBufferScale samples.
+ * @param targetLatencyMs Audio to keep in the ring buffer, in milliseconds. The rate audio is queued at is adjusted to
+ * hold it. Limited to half the ring buffer.
  * 
  * @return 0 on success, -1 on SDL error.
 */
-int SDLAudioBuffer_Create(SDLAudioBuffer** buffer, SDL_AudioSpec audioSpec, unsigned ringBufferScale);
+int SDLAudioBuffer_Create(SDLAudioBuffer** buffer, SDL_AudioSpec audioSpec, unsigned ringBufferScale, unsigned targetLatencyMs);
 
 /**
  * Free an SDL audio buffer. Closes audio with SDL_CloseAudio().
 */
 void SDLAudioBuffer_Free(SDLAudioBuffer* buffer);
 
+/**
+ * Queue audio at the rate of the audio spec, resampled to hold the target latency. Call from one thread only.
+ *
+ * @param len Number of bytes in src. The number of bytes queued is written back to it. Resampled audio is all taken,
+ * though samples are dropped if the ring buffer is full.
+*/
 void SDLAudioBuffer_QueueAudio(SDLAudioBuffer* buffer, Uint8* src, size_t* len);
 
+//Can be called from any thread
+void SDLAudioBuffer_GetStats(SDLAudioBuffer* buffer, SDLAudioBufferStats* stats);
+
 void _SDLAudioBufferCallback(void* userdata, Uint8* stream, int len);
 
 #endif //#ifndef SDL_AUDIO_BUFFER_H
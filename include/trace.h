@@ -0,0 +1,133 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+* Binary CPU trace. Records are appended to an in-memory ring and written to the trace file in large blocks,
+* so tracing does no formatting or file I/O per instruction. Use the TraceDecode tool to convert a trace file
+* to the text format of the old CPU log.
+*
+* File format: A TraceFileHeader followed by TraceRecords, both little endian.
+*/
+
+#define TRACE_MAGIC "EPNTRACE"
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_CAPACITY (1 << 20) //Ring size in records (16 MB)
+
+typedef enum {
+    TRACE_INSTR,    //Instruction: addr = PC, data = opcode, registers before execution, cycle after the opcode fetch
+    TRACE_NMI,      //NMI taken
+    TRACE_IRQ,      //IRQ taken
+    TRACE_READ,     //Bus read: addr, data
+    TRACE_WRITE     //Bus write: addr, data
+} TraceRecordType;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} TraceFileHeader;
+
+//Fixed size trace record (16 bytes)
+typedef struct {
+    uint64_t cycle; //Bits 0-55: CPU cycle, bits 56-63: TraceRecordType
+    uint16_t addr;
+    uint8_t data;
+    uint8_t a, x, y, s, p; //CPU registers, TRACE_INSTR only
+} TraceRecord;
+
+#define TRACE_RECORD_CYCLE(record) ((record)->cycle & 0x00FFFFFFFFFFFFFFULL)
+#define TRACE_RECORD_TYPE(record) ((TraceRecordType)((record)->cycle >> 56))
+
+typedef struct {
+    FILE* file;
+    TraceRecord* ring;
+    size_t capacity;
+    size_t count; //Records in the ring that have not been written yet
+
+    //Filters. Instructions outside the PC range are not recorded, and nothing is recorded outside the frame window.
+    uint16_t pc_min, pc_max;
+    unsigned long long frame_first, frame_last;
+    bool bus_accesses; //Record bus reads and writes of recorded instructions
+
+    unsigned long long frame; //Current frame, set by the host
+    bool frame_active; //Current frame is in the frame window
+    bool instr_active; //Current instruction passed the filters
+
+    unsigned long long records; //Total number of records written
+} CPUTrace;
+
+/*
+* Create a trace that writes to a file.
+*
+* @param capacity Ring size in records, or 0 for TRACE_DEFAULT_CAPACITY. The ring is written to the file when it is full.
+*
+* @return The trace, or NULL if the file couldn't be opened.
+*/
+CPUTrace* Trace_Create(const char* path, size_t capacity);
+
+//Flush the ring and close the trace file.
+void Trace_Close(CPUTrace* trace);
+
+//Write all records in the ring to the trace file.
+void Trace_Flush(CPUTrace* trace);
+
+//Only record instructions with a PC in [pcMin, pcMax] (default: all).
+void Trace_SetPCRange(CPUTrace* trace, uint16_t pcMin, uint16_t pcMax);
+
+//Only record during frames first to last (default: all). The host reports the current frame with Trace_SetFrame().
+void Trace_SetFrameWindow(CPUTrace* trace, unsigned long long first, unsigned long long last);
+
+void Trace_SetFrame(CPUTrace* trace, unsigned long long frame);
+
+void Trace_SetBusAccesses(CPUTrace* trace, bool enable);
+
+
+//Append a record, flushing the ring if it is full
+static inline TraceRecord* _Trace_Append(CPUTrace* trace, TraceRecordType type, unsigned long long cycle) {
+    if (trace->count == trace->capacity)
+        Trace_Flush(trace);
+    TraceRecord* record = &trace->ring[trace->count++];
+    record->cycle = (cycle & 0x00FFFFFFFFFFFFFFULL) | (uint64_t)type << 56;
+    return record;
+}
+
+static inline void Trace_Instruction(CPUTrace* trace, uint16_t pc, uint8_t opcode, uint8_t a, uint8_t x, uint8_t y, uint8_t s, uint8_t p, unsigned long long cycle) {
+    trace->instr_active = trace->frame_active && pc >= trace->pc_min && pc <= trace->pc_max;
+    if (!trace->instr_active)
+        return;
+    TraceRecord* record = _Trace_Append(trace, TRACE_INSTR, cycle);
+    record->addr = pc;
+    record->data = opcode;
+    record->a = a;
+    record->x = x;
+    record->y = y;
+    record->s = s;
+    record->p = p;
+}
+
+static inline void Trace_Interrupt(CPUTrace* trace, TraceRecordType type, unsigned long long cycle) {
+    //Bus accesses of the interrupt sequence are recorded after it
+    trace->instr_active = trace->frame_active;
+    if (!trace->frame_active)
+        return;
+    TraceRecord* record = _Trace_Append(trace, type, cycle);
+    record->addr = 0;
+    record->data = 0;
+    record->a = record->x = record->y = record->s = record->p = 0;
+}
+
+static inline void Trace_BusAccess(CPUTrace* trace, TraceRecordType type, uint16_t addr, uint8_t data, unsigned long long cycle) {
+    if (!trace->bus_accesses || !trace->instr_active)
+        return;
+    TraceRecord* record = _Trace_Append(trace, type, cycle);
+    record->addr = addr;
+    record->data = data;
+    record->a = record->x = record->y = record->s = record->p = 0;
+}
+
+#endif
@@ -0,0 +1,262 @@
+#include "EmuThread.h"
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <iostream>
+
+using Clock = std::chrono::steady_clock;
+
+static int BytesPerPixel(PixelFormat format)
+{
+    switch (format) {
+        case PIXEL_FORMAT_RGB565:   return 2;
+        case PIXEL_FORMAT_INDEXED8: return 1;
+        default:                    return 4;
+    }
+}
+
+EmuThread::EmuThread(PixelFormat format, AudioSink audioSink, size_t rewindBudget, unsigned long rewindFrames)
+    : format(format), pitch(NES_SCREEN_W * BytesPerPixel(format)), audioSink(audioSink),
+      frames((size_t)NES_SCREEN_W * BytesPerPixel(format) * NES_SCREEN_H)
+{
+    emulator = Emu_Create();
+    rewindBuffer = Rewind_Create(rewindBudget, rewindFrames, 0);
+
+    // Set (and create if needed) saves directory
+    std::filesystem::create_directory("saves");
+    Emu_SetSavePath(emulator, "saves/");
+
+    thread = std::thread(&EmuThread::Run, this);
+}
+
+EmuThread::~EmuThread()
+{
+    quit = true;
+    thread.join();
+    StopMovie();
+    Rewind_Free(rewindBuffer);
+    Emu_Free(emulator);
+}
+
+bool EmuThread::Send(EmuCommandType type, int value, int value2, const char* path)
+{
+    EmuCommand command;
+    command.type = type;
+    command.value = value;
+    command.value2 = value2;
+    command.path[0] = '\0';
+    if (path != nullptr) {
+        std::strncpy(command.path, path, sizeof(command.path));
+        command.path[sizeof(command.path) - 1] = '\0';
+    }
+    if (!commands.Push(command)) {
+        std::cout << "Emulation thread command queue is full, command dropped" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+const void* EmuThread::GetNewFrame(int* pitch)
+{
+    *pitch = this->pitch;
+    return frames.Acquire() ? frames.GetFront() : nullptr;
+}
+
+EmuStatus EmuThread::GetStatus()
+{
+    std::lock_guard<std::mutex> lock(statusMutex);
+    return status;
+}
+
+void EmuThread::Run()
+{
+    const auto frameTime = std::chrono::microseconds(1000000 / 60);
+    auto next = Clock::now();
+    auto fpsStart = next;
+    unsigned framesShown = 0, fps = 0;
+
+    while (!quit) {
+        EmuCommand command;
+        while (commands.Pop(command))
+            Execute(command);
+
+        if (Emu_IsROMLoaded(emulator) && !paused) {
+            Emu_SetFramebuffer(emulator, frames.GetBack(), pitch, format);
+            int result = RunFrames();
+            Emu_SetFramebuffer(emulator, NULL, 0, format);
+            if (result < 0) {
+                std::cout << "Emulation stopped: The emulator crashed" << std::endl;
+                StopMovie();
+                Emu_CloseROM(emulator);
+            } else if (result == 0) {
+                frames.Publish();
+                framesShown++;
+            }
+
+            //Queue samples from audio output
+            size_t len;
+            void* samples = Emu_GetAudioBuffer(emulator, &len);
+            if (len > 0)
+                audioSink(samples, len);
+            Emu_ClearAudioBuffer(emulator);
+        }
+
+        auto now = Clock::now();
+        if (now - fpsStart >= std::chrono::seconds(1)) {
+            fps = framesShown;
+            framesShown = 0;
+            fpsStart = now;
+        }
+        UpdateStatus(fps);
+
+        //Wait for the next frame. After a stall, start again from now rather than running frames to catch up.
+        next += frameTime;
+        if (next < now)
+            next = now;
+        std::this_thread::sleep_until(next);
+    }
+}
+
+int EmuThread::RunFrames()
+{
+    if (rewinding && movie == nullptr) {
+        //Step back one frame, then run it to show its picture. Audio is dropped while rewinding.
+        if (Rewind_StepBack(rewindBuffer, emulator) == 0) {
+            bool rendered = Emu_FramesUntilRender(emulator) == 1;
+            if (Emu_RunFrame(emulator) != 0)
+                return -1;
+            Emu_ClearAudioBuffer(emulator);
+            return rendered ? 0 : 1;
+        }
+        return 1;
+    }
+
+    //Fast-forward runs several frames, rendering only the last (see EMUCMD_SET_TURBO)
+    bool rendered = false;
+    for (int f = 0; f < (turbo ? TURBO_SPEED : 1); f++) {
+        //Record or play movie input
+        if (movie != nullptr && Movie_Frame(movie, emulator) != 0)
+            StopMovie();
+        //Run emulator
+        rendered |= Emu_FramesUntilRender(emulator) == 1;
+        if (Emu_RunFrame(emulator) != 0)
+            return -1;
+        Rewind_Push(rewindBuffer, emulator);
+        //Audio is dropped while fast-forwarding
+        if (turbo)
+            Emu_ClearAudioBuffer(emulator);
+    }
+    return rendered ? 0 : 1;
+}
+
+void EmuThread::Execute(const EmuCommand& command)
+{
+    switch (command.type) {
+        case EMUCMD_PRESS_BUTTON:
+            Emu_PressButton(emulator, (ControllerButton)command.value);
+            break;
+        case EMUCMD_RELEASE_BUTTON:
+            Emu_ReleaseButton(emulator, (ControllerButton)command.value);
+            break;
+        case EMUCMD_TOGGLE_PAUSE:
+            paused = !paused;
+            break;
+        case EMUCMD_POWER_CYCLE:
+            if (Emu_IsROMLoaded(emulator)) {
+                StopMovie();
+                Emu_PowerOn(emulator);
+                Rewind_Clear(rewindBuffer);
+            }
+            break;
+        case EMUCMD_OPEN_ROM:
+            OpenROM(command.path);
+            break;
+        case EMUCMD_CLOSE_ROM:
+            StopMovie();
+            Rewind_Clear(rewindBuffer);
+            Emu_CloseROM(emulator);
+            break;
+        case EMUCMD_SET_TURBO:
+            turbo = command.value != 0;
+            //Only the last of the frames run per frame shown is rendered
+            if (turbo)
+                Emu_SetRenderMode(emulator, RENDER_EVERY_NTH_FRAME, TURBO_SPEED);
+            else
+                Emu_SetRenderMode(emulator, RENDER_EVERY_FRAME, 0);
+            break;
+        case EMUCMD_SET_REWINDING:
+            rewinding = command.value != 0;
+            break;
+        case EMUCMD_RECORD_MOVIE: {
+            if (!Emu_IsROMLoaded(emulator) || movie != nullptr)
+                break;
+            // Record from power on to movies/<date and time>.epm
+            std::filesystem::create_directory("movies");
+            char name[64];
+            std::time_t now = std::time(nullptr);
+            std::strftime(name, sizeof(name), "movies/%Y%m%d-%H%M%S.epm", std::localtime(&now));
+            movie = Movie_Record(emulator, name, MOVIE_START_POWER_ON);
+            Rewind_Clear(rewindBuffer);
+            if (movie != nullptr)
+                std::cout << "Recording movie " << name << std::endl;
+            break;
+        }
+        case EMUCMD_PLAY_MOVIE:
+            if (!Emu_IsROMLoaded(emulator) || movie != nullptr)
+                break;
+            movie = Movie_Play(emulator, command.path);
+            Rewind_Clear(rewindBuffer);
+            break;
+        case EMUCMD_STOP_MOVIE:
+            StopMovie();
+            break;
+        case EMUCMD_SET_VOLUME:
+            Emu_SetAudioChannelVolume(emulator, (APU_Channel)command.value, command.value2 / 100.0);
+            break;
+        case EMUCMD_SET_REWIND_BUDGET:
+            Rewind_SetBudget(rewindBuffer, (size_t)command.value << 20, command.value2 * 60);
+            break;
+        case EMUCMD_SET_RUN_AHEAD:
+            if (Emu_SetRunAhead(emulator, command.value, command.value2 != 0) != 0) {
+                std::cout << "Error creating run-ahead instance, using save states instead" << std::endl;
+                Emu_SetRunAhead(emulator, command.value, false);
+            }
+            break;
+    }
+}
+
+void EmuThread::OpenROM(const char* path)
+{
+    StopMovie();
+    if (Emu_LoadROM(emulator, path) == 0) {
+        Emu_PowerOn(emulator);
+        Rewind_Clear(rewindBuffer);
+    }
+}
+
+void EmuThread::StopMovie()
+{
+    if (movie == nullptr)
+        return;
+    if (Movie_Close(movie, emulator) != 0)
+        std::cout << "Movie playback went out of sync or the movie couldn't be saved" << std::endl;
+    movie = nullptr;
+}
+
+void EmuThread::UpdateStatus(unsigned fps)
+{
+    EmuStatus s;
+    s.romLoaded = Emu_IsROMLoaded(emulator);
+    s.paused = paused;
+    s.rewinding = rewinding;
+    s.turbo = turbo;
+    s.movieActive = movie != nullptr;
+    s.movieRecording = movie != nullptr && movie->recording;
+    s.runAheadSecondInstance = emulator->run_ahead_instance != NULL;
+    s.fps = fps;
+    Rewind_GetStats(rewindBuffer, &s.rewind);
+
+    std::lock_guard<std::mutex> lock(statusMutex);
+    status = s;
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "emulator.h"
+#include "rewind.h"
+#include "movie.h"
+#include "SPSCQueue.h"
+#include "TripleBuffer.h"
+
+enum EmuCommandType {
+    EMUCMD_PRESS_BUTTON,        //value: ControllerButton
+    EMUCMD_RELEASE_BUTTON,      //value: ControllerButton
+    EMUCMD_TOGGLE_PAUSE,
+    EMUCMD_POWER_CYCLE,
+    EMUCMD_OPEN_ROM,            //path
+    EMUCMD_CLOSE_ROM,
+    EMUCMD_SET_TURBO,           //value: 1 to fast-forward while held
+    EMUCMD_SET_REWINDING,       //value: 1 to rewind while held
+    EMUCMD_RECORD_MOVIE,
+    EMUCMD_PLAY_MOVIE,          //path
+    EMUCMD_STOP_MOVIE,
+    EMUCMD_SET_VOLUME,          //value: APU_Channel, value2: Volume in percent
+    EMUCMD_SET_REWIND_BUDGET,   //value: Megabytes, value2: Seconds
+    EMUCMD_SET_RUN_AHEAD        //value: Frames, value2: 1 to use a second instance
+};
+
+struct EmuCommand {
+    EmuCommandType type;
+    int value;
+    int value2;
+    char path[256];
+};
+
+//What the UI shows about the emulation thread, updated after each frame
+struct EmuStatus {
+    bool romLoaded = false;
+    bool paused = false;
+    bool rewinding = false;
+    bool turbo = false;
+    bool movieActive = false;
+    bool movieRecording = false;
+    bool runAheadSecondInstance = false;
+    unsigned fps = 0; //Frames shown per second
+    RewindStats rewind = {};
+};
+
+/*
+* Runs the emulator on its own thread at 60 frames per second, so the UI thread's work never stalls emulation or audio.
+* The emulator, rewind buffer and movie belong to that thread: The UI thread only sends commands, picks up the newest
+* finished frame and reads the status.
+*/
+class EmuThread {
+public:
+    //Called on the emulation thread with the samples of each frame
+    typedef std::function<void(const void* samples, size_t len)> AudioSink;
+
+    static const int TURBO_SPEED = 4; //Frames run per frame shown while fast-forwarding
+
+private:
+    Emulator* emulator;
+    Rewind* rewindBuffer;
+    Movie* movie = nullptr;
+    bool paused = false;
+    bool rewinding = false; //Rewind key held
+    bool turbo = false; //Fast-forward key held
+
+    PixelFormat format;
+    int pitch;
+    AudioSink audioSink;
+
+    SPSCQueue<EmuCommand, 64> commands;
+    TripleBuffer frames;
+    std::mutex statusMutex;
+    EmuStatus status;
+
+    std::atomic<bool> quit{false};
+    std::thread thread;
+
+public:
+    EmuThread(PixelFormat format, AudioSink audioSink, size_t rewindBudget, unsigned long rewindFrames);
+    //Stops the emulation thread and frees the emulator
+    ~EmuThread();
+
+    //Send a command to the emulation thread. Returns false if the command queue is full.
+    bool Send(EmuCommandType type, int value = 0, int value2 = 0, const char* path = nullptr);
+
+    //Get the newest finished frame if there is one the UI hasn't picked up yet, else NULL
+    const void* GetNewFrame(int* pitch);
+
+    EmuStatus GetStatus();
+
+private:
+    void Run();
+    void Execute(const EmuCommand& command);
+    //Run the frames shown in one frame of time: One normally, several while fast-forwarding.
+    //Returns 0 if a frame was rendered to the back buffer, 1 if not (nothing left to rewind, or the frames run weren't
+    //rendered while fast-forwarding), -1 if the emulator crashed.
+    int RunFrames();
+    void OpenROM(const char* path);
+    void StopMovie();
+    void UpdateStatus(unsigned fps);
+};
@@ -0,0 +1,38 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+/*
+* Lock-free queue for one producer thread and one consumer thread. Capacity must be a power of 2.
+* The head and tail are on separate cache lines, so the two threads don't slow each other down by writing the same line.
+*/
+template <typename T, size_t Capacity>
+class SPSCQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "SPSCQueue capacity must be a power of 2");
+private:
+    T items[Capacity];
+    alignas(64) std::atomic<size_t> head{0}; //Items pushed, written by the producer
+    alignas(64) std::atomic<size_t> tail{0}; //Items popped, written by the consumer
+public:
+    //Producer: Add an item. Returns false if the queue is full.
+    bool Push(const T& item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == Capacity)
+            return false;
+        items[h & (Capacity - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    //Consumer: Take the oldest item. Returns false if the queue is empty.
+    bool Pop(T& item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == t)
+            return false;
+        item = items[t & (Capacity - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+};
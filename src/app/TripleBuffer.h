@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/*
+* Hands finished frames from a producer thread to a consumer thread without locks or waiting. The producer always has
+* a back buffer to write the next frame to, and the consumer always has the newest finished frame in the front buffer.
+* Frames the consumer doesn't pick up in time are overwritten by newer ones.
+*/
+class TripleBuffer {
+private:
+    static const int FRESH = 4; //Flag in middle: The middle buffer holds a frame the consumer hasn't picked up
+
+    std::vector<unsigned char> buffers[3];
+    int back = 0; //Producer's buffer
+    int front = 1; //Consumer's buffer
+    std::atomic<int> middle{2}; //Index of the buffer being handed over, and FRESH
+public:
+    TripleBuffer(size_t size)
+    {
+        for (auto& buffer : buffers)
+            buffer.resize(size);
+    }
+
+    //Producer: The buffer to write the next frame to
+    void* GetBack() { return buffers[back].data(); }
+
+    //Producer: The frame in the back buffer is finished. Swaps it with the middle buffer.
+    void Publish()
+    {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+    }
+
+    //Consumer: Swap the newest finished frame into the front buffer. Returns false if there is none since the last call.
+    bool Acquire()
+    {
+        if ((middle.load(std::memory_order_relaxed) & FRESH) == 0)
+            return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+
+    //Consumer: The frame picked up by Acquire()
+    const void* GetFront() const { return buffers[front].data(); }
+};
@@ -11,24 +11,38 @@
 
 #include "sdl_audio_buffer.h"
 
-#include "emulator.h"
+#include "EmuThread.h"
 
-Emulator* emulator = nullptr;
-bool paused = false;
+EmuThread* emuThread = nullptr;
+EmuStatus emuStatus; //Status of the emulation thread, read once per UI frame
 
 int mainMenuHeight;
 FileDialog fileDialog;
+FileDialog movieDialog;
 struct VolumeMixer {
     bool active = false;
     int chVolPercent[APU_NUM_VOL_SETTINGS] = { 100, 100, 100, 100, 100, 100 };
     bool chMute[APU_NUM_VOL_SETTINGS] = { false };
 };
 VolumeMixer volumeMixer;
+struct RewindSettings {
+    bool active = false;
+    int budgetMB = REWIND_DEFAULT_BUDGET >> 20;
+    int seconds = 60;
+};
+RewindSettings rewindSettings;
+struct RunAheadSettings {
+    bool active = false;
+    int frames = 0;
+    bool secondInstance = false;
+};
+RunAheadSettings runAheadSettings;
 
 SDL_Window* window;
 std::string windowTitle = "EpicNES";
 SDL_Renderer* renderer;
 SDL_Texture* emuVideo;
+PixelFormat emuVideoFormat; //Format of emuVideo's pixels, which the emulator's color indexes are converted to
 SDL_AudioSpec audioSpec;
 SDLAudioBuffer* audioBuffer = nullptr;
 
@@ -36,11 +50,14 @@ void UIAction_Open();
 void UIAction_Close();
 void UIAction_Pause();
 void UIAction_PowerCycle();
-
-void OpenROM(const char* path);
+void UIAction_RecordMovie();
+void UIAction_PlayMovie();
+void UIAction_StopMovie();
 
 void FitRectToRegion(SDL_Rect& rect, const SDL_Rect& region);
 
+Uint32 ChooseVideoFormat(SDL_Renderer* renderer, PixelFormat& format);
+
 int main(int argc, char* argv[]) {
     // Initialize SDL2
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
@@ -64,31 +81,30 @@ int main(int argc, char* argv[]) {
     ImGui_ImplSDL2_InitForSDLRenderer(window, renderer);
     ImGui_ImplSDLRenderer2_Init(renderer);
 
-    // Create emulator
-    emulator = Emu_Create();
-    
-    // Set (and create if needed) saves directory
-    std::filesystem::create_directory("saves");
-    Emu_SetSavePath(emulator, "saves/");
-
     // 16-bit 44.1khz audio
     audioSpec.freq = 44100;
     audioSpec.format = AUDIO_S16;
     audioSpec.channels = 1;
     audioSpec.samples = 1024;
-    if (SDLAudioBuffer_Create(&audioBuffer, audioSpec, 4) != 0) {
+    if (SDLAudioBuffer_Create(&audioBuffer, audioSpec, 4, SDL_AUDIO_BUFFER_DEFAULT_LATENCY) != 0) {
         std::cout << "Error opening SDL audio: " << SDL_GetError() << std::endl;
         return -1;
     }
     
     // Create video output texture
-    emuVideo = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, NES_SCREEN_W, NES_SCREEN_H);
+    emuVideo = SDL_CreateTexture(renderer, ChooseVideoFormat(renderer, emuVideoFormat), SDL_TEXTUREACCESS_STREAMING, NES_SCREEN_W, NES_SCREEN_H);
     if (emuVideo == NULL) {
         SDL_Log("Failed to create emulator video output texture: %s", SDL_GetError());
         return -1;
     }
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 
+    // Start the emulator on its own thread. Its audio goes straight to the audio buffer.
+    // Frames are handed over as color indexes, a quarter of the size of RGBA, and converted straight into emuVideo.
+    emuThread = new EmuThread(PIXEL_FORMAT_INDEXED8, [](const void* samples, size_t len) {
+        SDLAudioBuffer_QueueAudio(audioBuffer, (Uint8*)samples, &len);
+    }, (size_t)rewindSettings.budgetMB << 20, rewindSettings.seconds * 60);
+
     // Set window size to NES screen dimensions * 2, plus main menu height
     {
         ImGui_ImplSDLRenderer2_NewFrame();
@@ -104,6 +120,7 @@ int main(int argc, char* argv[]) {
 
     // Set up widgets
     fileDialog = FileDialog("Open ROM File");
+    movieDialog = FileDialog("Open Movie File");
 
     // Main loop
     Uint32 max_fps = 60;
@@ -117,7 +134,7 @@ int main(int argc, char* argv[]) {
             switch (event.type) {
                 case SDL_DROPFILE:
                     std::cout << "Dropped file " << event.drop.file << std::endl;
-                    OpenROM(event.drop.file);
+                    emuThread->Send(EMUCMD_OPEN_ROM, 0, 0, event.drop.file);
                     SDL_free(event.drop.file);
                     break;
                 case SDL_WINDOWEVENT:
@@ -127,14 +144,14 @@ int main(int argc, char* argv[]) {
                 case SDL_KEYDOWN:
                     switch (event.key.keysym.scancode) {
                         //Controller input
-                        case SDL_SCANCODE_X:        Emu_PressButton(emulator, BUTTON_A);        break;
-                        case SDL_SCANCODE_Z:        Emu_PressButton(emulator, BUTTON_B);        break;
-                        case SDL_SCANCODE_RETURN:   Emu_PressButton(emulator, BUTTON_START);    break;
-                        case SDL_SCANCODE_RSHIFT:   Emu_PressButton(emulator, BUTTON_SELECT);   break;
-                        case SDL_SCANCODE_UP:       Emu_PressButton(emulator, BUTTON_UP);       break;
-                        case SDL_SCANCODE_DOWN:     Emu_PressButton(emulator, BUTTON_DOWN);     break;
-                        case SDL_SCANCODE_LEFT:     Emu_PressButton(emulator, BUTTON_LEFT);     break;
-                        case SDL_SCANCODE_RIGHT:    Emu_PressButton(emulator, BUTTON_RIGHT);    break;
+                        case SDL_SCANCODE_X:        emuThread->Send(EMUCMD_PRESS_BUTTON, BUTTON_A);        break;
+                        case SDL_SCANCODE_Z:        emuThread->Send(EMUCMD_PRESS_BUTTON, BUTTON_B);        break;
+                        case SDL_SCANCODE_RETURN:   emuThread->Send(EMUCMD_PRESS_BUTTON, BUTTON_START);    break;
+                        case SDL_SCANCODE_RSHIFT:   emuThread->Send(EMUCMD_PRESS_BUTTON, BUTTON_SELECT);   break;
+                        case SDL_SCANCODE_UP:       emuThread->Send(EMUCMD_PRESS_BUTTON, BUTTON_UP);       break;
+                        case SDL_SCANCODE_DOWN:     emuThread->Send(EMUCMD_PRESS_BUTTON, BUTTON_DOWN);     break;
+                        case SDL_SCANCODE_LEFT:     emuThread->Send(EMUCMD_PRESS_BUTTON, BUTTON_LEFT);     break;
+                        case SDL_SCANCODE_RIGHT:    emuThread->Send(EMUCMD_PRESS_BUTTON, BUTTON_RIGHT);    break;
 
                         // UI actions
                         case SDL_SCANCODE_R:
@@ -152,19 +169,29 @@ int main(int argc, char* argv[]) {
                         case SDL_SCANCODE_ESCAPE: //Esc: Pause/resume
                             UIAction_Pause();
                             break;
+                        case SDL_SCANCODE_BACKSPACE: //Hold Backspace: Rewind
+                            if (!event.key.repeat)
+                                emuThread->Send(EMUCMD_SET_REWINDING, 1);
+                            break;
+                        case SDL_SCANCODE_TAB: //Hold Tab: Fast-forward
+                            if (!event.key.repeat)
+                                emuThread->Send(EMUCMD_SET_TURBO, 1);
+                            break;
                         default: break;
                     }
                     break;
                 case SDL_KEYUP:
                     switch (event.key.keysym.sym) {
-                        case SDLK_x:        Emu_ReleaseButton(emulator, BUTTON_A);        break;
-                        case SDLK_z:        Emu_ReleaseButton(emulator, BUTTON_B);        break;
-                        case SDLK_RETURN:   Emu_ReleaseButton(emulator, BUTTON_START);    break;
-                        case SDLK_RSHIFT:   Emu_ReleaseButton(emulator, BUTTON_SELECT);   break;
-                        case SDLK_UP:       Emu_ReleaseButton(emulator, BUTTON_UP);       break;
-                        case SDLK_DOWN:     Emu_ReleaseButton(emulator, BUTTON_DOWN);     break;
-                        case SDLK_LEFT:     Emu_ReleaseButton(emulator, BUTTON_LEFT);     break;
-                        case SDLK_RIGHT:    Emu_ReleaseButton(emulator, BUTTON_RIGHT);    break;
+                        case SDLK_x:        emuThread->Send(EMUCMD_RELEASE_BUTTON, BUTTON_A);        break;
+                        case SDLK_z:        emuThread->Send(EMUCMD_RELEASE_BUTTON, BUTTON_B);        break;
+                        case SDLK_RETURN:   emuThread->Send(EMUCMD_RELEASE_BUTTON, BUTTON_START);    break;
+                        case SDLK_RSHIFT:   emuThread->Send(EMUCMD_RELEASE_BUTTON, BUTTON_SELECT);   break;
+                        case SDLK_UP:       emuThread->Send(EMUCMD_RELEASE_BUTTON, BUTTON_UP);       break;
+                        case SDLK_DOWN:     emuThread->Send(EMUCMD_RELEASE_BUTTON, BUTTON_DOWN);     break;
+                        case SDLK_LEFT:     emuThread->Send(EMUCMD_RELEASE_BUTTON, BUTTON_LEFT);     break;
+                        case SDLK_RIGHT:    emuThread->Send(EMUCMD_RELEASE_BUTTON, BUTTON_RIGHT);    break;
+                        case SDLK_BACKSPACE: emuThread->Send(EMUCMD_SET_REWINDING, 0); break;
+                        case SDLK_TAB:      emuThread->Send(EMUCMD_SET_TURBO, 0); break;
                         default: break;
                     }
             }
@@ -172,16 +199,15 @@ int main(int argc, char* argv[]) {
             ImGui_ImplSDL2_ProcessEvent(&event);
         }
         
-        if (Emu_IsROMLoaded(emulator) && !paused) {
-            //Run emulator
-            if (Emu_RunFrame(emulator) != 0)
-                return -1;
-            //Queue samples from audio output
-            size_t len;
-            Uint8* emuAudio = (Uint8*)Emu_GetAudioBuffer(emulator, &len);
-            size_t iLen = len;
-            SDLAudioBuffer_QueueAudio(audioBuffer, emuAudio, &len);
-            Emu_ClearAudioBuffer(emulator);
+        //Show the newest frame the emulation thread finished, if there is a new one
+        emuStatus = emuThread->GetStatus();
+        int framePitch;
+        const void* frame = emuThread->GetNewFrame(&framePitch);
+        void* pixels;
+        int pitch;
+        if (frame != nullptr && SDL_LockTexture(emuVideo, NULL, &pixels, &pitch) == 0) {
+            PPU_ConvertIndexed((const uint8_t*)frame, framePitch, pixels, pitch, emuVideoFormat);
+            SDL_UnlockTexture(emuVideo);
         }
 
         // ImGui frame
@@ -203,12 +229,20 @@ int main(int argc, char* argv[]) {
                 if (ImGui::BeginMenu("Game")) {
                     if (ImGui::MenuItem("Pause", "Esc"))            UIAction_Pause();
                     if (ImGui::MenuItem("Reset", "Ctrl+R"))         UIAction_PowerCycle();
+                    ImGui::MenuItem("Rewind (hold)", "Backspace", false, false);
+                    ImGui::MenuItem("Fast-Forward (hold)", "Tab", false, false);
+                    ImGui::Separator();
+                    if (ImGui::MenuItem("Record Movie", NULL, false, !emuStatus.movieActive))     UIAction_RecordMovie();
+                    if (ImGui::MenuItem("Play Movie", NULL, false, !emuStatus.movieActive))       UIAction_PlayMovie();
+                    if (ImGui::MenuItem("Stop Movie", NULL, false, emuStatus.movieActive))       UIAction_StopMovie();
 
                     ImGui::EndMenu();
                 }
                 // Options
                 if (ImGui::BeginMenu("Options")) {
                     if (ImGui::MenuItem("Volume Mixer"))            volumeMixer.active = true;
+                    if (ImGui::MenuItem("Rewind"))                  rewindSettings.active = true;
+                    if (ImGui::MenuItem("Run-Ahead"))               runAheadSettings.active = true;
 
                     ImGui::EndMenu();
                 }
@@ -218,15 +252,53 @@ int main(int argc, char* argv[]) {
             // File dialog
             if (fileDialog.Update()) {
                 // File confirmed, open
-                OpenROM(fileDialog.GetFilePath().u8string().c_str());
+                emuThread->Send(EMUCMD_OPEN_ROM, 0, 0, fileDialog.GetFilePath().u8string().c_str());
+            }
+            if (movieDialog.Update()) {
+                // Movie file confirmed, play
+                emuThread->Send(EMUCMD_PLAY_MOVIE, 0, 0, movieDialog.GetFilePath().u8string().c_str());
             }
 
             // Volume mixer
             if (volumeMixer.active) {
                 if (ImGui::Begin("Volume Mixer", &volumeMixer.active)) {
                     if (ImGui::SliderInt("Master Volume", &volumeMixer.chVolPercent[APU_CH_MASTER], 0, 100)) {
-                        Emu_SetAudioChannelVolume(emulator, APU_CH_MASTER, volumeMixer.chVolPercent[APU_CH_MASTER] / 100.0);
+                        emuThread->Send(EMUCMD_SET_VOLUME, APU_CH_MASTER, volumeMixer.chVolPercent[APU_CH_MASTER]);
                     }
+
+                    SDLAudioBufferStats audioStats;
+                    SDLAudioBuffer_GetStats(audioBuffer, &audioStats);
+                    ImGui::Text("Latency: %.0f ms (%zu of %zu samples buffered)", audioStats.latency_ms, audioStats.fill, audioStats.capacity);
+                    ImGui::Text("Underruns: %lu", audioStats.underruns);
+                }
+                ImGui::End();
+            }
+
+            // Rewind settings and memory use
+            if (rewindSettings.active) {
+                if (ImGui::Begin("Rewind", &rewindSettings.active)) {
+                    bool changed = ImGui::SliderInt("Memory (MB)", &rewindSettings.budgetMB, 1, 512);
+                    changed |= ImGui::SliderInt("Length (seconds)", &rewindSettings.seconds, 1, 600);
+                    if (changed)
+                        emuThread->Send(EMUCMD_SET_REWIND_BUDGET, rewindSettings.budgetMB, rewindSettings.seconds);
+
+                    const RewindStats& stats = emuStatus.rewind;
+                    ImGui::Text("Stored: %.1f seconds (%lu frames, %lu keyframes)", stats.frames / 60.0, stats.frames, stats.keyframes);
+                    ImGui::Text("Memory used: %.2f of %.0f MB", stats.bytes_used / 1048576.0, stats.budget / 1048576.0);
+                    if (stats.frames > 0)
+                        ImGui::Text("Average: %.0f bytes per frame (state: %zu bytes)", (double)stats.bytes_used / stats.frames, stats.state_size);
+                }
+                ImGui::End();
+            }
+
+            // Run-ahead settings
+            if (runAheadSettings.active) {
+                if (ImGui::Begin("Run-Ahead", &runAheadSettings.active)) {
+                    bool changed = ImGui::SliderInt("Frames", &runAheadSettings.frames, 0, 4);
+                    changed |= ImGui::Checkbox("Use second instance", &runAheadSettings.secondInstance);
+                    if (changed)
+                        emuThread->Send(EMUCMD_SET_RUN_AHEAD, runAheadSettings.frames, runAheadSettings.secondInstance);
+                    ImGui::TextWrapped("Runs frames ahead to hide the game's input lag. Set to the number of frames a button press takes to show up in the game, or less.");
                 }
                 ImGui::End();
             }
@@ -237,11 +309,7 @@ int main(int argc, char* argv[]) {
         ImGui::Render();
 
         SDL_RenderClear(renderer);
-        if (Emu_IsROMLoaded(emulator)) {
-            SDL_Rect screenSrc = {0, 0, 0, 0};
-            RGBAPixel* buffer = Emu_GetPixelBuffer(emulator, &screenSrc.w, &screenSrc.h);
-            SDL_UpdateTexture(emuVideo, &screenSrc, buffer, sizeof(*buffer) * screenSrc.w);
-            
+        if (emuStatus.romLoaded) {
             SDL_Rect screenDest;
             SDL_QueryTexture(emuVideo, NULL, NULL, &screenDest.w, &screenDest.h);
             SDL_Rect screenRegion = { 0, mainMenuHeight, 0, 0 };
@@ -266,16 +334,22 @@ int main(int argc, char* argv[]) {
         
         windowTitle = "EpicNES";
         windowTitle += " (";
-        windowTitle += std::to_string(fps);
+        windowTitle += std::to_string(emuStatus.romLoaded && !emuStatus.paused ? emuStatus.fps : fps);
         windowTitle += " FPS)";
 
-        if (paused)
+        if (emuStatus.movieActive)
+            windowTitle += emuStatus.movieRecording ? " (Recording)" : " (Playing movie)";
+        if (emuStatus.paused)
             windowTitle += " (Paused)";
+        else if (emuStatus.rewinding && emuStatus.romLoaded)
+            windowTitle += " (Rewinding)";
+        else if (emuStatus.turbo && emuStatus.romLoaded)
+            windowTitle += " (Fast-forward)";
 
         SDL_SetWindowTitle(window, windowTitle.c_str());
     }
 
-    Emu_Free(emulator);
+    delete emuThread; //Stops any movie, so a recording is finished
 
     ImGui_ImplSDLRenderer2_Shutdown();
     ImGui_ImplSDL2_Shutdown();
@@ -293,24 +367,33 @@ void UIAction_Open()
 
 void UIAction_Close()
 {
-    Emu_CloseROM(emulator);
+    emuThread->Send(EMUCMD_CLOSE_ROM);
 }
 
 void UIAction_Pause()
 {
-    paused = !paused;
+    emuThread->Send(EMUCMD_TOGGLE_PAUSE);
 }
 
 void UIAction_PowerCycle()
 {
-    if (Emu_IsROMLoaded(emulator))
-        Emu_PowerOn(emulator);
+    emuThread->Send(EMUCMD_POWER_CYCLE);
+}
+
+void UIAction_RecordMovie()
+{
+    emuThread->Send(EMUCMD_RECORD_MOVIE);
+}
+
+void UIAction_PlayMovie()
+{
+    if (emuStatus.romLoaded)
+        movieDialog.Show();
 }
 
-void OpenROM(const char *path)
+void UIAction_StopMovie()
 {
-    if (Emu_LoadROM(emulator, path) == 0)
-        Emu_PowerOn(emulator);
+    emuThread->Send(EMUCMD_STOP_MOVIE);
 }
 
 void FitRectToRegion(SDL_Rect &rect, const SDL_Rect &region)
@@ -325,3 +408,21 @@ void FitRectToRegion(SDL_Rect &rect, const SDL_Rect &region)
     rect.x = region.x + ((region.w - rect.w) / 2);
     rect.y = region.y + ((region.h - rect.h) / 2);
 }
+
+Uint32 ChooseVideoFormat(SDL_Renderer* renderer, PixelFormat& format)
+{
+    //The first format in the renderer's list that the emulator can write, so the texture isn't converted on upload
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(renderer, &info) == 0) {
+        for (Uint32 i = 0; i < info.num_texture_formats; i++) {
+            switch (info.texture_formats[i]) {
+                case SDL_PIXELFORMAT_RGBA32: format = PIXEL_FORMAT_RGBA8888; return SDL_PIXELFORMAT_RGBA32;
+                case SDL_PIXELFORMAT_BGRA32: format = PIXEL_FORMAT_BGRA8888; return SDL_PIXELFORMAT_BGRA32;
+                case SDL_PIXELFORMAT_RGB565: format = PIXEL_FORMAT_RGB565;   return SDL_PIXELFORMAT_RGB565;
+                default: break;
+            }
+        }
+    }
+    format = PIXEL_FORMAT_RGBA8888;
+    return SDL_PIXELFORMAT_RGBA32;
+}
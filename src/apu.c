@@ -1,7 +1,35 @@
 #include "apu.h"
 #include <assert.h>
+#include <math.h>
 #include <string.h>
 
+#define PI 3.14159265358979323846
+#define BLIP_CUTOFF 0.45 //Band limit as a fraction of the sample rate, a little under the Nyquist frequency
+
+//Build the band-limited step kernel: For each phase, a Blackman-windowed sinc impulse centered between taps
+//TAPS / 2 - 1 and TAPS / 2, shifted by the phase. Each phase sums to exactly 1 << APU_BLIP_SHIFT, so a step adds
+//exactly its size to the output and the output can't drift.
+static void BuildBlipKernel(int16_t kernel[APU_BLIP_PHASES][APU_BLIP_TAPS])
+{
+    for (int p = 0; p < APU_BLIP_PHASES; p++) {
+        double h[APU_BLIP_TAPS], sum = 0;
+        for (int t = 0; t < APU_BLIP_TAPS; t++) {
+            double d = t - (APU_BLIP_TAPS / 2 - 1) - (double)p / APU_BLIP_PHASES;
+            double x = 2 * BLIP_CUTOFF * d;
+            double sinc = (x == 0) ? 1 : sin(PI * x) / (PI * x);
+            double window = 0.42 + 0.5 * cos(2 * PI * d / APU_BLIP_TAPS) + 0.08 * cos(4 * PI * d / APU_BLIP_TAPS);
+            h[t] = sinc * window;
+            sum += h[t];
+        }
+        int total = 0;
+        for (int t = 0; t < APU_BLIP_TAPS; t++) {
+            kernel[p][t] = (int16_t)lround(h[t] / sum * (1 << APU_BLIP_SHIFT));
+            total += kernel[p][t];
+        }
+        kernel[p][APU_BLIP_TAPS / 2 - 1] += (1 << APU_BLIP_SHIFT) - total;
+    }
+}
+
 //Write APU length counter load register. The upper 5 bits are an index into the length table.
 void _APU_WriteLength(APULength* length, uint8_t reg_data) {
     if (length->enabled)
@@ -14,9 +42,12 @@ void APU_Init(APU* apu, APUCallbacks callbacks, double cpuClockMHz, double sampl
     memset(apu, 0, sizeof(APU));
     apu->callbacks = callbacks;
     apu->cpuCyclesPerSample = (cpuClockMHz * 1000000) / sampleRateHz;
+    apu->samplesPerCycle = 1.0 / apu->cpuCyclesPerSample;
+    BuildBlipKernel(apu->blipKernel);
 
     for (int i = 0; i < APU_NUM_VOL_SETTINGS; i++)
         apu->volume[i] = 1.0;
+    _APU_BuildMixer(apu);
 }
 
 void APU_PowerOn(APU *apu)
@@ -39,6 +70,7 @@ void APU_Reset(APU* apu) {
 
 uint8_t APU_Read(APU *apu, uint16_t addr)
 {
+    APU_Sync(apu);
     APUState* state = &apu->state;
     if (addr == 0x4015) {
         uint8_t ret = (state->ch_pulse1.length.counter > 0) |
@@ -57,6 +89,7 @@ uint8_t APU_Read(APU *apu, uint16_t addr)
 
 void APU_Write(APU *apu, uint16_t addr, uint8_t data)
 {
+    APU_Sync(apu);
     APUState* state = &apu->state;
     switch (addr) {
         case 0x4000: _APUPulse_Write0(&state->ch_pulse1, data); break;
@@ -125,6 +158,7 @@ void APU_Write(APU *apu, uint16_t addr, uint8_t data)
                 state->fc_irq = false;
             //Side effects: Reset FC timer, and if the 5-step flag is set, generate quarter and half frame signals
             state->fc_cycles = 0;
+            state->fc_step = 0;
             if (data & FC_5STEP) {
                 _APU_FC_ClockQuarterFrame(apu);
                 _APU_FC_ClockHalfFrame(apu);
@@ -132,38 +166,115 @@ void APU_Write(APU *apu, uint16_t addr, uint8_t data)
             break;
         default: break;
     }
+    _APU_UpdateOutput(apu);
+    apu->syncDeadline = _APU_CyclesUntilDMCFetch(apu);
 }
 
-void APU_CPUCycle(APU *apu)
+void APU_Sync(APU *apu)
 {
-    //Audio output
-    apu->cycleSampleTimer++;
-    if (apu->cycleSampleTimer >= apu->cpuCyclesPerSample) {
-        apu->cycleSampleTimer -= apu->cpuCyclesPerSample;
-        
-        assert(apu->sampleBufferSize < APU_SAMPLE_CAPACITY);
-        apu->sampleBuffer[apu->sampleBufferSize++] = (short)(INT16_MAX * _APU_MixAudio(apu));
+    unsigned cycles = apu->pendingCycles;
+    apu->pendingCycles = 0;
+    if (cycles > 0) {
+        if (apu->synthesis == APU_SYNTH_BANDLIMITED)
+            _APU_RunBandlimited(apu, cycles);
+        else
+            _APU_RunPoint(apu, cycles);
+    }
+    apu->syncDeadline = _APU_CyclesUntilDMCFetch(apu);
+}
+
+void APU_EndFrame(APU *apu)
+{
+    APU_Sync(apu);
+    if (apu->synthesis != APU_SYNTH_BANDLIMITED || apu->skipOutput)
+        return;
+
+    double end = apu->blipOffset + apu->blipCycles * apu->samplesPerCycle;
+    size_t count = (size_t)end;
+    assert(apu->sampleBufferSize + count <= APU_SAMPLE_CAPACITY);
+    for (size_t i = 0; i < count; i++) {
+        apu->blipSum += apu->blipBuffer[i];
+        int32_t sample = apu->blipSum >> APU_BLIP_SHIFT;
+        //The kernel rings a little past full scale around big steps
+        if (sample > INT16_MAX)
+            sample = INT16_MAX;
+        else if (sample < INT16_MIN)
+            sample = INT16_MIN;
+        apu->sampleBuffer[apu->sampleBufferSize++] = (short)sample;
     }
 
-    //Clock frame counter
-    _APU_FC_Clock(apu);
+    //Keep the tails of the steps near the end for the next frame
+    memmove(apu->blipBuffer, apu->blipBuffer + count, APU_BLIP_TAPS * sizeof(int32_t));
+    memset(apu->blipBuffer + APU_BLIP_TAPS, 0, count * sizeof(int32_t));
+    apu->blipOffset = end - count;
+    apu->blipCycles = 0;
+}
+
+void APU_SetSynthesis(APU *apu, APU_Synthesis synthesis)
+{
+    APU_Sync(apu);
+    apu->synthesis = synthesis;
+    memset(apu->blipBuffer, 0, sizeof(apu->blipBuffer));
+    apu->blipCycles = 0;
+    apu->blipOffset = 0;
+    apu->blipLevel = 0;
+    apu->blipSum = 0;
+    memset(apu->blipChannels, 0, sizeof(apu->blipChannels));
+    apu->blipActive = 0;
 }
 
 bool APU_IRQSignal(APU *apu) { return apu->state.fc_irq || apu->state.ch_dmc.irq; }
 
+unsigned APU_CyclesUntilFrameStep(APU *apu)
+{
+    APU_Sync(apu);
+    APUState* state = &apu->state;
+    bool mode5 = (state->fc_ctrl & FC_5STEP) != 0;
+    return APU_FC_STEP_CYCLES[mode5][state->fc_step] - state->fc_cycles + 1;
+}
+
+void APU_FrameCounterStep(APU *apu)
+{
+    APU_Sync(apu);
+    APUState* state = &apu->state;
+
+    switch (state->fc_step) {
+        case 0: //Step 1 at 3728.5 APU cycles
+        case 2: //Step 3 at 11185.5 APU cycles
+            _APU_FC_ClockQuarterFrame(apu);
+            break;
+        case 1: //Step 2 at 7456.5 APU cycles
+            _APU_FC_ClockQuarterFrame(apu);
+            _APU_FC_ClockHalfFrame(apu);
+            break;
+        case 3: //Step 4 at 14914.5 APU cycles (4-step), step 5 at 18640.5 APU cycles (5-step)
+            _APU_FC_ClockQuarterFrame(apu);
+            _APU_FC_ClockHalfFrame(apu);
+            if ((state->fc_ctrl & (FC_5STEP | FC_IRQ_INHIBIT)) == 0)
+                state->fc_irq = true;
+            break;
+        default: break;
+    }
+    state->fc_step = (state->fc_step + 1) % 4;
+    _APU_UpdateOutput(apu);
+}
+
 void *APU_GetAudioBuffer(APU *apu, size_t *len)
 {
+    APU_Sync(apu);
     *len = apu->sampleBufferSize * sizeof(short);
     return &apu->sampleBuffer[0];
 }
 
 void APU_ClearAudioBuffer(APU *apu)
 {
+    APU_Sync(apu);
     apu->sampleBufferSize = 0;
 }
 
 void APU_DMCLoadSample(APU *apu, uint8_t sampleData)
 {
+    APU_Sync(apu);
     APU_DMC* dmc = &apu->state.ch_dmc;
 
     dmc->sample_buffer = sampleData;
@@ -180,6 +291,7 @@ void APU_DMCLoadSample(APU *apu, uint8_t sampleData)
         else if (dmc->irq_enable)
             dmc->irq = true;
     }
+    apu->syncDeadline = _APU_CyclesUntilDMCFetch(apu);
 }
 
 double APU_GetChannelVolume(APU *apu, APU_Channel channel)
@@ -196,7 +308,10 @@ void APU_SetChannelVolume(APU *apu, APU_Channel channel, double volume)
         volume = 1.0;
     if (volume < 0.0)
         volume = 0.0;
+    APU_Sync(apu);
     apu->volume[channel] = volume;
+    _APU_BuildMixer(apu);
+    _APU_UpdateOutput(apu);
 }
 
 bool APU_GetChannelMute(APU *apu, APU_Channel channel)
@@ -208,87 +323,240 @@ bool APU_GetChannelMute(APU *apu, APU_Channel channel)
 void APU_SetChannelMute(APU *apu, APU_Channel channel, bool mute)
 {
     assert(channel < APU_NUM_VOL_SETTINGS);
+    APU_Sync(apu);
     apu->mute[channel] = mute;
+    _APU_BuildMixer(apu);
+    _APU_UpdateOutput(apu);
 }
 
-double _APU_MixAudio(APU *apu)
+void _APU_BuildMixer(APU *apu)
 {
-    APUState* state = &apu->state;
+    for (int ch = 0; ch < APU_NUM_CHANNELS; ch++) {
+        double volume = apu->mute[ch] ? 0.0 : apu->volume[ch];
+        for (int out = 0; out < 128; out++)
+            apu->levelTable[ch][out] = (uint16_t)(out * volume * (1 << APU_LEVEL_SHIFT) + 0.5);
+    }
 
-    double pulse1 = _APUPulse_Output(&state->ch_pulse1, true)       * apu->volume[APU_CH_PULSE1] * (apu->mute[APU_CH_PULSE1] ? 0.0 : 1.0);
-    double pulse2 = _APUPulse_Output(&state->ch_pulse2, false)      * apu->volume[APU_CH_PULSE2] * (apu->mute[APU_CH_PULSE2] ? 0.0 : 1.0);
-    double pulse_out = 95.88 / ((8128 / (pulse1 + pulse2)) + 100);
+    //Samples with fraction bits, so adding a pulse and a TND entry rounds like mixing in floating point
+    double scale = INT16_MAX * (double)(1 << APU_MIX_SHIFT) * (apu->mute[APU_CH_MASTER] ? 0.0 : apu->volume[APU_CH_MASTER]);
+    apu->pulseTable[0] = 0;
+    for (int i = 1; i < 32; i++)
+        apu->pulseTable[i] = (int32_t)(scale * 95.88 / (8128.0 / i + 100));
+    //The triangle, noise and DMC are approximated as one weighted sum
+    apu->tndTable[0] = 0;
+    for (int i = 1; i < 204; i++)
+        apu->tndTable[i] = (int32_t)(scale * 163.67 / (24329.0 / i + 100));
+}
 
-    double triangle = _APUTriangle_Output(&state->ch_triangle)      * apu->volume[APU_CH_TRIANGLE] * (apu->mute[APU_CH_TRIANGLE] ? 0.0 : 1.0);
-    double noise = _APUNoise_Output(&state->ch_noise)               * apu->volume[APU_CH_NOISE] * (apu->mute[APU_CH_NOISE] ? 0.0 : 1.0);
-    double dmc = _APUDMC_Output(&state->ch_dmc)                     * apu->volume[APU_CH_DMC] * (apu->mute[APU_CH_DMC] ? 0.0 : 1.0);
-    double tnd_out = 159.79 / 
-        ((1 / ((triangle / 8227) + (noise / 12241) + (dmc / 22638))) + 100);
+//Look up a level with APU_LEVEL_SHIFT fraction bits, interpolating between the entries around it
+static inline int32_t MixLookup(const int32_t* table, int level)
+{
+    int i = level >> APU_LEVEL_SHIFT;
+    int frac = level & ((1 << APU_LEVEL_SHIFT) - 1);
+    return table[i] + (int32_t)(((int64_t)(table[i + 1] - table[i]) * frac) >> APU_LEVEL_SHIFT);
+}
 
-    return (pulse_out + tnd_out)                                    * apu->volume[APU_CH_MASTER] * (apu->mute[APU_CH_MASTER] ? 0.0 : 1.0);
+int16_t _APU_MixOutputs(APU *apu, const uint8_t outputs[APU_NUM_CHANNELS])
+{
+    const uint16_t (*level)[128] = apu->levelTable;
+    int pulse = level[APU_CH_PULSE1][outputs[APU_CH_PULSE1]] + level[APU_CH_PULSE2][outputs[APU_CH_PULSE2]];
+    int tnd = 3 * level[APU_CH_TRIANGLE][outputs[APU_CH_TRIANGLE]] + 2 * level[APU_CH_NOISE][outputs[APU_CH_NOISE]] +
+        level[APU_CH_DMC][outputs[APU_CH_DMC]];
+    int32_t sample = (MixLookup(apu->pulseTable, pulse) + MixLookup(apu->tndTable, tnd)) >> APU_MIX_SHIFT;
+    return (int16_t)(sample < INT16_MAX ? sample : INT16_MAX);
 }
 
-void _APU_FC_Clock(APU *apu)
+int16_t _APU_MixAudio(APU *apu)
 {
     APUState* state = &apu->state;
+    uint8_t outputs[APU_NUM_CHANNELS] = {
+        _APUPulse_Output(&state->ch_pulse1, true),
+        _APUPulse_Output(&state->ch_pulse2, false),
+        _APUTriangle_Output(&state->ch_triangle),
+        _APUNoise_Output(&state->ch_noise),
+        _APUDMC_Output(&state->ch_dmc)
+    };
+    return _APU_MixOutputs(apu, outputs);
+}
 
-    //Clock pulse waves every APU cycle (2 CPU cycles)
-    if (state->fc_cycles % 2 == 0) {
-        _APUPulse_ClockWave(&state->ch_pulse1);
-        _APUPulse_ClockWave(&state->ch_pulse2);
+uint8_t _APU_ChannelOutput(APU *apu, APU_Channel channel)
+{
+    APUState* state = &apu->state;
+    switch (channel) {
+        case APU_CH_PULSE1:     return _APUPulse_Output(&state->ch_pulse1, true);
+        case APU_CH_PULSE2:     return _APUPulse_Output(&state->ch_pulse2, false);
+        case APU_CH_TRIANGLE:   return _APUTriangle_Output(&state->ch_triangle);
+        case APU_CH_NOISE:      return _APUNoise_Output(&state->ch_noise);
+        case APU_CH_DMC:        return _APUDMC_Output(&state->ch_dmc);
+        default:                return 0;
     }
+}
 
-    //Clock triangle, noise, DMC every CPU cycle
-    _APUTriangle_ClockWave(&state->ch_triangle);
-    _APUNoise_ClockLFSR(&state->ch_noise);
-    _APUDMC_Clock(apu);
-    
-    //Frame counter sequencer
-    if (apu->state.fc_ctrl & FC_5STEP) {
-        //5-step sequence
-        switch (state->fc_cycles) {
-            case 7457: //Step 1 at 3728.5 APU cycles
-                _APU_FC_ClockQuarterFrame(apu);
-                break;
-            case 14913: //Step 2 at 7456.5 APU cycles
-                _APU_FC_ClockQuarterFrame(apu);
-                _APU_FC_ClockHalfFrame(apu);
-                break;
-            case 22371: //Step 3 at 11185.5 APU cycles
-                _APU_FC_ClockQuarterFrame(apu);
-                break;
-            case 37281: //Step 5 at 18640.5 APU cycles
-                _APU_FC_ClockQuarterFrame(apu);
-                _APU_FC_ClockHalfFrame(apu);
-                break;
-            default: break;
+void _APU_UpdateOutput(APU *apu)
+{
+    if (apu->synthesis != APU_SYNTH_BANDLIMITED || apu->skipOutput)
+        return;
+    for (int ch = 0; ch < APU_NUM_CHANNELS; ch++)
+        apu->blipChannels[ch] = _APU_ChannelOutput(apu, (APU_Channel)ch);
+
+    //Channels that are silenced by something other than their waveform stay silent when the waveform moves, until
+    //a register write or a frame counter step, which both come back here.
+    APUState* state = &apu->state;
+    apu->blipActive = 1 << APU_CH_TRIANGLE | 1 << APU_CH_DMC; //Their waveform only moves while they are audible
+    if (state->ch_pulse1.length.counter > 0 && _APUEnv_Output(&state->ch_pulse1.envelope) > 0 && !_APUPulse_SweepMute(&state->ch_pulse1, true))
+        apu->blipActive |= 1 << APU_CH_PULSE1;
+    if (state->ch_pulse2.length.counter > 0 && _APUEnv_Output(&state->ch_pulse2.envelope) > 0 && !_APUPulse_SweepMute(&state->ch_pulse2, false))
+        apu->blipActive |= 1 << APU_CH_PULSE2;
+    if (state->ch_noise.length.counter > 0 && _APUEnv_Output(&state->ch_noise.envelope) > 0)
+        apu->blipActive |= 1 << APU_CH_NOISE;
+    int16_t level = _APU_MixOutputs(apu, apu->blipChannels);
+    if (level != apu->blipLevel) {
+        _APU_AddStep(apu, apu->blipCycles, level - apu->blipLevel);
+        apu->blipLevel = level;
+    }
+}
+
+void _APU_AddStep(APU *apu, unsigned cpuCycles, int delta)
+{
+    double pos = apu->blipOffset + cpuCycles * apu->samplesPerCycle;
+    size_t i = (size_t)pos;
+    if (i > APU_SAMPLE_CAPACITY)
+        return; //Past the end of the buffer, the frame is too long to be output
+    const int16_t* kernel = apu->blipKernel[(int)((pos - i) * APU_BLIP_PHASES)];
+    int32_t* out = &apu->blipBuffer[i];
+    for (int t = 0; t < APU_BLIP_TAPS; t++)
+        out[t] += delta * kernel[t];
+}
+
+void _APU_RunPoint(APU *apu, unsigned cycles)
+{
+    //A sample is taken when the sample timer runs out at the start of a cycle, so the channels are run up to it in
+    //one go, and the cycle the sample is taken on is run with the ones up to the next sample. Whole cycles are added
+    //to the timer at once; its fraction bits are those of cpuCyclesPerSample, so the sums come out the same as
+    //adding 1 every cycle.
+    unsigned run = 0; //Cycles before the next sample that haven't run yet
+    while (true) {
+        unsigned untilSample = (unsigned)ceil(apu->cpuCyclesPerSample - apu->cycleSampleTimer);
+        if (untilSample > cycles)
+            break;
+        cycles -= untilSample;
+        apu->cycleSampleTimer += untilSample;
+        apu->cycleSampleTimer -= apu->cpuCyclesPerSample;
+        if (apu->skipOutput) {
+            run += untilSample;
+            continue;
         }
-        state->fc_cycles = (state->fc_cycles + 1) % 37282;
-    } else {
-        //4-step sequence
-        switch (state->fc_cycles) {
-            case 7457: //Step 1 at 3728.5 APU cycles
-                _APU_FC_ClockQuarterFrame(apu);
-                break;
-            case 14913: //Step 2 at 7456.5 APU cycles
-                _APU_FC_ClockQuarterFrame(apu);
-                _APU_FC_ClockHalfFrame(apu);
-                break;
-            case 22371: //Step 3 at 11185.5 APU cycles
-                _APU_FC_ClockQuarterFrame(apu);
-                break;
-            case 29829: //Step 4 at 14914.5 APU cycles
-                _APU_FC_ClockQuarterFrame(apu);
-                _APU_FC_ClockHalfFrame(apu);
-                if ((state->fc_ctrl & FC_IRQ_INHIBIT) == 0)
-                    state->fc_irq = true;
+        if (run + untilSample > 1)
+            _APU_FC_Clock(apu, run + untilSample - 1);
+        assert(apu->sampleBufferSize < APU_SAMPLE_CAPACITY);
+        apu->sampleBuffer[apu->sampleBufferSize++] = _APU_MixAudio(apu);
+        run = 1;
+    }
+    apu->cycleSampleTimer += cycles;
+    run += cycles;
+    if (run > 0)
+        _APU_FC_Clock(apu, run);
+}
+
+void _APU_RunBandlimited(APU *apu, unsigned cycles)
+{
+    if (apu->skipOutput) {
+        _APU_FC_Clock(apu, cycles);
+        return;
+    }
+    //Run up to the next time a channel in blipActive moves, so each step is recorded at its own cycle
+    while (cycles > 0) {
+        unsigned run = 1;
+        if (apu->blipCycles == 0) {
+            //At the start of a frame with output, pick up changes made outside of it, like loading a state
+            apu->blipCycles = 1;
+            _APU_UpdateOutput(apu);
+        } else {
+            run = _APU_CyclesUntilMove(apu);
+            if (run > cycles)
+                run = cycles;
+            apu->blipCycles += run;
+        }
+        cycles -= run;
+
+        //Only mix when a channel whose waveform moved has a new output
+        unsigned moved = _APU_FC_Clock(apu, run) & apu->blipActive;
+        for (int ch = 0; moved != 0; ch++, moved >>= 1) {
+            if ((moved & 1) && _APU_ChannelOutput(apu, (APU_Channel)ch) != apu->blipChannels[ch]) {
+                _APU_UpdateOutput(apu);
                 break;
-            default: break;
+            }
         }
-        state->fc_cycles = (state->fc_cycles + 1) % 29830;
     }
 }
 
+unsigned _APU_CyclesUntilMove(APU *apu)
+{
+    APUState* state = &apu->state;
+    unsigned until = UINT_MAX;
+    //A timer moves its channel when it's clocked at 0. Pulse timers are clocked on even frame counter cycles.
+    unsigned pulseOffset = state->fc_cycles % 2 == 0;
+    if (apu->blipActive & 1 << APU_CH_PULSE1) {
+        unsigned c = 2 * (state->ch_pulse1.timer + 1) - pulseOffset;
+        if (c < until) until = c;
+    }
+    if (apu->blipActive & 1 << APU_CH_PULSE2) {
+        unsigned c = 2 * (state->ch_pulse2.timer + 1) - pulseOffset;
+        if (c < until) until = c;
+    }
+    if ((apu->blipActive & 1 << APU_CH_TRIANGLE) && state->ch_triangle.length.counter > 0 && state->ch_triangle.linear_counter > 0) {
+        unsigned c = state->ch_triangle.timer + 1;
+        if (c < until) until = c;
+    }
+    if (apu->blipActive & 1 << APU_CH_NOISE) {
+        unsigned c = state->ch_noise.timer + 1;
+        if (c < until) until = c;
+    }
+    //A silenced DMC with an empty sample buffer doesn't move until a sample is loaded
+    APU_DMC* dmc = &state->ch_dmc;
+    if ((apu->blipActive & 1 << APU_CH_DMC) && (!dmc->silence || dmc->sample_buffer_full)) {
+        unsigned c = dmc->timer > 0 ? dmc->timer : 1;
+        if (c < until) until = c;
+    }
+    return until;
+}
+
+unsigned _APU_CyclesUntilDMCFetch(APU *apu)
+{
+    APU_DMC* dmc = &apu->state.ch_dmc;
+    if (dmc->bytes_remaining == 0)
+        return UINT_MAX;
+    //The DMA is asked for on every cycle until the sample buffer is loaded
+    if (!dmc->sample_buffer_full)
+        return 1;
+    //The sample buffer is emptied when the output unit starts its next output cycle
+    unsigned first = dmc->timer > 0 ? dmc->timer : 1, period = dmc->rate > 0 ? dmc->rate : 1;
+    unsigned clocks = dmc->dpcm_bits_remaining > 0 ? dmc->dpcm_bits_remaining : 1;
+    return first + (clocks - 1) * period;
+}
+
+unsigned _APU_FC_Clock(APU *apu, unsigned cycles)
+{
+    APUState* state = &apu->state;
+    unsigned moved = 0;
+
+    //Clock pulse waves every APU cycle (2 CPU cycles), on even frame counter cycles. Both sequence lengths are even,
+    //so they stay every other cycle when the frame counter wraps around.
+    unsigned apuCycles = (cycles + (state->fc_cycles % 2 == 0)) / 2;
+    moved |= (_APUPulse_ClockWave(&state->ch_pulse1, apuCycles) > 0) << APU_CH_PULSE1;
+    moved |= (_APUPulse_ClockWave(&state->ch_pulse2, apuCycles) > 0) << APU_CH_PULSE2;
+
+    //Clock triangle, noise, DMC every CPU cycle
+    moved |= (_APUTriangle_ClockWave(&state->ch_triangle, cycles) > 0) << APU_CH_TRIANGLE;
+    moved |= (_APUNoise_ClockLFSR(&state->ch_noise, cycles) > 0) << APU_CH_NOISE;
+    moved |= _APUDMC_Clock(apu, cycles) << APU_CH_DMC;
+    
+    //Frame counter sequence length: 4-step or 5-step
+    unsigned length = (state->fc_ctrl & FC_5STEP) ? 37282 : 29830;
+    state->fc_cycles = (state->fc_cycles + cycles % length) % length;
+    return moved;
+}
+
 void _APU_FC_ClockQuarterFrame(APU *apu)
 {
     APUState* state = &apu->state;
@@ -345,14 +613,23 @@ void _APUEnv_Clock(APUEnvelope *env, bool loop)
     }
 }
 
-void _APUPulse_ClockWave(APUPulse *pulse)
+//Clock a timer that counts down to 0 and then reloads with period, clocks times. Returns the number of reloads.
+static unsigned ClockTimer(uint16_t* timer, uint16_t period, unsigned clocks)
 {
-    if (pulse->timer == 0) {
-        pulse->timer = pulse->period;
-        pulse->duty_pos = (pulse->duty_pos > 0) ? (pulse->duty_pos - 1) : 7;
-    } else {
-        pulse->timer--;
+    if (clocks <= *timer) {
+        *timer -= clocks;
+        return 0;
     }
+    clocks -= *timer + 1; //Clocks after the first reload
+    *timer = period - clocks % (period + 1);
+    return 1 + clocks / (period + 1);
+}
+
+unsigned _APUPulse_ClockWave(APUPulse *pulse, unsigned clocks)
+{
+    unsigned moves = ClockTimer(&pulse->timer, pulse->period, clocks);
+    pulse->duty_pos = (pulse->duty_pos + 8 - moves % 8) % 8; //The sequencer counts down
+    return moves;
 }
 
 void _APUPulse_ClockSweep(APUPulse *pulse, bool isCh1)
@@ -372,15 +649,13 @@ void _APUPulse_ClockSweep(APUPulse *pulse, bool isCh1)
     }
 }
 
-void _APUTriangle_ClockWave(APUTriangle *tri)
+unsigned _APUTriangle_ClockWave(APUTriangle *tri, unsigned clocks)
 {
-    if (tri->timer == 0) {
-        tri->timer = tri->period;
-        if (tri->length.counter > 0 && tri->linear_counter > 0)
-            tri->wave_pos = (tri->wave_pos + 1) % 32;
-    } else {
-        tri->timer--;
-    }
+    unsigned moves = ClockTimer(&tri->timer, tri->period, clocks);
+    if (tri->length.counter == 0 || tri->linear_counter == 0)
+        return 0;
+    tri->wave_pos = (tri->wave_pos + moves) % 32;
+    return moves;
 }
 
 void _APUTriangle_ClockLinearCtr(APUTriangle *tri)
@@ -395,17 +670,15 @@ void _APUTriangle_ClockLinearCtr(APUTriangle *tri)
         tri->linear_reload = false;
 }
 
-void _APUNoise_ClockLFSR(APUNoise *noise)
+unsigned _APUNoise_ClockLFSR(APUNoise *noise, unsigned clocks)
 {
-    if (noise->timer == 0) {
-        noise->timer = noise->period;
-
+    unsigned moves = ClockTimer(&noise->timer, noise->period, clocks);
+    for (unsigned i = 0; i < moves; i++) {
         bool feedback = (noise->lfsr & 1) ^ (noise->lfsr >> (noise->mode ? 6 : 1) & 1);
         noise->lfsr |= feedback << 15;
         noise->lfsr >>= 1;
-    } else {
-        noise->timer--;
     }
+    return moves;
 }
 
 void _APUDMC_RestartSample(APU_DMC *dmc)
@@ -414,40 +687,69 @@ void _APUDMC_RestartSample(APU_DMC *dmc)
     dmc->bytes_remaining = dmc->sample_length;
 }
 
-void _APUDMC_Clock(APU* apu)
+bool _APUDMC_ClockOutput(APU_DMC* dmc)
 {
-    APU_DMC* dmc = &apu->state.ch_dmc;
+    bool moved = !dmc->silence; //Silenced output stays 0 until the silence flag is cleared below
 
-    //Output unit
-    if (--dmc->timer <= 0) {
-        dmc->timer = dmc->rate;
-
-        //DPCM output
-        if (!dmc->silence && dmc->dpcm_shift & 1) {
-            if (dmc->output <= 125) dmc->output += 2;
-        } else {
-            if (dmc->output >= 2)   dmc->output -= 2;
-        }
-        dmc->dpcm_shift >>= 1;
-        if (--dmc->dpcm_bits_remaining <= 0) {
-            //When bits remaining reaches 0, a new output cycle is started
-            dmc->dpcm_bits_remaining = 8;
-            //If the sample buffer is empty, silence channel, else sample buffer is emptied into DPCM shift register
-            if (!dmc->sample_buffer_full)
-                dmc->silence = true;
-            else {
-                dmc->silence = false;
-                dmc->dpcm_shift = dmc->sample_buffer;
-                dmc->sample_buffer_full = false;
-            }
+    //DPCM output
+    if (!dmc->silence && dmc->dpcm_shift & 1) {
+        if (dmc->output <= 125) dmc->output += 2;
+    } else {
+        if (dmc->output >= 2)   dmc->output -= 2;
+    }
+    dmc->dpcm_shift >>= 1;
+    if (--dmc->dpcm_bits_remaining <= 0) {
+        //When bits remaining reaches 0, a new output cycle is started
+        dmc->dpcm_bits_remaining = 8;
+        //If the sample buffer is empty, silence channel, else sample buffer is emptied into DPCM shift register
+        if (!dmc->sample_buffer_full)
+            dmc->silence = true;
+        else {
+            moved |= dmc->silence;
+            dmc->silence = false;
+            dmc->dpcm_shift = dmc->sample_buffer;
+            dmc->sample_buffer_full = false;
         }
     }
+    return moved;
+}
+
+bool _APUDMC_Clock(APU* apu, unsigned cycles)
+{
+    APU_DMC* dmc = &apu->state.ch_dmc;
+    bool moved = false;
+
+    //Output unit: Clocked when the timer counts down to 0 (or below), then reloaded with the rate. A rate of 0, before
+    //$4010 is written, clocks it every cycle.
+    unsigned first = dmc->timer > 0 ? dmc->timer : 1, period = dmc->rate > 0 ? dmc->rate : 1;
+    unsigned clocks = 0;
+    if (cycles < first)
+        dmc->timer -= cycles;
+    else {
+        unsigned after = cycles - first; //Cycles after the first clock
+        clocks = 1 + after / period;
+        dmc->timer = dmc->rate - after % period;
+    }
+
+    //Once the channel is silenced with an empty sample buffer, the clocks left only count down the output level, shift
+    //register and bits remaining, so they are done all at once
+    for (; clocks > 0 && (!dmc->silence || dmc->sample_buffer_full); clocks--)
+        moved |= _APUDMC_ClockOutput(dmc);
+    if (clocks > 0) {
+        unsigned steps = dmc->output / 2;
+        dmc->output -= 2 * (clocks < steps ? clocks : steps);
+        dmc->dpcm_shift = clocks < 8 ? dmc->dpcm_shift >> clocks : 0;
+        int bits = dmc->dpcm_bits_remaining > 0 ? dmc->dpcm_bits_remaining : 1;
+        dmc->dpcm_bits_remaining = (int8_t)((bits - 1 + 8 - clocks % 8) % 8 + 1);
+    }
     
-    //Memory reader sample buffer load
+    //Memory reader sample buffer load. Sync deadlines end a run on the cycle the buffer is emptied, and after that
+    //runs are 1 cycle long until it is loaded again, so this is done on the same cycles as when clocking every cycle.
     if (!dmc->sample_buffer_full && dmc->bytes_remaining > 0) {
         //Schedule a DMC DMA. When the DMC DMA transfers the sample data, the rest of the memory reader load logic is done in APU_DMCLoadSample().
         apu->callbacks.ondma(apu->callbacks.context, dmc->cur_addr);
     }
+    return moved;
 }
 
 uint16_t _APUPulse_SweepTargetPeriod(APUPulse *pulse, bool isCh1)
@@ -1,7 +1,18 @@
 #include "cpu.h"
+#include "cpu_block_cache.h"
 #include <string.h>
 #include <assert.h>
 
+//Forces opcode handlers and addressing mode helpers to be inlined into the opcode dispatch switch in CPU_Exec(),
+//so each opcode gets its own copy with the addressing mode resolved at compile time.
+#if defined(__GNUC__)
+    #define CPU_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+    #define CPU_INLINE __forceinline
+#else
+    #define CPU_INLINE inline
+#endif
+
 // Addressing modes
 typedef enum { 
     AD_IMP, AD_ACC, AD_IMM, AD_ZPG, AD_ZPX, AD_ZPY, AD_REL, AD_ABS, AD_ABX, AD_ABY, AD_IND, AD_IDX, AD_IDY
@@ -51,6 +62,21 @@ static uint16_t ReadWord(CPU* cpu, uint16_t addr) {
     return Read(cpu, addr) | Read(cpu, ((addr + 1) & 0xFF) | (addr & 0xFF00)) << 8;
 }
 
+//Bus cycle for a fetch served from the decode cache
+static void Tick(CPU* cpu, uint16_t addr, AccessType access) {
+    cpu->state.cycles++;
+    cpu->instr_cycle++;
+    cpu->access_type = access;
+
+    if (cpu->callbacks.ontick != NULL)
+        cpu->callbacks.ontick(cpu->callbacks.context, addr);
+    else
+        cpu->callbacks.onread(cpu->callbacks.context, addr);
+    //Code pages are plain memory, so the fetched byte can be read back for the trace
+    if (cpu->trace)
+        Trace_BusAccess(cpu->trace, TRACE_READ, addr, cpu->decode_cache->code_pages[addr >> 8][addr & 0xFF], cpu->state.cycles);
+}
+
 //Fetch opcode, increment pc. Use to fetch with execute access type.
 static uint8_t FetchOpcode(CPU* cpu) {
     uint8_t val = CPU_Read(cpu, cpu->state.pc, ACCESS_EXECUTE);
@@ -59,7 +85,14 @@ static uint8_t FetchOpcode(CPU* cpu) {
 }
 
 static uint8_t FetchByte(CPU* cpu) {
-    uint8_t val = Read(cpu, cpu->state.pc);
+    uint8_t val;
+    if (cpu->cached_operands != NULL) {
+        ProcessHalt(cpu, cpu->state.pc);
+        Tick(cpu, cpu->state.pc, ACCESS_READ);
+        val = *cpu->cached_operands++;
+    } else {
+        val = Read(cpu, cpu->state.pc);
+    }
     cpu->state.pc++;
     return val;
 }
@@ -116,23 +149,25 @@ static void PopP(CPU* cpu) {
 }
 
 //Fetch/calculate address by addressing mode for all modes except implied, accumulator and relative.
-static uint16_t FetchAddr(CPU* cpu, AddrMode mode, int forWrite);
-static uint8_t ReadByMode(CPU* cpu, AddrMode mode) {
+static CPU_INLINE uint16_t FetchAddr(CPU* cpu, AddrMode mode, int forWrite);
+static CPU_INLINE uint8_t ReadByMode(CPU* cpu, AddrMode mode) {
+    if (mode == AD_IMM)
+        return FetchByte(cpu);
     return Read(cpu, FetchAddr(cpu, mode, 0));
 }
 //Read value by addressing mode, then dummy write back value.
-static uint8_t RMWReadByMode(CPU* cpu, AddrMode mode, uint16_t* outAddr) {
+static CPU_INLINE uint8_t RMWReadByMode(CPU* cpu, AddrMode mode, uint16_t* outAddr) {
     *outAddr = FetchAddr(cpu, mode, 1);
     uint8_t val = Read(cpu, *outAddr);
     DummyWrite(cpu, *outAddr, val);
     return val;
 }
-static void WriteByMode(CPU* cpu, AddrMode mode, uint8_t val) {
+static CPU_INLINE void WriteByMode(CPU* cpu, AddrMode mode, uint8_t val) {
     Write(cpu, FetchAddr(cpu, mode, 1), val);
 }
 
 //Add index to address for absolute X/Y and indexed indirect addressing. Does dummy read if there is a page crossing or a write/read-modify-write instruction is being executed.
-static uint16_t AddrAddIndex(CPU* cpu, uint16_t base, uint8_t index, int forWrite) {
+static CPU_INLINE uint16_t AddrAddIndex(CPU* cpu, uint16_t base, uint8_t index, int forWrite) {
     uint16_t addr = base + index;
     if (forWrite || (addr & 0xFF00) != (base & 0xFF00))
         DummyRead(cpu, addr - ((addr & 0xFF00) - (base & 0xFF00)));
@@ -157,86 +192,103 @@ static void HandleInterrupt(CPU* cpu, InterruptType interrupt);
 
 /* OPCODES */
 
-static void ADC(CPU* cpu, AddrMode mode);
-static void AND(CPU* cpu, AddrMode mode);
-static void ASL(CPU* cpu, AddrMode mode);
-static void ASLA(CPU* cpu, AddrMode mode);
-static void BCC(CPU* cpu, AddrMode mode);
-static void BCS(CPU* cpu, AddrMode mode);
-static void BEQ(CPU* cpu, AddrMode mode);
-static void BIT(CPU* cpu, AddrMode mode);
-static void BMI(CPU* cpu, AddrMode mode);
-static void BNE(CPU* cpu, AddrMode mode);
-static void BPL(CPU* cpu, AddrMode mode);
-static void BRK(CPU* cpu, AddrMode mode);
-static void BVC(CPU* cpu, AddrMode mode);
-static void BVS(CPU* cpu, AddrMode mode);
-static void CLC(CPU* cpu, AddrMode mode);
-static void CLD(CPU* cpu, AddrMode mode);
-static void CLI(CPU* cpu, AddrMode mode);
-static void CLV(CPU* cpu, AddrMode mode);
-static void CMP(CPU* cpu, AddrMode mode);
-static void CPX(CPU* cpu, AddrMode mode);
-static void CPY(CPU* cpu, AddrMode mode);
-static void DEC(CPU* cpu, AddrMode mode);
-static void DEX(CPU* cpu, AddrMode mode);
-static void DEY(CPU* cpu, AddrMode mode);
-static void EOR(CPU* cpu, AddrMode mode);
-static void INC(CPU* cpu, AddrMode mode);
-static void INX(CPU* cpu, AddrMode mode);
-static void INY(CPU* cpu, AddrMode mode);
-static void JMP(CPU* cpu, AddrMode mode);
-static void JSR(CPU* cpu, AddrMode mode);
-static void LDA(CPU* cpu, AddrMode mode);
-static void LDX(CPU* cpu, AddrMode mode);
-static void LDY(CPU* cpu, AddrMode mode);
-static void LSR(CPU* cpu, AddrMode mode);
-static void LSRA(CPU* cpu, AddrMode mode);
-static void NOP(CPU* cpu, AddrMode mode);
-static void ORA(CPU* cpu, AddrMode mode);
-static void PHA(CPU* cpu, AddrMode mode);
-static void PHP(CPU* cpu, AddrMode mode);
-static void PLA(CPU* cpu, AddrMode mode);
-static void PLP(CPU* cpu, AddrMode mode);
-static void ROL(CPU* cpu, AddrMode mode);
-static void ROLA(CPU* cpu, AddrMode mode);
-static void ROR(CPU* cpu, AddrMode mode);
-static void RORA(CPU* cpu, AddrMode mode);
-static void RTI(CPU* cpu, AddrMode mode);
-static void RTS(CPU* cpu, AddrMode mode);
-static void SBC(CPU* cpu, AddrMode mode);
-static void SEC(CPU* cpu, AddrMode mode);
-static void SED(CPU* cpu, AddrMode mode);
-static void SEI(CPU* cpu, AddrMode mode);
-static void STA(CPU* cpu, AddrMode mode);
-static void STX(CPU* cpu, AddrMode mode);
-static void STY(CPU* cpu, AddrMode mode);
-static void TAX(CPU* cpu, AddrMode mode);
-static void TAY(CPU* cpu, AddrMode mode);
-static void TSX(CPU* cpu, AddrMode mode);
-static void TXA(CPU* cpu, AddrMode mode);
-static void TXS(CPU* cpu, AddrMode mode);
-static void TYA(CPU* cpu, AddrMode mode);
-
-typedef void(*OpcodeFn)(CPU*, AddrMode);
-static const OpcodeFn OPCODE_TABLE[256] = {
-    &BRK,&ORA,NULL,NULL, NULL,&ORA,&ASL,NULL, &PHP,&ORA,&ASLA,NULL,NULL,&ORA,&ASL,NULL,
-    &BPL,&ORA,NULL,NULL, NULL,&ORA,&ASL,NULL, &CLC,&ORA,NULL,NULL, NULL,&ORA,&ASL,NULL,
-    &JSR,&AND,NULL,NULL, &BIT,&AND,&ROL,NULL, &PLP,&AND,&ROLA,NULL,&BIT,&AND,&ROL,NULL,
-    &BMI,&AND,NULL,NULL, NULL,&AND,&ROL,NULL, &SEC,&AND,NULL,NULL, NULL,&AND,&ROL,NULL,
-    &RTI,&EOR,NULL,NULL, NULL,&EOR,&LSR,NULL, &PHA,&EOR,&LSRA,NULL,&JMP,&EOR,&LSR,NULL,
-    &BVC,&EOR,NULL,NULL, NULL,&EOR,&LSR,NULL, &CLI,&EOR,NULL,NULL, NULL,&EOR,&LSR,NULL,
-    &RTS,&ADC,NULL,NULL, NULL,&ADC,&ROR,NULL, &PLA,&ADC,&RORA,NULL,&JMP,&ADC,&ROR,NULL,
-    &BVS,&ADC,NULL,NULL, NULL,&ADC,&ROR,NULL, &SEI,&ADC,NULL,NULL, NULL,&ADC,&ROR,NULL,
-    NULL,&STA,NULL,NULL, &STY,&STA,&STX,NULL, &DEY,NULL,&TXA,NULL, &STY,&STA,&STX,NULL,
-    &BCC,&STA,NULL,NULL, &STY,&STA,&STX,NULL, &TYA,&STA,&TXS,NULL, NULL,&STA,NULL,NULL,
-    &LDY,&LDA,&LDX,NULL, &LDY,&LDA,&LDX,NULL, &TAY,&LDA,&TAX,NULL, &LDY,&LDA,&LDX,NULL,
-    &BCS,&LDA,NULL,NULL, &LDY,&LDA,&LDX,NULL, &CLV,&LDA,&TSX,NULL, &LDY,&LDA,&LDX,NULL,
-    &CPY,&CMP,NULL,NULL, &CPY,&CMP,&DEC,NULL, &INY,&CMP,&DEX,NULL, &CPY,&CMP,&DEC,NULL,
-    &BNE,&CMP,NULL,NULL, NULL,&CMP,&DEC,NULL, &CLD,&CMP,NULL,NULL, NULL,&CMP,&DEC,NULL,
-    &CPX,&SBC,NULL,NULL, &CPX,&SBC,&INC,NULL, &INX,&SBC,&NOP,NULL, &CPX,&SBC,&INC,NULL,
-    &BEQ,&SBC,NULL,NULL, NULL,&SBC,&INC,NULL, &SED,&SBC,NULL,NULL, NULL,&SBC,&INC,NULL
-};
+static CPU_INLINE void ADC(CPU* cpu, AddrMode mode);
+static CPU_INLINE void AND(CPU* cpu, AddrMode mode);
+static CPU_INLINE void ASL(CPU* cpu, AddrMode mode);
+static CPU_INLINE void ASLA(CPU* cpu, AddrMode mode);
+static CPU_INLINE void BCC(CPU* cpu, AddrMode mode);
+static CPU_INLINE void BCS(CPU* cpu, AddrMode mode);
+static CPU_INLINE void BEQ(CPU* cpu, AddrMode mode);
+static CPU_INLINE void BIT(CPU* cpu, AddrMode mode);
+static CPU_INLINE void BMI(CPU* cpu, AddrMode mode);
+static CPU_INLINE void BNE(CPU* cpu, AddrMode mode);
+static CPU_INLINE void BPL(CPU* cpu, AddrMode mode);
+static CPU_INLINE void BRK(CPU* cpu, AddrMode mode);
+static CPU_INLINE void BVC(CPU* cpu, AddrMode mode);
+static CPU_INLINE void BVS(CPU* cpu, AddrMode mode);
+static CPU_INLINE void CLC(CPU* cpu, AddrMode mode);
+static CPU_INLINE void CLD(CPU* cpu, AddrMode mode);
+static CPU_INLINE void CLI(CPU* cpu, AddrMode mode);
+static CPU_INLINE void CLV(CPU* cpu, AddrMode mode);
+static CPU_INLINE void CMP(CPU* cpu, AddrMode mode);
+static CPU_INLINE void CPX(CPU* cpu, AddrMode mode);
+static CPU_INLINE void CPY(CPU* cpu, AddrMode mode);
+static CPU_INLINE void DEC(CPU* cpu, AddrMode mode);
+static CPU_INLINE void DEX(CPU* cpu, AddrMode mode);
+static CPU_INLINE void DEY(CPU* cpu, AddrMode mode);
+static CPU_INLINE void EOR(CPU* cpu, AddrMode mode);
+static CPU_INLINE void INC(CPU* cpu, AddrMode mode);
+static CPU_INLINE void INX(CPU* cpu, AddrMode mode);
+static CPU_INLINE void INY(CPU* cpu, AddrMode mode);
+static CPU_INLINE void JMP(CPU* cpu, AddrMode mode);
+static CPU_INLINE void JSR(CPU* cpu, AddrMode mode);
+static CPU_INLINE void LDA(CPU* cpu, AddrMode mode);
+static CPU_INLINE void LDX(CPU* cpu, AddrMode mode);
+static CPU_INLINE void LDY(CPU* cpu, AddrMode mode);
+static CPU_INLINE void LSR(CPU* cpu, AddrMode mode);
+static CPU_INLINE void LSRA(CPU* cpu, AddrMode mode);
+static CPU_INLINE void NOP(CPU* cpu, AddrMode mode);
+static CPU_INLINE void ORA(CPU* cpu, AddrMode mode);
+static CPU_INLINE void PHA(CPU* cpu, AddrMode mode);
+static CPU_INLINE void PHP(CPU* cpu, AddrMode mode);
+static CPU_INLINE void PLA(CPU* cpu, AddrMode mode);
+static CPU_INLINE void PLP(CPU* cpu, AddrMode mode);
+static CPU_INLINE void ROL(CPU* cpu, AddrMode mode);
+static CPU_INLINE void ROLA(CPU* cpu, AddrMode mode);
+static CPU_INLINE void ROR(CPU* cpu, AddrMode mode);
+static CPU_INLINE void RORA(CPU* cpu, AddrMode mode);
+static CPU_INLINE void RTI(CPU* cpu, AddrMode mode);
+static CPU_INLINE void RTS(CPU* cpu, AddrMode mode);
+static CPU_INLINE void SBC(CPU* cpu, AddrMode mode);
+static CPU_INLINE void SEC(CPU* cpu, AddrMode mode);
+static CPU_INLINE void SED(CPU* cpu, AddrMode mode);
+static CPU_INLINE void SEI(CPU* cpu, AddrMode mode);
+static CPU_INLINE void STA(CPU* cpu, AddrMode mode);
+static CPU_INLINE void STX(CPU* cpu, AddrMode mode);
+static CPU_INLINE void STY(CPU* cpu, AddrMode mode);
+static CPU_INLINE void TAX(CPU* cpu, AddrMode mode);
+static CPU_INLINE void TAY(CPU* cpu, AddrMode mode);
+static CPU_INLINE void TSX(CPU* cpu, AddrMode mode);
+static CPU_INLINE void TXA(CPU* cpu, AddrMode mode);
+static CPU_INLINE void TXS(CPU* cpu, AddrMode mode);
+static CPU_INLINE void TYA(CPU* cpu, AddrMode mode);
+
+/* Official opcodes: X(opcode, handler, addressing mode).
+*  Used to generate the opcode dispatch switch in CPU_Exec(). Opcodes that aren't listed crash the CPU.
+*/
+#define CPU_OPCODES(X) \
+    X(0x00, BRK, AD_IMP) X(0x01, ORA, AD_IDX) X(0x05, ORA, AD_ZPG) X(0x06, ASL, AD_ZPG) X(0x08, PHP, AD_IMP) \
+    X(0x09, ORA, AD_IMM) X(0x0A, ASLA, AD_ACC) X(0x0D, ORA, AD_ABS) X(0x0E, ASL, AD_ABS) \
+    X(0x10, BPL, AD_REL) X(0x11, ORA, AD_IDY) X(0x15, ORA, AD_ZPX) X(0x16, ASL, AD_ZPX) \
+    X(0x18, CLC, AD_IMP) X(0x19, ORA, AD_ABY) X(0x1D, ORA, AD_ABX) X(0x1E, ASL, AD_ABX) \
+    X(0x20, JSR, AD_ABS) X(0x21, AND, AD_IDX) X(0x24, BIT, AD_ZPG) X(0x25, AND, AD_ZPG) X(0x26, ROL, AD_ZPG) X(0x28, PLP, AD_IMP) \
+    X(0x29, AND, AD_IMM) X(0x2A, ROLA, AD_ACC) X(0x2C, BIT, AD_ABS) X(0x2D, AND, AD_ABS) X(0x2E, ROL, AD_ABS) \
+    X(0x30, BMI, AD_REL) X(0x31, AND, AD_IDY) X(0x35, AND, AD_ZPX) X(0x36, ROL, AD_ZPX) \
+    X(0x38, SEC, AD_IMP) X(0x39, AND, AD_ABY) X(0x3D, AND, AD_ABX) X(0x3E, ROL, AD_ABX) \
+    X(0x40, RTI, AD_IMP) X(0x41, EOR, AD_IDX) X(0x45, EOR, AD_ZPG) X(0x46, LSR, AD_ZPG) X(0x48, PHA, AD_IMP) \
+    X(0x49, EOR, AD_IMM) X(0x4A, LSRA, AD_ACC) X(0x4C, JMP, AD_ABS) X(0x4D, EOR, AD_ABS) X(0x4E, LSR, AD_ABS) \
+    X(0x50, BVC, AD_REL) X(0x51, EOR, AD_IDY) X(0x55, EOR, AD_ZPX) X(0x56, LSR, AD_ZPX) \
+    X(0x58, CLI, AD_IMP) X(0x59, EOR, AD_ABY) X(0x5D, EOR, AD_ABX) X(0x5E, LSR, AD_ABX) \
+    X(0x60, RTS, AD_IMP) X(0x61, ADC, AD_IDX) X(0x65, ADC, AD_ZPG) X(0x66, ROR, AD_ZPG) X(0x68, PLA, AD_IMP) \
+    X(0x69, ADC, AD_IMM) X(0x6A, RORA, AD_ACC) X(0x6C, JMP, AD_IND) X(0x6D, ADC, AD_ABS) X(0x6E, ROR, AD_ABS) \
+    X(0x70, BVS, AD_REL) X(0x71, ADC, AD_IDY) X(0x75, ADC, AD_ZPX) X(0x76, ROR, AD_ZPX) \
+    X(0x78, SEI, AD_IMP) X(0x79, ADC, AD_ABY) X(0x7D, ADC, AD_ABX) X(0x7E, ROR, AD_ABX) \
+    X(0x81, STA, AD_IDX) X(0x84, STY, AD_ZPG) X(0x85, STA, AD_ZPG) X(0x86, STX, AD_ZPG) X(0x88, DEY, AD_IMP) \
+    X(0x8A, TXA, AD_IMP) X(0x8C, STY, AD_ABS) X(0x8D, STA, AD_ABS) X(0x8E, STX, AD_ABS) \
+    X(0x90, BCC, AD_REL) X(0x91, STA, AD_IDY) X(0x94, STY, AD_ZPX) X(0x95, STA, AD_ZPX) X(0x96, STX, AD_ZPY) \
+    X(0x98, TYA, AD_IMP) X(0x99, STA, AD_ABY) X(0x9A, TXS, AD_IMP) X(0x9D, STA, AD_ABX) \
+    X(0xA0, LDY, AD_IMM) X(0xA1, LDA, AD_IDX) X(0xA2, LDX, AD_IMM) X(0xA4, LDY, AD_ZPG) X(0xA5, LDA, AD_ZPG) X(0xA6, LDX, AD_ZPG) \
+    X(0xA8, TAY, AD_IMP) X(0xA9, LDA, AD_IMM) X(0xAA, TAX, AD_IMP) X(0xAC, LDY, AD_ABS) X(0xAD, LDA, AD_ABS) X(0xAE, LDX, AD_ABS) \
+    X(0xB0, BCS, AD_REL) X(0xB1, LDA, AD_IDY) X(0xB4, LDY, AD_ZPX) X(0xB5, LDA, AD_ZPX) X(0xB6, LDX, AD_ZPY) X(0xB8, CLV, AD_IMP) \
+    X(0xB9, LDA, AD_ABY) X(0xBA, TSX, AD_IMP) X(0xBC, LDY, AD_ABX) X(0xBD, LDA, AD_ABX) X(0xBE, LDX, AD_ABY) \
+    X(0xC0, CPY, AD_IMM) X(0xC1, CMP, AD_IDX) X(0xC4, CPY, AD_ZPG) X(0xC5, CMP, AD_ZPG) X(0xC6, DEC, AD_ZPG) X(0xC8, INY, AD_IMP) \
+    X(0xC9, CMP, AD_IMM) X(0xCA, DEX, AD_IMP) X(0xCC, CPY, AD_ABS) X(0xCD, CMP, AD_ABS) X(0xCE, DEC, AD_ABS) \
+    X(0xD0, BNE, AD_REL) X(0xD1, CMP, AD_IDY) X(0xD5, CMP, AD_ZPX) X(0xD6, DEC, AD_ZPX) \
+    X(0xD8, CLD, AD_IMP) X(0xD9, CMP, AD_ABY) X(0xDD, CMP, AD_ABX) X(0xDE, DEC, AD_ABX) \
+    X(0xE0, CPX, AD_IMM) X(0xE1, SBC, AD_IDX) X(0xE4, CPX, AD_ZPG) X(0xE5, SBC, AD_ZPG) X(0xE6, INC, AD_ZPG) X(0xE8, INX, AD_IMP) \
+    X(0xE9, SBC, AD_IMM) X(0xEA, NOP, AD_IMP) X(0xEC, CPX, AD_ABS) X(0xED, SBC, AD_ABS) X(0xEE, INC, AD_ABS) \
+    X(0xF0, BEQ, AD_REL) X(0xF1, SBC, AD_IDY) X(0xF5, SBC, AD_ZPX) X(0xF6, INC, AD_ZPX) \
+    X(0xF8, SED, AD_IMP) X(0xF9, SBC, AD_ABY) X(0xFD, SBC, AD_ABX) X(0xFE, INC, AD_ABX)
 
 static const AddrMode ADDRMODE_TABLE[256] = {
     AD_IMP,AD_IDX,AD_IMP,AD_IDX,AD_ZPG,AD_ZPG,AD_ZPG,AD_ZPG,AD_IMP,AD_IMM,AD_ACC,AD_IMM,AD_ABS,AD_ABS,AD_ABS,AD_ABS,
@@ -257,6 +309,203 @@ static const AddrMode ADDRMODE_TABLE[256] = {
     AD_REL,AD_IDY,AD_IMP,AD_IDY,AD_ZPX,AD_ZPX,AD_ZPX,AD_ZPX,AD_IMP,AD_ABY,AD_IMP,AD_ABY,AD_ABX,AD_ABX,AD_ABX,AD_ABX
 };
 
+//Instruction length in bytes by addressing mode
+static const uint8_t ADDRMODE_LENGTH[] = {
+    [AD_IMP] = 1, [AD_ACC] = 1, [AD_IMM] = 2, [AD_ZPG] = 2, [AD_ZPX] = 2, [AD_ZPY] = 2, [AD_REL] = 2,
+    [AD_ABS] = 3, [AD_ABX] = 3, [AD_ABY] = 3, [AD_IND] = 3, [AD_IDX] = 2, [AD_IDY] = 2
+};
+
+//Base cycle count of official opcodes. 0 for opcodes that aren't in CPU_OPCODES.
+static const uint8_t OPCODE_CYCLES[256] = {
+    7,6,0,0,0,3,5,0,3,2,2,0,0,4,6,0,
+    2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0,
+    6,6,0,0,3,3,5,0,4,2,2,0,4,4,6,0,
+    2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0,
+    6,6,0,0,0,3,5,0,3,2,2,0,3,4,6,0,
+    2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0,
+    6,6,0,0,0,3,5,0,4,2,2,0,5,4,6,0,
+    2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0,
+    0,6,0,0,3,3,3,0,2,0,2,0,4,4,4,0,
+    2,6,0,0,4,4,4,0,2,5,2,0,0,5,0,0,
+    2,6,2,0,3,3,3,0,2,2,2,0,4,4,4,0,
+    2,5,0,0,4,4,4,0,2,4,2,0,4,4,4,0,
+    2,6,0,0,3,3,5,0,2,2,2,0,4,4,6,0,
+    2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0,
+    2,6,0,0,3,3,5,0,2,2,2,0,4,4,6,0,
+    2,5,0,0,0,4,6,0,2,4,0,0,0,4,7,0
+};
+
+static void InvalidatePage(CPUDecodeCache* cache, uint8_t page) {
+    cache->page_has_code[page] = false;
+    cache->page_gen[page]++;
+}
+
+//Get the cached instruction at addr, decoding it first if needed. Returns NULL if the instruction can't be cached.
+static const CPUDecodedInstr* LookupDecoded(CPUDecodeCache* cache, uint16_t addr) {
+    uint8_t page = addr >> 8;
+    CPUDecodedInstr* instr = &cache->entries[addr];
+    if (instr->gen == cache->page_gen[page])
+        return instr;
+
+    const uint8_t* mem = cache->code_pages[page];
+    if (mem == NULL)
+        return NULL;
+    uint8_t opcode = mem[addr & 0xFF];
+    uint8_t length = ADDRMODE_LENGTH[ADDRMODE_TABLE[opcode]];
+    if (OPCODE_CYCLES[opcode] == 0 || (addr & 0xFF) + length > 0x100)
+        return NULL;
+
+    instr->opcode = opcode;
+    instr->operands[0] = (length > 1) ? mem[(addr & 0xFF) + 1] : 0;
+    instr->operands[1] = (length > 2) ? mem[(addr & 0xFF) + 2] : 0;
+    instr->length = length;
+    instr->cycles = OPCODE_CYCLES[opcode];
+    instr->gen = cache->page_gen[page];
+
+    //Mark every page that maps the same memory, so writes through mirrors are noticed
+    if (!cache->page_has_code[page]) {
+        for (int p = 0; p < 0x100; p++) {
+            if (cache->code_pages[p] == mem)
+                cache->page_has_code[p] = true;
+        }
+    }
+    return instr;
+}
+
+//Instructions allowed in an idle loop besides the jump back: reads that only change registers and flags
+static bool IsIdleLoopRead(uint8_t opcode) {
+    switch (opcode) {
+        case 0xA9: case 0xA5: case 0xAD: //LDA
+        case 0xA2: case 0xA6: case 0xAE: //LDX
+        case 0xA0: case 0xA4: case 0xAC: //LDY
+        case 0x24: case 0x2C:            //BIT
+        case 0xC9: case 0xC5: case 0xCD: //CMP
+        case 0xE0: case 0xE4: case 0xEC: //CPX
+        case 0xC0: case 0xC4: case 0xCC: //CPY
+        case 0x29: case 0x25: case 0x2D: //AND
+        case 0x09: case 0x05: case 0x0D: //ORA
+        case 0x49: case 0x45: case 0x4D: //EOR
+            return true;
+        default:
+            return false;
+    }
+}
+
+//Decode the loop from start to the jump back at the current instruction. Returns false if it isn't a possible idle loop.
+static bool DecodeIdleLoop(CPU* cpu, uint16_t start, CPUIdleLoop* loop) {
+    loop->start = start;
+    loop->length = 0;
+    uint16_t addr = start;
+    while (loop->length < CPU_IDLE_LOOP_MAX) {
+        const CPUDecodedInstr* instr = LookupDecoded(cpu->decode_cache, addr);
+        if (instr == NULL)
+            return false;
+        int i = loop->length++;
+        loop->opcodes[i] = instr->opcode;
+        loop->addrs[i] = -1;
+
+        if (addr == cpu->instr_addr)
+            return ADDRMODE_TABLE[instr->opcode] == AD_REL || instr->opcode == 0x4C;
+        if (!IsIdleLoopRead(instr->opcode))
+            return false;
+        if (ADDRMODE_TABLE[instr->opcode] == AD_ZPG)
+            loop->addrs[i] = instr->operands[0];
+        else if (ADDRMODE_TABLE[instr->opcode] == AD_ABS)
+            loop->addrs[i] = instr->operands[0] | instr->operands[1] << 8;
+        addr += instr->length;
+    }
+    return false;
+}
+
+/* Called after a jump or taken branch back to target. A loop that reaches its start twice in a row with the same registers and
+*  cycle count only reads memory, so it repeats identically until that memory changes or an interrupt happens. The host is then
+*  asked to skip iterations.
+*/
+static void CheckIdleLoop(CPU* cpu, uint16_t target) {
+    CPUState* state = &cpu->state;
+    CPUState* last = &cpu->idle_state;
+    if (target != last->pc || state->a != last->a || state->x != last->x || state->y != last->y || state->s != last->s || state->p != last->p) {
+        *last = *state;
+        cpu->idle_cycles = 0;
+        return;
+    }
+
+    //Nothing is skipped while an interrupt is pending, since it will be taken at the end of this instruction
+    unsigned cycles = (unsigned)(state->cycles - last->cycles);
+    bool interrupt = cpu->nmi_detected || (cpu->irq && !(state->p & CPU_FLAG_I));
+    CPUIdleLoop loop;
+    if (cycles == cpu->idle_cycles && !interrupt && DecodeIdleLoop(cpu, target, &loop)) {
+        loop.cycles = cycles;
+        state->cycles += cpu->callbacks.onidle(cpu->callbacks.context, cpu, &loop) * cycles;
+    }
+    cpu->idle_cycles = cycles;
+    last->cycles = state->cycles;
+}
+
+//Check for an idle loop on a jump back to target, if the host handles idle loops
+static CPU_INLINE void JumpBack(CPU* cpu, uint16_t target) {
+    if (target <= cpu->instr_addr && cpu->callbacks.onidle != NULL && cpu->decode_cache != NULL && cpu->trace == NULL)
+        CheckIdleLoop(cpu, target);
+}
+
+//Handle interrupts and pending halts after an instruction. Returns true if an interrupt was taken.
+static CPU_INLINE bool EndInstruction(CPU* cpu) {
+    CPUState* state = &cpu->state;
+    bool interrupted = false;
+
+    //Handle interrupts
+    if (cpu->nmi_detected) {
+        if (cpu->trace)
+            Trace_Interrupt(cpu->trace, TRACE_NMI, state->cycles);
+        DummyRead(cpu, state->pc);
+        HandleInterrupt(cpu, IR_NMI);
+        cpu->nmi_detected = false;
+        interrupted = true;
+    } else if (cpu->irq && !(cpu->state.p & CPU_FLAG_I)) {
+        if (cpu->trace)
+            Trace_Interrupt(cpu->trace, TRACE_IRQ, state->cycles);
+        DummyRead(cpu, state->pc);
+        HandleInterrupt(cpu, IR_IRQ);
+        interrupted = true;
+    }
+
+    //Process pending halt before next instruction
+    ProcessHalt(cpu, state->pc);
+    
+    cpu->instr_cycle = 0;
+    return interrupted;
+}
+
+
+/* BLOCK STEPS */
+
+const CPUDecodedInstr* _CPU_Decode(CPU* cpu, uint16_t addr) {
+    return (cpu->decode_cache != NULL) ? LookupDecoded(cpu->decode_cache, addr) : NULL;
+}
+
+/* Run one instruction of a cached block, with the opcode and operands that were read when the block was cached.
+*  Fetches still take their bus cycles. Returns nonzero if the block has to be exited after this instruction.
+*/
+#define BLOCK_STEP(op, handler, mode) \
+    static int BlockStep_##op(CPU* cpu, const uint8_t* operands) { \
+        cpu->instr_addr = cpu->state.pc; \
+        cpu->instr_cycle = 0; \
+        Tick(cpu, cpu->state.pc, ACCESS_EXECUTE); \
+        cpu->state.pc++; \
+        cpu->cached_operands = operands; \
+        handler(cpu, mode); \
+        cpu->cached_operands = NULL; \
+        return EndInstruction(cpu) || cpu->block_exit; \
+    }
+CPU_OPCODES(BLOCK_STEP)
+#undef BLOCK_STEP
+
+const CPUBlockStepFn _CPU_BLOCK_STEPS[256] = {
+    #define BLOCK_STEP_ENTRY(op, handler, mode) [op] = &BlockStep_##op,
+    CPU_OPCODES(BLOCK_STEP_ENTRY)
+    #undef BLOCK_STEP_ENTRY
+};
+
 
 /* PUBLIC FUNCTION DEFINITIONS */
 
@@ -285,48 +534,38 @@ int CPU_Exec(CPU *cpu)
 
     cpu->instr_addr = state->pc;
     cpu->instr_cycle = 0;
+    //The opcode fetch is part of the instruction's trace record
+    if (cpu->trace)
+        cpu->trace->instr_active = false;
     
     //Fetch opcode
-    uint8_t opcode = FetchOpcode(cpu);
-    OpcodeFn opcodeFn = OPCODE_TABLE[opcode];
-
-    //Log opcode
-    if (cpu->log) {
-        uint16_t pc = cpu->state.pc - 1;
-        fprintf(cpu->log, "%04x ", pc);
-        if (OPCODE_NAMES[opcode]) {
-            fprintf(cpu->log, OPCODE_NAMES[opcode]);
-        } else {
-            fprintf(cpu->log, "Null");
-        }
-        fprintf(cpu->log, " A:%02x X:%02x Y:%02x S:%02x P:%02x CYC:%llu\n", state->a, state->x, state->y, state->s, state->p, state->cycles);
+    uint8_t opcode;
+    const CPUDecodedInstr* decoded = (cpu->decode_cache != NULL) ? LookupDecoded(cpu->decode_cache, state->pc) : NULL;
+    if (decoded != NULL) {
+        Tick(cpu, state->pc, ACCESS_EXECUTE);
+        state->pc++;
+        opcode = decoded->opcode;
+        cpu->cached_operands = decoded->operands;
+    } else {
+        opcode = FetchOpcode(cpu);
     }
 
-    //Some illegal opcodes crash the CPU (or at this stage of development, aren't implemented yet). Return error if any of these opcodes are fetched.
-    if (opcodeFn == NULL)
-        return -1;
-
-    //Execute instruction
-    opcodeFn(cpu, ADDRMODE_TABLE[opcode]);
-
-    //Handle interrupts
-    if (cpu->nmi_detected) {
-        if (cpu->log)
-            fprintf(cpu->log, "NMI\n");
-        DummyRead(cpu, state->pc);
-        HandleInterrupt(cpu, IR_NMI);
-        cpu->nmi_detected = false;
-    } else if (cpu->irq && !(cpu->state.p & CPU_FLAG_I)) {
-        if (cpu->log)
-            fprintf(cpu->log, "IRQ\n");
-        DummyRead(cpu, state->pc);
-        HandleInterrupt(cpu, IR_IRQ);
+    //Trace opcode
+    if (cpu->trace)
+        Trace_Instruction(cpu->trace, state->pc - 1, opcode, state->a, state->x, state->y, state->s, state->p, state->cycles);
+
+    //Execute instruction. Every case has its own inlined copy of the opcode handler with a constant addressing mode.
+    switch (opcode) {
+        #define OPCODE_CASE(op, handler, mode) case op: handler(cpu, mode); break;
+        CPU_OPCODES(OPCODE_CASE)
+        #undef OPCODE_CASE
+        //Some illegal opcodes crash the CPU (or at this stage of development, aren't implemented yet). Return error if any of these opcodes are fetched.
+        default: return -1;
     }
+    cpu->cached_operands = NULL;
+    assert(decoded == NULL || cpu->instr_cycle >= decoded->cycles);
 
-    //Process pending halt before next instruction
-    ProcessHalt(cpu, state->pc);
-    
-    cpu->instr_cycle = 0;
+    EndInstruction(cpu);
     return 0;
 }
 
@@ -347,7 +586,10 @@ uint8_t CPU_Read(CPU *cpu, uint16_t addr, AccessType access)
     cpu->instr_cycle++;
     cpu->access_type = access;
 
-    return cpu->callbacks.onread(cpu->callbacks.context, addr);
+    uint8_t data = cpu->callbacks.onread(cpu->callbacks.context, addr);
+    if (cpu->trace)
+        Trace_BusAccess(cpu->trace, TRACE_READ, addr, data, cpu->state.cycles);
+    return data;
 }
 
 void CPU_Write(CPU *cpu, uint16_t addr, uint8_t data, AccessType access)
@@ -357,8 +599,49 @@ void CPU_Write(CPU *cpu, uint16_t addr, uint8_t data, AccessType access)
     cpu->access_type = access;
 
     cpu->callbacks.onwrite(cpu->callbacks.context, addr, data);
+    if (cpu->trace)
+        Trace_BusAccess(cpu->trace, TRACE_WRITE, addr, data, cpu->state.cycles);
+}
+
+void CPU_SetDecodeCache(CPU *cpu, CPUDecodeCache *cache, uint8_t* const* codePages)
+{
+    cpu->decode_cache = cache;
+    cpu->cached_operands = NULL;
+    if (cache != NULL) {
+        memset(cache, 0, sizeof(CPUDecodeCache));
+        cache->code_pages = codePages;
+        for (int p = 0; p < 0x100; p++)
+            cache->page_gen[p] = 1;
+    }
+}
+
+void CPU_InvalidateDecodeCache(CPU *cpu, uint8_t startPage, uint8_t endPage)
+{
+    if (cpu->decode_cache == NULL)
+        return;
+    for (unsigned p = startPage; p <= endPage; p++)
+        InvalidatePage(cpu->decode_cache, p);
+    //The current instruction's remaining operands are read from memory again, and a running block is exited
+    cpu->cached_operands = NULL;
+    cpu->block_exit = true;
 }
 
+void CPU_InvalidateDecodedMemory(CPU *cpu, uint16_t addr)
+{
+    CPUDecodeCache* cache = cpu->decode_cache;
+    if (cache == NULL || !cache->page_has_code[addr >> 8])
+        return;
+    const uint8_t* mem = cache->code_pages[addr >> 8];
+    for (int p = 0; p < 0x100; p++) {
+        if (cache->page_has_code[p] && cache->code_pages[p] == mem)
+            InvalidatePage(cache, p);
+    }
+    cpu->cached_operands = NULL;
+    cpu->block_exit = true;
+}
+
+void CPU_EndBlock(CPU *cpu) { cpu->block_exit = true; }
+
 int CPU_Disassemble(CPU *cpu, uint16_t instr_addr, char *buffer, size_t n)
 {
     
@@ -413,7 +696,7 @@ int CPU_Disassemble(CPU *cpu, uint16_t instr_addr, char *buffer, size_t n)
     }
 }
 
-void CPU_SetLogFile(CPU *cpu, FILE *logfile) { cpu->log = logfile; }
+void CPU_SetTrace(CPU *cpu, CPUTrace *trace) { cpu->trace = trace; }
 
 /* PRIVATE FUNCTION DEFINITIONS */
 
@@ -522,6 +805,7 @@ void Branch(CPU *cpu, int takeBranch)
             DummyRead(cpu, branch - pchDiff);
        }
        cpu->state.pc = branch;
+       JumpBack(cpu, branch);
     }
 }
 
@@ -688,6 +972,8 @@ void INY(CPU* cpu, AddrMode mode) {
 
 void JMP(CPU *cpu, AddrMode mode) {
     cpu->state.pc = FetchAddr(cpu, mode, 0);
+    if (mode == AD_ABS)
+        JumpBack(cpu, cpu->state.pc);
 }
 
 void JSR(CPU *cpu, AddrMode mode) {
@@ -0,0 +1,140 @@
+#include "cpu_block_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+//Number of cached blocks, a power of 2. Blocks are stored by a hash of their start address, replacing the one there.
+#define BLOCK_CACHE_SIZE 2048
+//Number of times an address has to be run by the interpreter before a block is cached there
+#define BLOCK_HOT_THRESHOLD 16
+#define BLOCK_MAX_INSTRS 16
+//Maximum number of blocks run by one CPU_ExecBlock() call
+#define BLOCK_MAX_CHAIN 64
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t operands[2];
+} BlockInstr;
+
+typedef struct {
+    uint16_t addr; //Start address
+    uint8_t count; //Number of instructions, 0 if no block is cached here
+    uint32_t gen; //Decode cache generation of the block's page when it was cached
+    BlockInstr instrs[BLOCK_MAX_INSTRS];
+} CPUBlock;
+
+struct CPUBlockCache {
+    const bool* rom_pages;
+    CPUBlock blocks[BLOCK_CACHE_SIZE];
+    uint8_t hits[0x10000]; //Number of times each address has been run by the interpreter
+};
+
+
+/* PRIVATE FUNCTIONS */
+
+static CPUBlock* BlockAt(CPUBlockCache* cache, uint16_t addr) {
+    return &cache->blocks[(addr ^ addr >> 11) & (BLOCK_CACHE_SIZE - 1)];
+}
+
+static bool IsCached(CPU* cpu, const CPUBlock* block, uint16_t addr) {
+    return block->count != 0 && block->addr == addr && block->gen == cpu->decode_cache->page_gen[addr >> 8];
+}
+
+//Instructions that end a basic block
+static bool IsBlockEnd(uint8_t opcode) {
+    switch (opcode) {
+        case 0x00: //BRK
+        case 0x20: //JSR
+        case 0x40: //RTI
+        case 0x4C: case 0x6C: //JMP
+        case 0x60: //RTS
+        case 0x10: case 0x30: case 0x50: case 0x70: case 0x90: case 0xB0: case 0xD0: case 0xF0: //Branches
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Store the basic block at addr in block. The block stays inside one page, so it only depends on that page's generation:
+*  It ends before an instruction whose operands are in the next page, and after a jump, branch, call, return or BRK.
+*  Returns false if the instruction at addr can't be cached.
+*/
+static bool Build(CPU* cpu, CPUBlock* block, uint16_t addr) {
+    uint8_t page = addr >> 8;
+    int count = 0;
+    for (uint16_t a = addr; count < BLOCK_MAX_INSTRS && (a >> 8) == page; ) {
+        const CPUDecodedInstr* instr = _CPU_Decode(cpu, a);
+        if (instr == NULL || _CPU_BLOCK_STEPS[instr->opcode] == NULL || (a & 0xFF) + instr->length > 0x100)
+            break;
+        block->instrs[count].opcode = instr->opcode;
+        memcpy(block->instrs[count].operands, instr->operands, 2);
+        count++;
+        a += instr->length;
+        if (IsBlockEnd(instr->opcode))
+            break;
+    }
+    block->addr = addr;
+    block->count = (uint8_t)count;
+    block->gen = cpu->decode_cache->page_gen[page];
+    return count > 0;
+}
+
+
+/* FUNCTION DEFINITIONS */
+
+CPUBlockCache *CPUBlockCache_Create()
+{
+    return calloc(1, sizeof(CPUBlockCache));
+}
+
+void CPUBlockCache_Free(CPUBlockCache *cache)
+{
+    free(cache);
+}
+
+void CPUBlockCache_Flush(CPUBlockCache *cache)
+{
+    memset(cache->blocks, 0, sizeof(cache->blocks));
+    memset(cache->hits, 0, sizeof(cache->hits));
+}
+
+void CPU_SetBlockCache(CPU *cpu, CPUBlockCache *cache, const bool *romPages)
+{
+    assert(cache == NULL || cpu->decode_cache != NULL);
+    cpu->block_cache = cache;
+    if (cache != NULL) {
+        cache->rom_pages = romPages;
+        CPUBlockCache_Flush(cache);
+    }
+}
+
+int CPU_ExecBlock(CPU *cpu)
+{
+    CPUBlockCache* cache = cpu->block_cache;
+    //The interpreter traces every instruction, so tracing disables the block cache
+    if (cache == NULL || cpu->trace != NULL)
+        return CPU_Exec(cpu);
+
+    uint16_t pc = cpu->state.pc;
+    CPUBlock* block = BlockAt(cache, pc);
+    if (!IsCached(cpu, block, pc)) {
+        if (!cache->rom_pages[pc >> 8] || ++cache->hits[pc] < BLOCK_HOT_THRESHOLD)
+            return CPU_Exec(cpu);
+        cache->hits[pc] = 0;
+        if (!Build(cpu, block, pc))
+            return CPU_Exec(cpu);
+    }
+
+    cpu->block_exit = false;
+    for (int chain = 0; chain < BLOCK_MAX_CHAIN; chain++) {
+        for (int i = 0; i < block->count; i++) {
+            if (_CPU_BLOCK_STEPS[block->instrs[i].opcode](cpu, block->instrs[i].operands))
+                return 0;
+        }
+        pc = cpu->state.pc;
+        block = BlockAt(cache, pc);
+        if (!IsCached(cpu, block, pc))
+            break;
+    }
+    return 0;
+}
@@ -4,6 +4,7 @@ void DMA_Process(DMAController *dma, CPU *cpu, APU *apu, uint16_t dummyReadAddr)
 {
     CPU_Read(cpu, dummyReadAddr, ACCESS_DMA | ACCESS_DUMMY_READ); //DMA halt cycle
     if (dma->dmcdma)    CPU_Read(cpu, dummyReadAddr, ACCESS_DMA | ACCESS_DUMMY_READ); //DMC DMA: dummy cycle
+    APU_Sync(apu); //Bring the frame counter cycle up to date
     if (apu->state.fc_cycles % 2 == 1) CPU_Read(cpu, dummyReadAddr, ACCESS_DMA | ACCESS_DUMMY_READ); //Second half of an APU cycle (put): alignment cycle
 
     if (dma->oamdma) {
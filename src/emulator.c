@@ -4,6 +4,38 @@
 #include <string.h>
 #include <assert.h>
 
+#define SAVESTATE_MAGIC "EPNSTATE"
+#define SAVESTATE_VERSION 2
+
+//Save state header. Identifies the ROM the state belongs to by its mapper and memory sizes.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    uint32_t mapper;
+    uint32_t prg_rom_size, chr_rom_size, prg_ram_size, chr_ram_size, vram_size;
+} SaveStateHeader;
+
+//CPU state that isn't in CPUState. States are saved between instructions, so nothing else is in flight.
+typedef struct {
+    CPUState state;
+    bool nmi, irq, nmi_detected, halt;
+} SaveStateCPU;
+
+//Everything with a fixed size
+typedef struct {
+    SaveStateCPU cpu;
+    PPUState ppu;
+    APUState apu;
+    double apu_sample_timer;
+    DMAController dma;
+    StandardController controller;
+    StandardController controller2;
+    uint8_t ram[0x800];
+    unsigned long long cycle;
+} SaveStateFixed;
+
+
 /* PRIVATE FUNCTIONS */
 
 //Write $4014: Schedule OAM DMA
@@ -13,38 +45,135 @@ void Write4014(Emulator *emu, uint16_t addr, uint8_t data) {
 
 //Write $4016: Controller strobe
 void Write4016(Emulator* emu, uint16_t addr, uint8_t data) {
-    //Write to both controller ports (currently only 1 standard controller)
+    //Write to both controller ports
+    if ((emu->controller.strobe & 1) && !(data & 1))
+        emu->input_polls++; //Strobe cleared: The button state is latched for reading
     StdController_Write(&emu->controller, addr, data);
+    StdController_Write(&emu->controller2, addr, data);
+}
+
+//Get the number of CPU cycles until the PPU reaches its next externally visible event (vblank set/clear, frame end)
+static int NextPPUSyncDeadline(Emulator* emu) {
+    int dots = PPU_DotsUntil(&emu->ppu, 241, 1);
+    int clear = PPU_DotsUntil(&emu->ppu, 261, 1);
+    int frameEnd = PPU_DotsUntil(&emu->ppu, 239, 340);
+    if (clear < dots) dots = clear;
+    if (frameEnd < dots) dots = frameEnd;
+    return (dots + 2) / 3;
+}
+
+//Run the PPU up to the current cycle, update the NMI signal and schedule the next sync
+static void SyncPPU(Emulator* emu) {
+    //Every access that could change PPU state syncs first, so nothing changes it during the run
+    if (emu->ppu_cycle < emu->scheduler.cycle) {
+        PPU_Run(&emu->ppu, (int)(emu->scheduler.cycle - emu->ppu_cycle) * 3);
+        emu->ppu_cycle = emu->scheduler.cycle;
+    }
+    if (emu->ppu.state.frames != emu->run_frame)
+        CPU_EndBlock(&emu->cpu);
+    CPU_SetNMISignal(&emu->cpu, PPU_NMISignal(&emu->ppu));
+    Scheduler_Post(&emu->scheduler, SCHED_PPU_SYNC, emu->ppu_cycle + NextPPUSyncDeadline(emu));
+}
+
+//Catch the PPU up before an access that reads or changes PPU state. The PPU is run again at the end of the access cycle.
+static void SyncPPUForAccess(Emulator* emu) {
+    if (emu->ppu_sync_mode == PPU_SYNC_CATCHUP) {
+        SyncPPU(emu);
+        Scheduler_Post(&emu->scheduler, SCHED_PPU_SYNC, emu->scheduler.cycle + 1);
+    }
+}
+
+//Schedule the next APU frame counter step. Must be called again after the frame counter is reset.
+static void ScheduleAPUFrameStep(Emulator* emu) {
+    Scheduler_Post(&emu->scheduler, SCHED_APU_FRAME_STEP, emu->scheduler.cycle + APU_CyclesUntilFrameStep(&emu->apu));
+}
+
+//Run all events that are due at the current cycle
+static void RunScheduledEvents(Emulator* emu) {
+    int event;
+    while ((event = Scheduler_PopDue(&emu->scheduler)) >= 0) {
+        switch (event) {
+            case SCHED_PPU_SYNC:
+                SyncPPU(emu);
+                break;
+            case SCHED_APU_FRAME_STEP:
+                APU_FrameCounterStep(&emu->apu);
+                CPU_SetIRQSignal(&emu->cpu, APU_IRQSignal(&emu->apu));
+                ScheduleAPUFrameStep(emu);
+                break;
+            default: break;
+        }
+    }
+}
+
+//Clock the APU and PPU after a CPU memory access cycle and run scheduled events
+static void EndCPUCycle(Emulator* emu) {
+    APU_CPUCycle(&emu->apu);
+
+    if (emu->ppu_sync_mode == PPU_SYNC_CYCLE) {
+        PPU_Cycle(&emu->ppu);
+        PPU_Cycle(&emu->ppu);
+        PPU_Cycle(&emu->ppu);
+        CPU_SetNMISignal(&emu->cpu, PPU_NMISignal(&emu->ppu));
+        if (emu->ppu.state.frames != emu->run_frame)
+            CPU_EndBlock(&emu->cpu);
+    }
+
+    if (++emu->scheduler.cycle >= emu->scheduler.next)
+        RunScheduledEvents(emu);
+}
+
+//Map internal RAM and its mirrors, and map the cartridge pages from the mapper
+static void BuildCPUPages(Emulator* emu) {
+    memset(emu->cpu_read_pages, 0, sizeof(emu->cpu_read_pages));
+    memset(emu->cpu_write_pages, 0, sizeof(emu->cpu_write_pages));
+    for (int p = 0x00; p <= 0x1F; p++) {
+        emu->cpu_read_pages[p] = &emu->ram[(p * 0x100) % 0x800];
+        emu->cpu_write_pages[p] = &emu->ram[(p * 0x100) % 0x800];
+    }
+    _Emu_UpdateCPUPages(emu, 0x41, 0xFF);
+    CPU_InvalidateDecodeCache(&emu->cpu, 0x00, 0xFF);
+}
+
+//Update the CPU page table after a state was loaded. PRG ROM pages still mapped to the same bank keep their decoded
+//instructions (and cached blocks), since their memory can't have changed. All other pages are invalidated.
+static void RestoreCPUPages(Emulator* emu) {
+    for (unsigned p = 0x00; p <= 0xFF; p++) {
+        uint8_t* page = (p >= 0x41) ? Mapper_GetCPUReadPage(&emu->mapper, p) : emu->cpu_read_pages[p];
+        if (page != emu->cpu_read_pages[p] || !emu->mapper.memory.prg_page_is_rom[p])
+            CPU_InvalidateDecodeCache(&emu->cpu, p, p);
+        emu->cpu_read_pages[p] = page;
+    }
 }
 
 uint8_t OnCPURead(void* emulator, uint16_t addr) {
     Emulator* emu = (Emulator*)emulator;
 
     uint8_t data = 0;
-    if (addr <= 0x1FFF) {
-        //RAM
-        data = emu->ram[addr % 0x800];
+    const uint8_t* page = emu->cpu_read_pages[addr >> 8];
+    if (page != NULL) {
+        //RAM, cartridge ROM/RAM
+        data = page[addr & 0xFF];
     } else if (addr <= 0x3FFF) {
         //PPU registers
+        SyncPPUForAccess(emu);
         data = PPU_RegRead(&emu->ppu, addr);
     } else if (addr == 0x4015) {
         //APU register $4015
         data = APU_Read(&emu->apu, addr);
+        CPU_SetIRQSignal(&emu->cpu, APU_IRQSignal(&emu->apu));
     } else if (addr == 0x4016) {
         //Controller 1
         data = StdController_Read(&emu->controller, addr);
+    } else if (addr == 0x4017) {
+        //Controller 2
+        data = StdController_Read(&emu->controller2, addr);
     } else if (addr >= 0x4020) {
         //Cartridge
         data = emu->mapper.f.CPURead(&emu->mapper, addr);
     }
 
-    APU_CPUCycle(&emu->apu);
-    PPU_Cycle(&emu->ppu);
-    PPU_Cycle(&emu->ppu);
-    PPU_Cycle(&emu->ppu);
-
-    CPU_SetNMISignal(&emu->cpu, PPU_NMISignal(&emu->ppu));
-    CPU_SetIRQSignal(&emu->cpu, APU_IRQSignal(&emu->apu));
+    EndCPUCycle(emu);
 
     return data;
 }
@@ -52,11 +181,16 @@ uint8_t OnCPURead(void* emulator, uint16_t addr) {
 void OnCPUWrite(void* emulator, uint16_t addr, uint8_t data) {
     Emulator* emu = (Emulator*)emulator;
     
-    if (addr <= 0x1FFF) {
+    //Cartridge writes are never direct, since mappers can watch any address for register writes
+    uint8_t* page = emu->cpu_write_pages[addr >> 8];
+    if (page != NULL) {
         //RAM
-        emu->ram[addr % 0x800] = data;
+        page[addr & 0xFF] = data;
+        if (emu->decode_cache.page_has_code[addr >> 8])
+            CPU_InvalidateDecodedMemory(&emu->cpu, addr);
     } else if (addr <= 0x3FFF) {
         //PPU registers
+        SyncPPUForAccess(emu);
         PPU_RegWrite(&emu->ppu, addr, data);
     } else if (addr == 0x4014) {
         //OAM DMA
@@ -64,26 +198,86 @@ void OnCPUWrite(void* emulator, uint16_t addr, uint8_t data) {
     } else if (addr <= 0x4015 || addr == 0x4017) {
         //APU registers
         APU_Write(&emu->apu, addr, data);
+        if (addr == 0x4017)
+            ScheduleAPUFrameStep(emu);
+        CPU_SetIRQSignal(&emu->cpu, APU_IRQSignal(&emu->apu));
     } else if (addr == 0x4016) {
         //Controller strobe
         Write4016(emu, addr, data);
     } else if (addr >= 0x4020) {
-        //Cartridge
+        //Cartridge (mapper registers can change PPU memory mapping)
+        SyncPPUForAccess(emu);
         emu->mapper.f.CPUWrite(&emu->mapper, addr, data);
+        if (emu->decode_cache.page_has_code[addr >> 8] && !emu->mapper.memory.prg_page_is_rom[addr >> 8])
+            CPU_InvalidateDecodedMemory(&emu->cpu, addr);
     }
 
-    APU_CPUCycle(&emu->apu);
-    PPU_Cycle(&emu->ppu);
-    PPU_Cycle(&emu->ppu);
-    PPU_Cycle(&emu->ppu);
+    EndCPUCycle(emu);
+}
 
-    CPU_SetNMISignal(&emu->cpu, PPU_NMISignal(&emu->ppu));
-    CPU_SetIRQSignal(&emu->cpu, APU_IRQSignal(&emu->apu));
+//Bus cycle of an instruction fetch from the decode cache. Code pages have no read side effects, so only the cycle is run.
+void OnCPUTick(void* emulator, uint16_t addr) {
+    EndCPUCycle((Emulator*)emulator);
+}
+
+//Check if an idle loop can be skipped without running the CPU: its reads must have no side effects, or only ones
+//that repeating changes nothing. Reads of PPUSTATUS only change it when vblank is set, which ends a BPL/BMI loop on it.
+static bool CanSkipIdleLoop(Emulator* emu, const CPUIdleLoop* loop) {
+    for (int i = 0; i < loop->length; i++) {
+        int32_t addr = loop->addrs[i];
+        if (addr < 0 || emu->cpu_read_pages[addr >> 8] != NULL)
+            continue;
+        if ((addr & 0xE007) != 0x2002 || loop->length != 2)
+            return false;
+        //BIT/LDA/LDX/LDY $2002 followed by BPL/BMI: Only the vblank flag decides when the loop ends. The flag may have been
+        //set after the last read, so it must still be clear.
+        uint8_t read = loop->opcodes[0], branch = loop->opcodes[1];
+        if ((read != 0x2C && read != 0xAD && read != 0xAE && read != 0xAC) || (branch != 0x10 && branch != 0x30))
+            return false;
+        if (emu->ppu.state.ppustatus & PPUSTATUS_VBLANK)
+            return false;
+    }
+    return true;
+}
+
+//Skip iterations of an idle loop up to the next event that could end it: a scheduled event, or in cycle sync mode the
+//next vblank/frame end. Nothing is skipped after the frame has ended, so Emu_RunFrame() stops on time, or while a DMC
+//sample plays, since its fetches can halt the CPU and raise IRQs on any cycle.
+unsigned long OnCPUIdle(void* emulator, CPU* cpu, const CPUIdleLoop* loop) {
+    Emulator* emu = (Emulator*)emulator;
+    if (!emu->idle_skip || emu->ppu.state.frames != emu->run_frame || cpu->halt || emu->apu.state.ch_dmc.bytes_remaining > 0)
+        return 0;
+    if (!CanSkipIdleLoop(emu, loop))
+        return 0;
+
+    unsigned long long window = emu->scheduler.next - emu->scheduler.cycle - 1;
+    if (emu->ppu_sync_mode == PPU_SYNC_CYCLE) {
+        unsigned long long ppuWindow = NextPPUSyncDeadline(emu) - 1;
+        if (ppuWindow < window)
+            window = ppuWindow;
+    }
+    unsigned long iterations = window / loop->cycles;
+    unsigned long long cycles = (unsigned long long)iterations * loop->cycles;
+    //Jump over the skipped cycles at once. No event is due in them, so the APU and PPU only need to count them.
+    APU_CPUCycles(&emu->apu, (unsigned)cycles);
+    if (emu->ppu_sync_mode == PPU_SYNC_CYCLE) {
+        PPU_Run(&emu->ppu, (int)cycles * 3);
+        CPU_SetNMISignal(&emu->cpu, PPU_NMISignal(&emu->ppu));
+    }
+    emu->scheduler.cycle += cycles;
+
+    if (iterations > 0) {
+        emu->stats.idle_skips++;
+        emu->stats.idle_cycles += cycles;
+    }
+    return iterations;
 }
 
 void OnCPUHalt(void *emulator, CPU *cpu, uint16_t nextAddr) {
     Emulator* emu = (Emulator*)emulator;
     DMA_Process(&emu->dma, &emu->cpu, &emu->apu, nextAddr);
+    //DMC sample loads can raise the DMC interrupt
+    CPU_SetIRQSignal(&emu->cpu, APU_IRQSignal(&emu->apu));
 }
 
 uint8_t OnPPURead(void* emulator, uint16_t addr) {
@@ -116,10 +310,14 @@ Emulator *Emu_Create()
         .onread = &OnCPURead,
         .onwrite = &OnCPUWrite,
         //.onpeek = &OnCPUPeek,
-        .onhalt = &OnCPUHalt
+        .onhalt = &OnCPUHalt,
+        .ontick = &OnCPUTick,
+        .onidle = &OnCPUIdle
     });
+    CPU_SetDecodeCache(&emu->cpu, &emu->decode_cache, emu->cpu_read_pages);
 
     PPU_Init(&emu->ppu, &OnPPURead, &OnPPUWrite, emu);
+    PPU_SetCHRCache(&emu->ppu, emu->mapper.memory.chr_decoded_pages);
 
     APU_Init(&emu->apu, (APUCallbacks){
         .context = emu,
@@ -127,6 +325,10 @@ Emulator *Emu_Create()
     }, NTSC_CPU_CLOCK, 44100);
     
     StdController_Init(&emu->controller);
+    StdController_Init(&emu->controller2);
+
+    BuildCPUPages(emu);
+    emu->idle_skip = true;
 
     return emu;
 }
@@ -134,6 +336,11 @@ Emulator *Emu_Create()
 void Emu_Free(Emulator *emu)
 {
     Emu_CloseROM(emu);
+    if (emu->run_ahead_instance != NULL)
+        Emu_Free(emu->run_ahead_instance);
+    free(emu->run_ahead_state);
+    free(emu->pixel_buffer);
+    CPUBlockCache_Free(emu->block_cache);
     free(emu);
 }
 
@@ -170,9 +377,13 @@ int Emu_LoadROM(Emulator *emu, const char *filename)
         Emu_CloseROM(emu);
         return -1;
     }
+    emu->mapper.emulator = emu;
+    BuildCPUPages(emu);
+    strncpy(emu->rom_path, filename, sizeof(emu->rom_path));
+    emu->rom_path[sizeof(emu->rom_path) - 1] = '\0';
 
-    //Load PRG RAM save if there is one
-    if (ines->has_battery_saves) {
+    //Load PRG RAM save if there is one. A run-ahead instance gets PRG RAM from save states instead.
+    if (ines->has_battery_saves && !emu->is_run_ahead_instance) {
         if (emu->save_dir[0] == '\0') {
             printf("Battery save path is not set, cannot load or save battery saves.\n");
         } else {
@@ -216,6 +427,12 @@ int Emu_LoadROM(Emulator *emu, const char *filename)
     //Power on system
     Emu_PowerOn(emu);
 
+    //Load the ROM on the run-ahead instance too, or fall back to save and restore if that fails
+    if (emu->run_ahead_instance != NULL && Emu_LoadROM(emu->run_ahead_instance, filename) != 0) {
+        Emu_Free(emu->run_ahead_instance);
+        emu->run_ahead_instance = NULL;
+    }
+
     return 0;
 }
 
@@ -234,7 +451,22 @@ void Emu_CloseROM(Emulator *emu)
         }
     }
     Mapper_Cleanup(&emu->mapper);
+    BuildCPUPages(emu);
     emu->is_rom_loaded = 0;
+    if (emu->run_ahead_instance != NULL)
+        Emu_CloseROM(emu->run_ahead_instance);
+}
+
+uint64_t Emu_GetROMHash(Emulator *emu)
+{
+    //FNV-1a
+    MapperMemory* mem = &emu->mapper.memory;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (unsigned i = 0; i < mem->prg_rom_size; i++)
+        hash = (hash ^ (uint8_t)mem->prg_rom[i]) * 0x100000001B3ULL;
+    for (unsigned i = 0; i < mem->chr_rom_size; i++)
+        hash = (hash ^ (uint8_t)mem->chr_rom[i]) * 0x100000001B3ULL;
+    return hash;
 }
 
 int Emu_IsROMLoaded(Emulator *emu)
@@ -244,24 +476,372 @@ int Emu_IsROMLoaded(Emulator *emu)
 
 void Emu_PowerOn(Emulator *emu)
 {
+    Scheduler_Reset(&emu->scheduler);
+    emu->ppu_cycle = 0;
+    memset(&emu->stats, 0, sizeof(emu->stats));
+    emu->input_polls = 0;
+    emu->run_ahead_synced = false;
+
     PPU_PowerOn(&emu->ppu);
+    if (emu->ppu_sync_mode == PPU_SYNC_CATCHUP)
+        SyncPPU(emu);
     APU_PowerOn(&emu->apu);
+    ScheduleAPUFrameStep(emu);
+    CPU_SetIRQSignal(&emu->cpu, APU_IRQSignal(&emu->apu));
     CPU_PowerOn(&emu->cpu);
 }
 
-int Emu_RunFrame(Emulator *emu)
+//Run one frame
+static int RunFrame(Emulator* emu)
 {
     //Execute instructions until a full frame is rendered
-    unsigned long long frame = emu->ppu.state.frames;
-    while (emu->ppu.state.frames == frame) {
-        if (CPU_Exec(&emu->cpu) != 0) {
+    emu->run_frame = emu->ppu.state.frames;
+    if (emu->cpu.trace != NULL)
+        Trace_SetFrame(emu->cpu.trace, emu->run_frame);
+    while (emu->ppu.state.frames == emu->run_frame) {
+        if (CPU_ExecBlock(&emu->cpu) != 0) {
             printf("Error: CPU crashed.\n");
             return -1;
         }
     }
+    //Bring the PPU up to date so its state is consistent between frames
+    if (emu->ppu_sync_mode == PPU_SYNC_CATCHUP)
+        SyncPPU(emu);
+    APU_EndFrame(&emu->apu);
+    return 0;
+}
+
+//Run one frame with video and/or audio output turned off
+static int RunFrameOutput(Emulator* emu, bool video, bool audio)
+{
+    bool skipRender = emu->ppu.skipRender, skipAudio = emu->apu.skipOutput;
+    emu->ppu.skipRender = !video;
+    emu->apu.skipOutput = !audio;
+    int result = RunFrame(emu);
+    emu->ppu.skipRender = skipRender;
+    emu->apu.skipOutput = skipAudio;
+    return result;
+}
+
+static int ReserveRunAheadState(Emulator* emu, size_t size)
+{
+    if (size <= emu->run_ahead_state_size)
+        return 0;
+    uint8_t* state = realloc(emu->run_ahead_state, size);
+    if (state == NULL)
+        return -1;
+    emu->run_ahead_state = state;
+    emu->run_ahead_state_size = size;
     return 0;
 }
 
+//Whether the frame about to be run should have its picture rendered
+static bool RenderThisFrame(Emulator* emu)
+{
+    switch (emu->render_mode) {
+        case RENDER_NEVER:
+            return false;
+        case RENDER_EVERY_NTH_FRAME:
+            if (++emu->render_counter < emu->render_interval)
+                return false;
+            emu->render_counter = 0;
+            return true;
+        default:
+            return true;
+    }
+}
+
+//Run-ahead by saving the state after the real frame, running the frames ahead and loading the state again
+static int RunAhead(Emulator* emu, bool video)
+{
+    //The real frame: Its audio is played, its picture is never shown
+    if (RunFrameOutput(emu, false, true) != 0)
+        return -1;
+
+    size_t size = Emu_SaveStateSize(emu);
+    if (ReserveRunAheadState(emu, size) != 0)
+        return -1;
+    Emu_SaveState(emu, emu->run_ahead_state, size);
+
+    //Frames ahead are run again as real frames later, so they aren't traced or counted in the stats and input polls
+    CPUTrace* trace = emu->cpu.trace;
+    EmuStats stats = emu->stats;
+    unsigned long long inputPolls = emu->input_polls;
+    emu->cpu.trace = NULL;
+    int result = 0;
+    for (int f = 1; f <= emu->run_ahead && result == 0; f++)
+        result = RunFrameOutput(emu, video && f == emu->run_ahead, false);
+    emu->cpu.trace = trace;
+    emu->stats = stats;
+    emu->input_polls = inputPolls;
+
+    if (Emu_LoadState(emu, emu->run_ahead_state, size) != 0)
+        return -1;
+    return result;
+}
+
+//Run-ahead on the second instance, which is kept run_ahead frames ahead while the buttons don't change
+static int RunAheadSecondInstance(Emulator* emu, bool video)
+{
+    Emulator* ahead = emu->run_ahead_instance;
+    if (RunFrameOutput(emu, false, true) != 0)
+        return -1;
+
+    int frames = 1;
+    uint8_t buttons = emu->controller.button_state;
+    if (!emu->run_ahead_synced || buttons != emu->run_ahead_buttons) {
+        //The frames run ahead guessed the wrong buttons (or nothing was run ahead yet): Copy the state and run them again
+        size_t size = Emu_SaveStateSize(emu);
+        if (ReserveRunAheadState(emu, size) != 0)
+            return -1;
+        if (ahead->ppu_sync_mode != emu->ppu_sync_mode)
+            Emu_SetPPUSyncMode(ahead, emu->ppu_sync_mode);
+        if ((ahead->block_cache != NULL) != (emu->block_cache != NULL))
+            Emu_SetBlockCache(ahead, emu->block_cache != NULL);
+        ahead->idle_skip = emu->idle_skip;
+        Emu_SaveState(emu, emu->run_ahead_state, size);
+        if (Emu_LoadState(ahead, emu->run_ahead_state, size) != 0)
+            return -1;
+        frames = emu->run_ahead;
+        emu->run_ahead_synced = true;
+        emu->run_ahead_buttons = buttons;
+    }
+
+    ahead->controller.button_state = buttons;
+    for (int f = 1; f <= frames; f++) {
+        if (RunFrameOutput(ahead, video && f == frames, false) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int Emu_RunFrameHidden(Emulator *emu)
+{
+    return RunFrameOutput(emu, false, false);
+}
+
+//PPU with the picture to show: With a run-ahead instance, the one it ran ahead to
+static const PPU* ShownPPU(Emulator* emu)
+{
+    if (emu->run_ahead > 0 && emu->run_ahead_instance != NULL)
+        return &emu->run_ahead_instance->ppu;
+    return &emu->ppu;
+}
+
+int Emu_RunFrame(Emulator *emu)
+{
+    bool video = RenderThisFrame(emu);
+    int result;
+    if (emu->run_ahead > 0 && emu->run_ahead_instance != NULL)
+        result = RunAheadSecondInstance(emu, video);
+    else if (emu->run_ahead > 0)
+        result = RunAhead(emu, video);
+    else
+        result = RunFrameOutput(emu, video, true);
+
+    if (result == 0 && video && emu->framebuffer != NULL)
+        PPU_ConvertFrame(ShownPPU(emu), emu->framebuffer, emu->framebuffer_pitch, emu->framebuffer_format);
+    return result;
+}
+
+void Emu_SetRenderMode(Emulator *emu, RenderMode mode, int interval)
+{
+    emu->render_mode = mode;
+    emu->render_interval = (interval > 1) ? interval : 1;
+    emu->render_counter = 0;
+}
+
+int Emu_FramesUntilRender(Emulator *emu)
+{
+    switch (emu->render_mode) {
+        case RENDER_NEVER:
+            return -1;
+        case RENDER_EVERY_NTH_FRAME:
+            return (emu->render_counter + 1 < emu->render_interval) ? emu->render_interval - emu->render_counter : 1;
+        default:
+            return 1;
+    }
+}
+
+int Emu_SetRunAhead(Emulator *emu, int frames, bool secondInstance)
+{
+    emu->run_ahead = (frames > 0) ? frames : 0;
+    emu->run_ahead_synced = false;
+    if (emu->run_ahead > 0 && secondInstance && emu->run_ahead_instance == NULL) {
+        Emulator* ahead = Emu_Create();
+        ahead->is_run_ahead_instance = true;
+        if (emu->is_rom_loaded && Emu_LoadROM(ahead, emu->rom_path) != 0) {
+            Emu_Free(ahead);
+            emu->run_ahead = 0;
+            return -1;
+        }
+        emu->run_ahead_instance = ahead;
+    } else if ((emu->run_ahead == 0 || !secondInstance) && emu->run_ahead_instance != NULL) {
+        Emu_Free(emu->run_ahead_instance);
+        emu->run_ahead_instance = NULL;
+    }
+    return 0;
+}
+
+void Emu_SetPPUSyncMode(Emulator *emu, PPUSyncMode mode)
+{
+    if (emu->ppu_sync_mode == PPU_SYNC_CATCHUP)
+        SyncPPU(emu);
+    emu->ppu_sync_mode = mode;
+
+    if (mode == PPU_SYNC_CATCHUP) {
+        emu->ppu_cycle = emu->scheduler.cycle;
+        SyncPPU(emu);
+    } else {
+        Scheduler_Cancel(&emu->scheduler, SCHED_PPU_SYNC);
+    }
+}
+
+int Emu_SetBlockCache(Emulator *emu, bool enable)
+{
+    if (enable && emu->block_cache == NULL) {
+        emu->block_cache = CPUBlockCache_Create();
+        if (emu->block_cache == NULL)
+            return -1;
+        //Only PRG ROM is cached; RAM and PRG RAM code stays in the interpreter
+        CPU_SetBlockCache(&emu->cpu, emu->block_cache, emu->mapper.memory.prg_page_is_rom);
+    } else if (!enable && emu->block_cache != NULL) {
+        CPU_SetBlockCache(&emu->cpu, NULL, NULL);
+        CPUBlockCache_Free(emu->block_cache);
+        emu->block_cache = NULL;
+    }
+    return 0;
+}
+
+void Emu_SetIdleSkip(Emulator *emu, bool enable)
+{
+    emu->idle_skip = enable;
+}
+
+void Emu_GetStats(Emulator *emu, EmuStats *stats)
+{
+    *stats = emu->stats;
+    stats->cpu_cycles = emu->scheduler.cycle;
+}
+
+static void MakeSaveStateHeader(Emulator* emu, SaveStateHeader* header) {
+    MapperMemory* mem = &emu->mapper.memory;
+    memset(header, 0, sizeof(SaveStateHeader));
+    memcpy(header->magic, SAVESTATE_MAGIC, sizeof(header->magic));
+    header->version = SAVESTATE_VERSION;
+    header->size = (uint32_t)Emu_SaveStateSize(emu);
+    header->mapper = emu->mapper.type;
+    header->prg_rom_size = mem->prg_rom_size;
+    header->chr_rom_size = mem->chr_rom_size;
+    header->prg_ram_size = mem->prg_ram_size;
+    header->chr_ram_size = mem->chr_ram_size;
+    header->vram_size = mem->vram_size;
+}
+
+size_t Emu_SaveStateSize(Emulator *emu)
+{
+    return sizeof(SaveStateHeader) + sizeof(SaveStateFixed) + Mapper_StateSize(&emu->mapper);
+}
+
+size_t Emu_SaveState(Emulator *emu, void *buffer, size_t size)
+{
+    size_t stateSize = Emu_SaveStateSize(emu);
+    if (!emu->is_rom_loaded || size < stateSize)
+        return 0;
+    //Bring the PPU up to date, so the state doesn't depend on the PPU sync mode
+    if (emu->ppu_sync_mode == PPU_SYNC_CATCHUP)
+        SyncPPU(emu);
+    APU_Sync(&emu->apu);
+
+    uint8_t* dst = buffer;
+    SaveStateHeader header;
+    MakeSaveStateHeader(emu, &header);
+    memcpy(dst, &header, sizeof(header));
+    dst += sizeof(header);
+
+    //Cleared first so padding bytes are the same in every state
+    SaveStateFixed fixed;
+    memset(&fixed, 0, sizeof(fixed));
+    memcpy(&fixed.cpu.state, &emu->cpu.state, sizeof(CPUState));
+    fixed.cpu.nmi = emu->cpu.nmi;
+    fixed.cpu.irq = emu->cpu.irq;
+    fixed.cpu.nmi_detected = emu->cpu.nmi_detected;
+    fixed.cpu.halt = emu->cpu.halt;
+    memcpy(&fixed.ppu, &emu->ppu.state, sizeof(PPUState));
+    memcpy(&fixed.apu, &emu->apu.state, sizeof(APUState));
+    fixed.apu_sample_timer = emu->apu.cycleSampleTimer;
+    memcpy(&fixed.dma, &emu->dma, sizeof(DMAController));
+    memcpy(&fixed.controller, &emu->controller, sizeof(StandardController));
+    memcpy(&fixed.controller2, &emu->controller2, sizeof(StandardController));
+    memcpy(fixed.ram, emu->ram, sizeof(emu->ram));
+    fixed.cycle = emu->scheduler.cycle;
+    memcpy(dst, &fixed, sizeof(fixed));
+    dst += sizeof(fixed);
+
+    Mapper_SaveState(&emu->mapper, dst);
+    return stateSize;
+}
+
+int Emu_LoadState(Emulator *emu, const void *buffer, size_t size)
+{
+    const uint8_t* src = buffer;
+    SaveStateHeader header, expected;
+    if (!emu->is_rom_loaded || size < sizeof(header))
+        return -1;
+    memcpy(&header, src, sizeof(header));
+    MakeSaveStateHeader(emu, &expected);
+    if (memcmp(&header, &expected, sizeof(header)) != 0 || size < header.size)
+        return -1;
+    src += sizeof(header);
+
+    //The state is copied out first, since the buffer isn't required to be aligned
+    SaveStateFixed fixed;
+    memcpy(&fixed, src, sizeof(fixed));
+    src += sizeof(fixed);
+    if (Mapper_LoadState(&emu->mapper, src) != 0)
+        return -1;
+
+    emu->cpu.state = fixed.cpu.state;
+    emu->cpu.nmi = fixed.cpu.nmi;
+    emu->cpu.irq = fixed.cpu.irq;
+    emu->cpu.nmi_detected = fixed.cpu.nmi_detected;
+    emu->cpu.halt = fixed.cpu.halt;
+    emu->cpu.idle_cycles = 0;
+    emu->ppu.state = fixed.ppu;
+    //The cycles counted before loading are run first, so their samples are made like the cycles had already run
+    APU_Sync(&emu->apu);
+    emu->apu.state = fixed.apu;
+    emu->apu.cycleSampleTimer = fixed.apu_sample_timer;
+    APU_Sync(&emu->apu);
+    emu->dma = fixed.dma;
+    //Buttons are input from the player, not console state, so the buttons held now stay held
+    uint8_t buttons = emu->controller.button_state, buttons2 = emu->controller2.button_state;
+    emu->controller = fixed.controller;
+    emu->controller.button_state = buttons;
+    emu->controller2 = fixed.controller2;
+    emu->controller2.button_state = buttons2;
+    memcpy(emu->ram, fixed.ram, sizeof(emu->ram));
+
+    //Memory and bank mappings changed
+    RestoreCPUPages(emu);
+    emu->run_ahead_synced = false;
+
+    //Rebuild the schedule from the restored state
+    Scheduler_Reset(&emu->scheduler);
+    emu->scheduler.cycle = fixed.cycle;
+    emu->ppu_cycle = fixed.cycle;
+    ScheduleAPUFrameStep(emu);
+    if (emu->ppu_sync_mode == PPU_SYNC_CATCHUP)
+        SyncPPU(emu);
+    return 0;
+}
+
+void Emu_SetButtons(Emulator *emu, int port, uint8_t buttons)
+{
+    StandardController* controller = (port == 0) ? &emu->controller : &emu->controller2;
+    controller->button_state = buttons;
+}
+
 void Emu_PressButton(Emulator *emu, ControllerButton button)
 {
     StdController_PressButton(&emu->controller, button);
@@ -280,11 +860,26 @@ bool Emu_GetAudioChannelMute(Emulator* emu, APU_Channel channel) { return APU_Ge
 
 void Emu_SetAudioChannelMute(Emulator* emu, APU_Channel channel, bool mute) { APU_SetChannelMute(&emu->apu, channel, mute); }
 
+void Emu_SetAudioSynthesis(Emulator* emu, APU_Synthesis synthesis) { APU_SetSynthesis(&emu->apu, synthesis); }
+
+void Emu_SetFramebuffer(Emulator *emu, void *buffer, int pitch, PixelFormat format)
+{
+    emu->framebuffer = buffer;
+    emu->framebuffer_pitch = pitch;
+    emu->framebuffer_format = format;
+}
+
 RGBAPixel *Emu_GetPixelBuffer(Emulator *emu, int *width, int *height)
 {
     *width = NES_SCREEN_W;
     *height = NES_SCREEN_H;
-    return &emu->ppu.pixelBuffer[0][0];
+    if (emu->pixel_buffer == NULL) {
+        emu->pixel_buffer = malloc(sizeof(RGBAPixel) * NES_SCREEN_W * NES_SCREEN_H);
+        if (emu->pixel_buffer == NULL)
+            return NULL;
+    }
+    PPU_ConvertFrame(ShownPPU(emu), emu->pixel_buffer, NES_SCREEN_W * sizeof(RGBAPixel), PIXEL_FORMAT_RGBA8888);
+    return emu->pixel_buffer;
 }
 
 void *Emu_GetAudioBuffer(Emulator *emu, size_t *len)
@@ -296,3 +891,13 @@ void Emu_ClearAudioBuffer(Emulator *emu)
 {
     APU_ClearAudioBuffer(&emu->apu);
 }
+
+void _Emu_UpdateCPUPages(Emulator *emu, uint8_t startPage, uint8_t endPage)
+{
+    //Page $40 is shared with the APU and I/O registers
+    if (startPage < 0x41)
+        startPage = 0x41;
+    for (unsigned p = startPage; p <= endPage; p++)
+        emu->cpu_read_pages[p] = Mapper_GetCPUReadPage(&emu->mapper, p);
+    CPU_InvalidateDecodeCache(&emu->cpu, startPage, endPage);
+}
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "emulator.h"
+#include "rewind.h"
+#include "movie.h"
+
+//FNV-1a hash, used to compare video and audio output between runs
+static uint64_t HashBytes(uint64_t hash, const void* data, size_t len) {
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static double GetSeconds() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void PrintUsage(const char* program) {
+    printf("Usage: %s [options] <rom.nes>\n", program);
+    printf("Runs a ROM without video or audio output and prints video/audio hashes and the emulation speed.\n\n");
+    printf("Options:\n");
+    printf("  --frames <n>        Number of frames to run (default: 600)\n");
+    printf("  --ppu-sync <mode>   PPU synchronization: catchup (default) or cycle\n");
+    printf("  --frame-hashes      Print the video and audio hash of every frame\n");
+    printf("  --block-cache       Run the CPU with the basic block cache\n");
+    printf("  --no-idle-skip      Run idle loops instruction by instruction\n");
+    printf("  --bandlimited       Make audio with band-limited synthesis instead of point sampling\n");
+    printf("  --render <n>        Render the picture of every nth frame, 0 for never (video hashes are of the last picture)\n");
+    printf("  --run-ahead <n>     Run n frames ahead (video hashes are of the frame n frames ahead)\n");
+    printf("  --run-ahead-instance  Run ahead on a second emulator instance instead of saving and restoring\n");
+    printf("  --trace <file>      Write a binary CPU trace (decode it with TraceDecode)\n");
+    printf("  --trace-pc <a>-<b>  Only trace instructions at PC $a-$b (hex)\n");
+    printf("  --trace-frames <a>-<b>  Only trace PPU frames a-b (the first frame is 1)\n");
+    printf("  --trace-bus         Also trace bus reads and writes\n");
+    printf("  --random-input <seed>  Hold random buttons, changed every 8 frames\n");
+    printf("  --record <file>     Record an input movie from power on\n");
+    printf("  --play <file>       Play an input movie to its end (overrides --frames)\n");
+    printf("  --rewind <MB>       Push every frame to a rewind buffer, then rewind it all, replay and check the output\n");
+}
+
+int main(int argc, char** argv) {
+    const char* rompath = NULL;
+    long frames = 600;
+    PPUSyncMode ppuSync = PPU_SYNC_CATCHUP;
+    int printFrameHashes = 0;
+    int useBlockCache = 0;
+    int idleSkip = 1;
+    int bandlimited = 0;
+    int renderInterval = 1;
+    int runAhead = 0;
+    int runAheadInstance = 0;
+    const char* tracePath = NULL;
+    unsigned tracePCMin = 0x0000, tracePCMax = 0xFFFF;
+    unsigned long long traceFirst = 0, traceLast = ~0ULL;
+    int traceBus = 0;
+    long rewindMB = 0;
+    unsigned long randomSeed = 0;
+    const char* recordPath = NULL;
+    const char* playPath = NULL;
+
+    //Read command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--ppu-sync") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "cycle") == 0)
+                ppuSync = PPU_SYNC_CYCLE;
+            else if (strcmp(argv[i], "catchup") == 0)
+                ppuSync = PPU_SYNC_CATCHUP;
+            else {
+                fprintf(stderr, "Unknown PPU sync mode: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--frame-hashes") == 0) {
+            printFrameHashes = 1;
+        } else if (strcmp(argv[i], "--block-cache") == 0) {
+            useBlockCache = 1;
+        } else if (strcmp(argv[i], "--no-idle-skip") == 0) {
+            idleSkip = 0;
+        } else if (strcmp(argv[i], "--bandlimited") == 0) {
+            bandlimited = 1;
+        } else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+            renderInterval = (int)strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+            runAhead = (int)strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--run-ahead-instance") == 0) {
+            runAheadInstance = 1;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--trace-pc") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%x-%x", &tracePCMin, &tracePCMax) != 2 || tracePCMin > tracePCMax || tracePCMax > 0xFFFF) {
+                fprintf(stderr, "Invalid PC range: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--trace-frames") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%llu-%llu", &traceFirst, &traceLast) != 2 || traceFirst > traceLast) {
+                fprintf(stderr, "Invalid frame window: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--trace-bus") == 0) {
+            traceBus = 1;
+        } else if (strcmp(argv[i], "--random-input") == 0 && i + 1 < argc) {
+            randomSeed = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) {
+            playPath = argv[++i];
+        } else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+            rewindMB = strtol(argv[++i], NULL, 10);
+        } else if (argv[i][0] == '-') {
+            PrintUsage(argv[0]);
+            return 1;
+        } else {
+            rompath = argv[i];
+        }
+    }
+    if (rompath == NULL) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    Emulator* emulator = Emu_Create();
+    Emu_SetPPUSyncMode(emulator, ppuSync);
+    Emu_SetIdleSkip(emulator, idleSkip);
+    if (bandlimited)
+        Emu_SetAudioSynthesis(emulator, APU_SYNTH_BANDLIMITED);
+    if (renderInterval <= 0)
+        Emu_SetRenderMode(emulator, RENDER_NEVER, 0);
+    else if (renderInterval > 1)
+        Emu_SetRenderMode(emulator, RENDER_EVERY_NTH_FRAME, renderInterval);
+    if (useBlockCache && Emu_SetBlockCache(emulator, true) != 0) {
+        fprintf(stderr, "Error allocating the block cache.\n");
+        Emu_Free(emulator);
+        return 1;
+    }
+    CPUTrace* trace = NULL;
+    if (tracePath != NULL) {
+        trace = Trace_Create(tracePath, 0);
+        if (trace == NULL) {
+            perror("Error creating CPU trace");
+            Emu_Free(emulator);
+            return 1;
+        }
+        Trace_SetPCRange(trace, tracePCMin, tracePCMax);
+        Trace_SetFrameWindow(trace, traceFirst, traceLast);
+        Trace_SetBusAccesses(trace, traceBus);
+        CPU_SetTrace(&emulator->cpu, trace);
+    }
+    if (Emu_LoadROM(emulator, rompath) != 0) {
+        Emu_Free(emulator);
+        Trace_Close(trace);
+        return 1;
+    }
+    if (Emu_SetRunAhead(emulator, runAhead, runAheadInstance) != 0) {
+        fprintf(stderr, "Error creating the run-ahead instance.\n");
+        Emu_Free(emulator);
+        Trace_Close(trace);
+        return 1;
+    }
+
+    Movie* movie = NULL;
+    if (recordPath != NULL) {
+        movie = Movie_Record(emulator, recordPath, MOVIE_START_POWER_ON);
+    } else if (playPath != NULL) {
+        movie = Movie_Play(emulator, playPath);
+        if (movie != NULL)
+            frames = (long)movie->header.frames;
+    }
+    if ((recordPath != NULL || playPath != NULL) && movie == NULL) {
+        Emu_Free(emulator);
+        Trace_Close(trace);
+        return 1;
+    }
+
+    Rewind* rewindBuffer = NULL;
+    uint64_t* rewindHashes = NULL;
+    if (rewindMB > 0) {
+        rewindBuffer = Rewind_Create((size_t)rewindMB << 20, 0, 0);
+        rewindHashes = malloc((frames > 0 ? frames : 1) * sizeof(uint64_t));
+        if (rewindBuffer == NULL || rewindHashes == NULL) {
+            fprintf(stderr, "Error allocating the rewind buffer.\n");
+            Rewind_Free(rewindBuffer);
+            free(rewindHashes);
+            if (movie != NULL)
+                Movie_Close(movie, emulator);
+            Emu_Free(emulator);
+            Trace_Close(trace);
+            return 1;
+        }
+    }
+
+    uint64_t videoHash = 0xCBF29CE484222325ULL;
+    uint64_t audioHash = 0xCBF29CE484222325ULL;
+    double start = GetSeconds();
+
+    uint32_t random = (uint32_t)randomSeed;
+    for (long frame = 0; frame < frames; frame++) {
+        if (randomSeed != 0 && frame % 8 == 0) {
+            random = random * 1103515245 + 12345;
+            for (int b = 0; b < 8; b++) {
+                if ((random >> (16 + b)) & 1)
+                    Emu_PressButton(emulator, (ControllerButton)(1 << b));
+                else
+                    Emu_ReleaseButton(emulator, (ControllerButton)(1 << b));
+            }
+        }
+        if (movie != NULL && Movie_Frame(movie, emulator) != 0) {
+            fprintf(stderr, "Error reading or writing the movie.\n");
+            Movie_Close(movie, emulator);
+            Emu_Free(emulator);
+            Trace_Close(trace);
+            return 1;
+        }
+        if (Emu_RunFrame(emulator) != 0) {
+            Emu_Free(emulator);
+            Trace_Close(trace);
+            return 1;
+        }
+
+        int w, h;
+        size_t len;
+        RGBAPixel* pixels = Emu_GetPixelBuffer(emulator, &w, &h);
+        void* audio = Emu_GetAudioBuffer(emulator, &len);
+        uint64_t frameVideo = HashBytes(0xCBF29CE484222325ULL, pixels, (size_t)w * h * sizeof(RGBAPixel));
+        uint64_t frameAudio = HashBytes(0xCBF29CE484222325ULL, audio, len);
+        Emu_ClearAudioBuffer(emulator);
+
+        videoHash = HashBytes(videoHash, &frameVideo, sizeof(frameVideo));
+        audioHash = HashBytes(audioHash, &frameAudio, sizeof(frameAudio));
+        if (printFrameHashes)
+            printf("frame %ld video %016llx audio %016llx\n", frame, (unsigned long long)frameVideo, (unsigned long long)frameAudio);
+        if (rewindBuffer != NULL) {
+            rewindHashes[frame] = HashBytes(frameVideo, &frameAudio, sizeof(frameAudio));
+            Rewind_Push(rewindBuffer, emulator);
+        }
+    }
+
+    double elapsed = GetSeconds() - start;
+    printf("video %016llx audio %016llx\n", (unsigned long long)videoHash, (unsigned long long)audioHash);
+    printf("%ld frames, %llu CPU cycles in %.3f s (%.1f fps)\n", frames, emulator->cpu.state.cycles, elapsed, frames / elapsed);
+
+    if (movie != NULL) {
+        printf("Movie: %llu frames, %llu controller reads\n", movie->frame, emulator->input_polls - movie->polls_start);
+        if (Movie_Close(movie, emulator) != 0) {
+            Emu_Free(emulator);
+            Trace_Close(trace);
+            return 1;
+        }
+    }
+
+    EmuStats stats;
+    Emu_GetStats(emulator, &stats);
+    printf("Idle loops: %llu skips, %llu CPU cycles skipped (%.1f%%, %.3f s of emulated time)\n", stats.idle_skips, stats.idle_cycles,
+        stats.cpu_cycles ? 100.0 * stats.idle_cycles / stats.cpu_cycles : 0.0, stats.idle_cycles / (NTSC_CPU_CLOCK * 1e6));
+
+    if (rewindBuffer != NULL) {
+        RewindStats rs;
+        Rewind_GetStats(rewindBuffer, &rs);
+        printf("Rewind: %lu frames (%.1f s), %lu keyframes, %zu of %zu bytes used (%.1f bytes per frame, state %zu bytes)\n",
+            rs.frames, rs.frames / 60.0, rs.keyframes, rs.bytes_used, rs.budget, (double)rs.bytes_used / rs.frames, rs.state_size);
+
+        //Rewind to the oldest state, then replay the frames after it and compare their output to the first run
+        long steps = 0;
+        double rewindStart = GetSeconds();
+        while (Rewind_StepBack(rewindBuffer, emulator) == 0)
+            steps++;
+        double rewindTime = GetSeconds() - rewindStart;
+        int mismatch = 0;
+        for (long frame = frames - steps; frame < frames; frame++) {
+            Emu_RunFrame(emulator);
+            int w, h;
+            size_t len;
+            RGBAPixel* pixels = Emu_GetPixelBuffer(emulator, &w, &h);
+            void* audio = Emu_GetAudioBuffer(emulator, &len);
+            uint64_t frameVideo = HashBytes(0xCBF29CE484222325ULL, pixels, (size_t)w * h * sizeof(RGBAPixel));
+            uint64_t frameAudio = HashBytes(0xCBF29CE484222325ULL, audio, len);
+            Emu_ClearAudioBuffer(emulator);
+            if (HashBytes(frameVideo, &frameAudio, sizeof(frameAudio)) != rewindHashes[frame])
+                mismatch = 1;
+        }
+        printf("Rewound %ld frames in %.3f ms (%.2f us per frame, %.2f us per emulated frame), replay %s\n", steps, rewindTime * 1e3,
+            steps ? rewindTime * 1e6 / steps : 0.0, elapsed * 1e6 / frames, mismatch ? "differs" : "matches");
+        Rewind_Free(rewindBuffer);
+        free(rewindHashes);
+        if (mismatch) {
+            Emu_Free(emulator);
+            Trace_Close(trace);
+            return 1;
+        }
+    }
+
+    if (trace != NULL) {
+        Trace_Flush(trace);
+        printf("Traced %llu records\n", trace->records);
+    }
+    Emu_Free(emulator);
+    Trace_Close(trace);
+    return 0;
+}
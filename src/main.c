@@ -7,6 +7,8 @@
 #include "emulator.h"
 #include "sdl_audio_buffer.h"
 
+#define TURBO_SPEED 4 //Frames run per frame shown while fast-forwarding
+
 #ifdef _WIN32
     #include <direct.h> // For _mkdir on Windows
     #define MKDIR(path) _mkdir(path)
@@ -64,11 +66,11 @@ int main(int argc, char** argv){
     // Initialize emulator
     Emulator* emulator = Emu_Create();
 
-    //Log CPU?
+    //Trace CPU? Decode cpu.trace to text with TraceDecode.
     if (logcpu) {
-        FILE* logfile = fopen("cpu.log", "w");
-        if (logfile) {
-            CPU_SetLogFile(&emulator->cpu, logfile);
+        CPUTrace* trace = Trace_Create("cpu.trace", 0);
+        if (trace) {
+            CPU_SetTrace(&emulator->cpu, trace);
         }
     }
 
@@ -127,7 +129,7 @@ int main(int argc, char** argv){
 
     // Create audio buffer
 
-    if (SDLAudioBuffer_Create(&audioBuffer, audioSpec, 8) != 0) {
+    if (SDLAudioBuffer_Create(&audioBuffer, audioSpec, 8, SDL_AUDIO_BUFFER_DEFAULT_LATENCY) != 0) {
         SDL_Log("Failed to open audio: %s", SDL_GetError());
         return -1;
     }
@@ -151,6 +153,7 @@ int main(int argc, char** argv){
     Uint32 max_fps = 60;
     bool running = true;
     bool paused = false;
+    bool turbo = false;
     while (running) {
         Uint32 start = SDL_GetTicks();
         
@@ -177,6 +180,12 @@ int main(int argc, char** argv){
                                 Emu_PowerOn(emulator);
                             break;
                         //Other
+                        case SDL_SCANCODE_TAB: //Hold TAB: Fast-forward, rendering only the last of every TURBO_SPEED frames
+                            if (!e.key.repeat) {
+                                turbo = true;
+                                Emu_SetRenderMode(emulator, RENDER_EVERY_NTH_FRAME, TURBO_SPEED);
+                            }
+                            break;
                         case SDL_SCANCODE_U:
                             if (e.key.keysym.mod & KMOD_CTRL) { //CTRL+U: Unlimited speed
                                 if (max_fps == 60)
@@ -243,21 +252,41 @@ int main(int argc, char** argv){
                         case SDLK_DOWN:     Emu_ReleaseButton(emulator, BUTTON_DOWN);     break;
                         case SDLK_LEFT:     Emu_ReleaseButton(emulator, BUTTON_LEFT);     break;
                         case SDLK_RIGHT:    Emu_ReleaseButton(emulator, BUTTON_RIGHT);    break;
+                        case SDLK_TAB:
+                            turbo = false;
+                            Emu_SetRenderMode(emulator, RENDER_EVERY_FRAME, 0);
+                            break;
                         default: break;
                     }
             }
         }
         
         if (!paused) {
-            //Run emulator
-            if (Emu_RunFrame(emulator) != 0)
+            //Run emulator, writing the rendered frame straight to the screen texture. Audio is dropped while fast-forwarding.
+            //The texture is only locked when one of the frames is rendered, since its pixels are undefined until written
+            int frames = turbo ? TURBO_SPEED : 1;
+            int untilRender = Emu_FramesUntilRender(emulator);
+            void* pixels;
+            int pitch;
+            bool locked = untilRender > 0 && untilRender <= frames &&
+                SDL_LockTexture(screen_texture, NULL, &pixels, &pitch) == 0;
+            if (locked)
+                Emu_SetFramebuffer(emulator, pixels, pitch, PIXEL_FORMAT_RGBA8888);
+            int result = 0;
+            for (int f = 0; f < frames && result == 0; f++) {
+                result = Emu_RunFrame(emulator);
+                if (turbo)
+                    Emu_ClearAudioBuffer(emulator);
+            }
+            if (locked) {
+                Emu_SetFramebuffer(emulator, NULL, 0, PIXEL_FORMAT_RGBA8888);
+                SDL_UnlockTexture(screen_texture);
+            }
+            if (result != 0)
                 return -1;
             
             //Render
             SDL_RenderClear(renderer);
-            SDL_Rect rect = {0, 0, 0, 0};
-            RGBAPixel* buffer = Emu_GetPixelBuffer(emulator, &rect.w, &rect.h);
-            SDL_UpdateTexture(screen_texture, &rect, buffer, sizeof(*buffer) * rect.w);
             SDL_RenderCopy(renderer, screen_texture, NULL, &screen_rect);
             SDL_RenderPresent(renderer);
             
@@ -284,9 +313,7 @@ int main(int argc, char** argv){
 
     printf("Exiting emulator...\n");
     if (logcpu) {
-        if (emulator->cpu.log) {
-            fclose(emulator->cpu.log);
-        }
+        Trace_Close(emulator->cpu.trace);
     }
     Emu_Free(emulator);
     SDLAudioBuffer_Free(audioBuffer);
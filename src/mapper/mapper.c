@@ -1,7 +1,9 @@
 #include "mapper.h"
+#include "emulator.h"
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 /* Default mapper methods */
 
@@ -37,8 +39,12 @@ void DefaultPPUWrite(Mapper* mapper, uint16_t addr, uint8_t data) {
     assert(addr < 0x4000);
     MapperMemory* mem = &mapper->memory;
 
-    if (mem->chr_pages[addr >> 8] != NULL && !mem->chr_page_is_rom[addr >> 8])
+    if (mem->chr_pages[addr >> 8] != NULL && !mem->chr_page_is_rom[addr >> 8]) {
         mem->chr_pages[addr >> 8][addr & 0x00FF] = data;
+        //Keep the decoded copy of CHR RAM up to date
+        if (addr < 0x2000 && mem->chr_decoded_pages[addr >> 8] != NULL)
+            PPU_DecodeCHRRow(mem->chr_ram_decoded, (uint8_t*)mem->chr_ram, (mem->chr_pages[addr >> 8] - mem->chr_ram) + (addr & 0x00FF));
+    }
 }
 
 void DefaultWriteRegisters(Mapper* mapper, uint16_t addr, uint8_t data) {}
@@ -59,6 +65,65 @@ size_t DefaultLoadBattery(Mapper* mapper, FILE* file) {
     return fread(mem->prg_ram, 1, mem->prg_ram_size, file);
 }
 
+//Get the decoded copy of a CHR page, if it is in CHR ROM or RAM and the PPU reads CHR through DefaultPPURead()
+static PPUDecodedPage* DecodedCHRPage(Mapper* mapper, const char* page) {
+    MapperMemory* mem = &mapper->memory;
+    if (mapper->f.PPURead != &DefaultPPURead || page == NULL)
+        return NULL;
+    if (mem->chr_rom_decoded != NULL && page >= mem->chr_rom && page < mem->chr_rom + mem->chr_rom_size)
+        return &mem->chr_rom_decoded[(page - mem->chr_rom) / 0x100];
+    if (mem->chr_ram_decoded != NULL && page >= mem->chr_ram && page < mem->chr_ram + mem->chr_ram_size)
+        return &mem->chr_ram_decoded[(page - mem->chr_ram) / 0x100];
+    return NULL;
+}
+
+/* Save state helpers */
+
+//Memory regions that pages can point into. A saved page is (region << 24) | offset.
+typedef enum { REGION_NONE, REGION_PRG_ROM, REGION_PRG_RAM, REGION_CHR_ROM, REGION_CHR_RAM, REGION_VRAM, NUM_REGIONS } MemoryRegion;
+
+//Mapper registers: the mapper specific union
+#define MAPPER_REGS_OFFSET offsetof(Mapper, mmc1)
+#define MAPPER_REGS_SIZE (offsetof(Mapper, f) - offsetof(Mapper, mmc1))
+
+static char* RegionBase(MapperMemory* mem, MemoryRegion region, unsigned* size) {
+    switch (region) {
+        case REGION_PRG_ROM: *size = mem->prg_rom_size; return mem->prg_rom;
+        case REGION_PRG_RAM: *size = mem->prg_ram_size; return mem->prg_ram;
+        case REGION_CHR_ROM: *size = mem->chr_rom_size; return mem->chr_rom;
+        case REGION_CHR_RAM: *size = mem->chr_ram_size; return mem->chr_ram;
+        case REGION_VRAM:    *size = mem->vram_size;    return mem->vram;
+        default:             *size = 0;                 return NULL;
+    }
+}
+
+static uint32_t PageToOffset(MapperMemory* mem, const char* page, MemoryRegion first, MemoryRegion last) {
+    for (MemoryRegion r = first; page != NULL && r <= last; r++) {
+        unsigned size;
+        char* base = RegionBase(mem, r, &size);
+        if (base != NULL && page >= base && page < base + size)
+            return (uint32_t)r << 24 | (uint32_t)(page - base);
+    }
+    return 0;
+}
+
+//Returns false if the offset is outside of its region
+static bool OffsetToPage(MapperMemory* mem, uint32_t offset, char** page, bool* isRom) {
+    MemoryRegion region = offset >> 24;
+    unsigned size;
+    char* base = RegionBase(mem, region, &size);
+    *isRom = (region == REGION_PRG_ROM || region == REGION_CHR_ROM);
+    if (region == REGION_NONE) {
+        *page = NULL;
+        return true;
+    }
+    if (base == NULL || (offset & 0xFFFFFF) + 0x100 > size)
+        return false;
+    *page = base + (offset & 0xFFFFFF);
+    return true;
+}
+
+
 /* Public functions */
 
 int Mapper_Init(Mapper *mapper, const INESHeader *ines, FILE* romFile)
@@ -83,9 +148,12 @@ int Mapper_Init(Mapper *mapper, const INESHeader *ines, FILE* romFile)
     mem->prg_rom = INES_ReadPRG(ines, romFile);
     //If CHR-ROM is present, load it. Else, default to 8KB of CHR-RAM instead
     mem->chr_rom_size = ines->chr_bytes;
-    if (mem->chr_rom_size > 0)
+    if (mem->chr_rom_size > 0) {
         mem->chr_rom = INES_ReadCHR(ines, romFile);
-    else
+        mem->chr_rom_decoded = malloc(mem->chr_rom_size / 0x100 * sizeof(PPUDecodedPage));
+        if (mem->chr_rom != NULL && mem->chr_rom_decoded != NULL)
+            PPU_DecodeCHR(mem->chr_rom_decoded, (uint8_t*)mem->chr_rom, mem->chr_rom_size);
+    } else
         Mapper_ResizeCHRRAM(mapper, 0x2000);
     
     Mapper_ResizeVRAM(mapper, 0x800);
@@ -103,17 +171,102 @@ void Mapper_Cleanup(Mapper *mapper)
 {
     MapperMemory* mem = &mapper->memory;
 
-    mapper->f.Cleanup(mapper);
+    //No mapper is set up if no ROM is loaded
+    if (mapper->f.Cleanup != NULL)
+        mapper->f.Cleanup(mapper);
 
     free(mem->prg_rom);
     free(mem->chr_rom);
     free(mem->prg_ram);
     free(mem->chr_ram);
     free(mem->vram);
+    free(mem->chr_rom_decoded);
+    free(mem->chr_ram_decoded);
 
     memset(mapper, 0, sizeof(Mapper));
 }
 
+uint8_t *Mapper_GetCPUReadPage(Mapper *mapper, uint8_t page)
+{
+    if (mapper->f.CPURead != &DefaultCPURead)
+        return NULL;
+    return (uint8_t*)mapper->memory.prg_pages[page];
+}
+
+size_t Mapper_StateSize(Mapper *mapper)
+{
+    MapperMemory* mem = &mapper->memory;
+    return MAPPER_REGS_SIZE + mem->prg_ram_size + mem->chr_ram_size + mem->vram_size
+        + sizeof(uint32_t) * (0x100 + 0x40);
+}
+
+void Mapper_SaveState(Mapper *mapper, uint8_t *dst)
+{
+    MapperMemory* mem = &mapper->memory;
+
+    memcpy(dst, (uint8_t*)mapper + MAPPER_REGS_OFFSET, MAPPER_REGS_SIZE);
+    dst += MAPPER_REGS_SIZE;
+    memcpy(dst, mem->prg_ram, mem->prg_ram_size);
+    dst += mem->prg_ram_size;
+    memcpy(dst, mem->chr_ram, mem->chr_ram_size);
+    dst += mem->chr_ram_size;
+    memcpy(dst, mem->vram, mem->vram_size);
+    dst += mem->vram_size;
+
+    uint32_t pages[0x100 + 0x40];
+    for (int p = 0; p < 0x100; p++)
+        pages[p] = PageToOffset(mem, mem->prg_pages[p], REGION_PRG_ROM, REGION_PRG_RAM);
+    for (int p = 0; p < 0x40; p++)
+        pages[0x100 + p] = PageToOffset(mem, mem->chr_pages[p], REGION_CHR_ROM, REGION_VRAM);
+    memcpy(dst, pages, sizeof(pages));
+}
+
+int Mapper_LoadState(Mapper *mapper, const uint8_t *src)
+{
+    MapperMemory* mem = &mapper->memory;
+
+    //Check the bank mappings before loading anything
+    const uint8_t* pageSrc = src + MAPPER_REGS_SIZE + mem->prg_ram_size + mem->chr_ram_size + mem->vram_size;
+    uint32_t offsets[0x100 + 0x40];
+    memcpy(offsets, pageSrc, sizeof(offsets));
+    char* prgPages[0x100];
+    char* chrPages[0x40];
+    bool prgIsRom[0x100];
+    bool chrIsRom[0x40];
+    for (int p = 0; p < 0x100; p++) {
+        if ((offsets[p] >> 24) > REGION_PRG_RAM || !OffsetToPage(mem, offsets[p], &prgPages[p], &prgIsRom[p]))
+            return -1;
+    }
+    for (int p = 0; p < 0x40; p++) {
+        uint32_t offset = offsets[0x100 + p];
+        if (((offset >> 24) != REGION_NONE && (offset >> 24) < REGION_CHR_ROM) || !OffsetToPage(mem, offset, &chrPages[p], &chrIsRom[p]))
+            return -1;
+    }
+
+    memcpy((uint8_t*)mapper + MAPPER_REGS_OFFSET, src, MAPPER_REGS_SIZE);
+    src += MAPPER_REGS_SIZE;
+    memcpy(mem->prg_ram, src, mem->prg_ram_size);
+    src += mem->prg_ram_size;
+    //Copy CHR RAM tile by tile, so only the tiles that changed are decoded again
+    for (unsigned addr = 0; addr < mem->chr_ram_size; addr += 16) {
+        if (memcmp(mem->chr_ram + addr, src + addr, 16) == 0)
+            continue;
+        memcpy(mem->chr_ram + addr, src + addr, 16);
+        for (unsigned y = 0; mem->chr_ram_decoded != NULL && y < 8; y++)
+            PPU_DecodeCHRRow(mem->chr_ram_decoded, (uint8_t*)mem->chr_ram, addr + y);
+    }
+    src += mem->chr_ram_size;
+    memcpy(mem->vram, src, mem->vram_size);
+
+    memcpy(mem->prg_pages, prgPages, sizeof(prgPages));
+    memcpy(mem->prg_page_is_rom, prgIsRom, sizeof(prgIsRom));
+    memcpy(mem->chr_pages, chrPages, sizeof(chrPages));
+    memcpy(mem->chr_page_is_rom, chrIsRom, sizeof(chrIsRom));
+    for (int p = 0; p < 0x20; p++)
+        mem->chr_decoded_pages[p] = DecodedCHRPage(mapper, mem->chr_pages[p]);
+    return 0;
+}
+
 /* Helper functions */
 
 void Mapper_ResizePRGRAM(Mapper *mapper, unsigned size)
@@ -128,6 +281,9 @@ void Mapper_ResizeCHRRAM(Mapper *mapper, unsigned size)
     MapperMemory* mem = &mapper->memory;
     mem->chr_ram = realloc(mem->chr_ram, size);
     mem->chr_ram_size = size;
+    mem->chr_ram_decoded = realloc(mem->chr_ram_decoded, size / 0x100 * sizeof(PPUDecodedPage));
+    if (mem->chr_ram != NULL && mem->chr_ram_decoded != NULL)
+        PPU_DecodeCHR(mem->chr_ram_decoded, (uint8_t*)mem->chr_ram, size);
 }
 
 void Mapper_ResizeVRAM(Mapper *mapper, unsigned size)
@@ -158,6 +314,9 @@ void MapPRGPages(Mapper *mapper, uint8_t startPage, uint8_t endPage, int srcPage
         mem->prg_page_is_rom[p] = isRom;
         srcPage = (srcPage + 1) % srcCount;
     }
+    //Keep the emulator's CPU page table in sync with bank switches
+    if (mapper->emulator != NULL)
+        _Emu_UpdateCPUPages(mapper->emulator, startPage, endPage);
 }
 
 void MapCHRPages(Mapper *mapper, uint8_t startPage, uint8_t endPage, int srcPage, CHRType type)
@@ -182,6 +341,8 @@ void MapCHRPages(Mapper *mapper, uint8_t startPage, uint8_t endPage, int srcPage
     for (unsigned p = startPage; p <= endPage; p++) {
         mem->chr_pages[p] = &src[srcPage * 0x100];
         mem->chr_page_is_rom[p] = isRom;
+        if (p < 0x20)
+            mem->chr_decoded_pages[p] = DecodedCHRPage(mapper, mem->chr_pages[p]);
         srcPage = (srcPage + 1) % srcCount;
     }
 }
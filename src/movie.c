@@ -0,0 +1,207 @@
+#include "movie.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/* PRIVATE FUNCTIONS */
+
+static int WriteVarint(FILE* file, unsigned long long value) {
+    while (value >= 0x80) {
+        if (fputc((int)(value & 0x7F) | 0x80, file) == EOF)
+            return -1;
+        value >>= 7;
+    }
+    return (fputc((int)value, file) == EOF) ? -1 : 0;
+}
+
+static int ReadVarint(FILE* file, unsigned long long* value) {
+    unsigned long long v = 0;
+    int c, shift = 0;
+    do {
+        c = fgetc(file);
+        if (c == EOF || shift > 63)
+            return -1;
+        v |= (unsigned long long)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    *value = v;
+    return 0;
+}
+
+//Write the current run of buttons
+static int WriteRun(Movie* movie) {
+    if (movie->run == 0)
+        return 0;
+    if (WriteVarint(movie->file, movie->run) != 0 || fputc(movie->buttons, movie->file) == EOF)
+        return -1;
+    movie->run = 0;
+    return 0;
+}
+
+//Read the next run of buttons. Returns 1 at the end of the movie.
+static int ReadRun(Movie* movie) {
+    if (movie->frame >= movie->header.frames)
+        return 1;
+    int buttons;
+    if (ReadVarint(movie->file, &movie->run) != 0 || (buttons = fgetc(movie->file)) == EOF || movie->run == 0)
+        return -1;
+    movie->buttons = (uint8_t)buttons;
+    return 0;
+}
+
+static void SetButtons(Emulator* emu, uint8_t buttons) {
+    for (int b = 0; b < 8; b++) {
+        if (buttons & (1 << b))
+            Emu_PressButton(emu, (ControllerButton)(1 << b));
+        else
+            Emu_ReleaseButton(emu, (ControllerButton)(1 << b));
+    }
+}
+
+static Movie* NewMovie(FILE* file, bool recording) {
+    Movie* movie = malloc(sizeof(Movie));
+    if (movie == NULL)
+        return NULL;
+    memset(movie, 0, sizeof(Movie));
+    movie->file = file;
+    movie->recording = recording;
+    return movie;
+}
+
+
+/* PUBLIC FUNCTIONS */
+
+Movie* Movie_Record(Emulator* emu, const char* path, MovieStart start)
+{
+    if (!Emu_IsROMLoaded(emu))
+        return NULL;
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("Error creating movie file");
+        return NULL;
+    }
+    Movie* movie = NewMovie(file, true);
+    if (movie == NULL) {
+        fclose(file);
+        return NULL;
+    }
+
+    MovieHeader* header = &movie->header;
+    memcpy(header->magic, MOVIE_MAGIC, sizeof(header->magic));
+    header->version = MOVIE_VERSION;
+    header->start = start;
+    header->rom_hash = Emu_GetROMHash(emu);
+
+    if (start == MOVIE_START_POWER_ON)
+        Emu_PowerOn(emu);
+    header->state_size = (uint32_t)Emu_SaveStateSize(emu);
+    uint8_t* state = malloc(header->state_size);
+    if (state == NULL || Emu_SaveState(emu, state, header->state_size) != header->state_size) {
+        free(state);
+        fclose(file);
+        free(movie);
+        return NULL;
+    }
+
+    //The header is written again with the frame and poll counts when the recording is finished
+    bool ok = fwrite(header, sizeof(MovieHeader), 1, file) == 1 && fwrite(state, header->state_size, 1, file) == 1;
+    free(state);
+    if (!ok) {
+        perror("Error writing movie file");
+        fclose(file);
+        free(movie);
+        return NULL;
+    }
+    movie->polls_start = emu->input_polls;
+    return movie;
+}
+
+Movie* Movie_Play(Emulator* emu, const char* path)
+{
+    if (!Emu_IsROMLoaded(emu))
+        return NULL;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("Error opening movie file");
+        return NULL;
+    }
+    Movie* movie = NewMovie(file, false);
+    if (movie == NULL) {
+        fclose(file);
+        return NULL;
+    }
+
+    MovieHeader* header = &movie->header;
+    if (fread(header, sizeof(MovieHeader), 1, file) != 1 || memcmp(header->magic, MOVIE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != MOVIE_VERSION) {
+        fprintf(stderr, "Error opening movie file: Not a movie, or from another version.\n");
+        Movie_Close(movie, emu);
+        return NULL;
+    }
+    if (header->rom_hash != Emu_GetROMHash(emu)) {
+        fprintf(stderr, "Error opening movie file: The movie was recorded with another ROM.\n");
+        Movie_Close(movie, emu);
+        return NULL;
+    }
+
+    uint8_t* state = malloc(header->state_size);
+    int result = (state != NULL && fread(state, header->state_size, 1, file) == 1) ?
+        Emu_LoadState(emu, state, header->state_size) : -1;
+    free(state);
+    if (result != 0) {
+        fprintf(stderr, "Error opening movie file: Invalid save state.\n");
+        Movie_Close(movie, emu);
+        return NULL;
+    }
+    movie->polls_start = emu->input_polls;
+    return movie;
+}
+
+int Movie_Frame(Movie* movie, Emulator* emu)
+{
+    uint8_t buttons = emu->controller.button_state;
+    if (movie->recording) {
+        if (movie->run > 0 && buttons != movie->buttons && WriteRun(movie) != 0)
+            return -1;
+        movie->buttons = buttons;
+        movie->run++;
+        movie->frame++;
+        return 0;
+    }
+
+    if (movie->run == 0) {
+        int result = ReadRun(movie);
+        if (result != 0)
+            return result;
+    }
+    if (buttons != movie->buttons)
+        SetButtons(emu, movie->buttons);
+    movie->run--;
+    movie->frame++;
+    return 0;
+}
+
+int Movie_Close(Movie* movie, Emulator* emu)
+{
+    if (movie == NULL)
+        return 0;
+    int result = 0;
+    unsigned long long polls = emu->input_polls - movie->polls_start;
+    if (movie->recording) {
+        movie->header.frames = movie->frame;
+        movie->header.input_polls = polls;
+        if (WriteRun(movie) != 0 || fseek(movie->file, 0, SEEK_SET) != 0
+            || fwrite(&movie->header, sizeof(MovieHeader), 1, movie->file) != 1) {
+            perror("Error writing movie file");
+            result = -1;
+        }
+    } else if (movie->frame == movie->header.frames && movie->frame > 0 && polls != movie->header.input_polls) {
+        fprintf(stderr, "Movie playback went out of sync: The controller was read %llu times, %llu when recorded.\n",
+            polls, (unsigned long long)movie->header.input_polls);
+        result = -1;
+    }
+    if (fclose(movie->file) != 0)
+        result = -1;
+    free(movie);
+    return result;
+}
@@ -0,0 +1,203 @@
+#include "net_transport.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+typedef int socklen_t;
+#define CloseSocket closesocket
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define CloseSocket close
+#endif
+
+
+/* PRIVATE FUNCTIONS */
+
+static unsigned Random(uint64_t* rng, unsigned max) {
+    if (max == 0)
+        return 0;
+    *rng = *rng * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned)((*rng >> 33) % (max + 1));
+}
+
+static int Enqueue(NetDelayQueue* queue, const void* data, size_t len, uint64_t deliverTime) {
+    if (len > NET_MAX_PACKET)
+        return -1;
+    if (queue->count == NET_MAX_QUEUED)
+        return 0; //Queue full: The packet is lost, like a network dropping packets when congested
+    NetQueuedPacket* packet = &queue->packets[queue->count++];
+    memcpy(packet->data, data, len);
+    packet->len = len;
+    packet->deliver_time = deliverTime;
+    packet->sequence = queue->sequence++;
+    return 0;
+}
+
+//Remove the packet to deliver first, if it is due at time now
+static int Dequeue(NetDelayQueue* queue, uint64_t now, void* buffer, size_t size) {
+    size_t next = queue->count;
+    for (size_t i = 0; i < queue->count; i++) {
+        NetQueuedPacket* p = &queue->packets[i];
+        if (p->deliver_time <= now && (next == queue->count || p->deliver_time < queue->packets[next].deliver_time ||
+            (p->deliver_time == queue->packets[next].deliver_time && p->sequence < queue->packets[next].sequence)))
+            next = i;
+    }
+    if (next == queue->count)
+        return 0;
+
+    NetQueuedPacket* packet = &queue->packets[next];
+    if (packet->len > size)
+        return -1;
+    int len = (int)packet->len;
+    memcpy(buffer, packet->data, packet->len);
+    if (next != queue->count - 1)
+        *packet = queue->packets[queue->count - 1];
+    queue->count--;
+    return len;
+}
+
+static int LoopbackSend(void* context, const void* data, size_t len) {
+    NetLoopbackEnd* end = context;
+    NetLoopback* loop = end->loopback;
+    uint64_t deliverTime = loop->now + loop->latency + Random(&loop->rng, loop->jitter);
+    return Enqueue(&loop->queues[end->end ^ 1], data, len, deliverTime);
+}
+
+static int LoopbackReceive(void* context, void* buffer, size_t size) {
+    NetLoopbackEnd* end = context;
+    return Dequeue(&end->loopback->queues[end->end], end->loopback->now, buffer, size);
+}
+
+static uint64_t GetMilliseconds() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int UDPSend(void* context, const void* data, size_t len) {
+    NetUDP* udp = context;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(udp->remote_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    //A failed send is treated as a lost packet
+    sendto(udp->socket, data, (int)len, 0, (struct sockaddr*)&addr, sizeof(addr));
+    return 0;
+}
+
+static int UDPReceive(void* context, void* buffer, size_t size) {
+    NetUDP* udp = context;
+    uint64_t now = GetMilliseconds();
+
+    //Move everything that arrived on the socket to the delay queue
+    uint8_t packet[NET_MAX_PACKET];
+    for (;;) {
+        int len = (int)recvfrom(udp->socket, packet, sizeof(packet), 0, NULL, NULL);
+        if (len <= 0)
+            break;
+        Enqueue(&udp->queue, packet, len, now + udp->latency + Random(&udp->rng, udp->jitter));
+    }
+    return Dequeue(&udp->queue, now, buffer, size);
+}
+
+
+/* PUBLIC FUNCTIONS */
+
+NetLoopback* NetLoopback_Create(unsigned latency, unsigned jitter, uint64_t seed)
+{
+    NetLoopback* loop = malloc(sizeof(NetLoopback));
+    if (loop == NULL)
+        return NULL;
+    memset(loop, 0, sizeof(NetLoopback));
+    loop->latency = latency;
+    loop->jitter = jitter;
+    loop->rng = seed;
+    for (int i = 0; i < 2; i++) {
+        loop->ends[i].loopback = loop;
+        loop->ends[i].end = i;
+    }
+    return loop;
+}
+
+void NetLoopback_Free(NetLoopback* loopback)
+{
+    free(loopback);
+}
+
+NetTransport NetLoopback_GetTransport(NetLoopback* loopback, int end)
+{
+    NetTransport transport = { &loopback->ends[end & 1], LoopbackSend, LoopbackReceive };
+    return transport;
+}
+
+void NetLoopback_Tick(NetLoopback* loopback)
+{
+    loopback->now++;
+}
+
+NetUDP* NetUDP_Create(unsigned short localPort, unsigned short remotePort, unsigned latency, unsigned jitter)
+{
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+        return NULL;
+#endif
+    NetUDP* udp = malloc(sizeof(NetUDP));
+    if (udp == NULL)
+        return NULL;
+    memset(udp, 0, sizeof(NetUDP));
+    udp->remote_port = remotePort;
+    udp->latency = latency;
+    udp->jitter = jitter;
+    udp->rng = ((uint64_t)localPort << 16) | remotePort;
+
+    udp->socket = (intptr_t)socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp->socket < 0) {
+        perror("Error creating UDP socket");
+        free(udp);
+        return NULL;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(localPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#ifdef _WIN32
+    u_long nonBlocking = 1;
+    int result = ioctlsocket(udp->socket, FIONBIO, &nonBlocking);
+#else
+    int result = fcntl((int)udp->socket, F_SETFL, fcntl((int)udp->socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+    if (result != 0 || bind(udp->socket, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("Error binding UDP socket");
+        CloseSocket(udp->socket);
+        free(udp);
+        return NULL;
+    }
+    return udp;
+}
+
+void NetUDP_Free(NetUDP* udp)
+{
+    if (udp == NULL)
+        return;
+    CloseSocket(udp->socket);
+    free(udp);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+NetTransport NetUDP_GetTransport(NetUDP* udp)
+{
+    NetTransport transport = { udp, UDPSend, UDPReceive };
+    return transport;
+}
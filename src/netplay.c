@@ -0,0 +1,280 @@
+#include "netplay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define INPUT_MASK (NETPLAY_INPUT_FRAMES - 1)
+#define SNAPSHOTS (NETPLAY_MAX_ROLLBACK + 1)
+
+#define PACKET_INPUT 1
+#define PACKET_HEADER_SIZE 19
+#define PACKET_CHECKSUM_SIZE 12
+#define NO_CHECKSUM 0xFFFFFFFF
+
+
+/* PRIVATE FUNCTIONS */
+
+static double GetSeconds() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint8_t* Put32(uint8_t* dst, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        *dst++ = (uint8_t)(value >> (i * 8));
+    return dst;
+}
+
+static uint8_t* Put64(uint8_t* dst, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        *dst++ = (uint8_t)(value >> (i * 8));
+    return dst;
+}
+
+static uint32_t Get32(const uint8_t* src) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= (uint32_t)src[i] << (i * 8);
+    return value;
+}
+
+static uint64_t Get64(const uint8_t* src) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value |= (uint64_t)src[i] << (i * 8);
+    return value;
+}
+
+static uint8_t* Snapshot(Netplay* np, uint32_t frame) {
+    return np->snapshots[frame % SNAPSHOTS];
+}
+
+//Set the buttons of both players for a frame, predicting the remote input if it hasn't arrived yet
+static void SetInputs(Netplay* np, uint32_t frame) {
+    uint8_t remote;
+    if (frame < np->remote_count)
+        remote = np->remote_inputs[frame & INPUT_MASK];
+    else
+        remote = np->remote_count > 0 ? np->remote_inputs[(np->remote_count - 1) & INPUT_MASK] : 0;
+    np->used_inputs[frame & INPUT_MASK] = remote;
+    Emu_SetButtons(np->emu, np->local_port, np->local_inputs[frame & INPUT_MASK]);
+    Emu_SetButtons(np->emu, np->local_port ^ 1, remote);
+}
+
+//Compare a checksum with the other side's checksum of the same frame, if it has one
+static void CompareChecksum(Netplay* np, const NetplayChecksum* checksum, const NetplayChecksum* others) {
+    for (int i = 0; i < NETPLAY_CHECKSUMS; i++) {
+        if (!others[i].valid || others[i].frame != checksum->frame)
+            continue;
+        np->stats.checksums_compared++;
+        if (others[i].checksum != checksum->checksum) {
+            np->stats.desyncs++;
+            fprintf(stderr, "Netplay desync: The console states differ at frame %lu.\n", (unsigned long)checksum->frame);
+        }
+        return;
+    }
+}
+
+static void AddChecksum(Netplay* np, NetplayChecksum* checksums, NetplayChecksum* others, uint32_t frame, uint64_t value) {
+    NetplayChecksum* slot = &checksums[(frame / NETPLAY_CHECKSUM_INTERVAL) % NETPLAY_CHECKSUMS];
+    if (slot->valid && slot->frame == frame)
+        return; //Already have it (the remote checksum is sent in every packet until the next one)
+    slot->frame = frame;
+    slot->checksum = value;
+    slot->valid = true;
+    CompareChecksum(np, slot, others);
+}
+
+//Checksum the states of frames whose input from both players is known
+static void UpdateChecksums(Netplay* np) {
+    while (np->checksum_frame < np->frame && np->checksum_frame <= np->remote_count) {
+        uint32_t frame = np->checksum_frame;
+        np->checksum_frame += NETPLAY_CHECKSUM_INTERVAL;
+        if (frame + NETPLAY_MAX_ROLLBACK < np->frame)
+            continue; //Snapshot already overwritten
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        const uint8_t* state = Snapshot(np, frame);
+        for (size_t i = 0; i < np->state_size; i++)
+            hash = (hash ^ state[i]) * 0x100000001B3ULL;
+        np->last_checksum.frame = frame;
+        np->last_checksum.checksum = hash;
+        np->last_checksum.valid = true;
+        AddChecksum(np, np->local_checksums, np->remote_checksums, frame, hash);
+    }
+}
+
+static int ProcessPacket(Netplay* np, const uint8_t* packet, int len) {
+    if (len < PACKET_HEADER_SIZE || packet[0] != PACKET_INPUT)
+        return 0; //Not a netplay packet
+    int count = packet[18];
+    if (len < PACKET_HEADER_SIZE + count + PACKET_CHECKSUM_SIZE)
+        return 0;
+    if (Get64(packet + 2) != np->rom_hash) {
+        fprintf(stderr, "Netplay error: The other player is using another ROM.\n");
+        return -1;
+    }
+    if (packet[1] != (np->local_port ^ 1)) {
+        fprintf(stderr, "Netplay error: Both players are using controller port %d.\n", np->local_port + 1);
+        return -1;
+    }
+
+    uint32_t first = Get32(packet + 10), ack = Get32(packet + 14);
+    if (ack > np->remote_ack && ack <= np->local_count)
+        np->remote_ack = ack;
+
+    //Inputs are taken in order, so remote_count always means all remote input before it is known
+    const uint8_t* inputs = packet + PACKET_HEADER_SIZE;
+    for (int i = 0; i < count; i++) {
+        uint32_t frame = first + i;
+        if (frame < np->remote_count)
+            continue;
+        if (frame > np->remote_count || frame >= np->frame + NETPLAY_INPUT_FRAMES - SNAPSHOTS)
+            break;
+        np->remote_inputs[frame & INPUT_MASK] = inputs[i];
+        np->remote_count++;
+        if (frame < np->frame && np->used_inputs[frame & INPUT_MASK] != inputs[i]) {
+            np->stats.mispredictions++;
+            if (np->rollback_frame < 0 || frame < np->rollback_frame)
+                np->rollback_frame = frame;
+        }
+    }
+
+    const uint8_t* checksum = inputs + count;
+    uint32_t checksumFrame = Get32(checksum);
+    if (checksumFrame != NO_CHECKSUM)
+        AddChecksum(np, np->remote_checksums, np->local_checksums, checksumFrame, Get64(checksum + 4));
+    return 0;
+}
+
+//Send the local inputs the other player hasn't acknowledged
+static void SendInputs(Netplay* np) {
+    uint8_t packet[PACKET_HEADER_SIZE + NETPLAY_MAX_PACKET_INPUTS + PACKET_CHECKSUM_SIZE];
+    uint32_t count = np->local_count - np->remote_ack;
+    if (count > NETPLAY_MAX_PACKET_INPUTS)
+        count = NETPLAY_MAX_PACKET_INPUTS;
+
+    uint8_t* p = packet;
+    *p++ = PACKET_INPUT;
+    *p++ = (uint8_t)np->local_port;
+    p = Put64(p, np->rom_hash);
+    p = Put32(p, np->remote_ack);
+    p = Put32(p, np->remote_count);
+    *p++ = (uint8_t)count;
+    for (uint32_t i = 0; i < count; i++)
+        *p++ = np->local_inputs[(np->remote_ack + i) & INPUT_MASK];
+    p = Put32(p, np->last_checksum.valid ? np->last_checksum.frame : NO_CHECKSUM);
+    p = Put64(p, np->last_checksum.checksum);
+    np->transport.send(np->transport.context, packet, p - packet);
+}
+
+//Load the snapshot of the first mispredicted frame and run the frames since with the right input
+static int Rollback(Netplay* np) {
+    uint32_t from = (uint32_t)np->rollback_frame;
+    np->rollback_frame = -1;
+    double start = GetSeconds();
+    if (Emu_LoadState(np->emu, Snapshot(np, from), np->state_size) != 0)
+        return -1;
+    for (uint32_t frame = from; frame < np->frame; frame++) {
+        if (frame != from)
+            Emu_SaveState(np->emu, Snapshot(np, frame), np->state_size);
+        SetInputs(np, frame);
+        if (Emu_RunFrameHidden(np->emu) != 0)
+            return -1;
+    }
+    np->stats.rollbacks++;
+    np->stats.frames_resimulated += np->frame - from;
+    np->stats.resim_seconds += GetSeconds() - start;
+    return 0;
+}
+
+
+/* PUBLIC FUNCTIONS */
+
+Netplay* Netplay_Create(Emulator* emu, NetTransport transport, int localPort, int inputDelay)
+{
+    if (!Emu_IsROMLoaded(emu) || inputDelay < 0 || inputDelay >= NETPLAY_INPUT_FRAMES / 2)
+        return NULL;
+    Netplay* np = malloc(sizeof(Netplay));
+    if (np == NULL)
+        return NULL;
+    memset(np, 0, sizeof(Netplay));
+    np->emu = emu;
+    np->transport = transport;
+    np->local_port = localPort & 1;
+    np->input_delay = inputDelay;
+    np->rom_hash = Emu_GetROMHash(emu);
+    np->rollback_frame = -1;
+
+    np->state_size = Emu_SaveStateSize(emu);
+    for (int i = 0; i < SNAPSHOTS; i++) {
+        np->snapshots[i] = malloc(np->state_size);
+        if (np->snapshots[i] == NULL) {
+            Netplay_Free(np);
+            return NULL;
+        }
+    }
+
+    //Nothing is pressed during the input delay at the start. The other player knows this, so it isn't sent.
+    np->local_count = np->remote_count = np->remote_ack = inputDelay;
+    return np;
+}
+
+void Netplay_Free(Netplay* netplay)
+{
+    if (netplay == NULL)
+        return;
+    for (int i = 0; i < SNAPSHOTS; i++)
+        free(netplay->snapshots[i]);
+    free(netplay);
+}
+
+int Netplay_Poll(Netplay* netplay)
+{
+    Netplay* np = netplay;
+    uint8_t packet[NET_MAX_PACKET];
+    int len;
+    while ((len = np->transport.receive(np->transport.context, packet, sizeof(packet))) > 0) {
+        if (ProcessPacket(np, packet, len) != 0)
+            return -1;
+    }
+    if (len < 0)
+        return -1;
+
+    if (np->rollback_frame >= 0 && Rollback(np) != 0)
+        return -1;
+    UpdateChecksums(np);
+    SendInputs(np);
+    return 0;
+}
+
+int Netplay_RunFrame(Netplay* netplay, uint8_t localButtons)
+{
+    Netplay* np = netplay;
+
+    //Local input for this frame, unless it was taken by a call that stalled
+    if (np->local_count == np->frame + np->input_delay && np->local_count - np->remote_ack < NETPLAY_INPUT_FRAMES)
+        np->local_inputs[np->local_count++ & INPUT_MASK] = localButtons;
+    if (Netplay_Poll(np) != 0)
+        return -1;
+
+    //Stall if the oldest frame that may need a rollback would no longer have a snapshot, or the local input is missing
+    if (np->frame >= np->remote_count + NETPLAY_MAX_ROLLBACK || np->local_count <= np->frame) {
+        np->stats.stalls++;
+        return NETPLAY_STALLED;
+    }
+
+    Emu_SaveState(np->emu, Snapshot(np, np->frame), np->state_size);
+    SetInputs(np, np->frame);
+    if (Emu_RunFrame(np->emu) != 0)
+        return -1;
+    np->frame++;
+    np->stats.frames++;
+    return 0;
+}
+
+void Netplay_GetStats(Netplay* netplay, NetplayStats* stats)
+{
+    *stats = netplay->stats;
+}
@@ -1,8 +1,15 @@
 #include "ppu.h"
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 #include <stdio.h>
 
+//AVX2 frame conversion, chosen at run time with GCC and Clang on x86
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PPU_CONVERT_AVX2
+#endif
+
 
 /* PRIVATE FUNCTIONS */
 
@@ -25,6 +32,8 @@ void ShiftPixels(PPU* ppu);
 void ReloadPixels(PPU* ppu);
 //Render a pixel from the pixel shift registers at (x,y) on the pixel buffer.
 void RenderPixel(PPU* ppu, int x, int y);
+//Set the sprite 0 hit flag if RenderPixel() would set it at x, without rendering the pixel
+void CheckSpr0Hit(PPU* ppu, int x);
 
 //Get the 2-bit pattern pixel of a sprite from secondary OAM at a given x position on screen
 int GetSprPatternPixel(PPU* ppu, int sprite, int x);
@@ -33,9 +42,32 @@ void FetchNT(PPU* ppu);
 void FetchAT(PPU* ppu);
 void FetchBGlsb(PPU* ppu);
 void FetchBGmsb(PPU* ppu);
+void FetchSprPattern(PPU* ppu, int sprIndex, bool msbp);
 void FetchSprLsb(PPU* ppu);
 void FetchSprMsb(PPU* ppu);
 
+//Decode a row of 8 pixels from its 2 bit planes, leftmost pixel first
+void DecodeRow(uint8_t* dst, uint8_t pattern0, uint8_t pattern1);
+
+#ifdef PPU_CONVERT_AVX2
+//Look up 8 pixels at a time with a gather. Returns the number of pixels converted, a multiple of 8.
+__attribute__((target("avx2")))
+static int ConvertPixelsAVX2(const uint8_t* src, uint8_t* dst, const uint32_t* colors, int count) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+        index = _mm256_and_si256(index, _mm256_set1_epi32(0x3F));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_i32gather_epi32((const int*)colors, index, 4));
+    }
+    return i;
+}
+#endif
+
+//Run a whole scanline starting at cycle 0 or 1 at once, if it is one that can be. Returns false if it can't.
+bool RunScanline(PPU* ppu);
+//Render cycles 1-340 of a visible scanline with rendering enabled
+void RenderScanline(PPU* ppu);
+
 //Do secondary OAM clear and sprite evaluation all at once and without setting the sprite overflow flag because I'm lazy
 void QuickSpriteEval(PPU* ppu);
 
@@ -95,6 +127,25 @@ void PPU_Init(PPU* ppu, PPUReadFn readfn, PPUWriteFn writefn, void* fndata)
     ppu->fndata = fndata;
 }
 
+void PPU_SetCHRCache(PPU *ppu, PPUDecodedPage *const *pages)
+{
+    ppu->decodedPages = pages;
+}
+
+void PPU_DecodeCHR(PPUDecodedPage *dst, const uint8_t *src, unsigned size)
+{
+    for (unsigned addr = 0; addr < size; addr += 16) {
+        for (int y = 0; y < 8; y++)
+            DecodeRow(dst[addr >> 8].rows[addr >> 4 & 0xF][y], src[addr + y], src[addr + y + 8]);
+    }
+}
+
+void PPU_DecodeCHRRow(PPUDecodedPage *dst, const uint8_t *src, unsigned addr)
+{
+    unsigned lsb = addr & ~0x8u;
+    DecodeRow(dst[addr >> 8].rows[addr >> 4 & 0xF][addr & 0x7], src[lsb], src[lsb + 8]);
+}
+
 void PPU_PowerOn(PPU* ppu) {
     PPUState* state = &ppu->state;
 
@@ -211,7 +262,10 @@ void PPU_Cycle(PPU *ppu)
 
     //Render pixel
     if (state->scanline < NES_SCREEN_H && 1 <= state->cycle && state->cycle <= NES_SCREEN_W) {
-        RenderPixel(ppu, state->cycle - 1, state->scanline);
+        if (!ppu->skipRender)
+            RenderPixel(ppu, state->cycle - 1, state->scanline);
+        else if (state->scanlineHasSpr0 && !(state->ppustatus & PPUSTATUS_SPR0HIT))
+            CheckSpr0Hit(ppu, state->cycle - 1);
     }
 
     //Do frame rendering operations (render fetches, sprite evalution, flag updates) according
@@ -252,6 +306,37 @@ void PPU_Cycle(PPU *ppu)
     }
 }
 
+void PPU_Run(PPU *ppu, int dots)
+{
+    PPUState* state = &ppu->state;
+    while (dots > 0) {
+        int lineDots = 341 - state->cycle;
+        if (state->cycle <= 1 && dots >= lineDots && RunScanline(ppu)) {
+            dots -= lineDots;
+        } else {
+            PPU_Cycle(ppu);
+            dots--;
+        }
+    }
+}
+
+int PPU_DotsUntil(PPU *ppu, int scanline, int cycle)
+{
+    PPUState* state = &ppu->state;
+    const int frameDots = 262 * 341;
+
+    int from = state->scanline * 341 + state->cycle;
+    int to = scanline * 341 + cycle;
+    int dots = to - from + 1;
+    if (to < from) {
+        //Wraps around to the next frame, which may skip (0,0)
+        dots += frameDots;
+        if (state->ppumask & PPUMASK_RENDER)
+            dots--;
+    }
+    return dots;
+}
+
 bool PPU_NMISignal(PPU *ppu)
 {
     PPUState* state = &ppu->state;
@@ -260,6 +345,51 @@ bool PPU_NMISignal(PPU *ppu)
         (state->ppuctrl & PPUCTRL_NMI) == PPUCTRL_NMI;
 }
 
+void PPU_ConvertFrame(const PPU *ppu, void *dst, int pitch, PixelFormat format)
+{
+    PPU_ConvertIndexed(&ppu->pixelBuffer[0][0], NES_SCREEN_W, dst, pitch, format);
+}
+
+void PPU_ConvertIndexed(const uint8_t *src, int srcPitch, void *dst, int pitch, PixelFormat format)
+{
+    //Colors in the output format. 32-bit colors have their bytes in memory order, so a pixel is one load and store.
+    uint32_t colors[64];
+    uint16_t colors16[64];
+    for (int i = 0; i < 64; i++) {
+        RGBAPixel c = PPUCOLORS[i];
+        if (format == PIXEL_FORMAT_BGRA8888)
+            c = (RGBAPixel){ c.b, c.g, c.r, c.a };
+        memcpy(&colors[i], &c, sizeof(c));
+        colors16[i] = (uint16_t)((c.r >> 3) << 11 | (c.g >> 2) << 5 | c.b >> 3);
+    }
+#ifdef PPU_CONVERT_AVX2
+    bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    for (int y = 0; y < NES_SCREEN_H; y++) {
+        const uint8_t* indexes = src + (ptrdiff_t)y * srcPitch;
+        uint8_t* line = (uint8_t*)dst + (ptrdiff_t)y * pitch;
+        int x = 0;
+        switch (format) {
+            case PIXEL_FORMAT_INDEXED8:
+                memcpy(line, indexes, NES_SCREEN_W);
+                break;
+            case PIXEL_FORMAT_RGB565:
+                for (; x < NES_SCREEN_W; x++)
+                    memcpy(line + x * 2, &colors16[indexes[x] & 0x3F], 2);
+                break;
+            default:
+#ifdef PPU_CONVERT_AVX2
+                if (avx2)
+                    x = ConvertPixelsAVX2(indexes, line, colors, NES_SCREEN_W);
+#endif
+                for (; x < NES_SCREEN_W; x++)
+                    memcpy(line + x * 4, &colors[indexes[x] & 0x3F], 4);
+                break;
+        }
+    }
+}
+
 void VRAMFetch(PPU *ppu)
 {
     PPUState* state = &ppu->state;
@@ -361,7 +491,20 @@ void RenderPixel(PPU *ppu, int x, int y)
         }
     }
 
-    ppu->pixelBuffer[y][x] = PPUCOLORS[state->paletteRam[pixel]];
+    ppu->pixelBuffer[y][x] = state->paletteRam[pixel] & 0x3F;
+}
+
+void CheckSpr0Hit(PPU *ppu, int x)
+{
+    PPUState* state = &ppu->state;
+    //Sprite 0 is first in secondary OAM, so it's the first opaque sprite wherever it is opaque
+    if ((state->ppumask & PPUMASK_RENDER) != PPUMASK_RENDER || state->secondaryOamCount == 0)
+        return;
+    int bgPixel =
+        state->bgShift0 >> (15 - state->x) & 0x1 |
+        state->bgShift1 >> (15 - state->x) << 1 & 0x2;
+    if (bgPixel != 0 && GetSprPatternPixel(ppu, 0, x) != 0)
+        state->ppustatus |= PPUSTATUS_SPR0HIT;
 }
 
 void ShiftPixels(PPU *ppu)
@@ -445,11 +588,9 @@ void FetchBGmsb(PPU *ppu)
     ppu->state.bgPattern1 = Read(ppu, addr);
 }
 
-void FetchSprPattern(PPU *ppu, bool msbp) {
+void FetchSprPattern(PPU *ppu, int sprIndex, bool msbp) {
     PPUState* state = &ppu->state;
 
-    int sprIndex = (state->cycle - 257) / 8;
-    
     if (sprIndex < state->secondaryOamCount) {
         OAMSprite* sprite = &state->secondaryOam[sprIndex];
         
@@ -487,12 +628,18 @@ void FetchSprPattern(PPU *ppu, bool msbp) {
 
 void FetchSprLsb(PPU *ppu)
 {
-    FetchSprPattern(ppu, 0);
+    FetchSprPattern(ppu, (ppu->state.cycle - 257) / 8, 0);
 }
 
 void FetchSprMsb(PPU *ppu)
 {
-    FetchSprPattern(ppu, 1);
+    FetchSprPattern(ppu, (ppu->state.cycle - 257) / 8, 1);
+}
+
+void DecodeRow(uint8_t *dst, uint8_t pattern0, uint8_t pattern1)
+{
+    for (int x = 0; x < 8; x++)
+        dst[x] = (pattern0 >> (7 - x) & 1) | (pattern1 >> (7 - x) & 1) << 1;
 }
 
 void QuickSpriteEval(PPU *ppu)
@@ -519,3 +666,141 @@ void QuickSpriteEval(PPU *ppu)
         }
     }
 }
+
+bool RunScanline(PPU *ppu)
+{
+    PPUState* state = &ppu->state;
+    if (state->scanline == 261)
+        return false; //Pre-render scanline: Flag clears and vertical scroll copies, left to PPU_Cycle()
+
+    if (state->scanline < NES_SCREEN_H) {
+        if (state->ppumask & PPUMASK_RENDER)
+            RenderScanline(ppu);
+        else if (!ppu->skipRender) {
+            //Rendering disabled: Every pixel is the backdrop color
+            memset(ppu->pixelBuffer[state->scanline], state->paletteRam[0] & 0x3F, NES_SCREEN_W);
+        }
+    } else if (state->scanline == 241) {
+        state->ppustatus |= PPUSTATUS_VBLANK;
+    }
+
+    state->cycle = 0;
+    if (++state->scanline == 240)
+        state->frames++;
+    return true;
+}
+
+void RenderScanline(PPU *ppu)
+{
+    PPUState* state = &ppu->state;
+    int y = state->scanline;
+
+    //Background tiles in the order they pass through the shift registers: The 2 already loaded, then the 32 fetched on
+    //cycles 1-256. Tile t is reloaded on cycle 8 * (t - 1), and its attribute latch is shifted in on the 8 cycles after.
+    //Patterns are copied from the decoded pattern table when it is mapped, so their bit planes aren't read and combined.
+    uint8_t patterns[34][8], latch0[34], latch1[34];
+    DecodeRow(patterns[0], state->bgShift0 >> 8, state->bgShift1 >> 8);
+    DecodeRow(patterns[1], state->bgShift0 & 0xFF, state->bgShift1 & 0xFF);
+    latch0[1] = state->attrLatch0;
+    latch1[1] = state->attrLatch1;
+    uint16_t bgTable = (state->ppuctrl & PPUCTRL_BGTABLE) ? 0x1000 : 0;
+    for (int t = 2; t < 34; t++) {
+        FetchNT(ppu);
+        FetchAT(ppu);
+        uint16_t addr = state->v >> 12 | (uint16_t)state->ntByte << 4 | bgTable;
+        const PPUDecodedPage* page = (ppu->decodedPages != NULL) ? ppu->decodedPages[addr >> 8] : NULL;
+        if (page != NULL) {
+            memcpy(patterns[t], page->rows[addr >> 4 & 0xF][addr & 0x7], 8);
+        } else {
+            FetchBGlsb(ppu);
+            FetchBGmsb(ppu);
+            DecodeRow(patterns[t], state->bgPattern0, state->bgPattern1);
+        }
+        ReloadPixels(ppu);
+        latch0[t] = state->attrLatch0;
+        latch1[t] = state->attrLatch1;
+        IncHoriV(ppu);
+    }
+    IncVertV(ppu);
+
+    //Background pixels (4-bit palette index, 0 if transparent). Pixel x is pixel x + fine x of the pattern stream, and
+    //its attribute is the one shifted in 7 - fine x cycles before, from the attribute shift registers or a latch.
+    uint8_t bg[NES_SCREEN_W];
+    if (state->ppumask & PPUMASK_BG) {
+        const uint8_t* stream = &patterns[0][state->x];
+        for (int x = 0; x < NES_SCREEN_W; x++) {
+            int pixel = stream[x];
+            if (pixel != 0) {
+                int shift = x - 7 + state->x; //Cycle the attribute bit was shifted in, 0 or less if before this scanline
+                int a0, a1;
+                if (shift <= 0) {
+                    a0 = state->attrShift0 >> -shift & 1;
+                    a1 = state->attrShift1 >> -shift & 1;
+                } else {
+                    int t = (shift - 1) / 8 + 1;
+                    a0 = latch0[t];
+                    a1 = latch1[t];
+                }
+                pixel |= a0 << 2 | a1 << 3;
+            }
+            bg[x] = (uint8_t)pixel;
+        }
+    } else {
+        memset(bg, 0, sizeof(bg));
+    }
+
+    //Sprite pixels: The first opaque sprite at each x wins, so draw them from last to first
+    uint8_t spr[NES_SCREEN_W]; //Sprite palette index (0x10-0x1F), 0 if transparent
+    uint8_t sprFlags[NES_SCREEN_W]; //Bit 0: Behind background, bit 1: Sprite 0
+    bool hasSprites = (state->ppumask & PPUMASK_SPR) && state->secondaryOamCount > 0;
+    if (hasSprites) {
+        memset(spr, 0, sizeof(spr));
+        for (int sprite = state->secondaryOamCount - 1; sprite >= 0; sprite--) {
+            OAMSprite* oamSprite = &state->secondaryOam[sprite];
+            uint8_t row[8];
+            DecodeRow(row, state->sprPattern0[sprite], state->sprPattern1[sprite]);
+            int flip = (oamSprite->attributes & OAMATTR_FLIP_H) ? 7 : 0;
+            for (int x = oamSprite->x; x < oamSprite->x + 8 && x < NES_SCREEN_W; x++) {
+                int pixel = row[(x - oamSprite->x) ^ flip];
+                if (pixel != 0) {
+                    spr[x] = 0x10 | (oamSprite->attributes & OAMATTR_PALETTE) << 2 | pixel;
+                    sprFlags[x] = ((oamSprite->attributes & OAMATTR_PRIORITY) ? 1 : 0) | (sprite == 0 ? 2 : 0);
+                }
+            }
+        }
+    }
+
+    //Compose the picture, or only check for sprite 0 hit when not rendering
+    if (hasSprites && state->scanlineHasSpr0) {
+        for (int x = 0; x < NES_SCREEN_W; x++) {
+            if (spr[x] != 0 && (sprFlags[x] & 2) && bg[x] != 0) {
+                state->ppustatus |= PPUSTATUS_SPR0HIT;
+                break;
+            }
+        }
+    }
+    if (!ppu->skipRender) {
+        uint8_t* line = ppu->pixelBuffer[y];
+        for (int x = 0; x < NES_SCREEN_W; x++) {
+            int pixel = bg[x];
+            if (hasSprites && spr[x] != 0 && (pixel == 0 || !(sprFlags[x] & 1)))
+                pixel = spr[x];
+            line[x] = state->paletteRam[pixel] & 0x3F;
+        }
+    }
+
+    //The shift registers aren't updated: Cycles 321-336 shift all of their bits out before they are used again
+    QuickSpriteEval(ppu);
+
+    //Cycles 257-320: Sprite pattern fetches for the next scanline. The garbage nametable fetches in between are left
+    //out, as their result is overwritten by the fetch on cycle 322.
+    HoriVCopyT(ppu);
+    for (int sprite = 0; sprite < 8; sprite++) {
+        FetchSprPattern(ppu, sprite, 0);
+        FetchSprPattern(ppu, sprite, 1);
+    }
+
+    //Cycles 321-340: First 2 tiles of the next scanline
+    for (state->cycle = 321; state->cycle <= 340; state->cycle++)
+        VRAMFetch(ppu);
+}
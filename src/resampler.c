@@ -0,0 +1,58 @@
+#include "resampler.h"
+
+void Resampler_Init(Resampler *resampler, double inRate, double outRate, size_t targetFill)
+{
+    resampler->step = inRate / outRate;
+    resampler->target_fill = targetFill;
+    resampler->adjust = 0;
+    resampler->integral = 0;
+    resampler->position = 1; //Start at the first input sample
+    resampler->last = 0;
+}
+
+size_t Resampler_Process(Resampler *resampler, const int16_t *in, size_t inCount, int16_t *out, size_t outCapacity, size_t fill)
+{
+    if (inCount == 0)
+        return 0;
+
+    //Proportional control: Full adjustment when the buffer is empty or twice the target
+    double error = resampler->target_fill > 0 ? ((double)resampler->target_fill - fill) / resampler->target_fill : 0;
+    if (error > 1)
+        error = 1;
+    else if (error < -1)
+        error = -1;
+    //Integral control removes the offset the proportional part leaves when the clocks differ. Its gain is per output
+    //sample and scaled to the target, which damps the loop critically whatever the rates and target.
+    if (resampler->target_fill > 0)
+        resampler->integral += error * (inCount / resampler->step) * RESAMPLER_MAX_ADJUST / (4.0 * resampler->target_fill);
+    if (resampler->integral > 1)
+        resampler->integral = 1;
+    else if (resampler->integral < -1)
+        resampler->integral = -1;
+    double control = error + resampler->integral;
+    if (control > 1)
+        control = 1;
+    else if (control < -1)
+        control = -1;
+    resampler->adjust = RESAMPLER_MAX_ADJUST * control;
+    double step = resampler->step / (1 + resampler->adjust);
+
+    //Position 0 is the last sample of the previous block, position i is in[i - 1]
+    double pos = resampler->position;
+    size_t count = 0;
+    while (pos < inCount && count < outCapacity) {
+        size_t i = (size_t)pos;
+        double frac = pos - i;
+        double a = i == 0 ? resampler->last : in[i - 1];
+        double b = in[i];
+        out[count++] = (int16_t)(a + (b - a) * frac);
+        pos += step;
+    }
+
+    //Samples that didn't fit are dropped
+    if (pos < inCount)
+        pos = inCount;
+    resampler->position = pos - inCount;
+    resampler->last = in[inCount - 1];
+    return count;
+}
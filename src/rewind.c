@@ -0,0 +1,290 @@
+#include "rewind.h"
+#include <stdlib.h>
+#include <string.h>
+
+//Unchanged bytes needed to end a run of changed bytes. Shorter gaps are cheaper to store as changed bytes.
+#define MIN_SKIP 4
+
+
+/* PRIVATE FUNCTIONS */
+
+static uint8_t* WriteVarint(uint8_t* dst, size_t value) {
+    while (value >= 0x80) {
+        *dst++ = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    *dst++ = (uint8_t)value;
+    return dst;
+}
+
+static const uint8_t* ReadVarint(const uint8_t* src, size_t* value) {
+    size_t v = 0;
+    int shift = 0;
+    do {
+        v |= (size_t)(*src & 0x7F) << shift;
+        shift += 7;
+    } while (*src++ & 0x80);
+    *value = v;
+    return src;
+}
+
+//Length of the run of equal bytes at the start of a and b, compared 8 bytes at a time
+static size_t EqualRun(const uint8_t* a, const uint8_t* b, size_t len) {
+    size_t i = 0;
+    while (i + 8 <= len) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        if (wa != wb)
+            break;
+        i += 8;
+    }
+    while (i < len && a[i] == b[i])
+        i++;
+    return i;
+}
+
+static size_t ZeroRun(const uint8_t* a, size_t len) {
+    size_t i = 0;
+    while (i < len && a[i] == 0)
+        i++;
+    return i;
+}
+
+/*
+* Encode state XOR base into dst, or state against all zeroes if base is NULL.
+* dst must hold at least 2 * size + 64 bytes.
+*
+* @return Encoded size
+*/
+static size_t EncodeDelta(uint8_t* dst, const uint8_t* state, const uint8_t* base, size_t size) {
+    uint8_t* out = dst;
+    size_t i = 0;
+    while (i < size) {
+        size_t skip = base ? EqualRun(state + i, base + i, size - i) : ZeroRun(state + i, size - i);
+        if (i + skip == size)
+            break;
+        //Extend the changed run until MIN_SKIP unchanged bytes follow
+        size_t start = i + skip, end = start;
+        while (end < size) {
+            size_t same = base ? EqualRun(state + end, base + end, size - end) : ZeroRun(state + end, size - end);
+            if (same >= MIN_SKIP || end + same == size)
+                break;
+            end += same + 1;
+        }
+        out = WriteVarint(out, skip);
+        out = WriteVarint(out, end - start);
+        for (size_t j = start; j < end; j++)
+            *out++ = base ? state[j] ^ base[j] : state[j];
+        i = end;
+    }
+    return out - dst;
+}
+
+//XOR an encoded entry into state
+static void ApplyDelta(uint8_t* state, const uint8_t* src, size_t len) {
+    const uint8_t* end = src + len;
+    while (src < end) {
+        size_t skip, count;
+        src = ReadVarint(src, &skip);
+        src = ReadVarint(src, &count);
+        state += skip;
+        for (size_t j = 0; j < count; j++)
+            state[j] ^= src[j];
+        state += count;
+        src += count;
+    }
+}
+
+static RewindEntry* GetEntry(Rewind* rewind, size_t index) {
+    return &rewind->entries[(rewind->first + index) % rewind->capacity];
+}
+
+static size_t BytesUsed(Rewind* rewind) {
+    return rewind->entry_bytes + rewind->capacity * sizeof(RewindEntry) + rewind->state_size * 4 + 64;
+}
+
+//Drop the newest entry
+static void DropNewest(Rewind* rewind) {
+    RewindEntry* entry = GetEntry(rewind, rewind->count - 1);
+    rewind->entry_bytes -= entry->size;
+    rewind->keyframes -= entry->keyframe;
+    free(entry->data);
+    rewind->count--;
+}
+
+//Drop the oldest keyframe and its deltas
+static void DropOldestKeyframe(Rewind* rewind) {
+    do {
+        RewindEntry* entry = GetEntry(rewind, 0);
+        rewind->entry_bytes -= entry->size;
+        rewind->keyframes -= entry->keyframe;
+        free(entry->data);
+        rewind->first = (rewind->first + 1) % rewind->capacity;
+        rewind->count--;
+    } while (rewind->count > 0 && !GetEntry(rewind, 0)->keyframe);
+}
+
+//Keep at least the newest keyframe and its deltas, so there is always a state to go back to
+static void Trim(Rewind* rewind) {
+    while (rewind->keyframes > 1 &&
+        (BytesUsed(rewind) > rewind->budget || (rewind->max_frames != 0 && rewind->count > rewind->max_frames)))
+        DropOldestKeyframe(rewind);
+}
+
+static int Grow(Rewind* rewind) {
+    size_t capacity = rewind->capacity ? rewind->capacity * 2 : 256;
+    RewindEntry* entries = malloc(capacity * sizeof(RewindEntry));
+    if (entries == NULL)
+        return -1;
+    for (size_t i = 0; i < rewind->count; i++)
+        entries[i] = *GetEntry(rewind, i);
+    free(rewind->entries);
+    rewind->entries = entries;
+    rewind->capacity = capacity;
+    rewind->first = 0;
+    return 0;
+}
+
+//Set up the state buffers for a ROM's state size
+static int Resize(Rewind* rewind, size_t stateSize) {
+    Rewind_Clear(rewind);
+    free(rewind->state);
+    free(rewind->next);
+    free(rewind->encoded);
+    rewind->state = malloc(stateSize);
+    rewind->next = malloc(stateSize);
+    rewind->encoded = malloc(stateSize * 2 + 64);
+    if (rewind->state == NULL || rewind->next == NULL || rewind->encoded == NULL) {
+        free(rewind->state);
+        free(rewind->next);
+        free(rewind->encoded);
+        rewind->state = rewind->next = rewind->encoded = NULL;
+        rewind->state_size = 0;
+        return -1;
+    }
+    rewind->state_size = stateSize;
+    return 0;
+}
+
+
+/* PUBLIC FUNCTIONS */
+
+Rewind* Rewind_Create(size_t budget, unsigned long maxFrames, unsigned keyframeInterval)
+{
+    Rewind* rewind = malloc(sizeof(Rewind));
+    if (rewind == NULL)
+        return NULL;
+    memset(rewind, 0, sizeof(Rewind));
+    rewind->budget = budget ? budget : REWIND_DEFAULT_BUDGET;
+    rewind->max_frames = maxFrames;
+    rewind->keyframe_interval = keyframeInterval ? keyframeInterval : REWIND_DEFAULT_KEYFRAME_INTERVAL;
+    return rewind;
+}
+
+void Rewind_Free(Rewind *rewind)
+{
+    if (rewind == NULL)
+        return;
+    Rewind_Clear(rewind);
+    free(rewind->entries);
+    free(rewind->state);
+    free(rewind->next);
+    free(rewind->encoded);
+    free(rewind);
+}
+
+void Rewind_Clear(Rewind *rewind)
+{
+    while (rewind->count > 0)
+        DropNewest(rewind);
+    rewind->first = 0;
+    rewind->since_keyframe = 0;
+}
+
+void Rewind_SetBudget(Rewind *rewind, size_t budget, unsigned long maxFrames)
+{
+    rewind->budget = budget ? budget : REWIND_DEFAULT_BUDGET;
+    rewind->max_frames = maxFrames;
+    Trim(rewind);
+}
+
+int Rewind_Push(Rewind *rewind, Emulator *emu)
+{
+    size_t stateSize = Emu_SaveStateSize(emu);
+    if (stateSize != rewind->state_size && Resize(rewind, stateSize) != 0)
+        return -1;
+    if (Emu_SaveState(emu, rewind->next, stateSize) != stateSize)
+        return -1;
+    if (rewind->count == rewind->capacity && Grow(rewind) != 0)
+        return -1;
+
+    bool keyframe = (rewind->count == 0 || rewind->since_keyframe + 1 >= rewind->keyframe_interval);
+    size_t size = EncodeDelta(rewind->encoded, rewind->next, keyframe ? NULL : rewind->state, stateSize);
+    uint8_t* data = malloc(size ? size : 1);
+    if (data == NULL)
+        return -1;
+    memcpy(data, rewind->encoded, size);
+
+    RewindEntry* entry = GetEntry(rewind, rewind->count++);
+    entry->data = data;
+    entry->size = size;
+    entry->keyframe = keyframe;
+    rewind->entry_bytes += size;
+    rewind->keyframes += keyframe;
+    rewind->since_keyframe = keyframe ? 0 : rewind->since_keyframe + 1;
+
+    uint8_t* swap = rewind->state;
+    rewind->state = rewind->next;
+    rewind->next = swap;
+
+    Trim(rewind);
+    return 0;
+}
+
+int Rewind_StepBack(Rewind *rewind, Emulator *emu)
+{
+    if (rewind->count < 2 || Emu_SaveStateSize(emu) != rewind->state_size)
+        return -1;
+
+    //Decode the previous state into the spare buffer, so nothing changes if it can't be loaded
+    RewindEntry* newest = GetEntry(rewind, rewind->count - 1);
+    bool keyframe = newest->keyframe;
+    size_t key = rewind->count - 1;
+    if (!keyframe) {
+        //Undo the delta: XOR deltas work both ways
+        memcpy(rewind->next, rewind->state, rewind->state_size);
+        ApplyDelta(rewind->next, newest->data, newest->size);
+    } else {
+        //Decode the previous keyframe and its deltas
+        do
+            key--;
+        while (!GetEntry(rewind, key)->keyframe);
+        memset(rewind->next, 0, rewind->state_size);
+        for (size_t i = key; i < rewind->count - 1; i++) {
+            RewindEntry* entry = GetEntry(rewind, i);
+            ApplyDelta(rewind->next, entry->data, entry->size);
+        }
+    }
+    if (Emu_LoadState(emu, rewind->next, rewind->state_size) != 0)
+        return -1;
+
+    DropNewest(rewind);
+    if (keyframe)
+        rewind->since_keyframe = (unsigned)(rewind->count - 1 - key);
+    else
+        rewind->since_keyframe--;
+    uint8_t* swap = rewind->state;
+    rewind->state = rewind->next;
+    rewind->next = swap;
+    return 0;
+}
+
+void Rewind_GetStats(Rewind *rewind, RewindStats *stats)
+{
+    stats->frames = rewind->count;
+    stats->keyframes = rewind->keyframes;
+    stats->bytes_used = BytesUsed(rewind);
+    stats->budget = rewind->budget;
+    stats->state_size = rewind->state_size;
+}
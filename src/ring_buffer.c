@@ -1,42 +1,77 @@
 #include "ring_buffer.h"
 #include <stdlib.h>
+#include <string.h>
 
 void RingBuffer_Init(RingBuffer *buffer, size_t size)
 {
-    buffer->buffer = malloc(size);
-    buffer->size = size;
-    buffer->head = buffer->tail = 0;
-    buffer->space = size;
+    size_t pow2 = 1;
+    while (pow2 < size)
+        pow2 <<= 1;
+    buffer->buffer = malloc(pow2);
+    buffer->size = pow2;
+    buffer->mask = pow2 - 1;
+    atomic_init(&buffer->head, 0);
+    atomic_init(&buffer->tail, 0);
 }
 
 void RingBuffer_Destroy(RingBuffer *buffer)
 {
     if (buffer->buffer != NULL)
         free(buffer->buffer);
+    buffer->buffer = NULL;
 }
 
 void RingBuffer_Queue(RingBuffer* buffer, const void* src, size_t* len)
 {
-    if (*len > buffer->space) {
-        *len = buffer->space;
-    }
-    char* dst = buffer->buffer;
-    for (size_t i = 0; i < *len; i++) {
-        dst[buffer->head] = ((char*)src)[i];
-        buffer->head = (buffer->head + 1) % buffer->size;
-    }
-    buffer->space -= *len;
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    //Acquire: The consumer is done reading the bytes it consumed before we overwrite them
+    size_t tail = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+    size_t space = buffer->size - (head - tail);
+    if (*len > space)
+        *len = space;
+
+    size_t start = head & buffer->mask;
+    size_t first = buffer->size - start;
+    if (first > *len)
+        first = *len;
+    memcpy(buffer->buffer + start, src, first);
+    memcpy(buffer->buffer, (const uint8_t*)src + first, *len - first);
+
+    //Release: The bytes are written before the consumer sees them queued
+    atomic_store_explicit(&buffer->head, head + *len, memory_order_release);
 }
 
 void RingBuffer_Consume(RingBuffer *buffer, void *dst, size_t *len)
 {
-    if (*len > (buffer->size - buffer->space)) {
-        *len = buffer->size - buffer->space;
-    }
-    char* src = buffer->buffer;
-    for (size_t i = 0; i < *len; i++) {
-        ((char*)dst)[i] = src[buffer->tail];
-        buffer->tail = (buffer->tail + 1) % buffer->size;
-    }
-    buffer->space += *len;
+    size_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    //Acquire: See the bytes the producer wrote before it moved head
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    size_t fill = head - tail;
+    if (*len > fill)
+        *len = fill;
+
+    size_t start = tail & buffer->mask;
+    size_t first = buffer->size - start;
+    if (first > *len)
+        first = *len;
+    memcpy(dst, buffer->buffer + start, first);
+    memcpy((uint8_t*)dst + first, buffer->buffer, *len - first);
+
+    //Release: The bytes are read before the producer may overwrite them
+    atomic_store_explicit(&buffer->tail, tail + *len, memory_order_release);
+}
+
+size_t RingBuffer_GetFill(RingBuffer* buffer)
+{
+    //Load tail first: It never passes head, so the fill can't come out negative. If both threads moved their index in
+    //between, it can come out above the size.
+    size_t tail = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    size_t fill = head - tail;
+    return fill < buffer->size ? fill : buffer->size;
+}
+
+size_t RingBuffer_GetSize(const RingBuffer* buffer)
+{
+    return buffer->size;
 }
@@ -0,0 +1,64 @@
+#include "scheduler.h"
+#include <string.h>
+#include <assert.h>
+
+/* PRIVATE FUNCTIONS */
+
+static void UpdateNext(Scheduler* sched) {
+    sched->next = (sched->count > 0) ? sched->entries[0].cycle : SCHED_NEVER;
+}
+
+//Remove the entry at index i, keeping the array sorted
+static void RemoveEntry(Scheduler* sched, int i) {
+    sched->count--;
+    memmove(&sched->entries[i], &sched->entries[i + 1], (sched->count - i) * sizeof(SchedulerEntry));
+}
+
+
+/* FUNCTION DEFINITIONS */
+
+void Scheduler_Reset(Scheduler *sched)
+{
+    sched->cycle = 0;
+    sched->count = 0;
+    UpdateNext(sched);
+}
+
+void Scheduler_Post(Scheduler *sched, SchedulerEvent event, unsigned long long cycle)
+{
+    assert(event < SCHED_NUM_EVENTS);
+
+    Scheduler_Cancel(sched, event);
+
+    //Insertion sort; events with the same cycle keep the order they were posted in
+    int i = sched->count;
+    while (i > 0 && sched->entries[i - 1].cycle > cycle) {
+        sched->entries[i] = sched->entries[i - 1];
+        i--;
+    }
+    sched->entries[i] = (SchedulerEntry){ .cycle = cycle, .event = event };
+    sched->count++;
+    UpdateNext(sched);
+}
+
+void Scheduler_Cancel(Scheduler *sched, SchedulerEvent event)
+{
+    for (int i = 0; i < sched->count; i++) {
+        if (sched->entries[i].event == event) {
+            RemoveEntry(sched, i);
+            UpdateNext(sched);
+            return;
+        }
+    }
+}
+
+int Scheduler_PopDue(Scheduler *sched)
+{
+    if (sched->count == 0 || sched->entries[0].cycle > sched->cycle)
+        return -1;
+
+    SchedulerEvent event = sched->entries[0].event;
+    RemoveEntry(sched, 0);
+    UpdateNext(sched);
+    return event;
+}
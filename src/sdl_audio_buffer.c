@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-int SDLAudioBuffer_Create(SDLAudioBuffer **buffer, SDL_AudioSpec audioSpec, unsigned ringBufferScale)
+#define RESAMPLE_BLOCK 256 //Input samples resampled at a time
+
+int SDLAudioBuffer_Create(SDLAudioBuffer **buffer, SDL_AudioSpec audioSpec, unsigned ringBufferScale, unsigned targetLatencyMs)
 {
     SDLAudioBuffer* buf = malloc(sizeof(SDLAudioBuffer));
     *buffer = buf;
@@ -13,10 +15,21 @@ int SDLAudioBuffer_Create(SDLAudioBuffer **buffer, SDL_AudioSpec audioSpec, unsi
     if (SDL_OpenAudio(&buf->audiospec, NULL) != 0) {
         return -1;
     }
-    SDL_PauseAudio(0);
 
     RingBuffer_Init(&buf->buffer, buf->audiospec.size * ringBufferScale);
 
+    unsigned frameBytes = SDL_AUDIO_BITSIZE(buf->audiospec.format) / 8 * buf->audiospec.channels;
+    size_t target = (size_t)buf->audiospec.freq * targetLatencyMs / 1000 * frameBytes;
+    if (target > RingBuffer_GetSize(&buf->buffer) / 2)
+        target = RingBuffer_GetSize(&buf->buffer) / 2;
+    buf->target_bytes = target;
+    buf->resample = buf->audiospec.format == AUDIO_S16SYS && buf->audiospec.channels == 1;
+    Resampler_Init(&buf->resampler, buf->audiospec.freq, buf->audiospec.freq, target / sizeof(int16_t));
+
+    buf->waiting = true;
+    SDL_AtomicSet(&buf->underruns, 0);
+    SDL_PauseAudio(0);
+
     return 0;
 }
 
@@ -29,14 +42,46 @@ void SDLAudioBuffer_Free(SDLAudioBuffer *buffer)
 
 void SDLAudioBuffer_QueueAudio(SDLAudioBuffer *buffer, Uint8 *src, size_t* len)
 {
-    SDL_LockAudio();
-    RingBuffer_Queue(&buffer->buffer, src, len);
-    SDL_UnlockAudio();
+    //No lock needed: The ring is lock-free with this thread as the only producer and the audio callback as the consumer
+    if (!buffer->resample) {
+        RingBuffer_Queue(&buffer->buffer, src, len);
+        return;
+    }
+
+    const int16_t* in = (const int16_t*)src;
+    size_t inCount = *len / sizeof(int16_t);
+    int16_t out[RESAMPLE_BLOCK * 2];
+    for (size_t i = 0; i < inCount; i += RESAMPLE_BLOCK) {
+        size_t n = inCount - i < RESAMPLE_BLOCK ? inCount - i : RESAMPLE_BLOCK;
+        size_t fill = RingBuffer_GetFill(&buffer->buffer) / sizeof(int16_t);
+        size_t outLen = Resampler_Process(&buffer->resampler, in + i, n, out, RESAMPLE_BLOCK * 2, fill) * sizeof(int16_t);
+        RingBuffer_Queue(&buffer->buffer, out, &outLen);
+    }
+}
+
+void SDLAudioBuffer_GetStats(SDLAudioBuffer *buffer, SDLAudioBufferStats *stats)
+{
+    unsigned frameBytes = SDL_AUDIO_BITSIZE(buffer->audiospec.format) / 8 * buffer->audiospec.channels;
+    stats->fill = RingBuffer_GetFill(&buffer->buffer) / frameBytes;
+    stats->capacity = RingBuffer_GetSize(&buffer->buffer) / frameBytes;
+    stats->underruns = (unsigned long)SDL_AtomicGet(&buffer->underruns);
+    stats->latency_ms = (stats->fill + buffer->audiospec.samples) * 1000.0 / buffer->audiospec.freq;
 }
 
 void _SDLAudioBufferCallback(void *userdata, Uint8 *stream, int len)
 {
-    size_t l = len;
-    RingBuffer_Consume(&((SDLAudioBuffer*)userdata)->buffer, stream, &l);
+    SDLAudioBuffer* buffer = userdata;
+    size_t l = 0;
+    //After running dry, wait until the target latency is buffered again, rather than playing each frame's audio as it comes
+    if (buffer->waiting && RingBuffer_GetFill(&buffer->buffer) >= buffer->target_bytes)
+        buffer->waiting = false;
+    if (!buffer->waiting) {
+        l = len;
+        RingBuffer_Consume(&buffer->buffer, stream, &l);
+        if (l < (size_t)len) {
+            SDL_AtomicAdd(&buffer->underruns, 1);
+            buffer->waiting = true;
+        }
+    }
     SDL_memset(stream + l, 0, len - l);
 }
@@ -0,0 +1,76 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+CPUTrace *Trace_Create(const char *path, size_t capacity)
+{
+    if (capacity == 0)
+        capacity = TRACE_DEFAULT_CAPACITY;
+
+    CPUTrace* trace = malloc(sizeof(CPUTrace));
+    if (trace == NULL)
+        return NULL;
+    memset(trace, 0, sizeof(CPUTrace));
+    trace->ring = malloc(capacity * sizeof(TraceRecord));
+    trace->file = fopen(path, "wb");
+    if (trace->ring == NULL || trace->file == NULL) {
+        if (trace->file != NULL)
+            fclose(trace->file);
+        free(trace->ring);
+        free(trace);
+        return NULL;
+    }
+    trace->capacity = capacity;
+
+    TraceFileHeader header = { .version = TRACE_VERSION, .record_size = sizeof(TraceRecord) };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, trace->file);
+
+    Trace_SetPCRange(trace, 0x0000, 0xFFFF);
+    Trace_SetFrameWindow(trace, 0, ~0ULL);
+    return trace;
+}
+
+void Trace_Close(CPUTrace *trace)
+{
+    if (trace == NULL)
+        return;
+    Trace_Flush(trace);
+    fclose(trace->file);
+    free(trace->ring);
+    free(trace);
+}
+
+void Trace_Flush(CPUTrace *trace)
+{
+    if (trace->count > 0 && fwrite(trace->ring, sizeof(TraceRecord), trace->count, trace->file) != trace->count)
+        perror("Error writing CPU trace");
+    trace->records += trace->count;
+    trace->count = 0;
+}
+
+void Trace_SetPCRange(CPUTrace *trace, uint16_t pcMin, uint16_t pcMax)
+{
+    trace->pc_min = pcMin;
+    trace->pc_max = pcMax;
+}
+
+void Trace_SetFrameWindow(CPUTrace *trace, unsigned long long first, unsigned long long last)
+{
+    trace->frame_first = first;
+    trace->frame_last = last;
+    Trace_SetFrame(trace, trace->frame);
+}
+
+void Trace_SetFrame(CPUTrace *trace, unsigned long long frame)
+{
+    trace->frame = frame;
+    trace->frame_active = frame >= trace->frame_first && frame <= trace->frame_last;
+    if (!trace->frame_active)
+        trace->instr_active = false;
+}
+
+void Trace_SetBusAccesses(CPUTrace *trace, bool enable)
+{
+    trace->bus_accesses = enable;
+}
@@ -0,0 +1,229 @@
+/*
+* Checks that running the APU lazily gives the same results as the per-cycle APU it replaced, kept in reference/apu.c.
+* Both get the same register writes, reads and DMC sample loads. The real APU only syncs itself when it needs to, the
+* reference clocks everything on every cycle. Their DMC DMA requests, frame counter steps and IRQ signals must match on
+* every cycle, their channel outputs whenever the real APU has synced, and their $4015 reads and samples. The reference
+* mixes with the real APU's mixer, so samples compare the channels' timing, not two mixers. Each synthesis mode is run
+* at full volume and with different channel volumes, which change halfway.
+*
+* The first frames follow a script that plays every channel, lets length counters run out, starts looping and one-shot
+* DMC samples with IRQs, and switches between the frame counter modes with and without the frame IRQ. Random register
+* writes follow.
+*/
+#include "apu.h"
+#include "reference_apu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAMES 120
+#define FRAME_CYCLES 29781
+
+//What the CPU side tracks for each APU
+typedef struct {
+    unsigned long long dmaCycle; //Cycle of the last DMC DMA request
+    int dmaWait; //Cycles until the requested sample is loaded, or -1
+    unsigned long long frameStep; //Cycle of the next frame counter step
+} TestBus;
+
+typedef struct {
+    int frame;
+    int cycle; //Cycle in the frame
+    uint16_t addr; //0x4016 reads $4015 instead
+    uint8_t data;
+} ScriptWrite;
+
+static const ScriptWrite script[] = {
+    //Frame counter in 4-step mode with the frame IRQ, all channels on
+    { 0, 10, 0x4017, 0x00 },
+    { 0, 20, 0x4015, 0x0F },
+    //Pulse 1: Constant volume, length counter running, sweep down. Pulse 2: Envelope, halted length counter.
+    { 0, 100, 0x4000, 0x9F },
+    { 0, 104, 0x4001, 0x8B },
+    { 0, 108, 0x4002, 0x40 },
+    { 0, 112, 0x4003, 0x18 }, //Short length
+    { 0, 120, 0x4004, 0x64 },
+    { 0, 124, 0x4006, 0x80 },
+    { 0, 128, 0x4007, 0x01 },
+    //Triangle with the linear counter, noise in both modes
+    { 0, 200, 0x4008, 0x20 },
+    { 0, 204, 0x400A, 0x30 },
+    { 0, 208, 0x400B, 0x08 },
+    { 0, 300, 0x400C, 0x3A },
+    { 0, 304, 0x400E, 0x04 },
+    { 0, 308, 0x400F, 0x10 },
+    { 2, 5000, 0x400E, 0x83 },
+    //Acknowledge the frame IRQ, then switch to 5-step mode, which clocks the length counters right away
+    { 3, 0, 0x4016, 0 },
+    { 4, 1000, 0x4017, 0x80 },
+    { 5, 7000, 0x4003, 0x08 },
+    //DMC: One-shot short sample with IRQ at the fastest rate, then a looping one at a slow rate
+    { 6, 50, 0x4010, 0x8F },
+    { 6, 54, 0x4011, 0x40 },
+    { 6, 58, 0x4012, 0x00 },
+    { 6, 62, 0x4013, 0x01 },
+    { 6, 66, 0x4015, 0x1F },
+    { 7, 0, 0x4016, 0 },
+    { 7, 100, 0x4010, 0x40 },
+    { 7, 104, 0x4013, 0x02 },
+    { 7, 108, 0x4015, 0x1F },
+    //Back to 4-step mode with the IRQ inhibited, and length counters disabled and enabled again
+    { 8, 200, 0x4017, 0x40 },
+    { 8, 20000, 0x4015, 0x10 },
+    { 9, 300, 0x4015, 0x1F },
+    { 9, 304, 0x400B, 0xF8 },
+    { 9, 308, 0x4003, 0x00 },
+    //Frame and DMC IRQs at once, acknowledged one after the other: The DMC's by stopping it, the frame's by a read
+    { 10, 0, 0x4017, 0x00 },
+    { 10, 400, 0x4010, 0x8E },
+    { 10, 404, 0x4015, 0x1F },
+    { 11, 8000, 0x4015, 0x0F },
+    { 11, 8004, 0x4016, 0 },
+};
+
+static unsigned long long cycle;
+static unsigned seed = 1;
+static TestBus realBus, refBus;
+
+static unsigned Random() {
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 8;
+}
+
+static void OnDMA(void* context, uint16_t addr) {
+    TestBus* bus = context;
+    bus->dmaCycle = cycle;
+    if (bus->dmaWait < 0)
+        bus->dmaWait = 3;
+}
+
+static void Fail(const char* name, int frame, const char* what) {
+    printf("FAIL: %s: %s differ in frame %d.\n", name, what, frame);
+    exit(1);
+}
+
+static void Write(APU* real, RefAPU* ref, uint16_t addr, uint8_t data, const char* name, int frame) {
+    if (addr == 0x4016) {
+        if (APU_Read(real, 0x4015) != RefAPU_Read(ref, 0x4015))
+            Fail(name, frame, "$4015 reads");
+        return;
+    }
+    APU_Write(real, addr, data);
+    RefAPU_Write(ref, addr, data);
+    if (addr == 0x4017) {
+        realBus.frameStep = cycle + APU_CyclesUntilFrameStep(real);
+        refBus.frameStep = cycle + RefAPU_CyclesUntilFrameStep(ref);
+    }
+}
+
+static int16_t Mix(void* context, const uint8_t outputs[APU_NUM_CHANNELS]) {
+    return _APU_MixOutputs(context, outputs);
+}
+
+static void SetVolumes(APU* real, RefAPU* ref, const double volumes[APU_NUM_VOL_SETTINGS]) {
+    for (int ch = 0; ch < APU_NUM_VOL_SETTINGS; ch++) {
+        //The real APU first: Its mixer is the one the reference remixes with
+        APU_SetChannelVolume(real, (APU_Channel)ch, volumes[ch]);
+        RefAPU_SetChannelVolume(ref, ch, volumes[ch]);
+    }
+}
+
+static void Run(const char* name, APU_Synthesis synthesis, const double* volumes) {
+    static APU real;
+    memset(&real, 0, sizeof(APU));
+    APU_Init(&real, (APUCallbacks){ .context = &realBus, .ondma = OnDMA }, 1.789773, 44100);
+    APU_SetSynthesis(&real, synthesis);
+    APU_PowerOn(&real);
+    RefAPU* ref = RefAPU_Create(OnDMA, &refBus, Mix, &real, synthesis == APU_SYNTH_BANDLIMITED);
+    if (volumes != NULL)
+        SetVolumes(&real, ref, volumes);
+    cycle = 0;
+    realBus = refBus = (TestBus){ 0, -1, 0 };
+    realBus.frameStep = APU_CyclesUntilFrameStep(&real);
+    refBus.frameStep = RefAPU_CyclesUntilFrameStep(ref);
+    size_t next = 0;
+    int scriptFrames = script[sizeof(script) / sizeof(script[0]) - 1].frame + 1;
+
+    for (int frame = 0; frame < FRAMES; frame++) {
+        if (volumes != NULL && frame == FRAMES / 2)
+            SetVolumes(&real, ref, volumes + APU_NUM_VOL_SETTINGS);
+        //Some frames are run without output, like run-ahead frames
+        bool skip = frame >= scriptFrames && Random() % 5 == 0;
+        real.skipOutput = skip;
+        RefAPU_SetSkipOutput(ref, skip);
+        for (int c = 0; c < FRAME_CYCLES; c++) {
+            for (; next < sizeof(script) / sizeof(script[0]) && script[next].frame == frame && script[next].cycle == c; next++)
+                Write(&real, ref, script[next].addr, script[next].data, name, frame);
+            if (frame >= scriptFrames && Random() % 400 == 0) {
+                uint16_t addr = 0x4000 + Random() % 0x18;
+                uint8_t data = Random();
+                if (addr == 0x4013)
+                    data &= 3; //Short samples, so they are fetched often
+                Write(&real, ref, addr, data, name, frame);
+            }
+
+            uint8_t sample = Random();
+            cycle++;
+            if (realBus.dmaWait == 0) {
+                APU_DMCLoadSample(&real, sample);
+                realBus.dmaWait = -1;
+            }
+            if (refBus.dmaWait == 0) {
+                RefAPU_DMCLoadSample(ref, sample);
+                refBus.dmaWait = -1;
+            }
+            APU_CPUCycle(&real);
+            RefAPU_CPUCycle(ref);
+            if (realBus.dmaWait > 0)
+                realBus.dmaWait--;
+            if (refBus.dmaWait > 0)
+                refBus.dmaWait--;
+            if (cycle == realBus.frameStep) {
+                APU_FrameCounterStep(&real);
+                realBus.frameStep = cycle + APU_CyclesUntilFrameStep(&real);
+            }
+            if (cycle == refBus.frameStep) {
+                RefAPU_FrameCounterStep(ref);
+                refBus.frameStep = cycle + RefAPU_CyclesUntilFrameStep(ref);
+            }
+
+            if (realBus.dmaCycle != refBus.dmaCycle || realBus.dmaWait != refBus.dmaWait)
+                Fail(name, frame, "DMC DMA requests");
+            if (realBus.frameStep != refBus.frameStep)
+                Fail(name, frame, "Frame counter steps");
+            if (APU_IRQSignal(&real) != RefAPU_IRQSignal(ref))
+                Fail(name, frame, "IRQ signals");
+            if (real.pendingCycles == 0) {
+                for (int ch = 0; ch < APU_NUM_CHANNELS; ch++) {
+                    if (_APU_ChannelOutput(&real, (APU_Channel)ch) != RefAPU_ChannelOutput(ref, ch))
+                        Fail(name, frame, "Channel outputs");
+                }
+            }
+        }
+
+        size_t realLen, refLen;
+        APU_EndFrame(&real);
+        RefAPU_EndFrame(ref);
+        void* realSamples = APU_GetAudioBuffer(&real, &realLen);
+        void* refSamples = RefAPU_GetAudioBuffer(ref, &refLen);
+        if (realLen != refLen || memcmp(realSamples, refSamples, realLen) != 0)
+            Fail(name, frame, "Samples");
+        APU_ClearAudioBuffer(&real);
+        RefAPU_ClearAudioBuffer(ref);
+    }
+    RefAPU_Free(ref);
+    printf("%s: %d frames match\n", name, FRAMES);
+}
+
+int main() {
+    //Channel volumes and the master volume, before and after the change halfway
+    static const double volumes[2 * APU_NUM_VOL_SETTINGS] = {
+        0.1, 0.33, 0.5, 0.75, 0.9, 0.8,
+        0.9, 0.05, 0.25, 0.6, 0.4, 0.5
+    };
+    Run("Point sampling", APU_SYNTH_POINT, NULL);
+    Run("Band-limited", APU_SYNTH_BANDLIMITED, NULL);
+    Run("Point sampling, channel volumes", APU_SYNTH_POINT, volumes);
+    Run("Band-limited, channel volumes", APU_SYNTH_BANDLIMITED, volumes);
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+* Compares the lookup table mixer with the floating point mixer it replaced, over every combination of channel outputs.
+* The pulse table is exact. The TND table approximates the triangle, noise and DMC mix as one weighted sum, which is
+* off by up to 1.3% of full scale. Channel volumes scale each channel's level, which keeps 8 fraction bits and is
+* interpolated between table entries, so lowered channel volumes stay within a few samples of the reference.
+*/
+#include "apu.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FULL_SCALE INT16_MAX
+
+static void OnDMA(void* context, uint16_t addr) {}
+
+//The floating point mixer, with the channel volumes applied to the channel outputs
+static int16_t ReferenceMix(APU* apu, const uint8_t out[APU_NUM_CHANNELS]) {
+    double v[APU_NUM_VOL_SETTINGS];
+    for (int ch = 0; ch < APU_NUM_VOL_SETTINGS; ch++)
+        v[ch] = apu->mute[ch] ? 0.0 : apu->volume[ch];
+
+    double pulse1 = out[APU_CH_PULSE1] * v[APU_CH_PULSE1];
+    double pulse2 = out[APU_CH_PULSE2] * v[APU_CH_PULSE2];
+    double pulse_out = 95.88 / ((8128 / (pulse1 + pulse2)) + 100);
+
+    double triangle = out[APU_CH_TRIANGLE] * v[APU_CH_TRIANGLE];
+    double noise = out[APU_CH_NOISE] * v[APU_CH_NOISE];
+    double dmc = out[APU_CH_DMC] * v[APU_CH_DMC];
+    double tnd_out = 159.79 / ((1 / ((triangle / 8227) + (noise / 12241) + (dmc / 22638))) + 100);
+
+    return (short)(INT16_MAX * (pulse_out + tnd_out) * v[APU_CH_MASTER]);
+}
+
+//Check every combination of channel outputs. Fails if a sample is further than maxDeviation from the reference, or
+//if a sample with only the pulse channels playing is further than maxPulseDeviation.
+static void CheckMixer(APU* apu, const char* name, int maxDeviation, int maxPulseDeviation) {
+    int worst = 0, worstPulse = 0;
+    uint8_t out[APU_NUM_CHANNELS];
+    for (int p1 = 0; p1 < 16; p1++)
+    for (int p2 = 0; p2 < 16; p2++)
+    for (int t = 0; t < 16; t++)
+    for (int n = 0; n < 16; n++)
+    for (int d = 0; d < 128; d++) {
+        out[APU_CH_PULSE1] = p1;
+        out[APU_CH_PULSE2] = p2;
+        out[APU_CH_TRIANGLE] = t;
+        out[APU_CH_NOISE] = n;
+        out[APU_CH_DMC] = d;
+        int deviation = abs(_APU_MixOutputs(apu, out) - ReferenceMix(apu, out));
+        if (deviation > worst)
+            worst = deviation;
+        if (t == 0 && n == 0 && d == 0 && deviation > worstPulse)
+            worstPulse = deviation;
+    }
+
+    printf("%s: max deviation %d (%.2f%% of full scale), pulse only %d\n", name, worst, 100.0 * worst / FULL_SCALE, worstPulse);
+    if (worst > maxDeviation || worstPulse > maxPulseDeviation) {
+        printf("FAIL: %s: Mixer deviates more than %d (pulse only %d) from the floating point mixer.\n", name, maxDeviation, maxPulseDeviation);
+        exit(1);
+    }
+}
+
+int main() {
+    APU apu;
+    APU_Init(&apu, (APUCallbacks){ .context = NULL, .ondma = OnDMA }, 1.789773, 44100);
+
+    //The TND approximation is off by up to 1.3% of full scale
+    const int tndDeviation = FULL_SCALE * 14 / 1000;
+    CheckMixer(&apu, "Default volume", tndDeviation, 1);
+
+    APU_SetChannelVolume(&apu, APU_CH_MASTER, 0.25);
+    CheckMixer(&apu, "Master volume 25%", tndDeviation / 4 + 1, 1);
+
+    APU_SetChannelMute(&apu, APU_CH_NOISE, true);
+    CheckMixer(&apu, "Noise muted", tndDeviation / 4 + 1, 1);
+
+    APU_SetChannelMute(&apu, APU_CH_MASTER, true);
+    CheckMixer(&apu, "Master muted", 0, 0);
+
+    //Sweep channel volumes, giving each channel a different one in each pass. Low volumes must not round to silence,
+    //which rounding levels to whole steps did: Pulse output 4 at 10% volume was 0.
+    APU_SetChannelMute(&apu, APU_CH_MASTER, false);
+    APU_SetChannelMute(&apu, APU_CH_NOISE, false);
+    APU_SetChannelVolume(&apu, APU_CH_MASTER, 1.0);
+    const double volumes[APU_NUM_CHANNELS] = { 0.1, 0.33, 0.5, 0.75, 0.9 };
+    for (int pass = 0; pass < APU_NUM_CHANNELS; pass++) {
+        char name[64];
+        int length = snprintf(name, sizeof(name), "Channel volumes");
+        for (int ch = 0; ch < APU_NUM_CHANNELS; ch++) {
+            double volume = volumes[(ch + pass) % APU_NUM_CHANNELS];
+            APU_SetChannelVolume(&apu, (APU_Channel)ch, volume);
+            length += snprintf(name + length, sizeof(name) - length, " %.0f%%", volume * 100);
+        }
+        CheckMixer(&apu, name, tndDeviation, 3);
+    }
+
+    printf("PASS\n");
+    return 0;
+}
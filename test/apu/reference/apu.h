@@ -0,0 +1,348 @@
+/*
+* The APU as it was before it ran lazily: Every channel, the frame counter and the DMC are clocked on every CPU cycle.
+* Kept unchanged as the reference for catchup_test.c, except that its functions are static so it can be linked beside
+* the real APU, and that it mixes with the real APU's mixer rather than its own, which has changed since. Only compiled
+* through reference_apu.c.
+*/
+#ifndef APU_H
+#define APU_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define APU_SAMPLE_CAPACITY 1024 //Max number of samples in buffer
+
+//Band-limited synthesis: Each step is spread over APU_BLIP_TAPS output samples, with the kernel picked from
+//APU_BLIP_PHASES sub-sample positions. Kernel values are fixed-point with APU_BLIP_SHIFT fraction bits.
+#define APU_BLIP_TAPS 16
+#define APU_BLIP_PHASES 32
+#define APU_BLIP_SHIFT 12
+#define APU_BLIP_SIZE (APU_SAMPLE_CAPACITY + APU_BLIP_TAPS)
+
+
+//Callback to schedule a DMC DMA
+typedef void(*APUDMAFn)(void *context, uint16_t addr);
+
+typedef struct {
+    void *context;
+    APUDMAFn ondma;
+} APUCallbacks;
+
+
+static const uint8_t APU_LENGTH_TABLE[32] = {
+    10,254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+    12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+//Waveforms of pulse channel's duty cycle sequences.
+static const uint8_t PULSE_DUTY_WAVEFORMS[4] = {
+    0b00000001, //Duty 0 (12.5%)
+    0b00000011, //Duty 1 (25%)
+    0b00001111, //Duty 2 (50%)
+    0b11111100  //Duty 3 (75%)
+};
+
+static const uint8_t TRIANGLE_WAVE[32] = {
+    15, 14, 13, 12, 11, 10, 9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+};
+
+static const uint16_t NOISE_PERIOD_TABLE[2][16] = {
+    {4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068},//NTSC
+    {4, 8, 14, 30, 60, 88, 118, 148, 188, 236, 354, 472, 708,  944, 1890, 3778} //PAL
+};
+
+static const int16_t DMC_RATE_TABLE[2][16] = {
+    {428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106,  84,  72,  54},   //NTSC
+    {398, 354, 316, 298, 276, 236, 210, 198, 176, 148, 132, 118,  98,  78,  66,  50}    //PAL
+};
+
+
+//Frame counter sequencer step timings in CPU cycles since the frame counter was reset, for the 4-step and 5-step sequence.
+//The 5-step sequence's 4th step (29829) does nothing and is left out.
+static const unsigned APU_FC_STEP_CYCLES[2][4] = {
+    {7457, 14913, 22371, 29829},
+    {7457, 14913, 22371, 37281}
+};
+
+typedef enum {
+    APU_CH_PULSE1 = 0,
+    APU_CH_PULSE2,
+    APU_CH_TRIANGLE,
+    APU_CH_NOISE,
+    APU_CH_DMC,
+    APU_NUM_CHANNELS,
+    APU_CH_MASTER = APU_NUM_CHANNELS,
+    APU_NUM_VOL_SETTINGS
+} APU_Channel;
+
+typedef enum {
+    APU_SYNTH_POINT, //Mix all channels and take a sample every time the sample timer runs out
+    APU_SYNTH_BANDLIMITED //Record the steps of the mixed output and turn them into band-limited samples each frame
+} APU_Synthesis;
+
+typedef enum {
+    FC_IRQ_INHIBIT  = 1 << 6, //IRQ inhibit
+    FC_5STEP         = 1 << 7  //Sequencer mode (0 = 4-step, 1 = 5-step)
+} APU_FCCtrl;
+
+typedef enum {
+    APU_STATUS_1 = 1,       //Pulse 1 length counter enable
+    APU_STATUS_2 = 1 << 1,  //Pulse 2 length counter enable
+    APU_STATUS_T = 1 << 2,  //Triangle length counter enable
+    APU_STATUS_N = 1 << 3,  //Noise length counter enable
+    APU_STATUS_D = 1 << 4,  //DMC enable
+    APU_STATUS_F = 1 << 6,  //Frame interrupt
+    APU_STATUS_I = 1 << 7   //DMC interrupt
+} APU_Status;
+
+
+typedef struct {
+    bool enabled;
+    bool halt; //Halt flag is also the pulse/noise envelope loop flag and triangle linear counter control flag
+    uint8_t counter;
+} APULength;
+
+typedef struct {
+    bool start; //When set, reloads decay counter with 15 and divider with period.
+    bool constant_volume;
+    uint8_t period; //Envelope period (low 4 bits of $4000/4004/400C). Used as output if constant volume flag is set.
+    uint8_t divider; //Loaded with period. When clocked by frame counter, decrements. When clocked at 0, reloads with period and clocks decay counter.
+    uint8_t decay; //Decremented at a rate determined by period. Used as output if constant volume flag is clear.
+} APUEnvelope;
+
+typedef struct {
+    bool enabled;
+    uint8_t period;
+    bool negate;
+    uint8_t shift;
+
+    bool reload;
+    uint8_t divider;
+} APUSweep;
+
+typedef struct {
+    APUEnvelope envelope;
+    APUSweep sweep;
+    uint8_t duty;
+    APULength length;
+    uint16_t period;
+    uint16_t timer; //Reloaded with period, clocks sequencer
+    uint8_t duty_pos; //Position in output waveform
+} APUPulse;
+
+typedef struct {
+    bool linear_reload;
+    uint8_t linear_counter;
+    uint8_t linear_reload_value;
+
+    APULength length;
+    uint16_t period;
+    uint16_t timer;
+    uint8_t wave_pos;
+} APUTriangle;
+
+typedef struct {
+    APUEnvelope envelope;
+    APULength length;
+    uint16_t period;
+    uint16_t timer;
+    bool mode;
+    uint16_t lfsr; //15-bit linear feedback shift register
+} APUNoise;
+
+typedef struct {
+    bool irq_enable;
+    bool loop;
+
+    int16_t rate;
+    int16_t timer;
+
+    uint16_t sample_addr;
+    uint16_t cur_addr;
+    uint16_t sample_length;
+    uint16_t bytes_remaining;
+    uint8_t sample_buffer;
+    bool sample_buffer_full;
+
+    uint8_t dpcm_shift; //Sample buffer is emptied into DPCM shift register when bits remaining counter reaches 0
+    int8_t dpcm_bits_remaining; //DPCM shift register bits remaining
+    uint8_t output; //7-bit output level
+    bool silence;
+    bool irq;
+} APU_DMC;
+
+
+typedef struct {
+    APUPulse ch_pulse1, ch_pulse2;
+    APUTriangle ch_triangle;
+    APUNoise ch_noise;
+    APU_DMC ch_dmc;
+    
+    bool fc_irq;
+    uint8_t fc_ctrl; //Frame counter control ($4017)
+    unsigned fc_cycles; //Frame counter cycle count (CPU cycles, divide by 2 for APU cycles)
+    uint8_t fc_step; //Index of the next frame counter sequencer step in APU_FC_STEP_CYCLES
+} APUState;
+
+
+
+typedef struct {
+    APUCallbacks callbacks;
+
+    APUState state;
+
+    double volume[APU_NUM_VOL_SETTINGS]; //Volume levels of each channel between 0.0 and 1.0
+    bool mute[APU_NUM_VOL_SETTINGS];
+
+    //The mixer of the APU under test, so both mix channel outputs the same way. Set by RefAPU_Create().
+    int16_t (*mix)(void* context, const uint8_t outputs[APU_NUM_CHANNELS]);
+    void* mixContext;
+
+    double cpuCyclesPerSample;
+    double cycleSampleTimer; //Increments every CPU cycle. When cpuCyclesPerSample cycles have run, output a sample.
+    short sampleBuffer[APU_SAMPLE_CAPACITY]; //Sample output buffer
+    size_t sampleBufferSize;
+    bool skipOutput; //Don't mix or output samples. The sample timer still runs, so output resumes in step.
+
+    /*
+    * Band-limited synthesis. The mixed output is only recomputed when a channel's output changed, and each
+    * change is added to blipBuffer as the derivative of a band-limited step at its position in output samples.
+    * APU_EndFrame() sums the buffer up to the frame's end into samples. Frames with skipOutput set are not counted
+    * in the time, so frames run and then undone (run-ahead, netplay rollback) leave no trace in the audio.
+    */
+    APU_Synthesis synthesis;
+    double samplesPerCycle;
+    unsigned blipCycles; //CPU cycles run in frames with output since the last APU_EndFrame()
+    double blipOffset; //Position of the first of those cycles in output samples, between 0 and 1
+    uint8_t blipChannels[APU_NUM_CHANNELS]; //Channel outputs blipLevel was mixed from
+    unsigned blipActive; //Channels whose output can change when their waveform moves, as bits 1 << APU_Channel
+    int16_t blipLevel; //Output level after the last recorded step
+    int32_t blipSum; //Output level of the last sample made, with APU_BLIP_SHIFT fraction bits
+    int32_t blipBuffer[APU_BLIP_SIZE];
+    int16_t blipKernel[APU_BLIP_PHASES][APU_BLIP_TAPS];
+} APU;
+
+
+
+/*
+* Initialize APU struct. The CPU clock speed is needed to determine the number of CPU cycles per output sample.
+*/
+static void APU_Init(APU* apu, APUCallbacks callbacks, double cpuClockMHz, double sampleRateHz);
+static void APU_PowerOn(APU* apu);
+static void APU_Reset(APU* apu);
+
+static uint8_t APU_Read(APU* apu, uint16_t addr);
+static void APU_Write(APU* apu, uint16_t addr, uint8_t data);
+static void APU_CPUCycle(APU* apu);
+/*
+* End an emulated frame. In band-limited mode, the samples up to now are made and added to the audio buffer.
+* Does nothing in point sampling mode, where samples are made as the CPU cycles run.
+*/
+static void APU_EndFrame(APU* apu);
+
+//Set how audio samples are made. Can be changed at any time; band-limited output starts from silence.
+static void APU_SetSynthesis(APU* apu, APU_Synthesis synthesis);
+
+static bool APU_IRQSignal(APU *apu);
+
+/*
+* Get the number of APU_CPUCycle() calls, counting the next one, after which the next frame counter
+* sequencer step is due. The frame counter is reset by writing $4017, so this changes after $4017 writes.
+*/
+static unsigned APU_CyclesUntilFrameStep(APU* apu);
+/*
+* Run the next frame counter sequencer step (quarter frame, half frame and frame interrupt).
+* Call this right after the APU_CPUCycle() call that APU_CyclesUntilFrameStep() counted to.
+*/
+static void APU_FrameCounterStep(APU* apu);
+
+static void* APU_GetAudioBuffer(APU* apu, size_t* len);
+static void APU_ClearAudioBuffer(APU* apu);
+
+//Load the DMC sample buffer with a DPCM sample byte. For use in DMC DMA transfers.
+static void APU_DMCLoadSample(APU* apu, uint8_t sampleData);
+
+//Get the output volume of an APU channel. Volume is a value between 0.0 and 1.0.
+static double APU_GetChannelVolume(APU* apu, APU_Channel channel);
+//Set the output volume of an APU channel. Volume is a value between 0.0 and 1.0.
+static void APU_SetChannelVolume(APU* apu, APU_Channel channel, double volume);
+//Get the output volume mute status of an APU channel.
+static bool APU_GetChannelMute(APU* apu, APU_Channel channel);
+//Set the output volume mute status of an APU channel.
+static void APU_SetChannelMute(APU* apu, APU_Channel channel, bool mute);
+
+
+//Mix channel outputs (as returned by _APU_ChannelOutput()) into an audio sample
+static int16_t _APU_MixOutputs(APU* apu, const uint8_t outputs[APU_NUM_CHANNELS]);
+//Mix the output of all channels into an audio sample
+static int16_t _APU_MixAudio(APU* apu);
+
+//Get the output of a channel (not the master volume), 0-15 or 0-127 for the DMC
+static uint8_t _APU_ChannelOutput(APU* apu, APU_Channel channel);
+//Band-limited mode: Mix the output again, and if it changed, record the step at the current time
+static void _APU_UpdateOutput(APU* apu);
+//Band-limited mode: Add a step of delta to the output at cpuCycles since the start of the frame
+static void _APU_AddStep(APU* apu, unsigned cpuCycles, int delta);
+
+//Clock channel timers and frame counter by 1 CPU cycle. The sequencer steps are run separately by APU_FrameCounterStep().
+//Returns the channels whose waveform moved, as bits 1 << APU_Channel, so their output may have changed.
+static unsigned _APU_FC_Clock(APU* apu);
+//APU frame counter "quarter frame" clock: Clock envelopes & triangle linear counter
+static void _APU_FC_ClockQuarterFrame(APU* apu);
+//APU frame counter "half frame" clock: Clock length counters & sweep units
+static void _APU_FC_ClockHalfFrame(APU* apu);
+
+//Enable or disable length counter via $4015
+static void _APULength_Enable(APULength* length, bool enable);
+//Clock APU length counter. Clocked by frame counter every half frame.
+static void _APULength_Clock(APULength* length);
+
+//Clock APU envelope. Clocked by frame counter every quarter frame.
+static void _APUEnv_Clock(APUEnvelope* env, bool loop);
+//Clock pulse wave timer. Clocked every APU cycle. Returns true if the sequencer moved.
+static bool _APUPulse_ClockWave(APUPulse* pulse);
+//Clock pulse sweep timer. Clocked by frame counter. Pulse channels 1 and 2 add the sweep period change differently.
+static void _APUPulse_ClockSweep(APUPulse* pulse, bool isCh1);
+
+//Clock triangle wave timer. Clocked every CPU cycle. Returns true if the sequencer moved.
+static bool _APUTriangle_ClockWave(APUTriangle* tri);
+//Clock triangle linear counter.  Clocked by frame counter every quarter frame.
+static void _APUTriangle_ClockLinearCtr(APUTriangle* tri);
+
+//Clock noise LFSR timer. Clocked every CPU cycle. Returns true if the LFSR shifted.
+static bool _APUNoise_ClockLFSR(APUNoise* noise);
+
+static void _APUDMC_RestartSample(APU_DMC* dmc);
+//Clocked every CPU cycle. Returns true if the output unit was clocked while not silenced, or was unsilenced.
+static bool _APUDMC_Clock(APU* apu);
+
+/*Returns the pulse channel target period calculated by the sweep unit.
+* Channels 1 and 2 negate the period change amount (period >> sweep.shift) differently:
+* Channel 1 does one's complement negation (-c - 1), and channel 2 does two's complement (-c).
+*/
+static uint16_t _APUPulse_SweepTargetPeriod(APUPulse* pulse, bool isCh1);
+//Returns true if the sweep unit is muting the pulse channel (current pulse period < 8, or target period > $7FF)
+static bool _APUPulse_SweepMute(APUPulse* pulse, bool isCh1);
+
+//Write $4000/$4004
+static void _APUPulse_Write0(APUPulse* pulse, uint8_t data);
+//Write $4001/$4005
+static void _APUPulse_Write1(APUPulse* pulse, uint8_t data);
+//Write $4002/$4006
+static void _APUPulse_Write2(APUPulse* pulse, uint8_t data);
+//Write $4003/$4007
+static void _APUPulse_Write3(APUPulse* pulse, uint8_t data);
+
+//Get APU envelope volume output.
+static uint8_t _APUEnv_Output(APUEnvelope* env);
+//Get output of APU pulse channel. This is a volume level between 0-15.
+static uint8_t _APUPulse_Output(APUPulse* pulse, bool isCh1);
+//Get output of APU triangle channel. This is a volume level between 0-15.
+static uint8_t _APUTriangle_Output(APUTriangle* tri);
+//Get output of noise channel. This is a volume level between 0-15.
+static uint8_t _APUNoise_Output(APUNoise* noise);
+//Get output of DMC channel. This is a volume level between 0-127.
+static uint8_t _APUDMC_Output(APU_DMC* dmc);
+
+#endif
\ No newline at end of file
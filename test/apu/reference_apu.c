@@ -0,0 +1,35 @@
+#include "reference/apu.c"
+#include "reference_apu.h"
+#include <stdlib.h>
+
+struct RefAPU {
+    APU apu;
+};
+
+RefAPU* RefAPU_Create(void (*ondma)(void* context, uint16_t addr), void* context, RefAPUMixFn mix, void* mixContext,
+    bool bandlimited) {
+    RefAPU* ref = malloc(sizeof(RefAPU));
+    APU_Init(&ref->apu, (APUCallbacks){ .context = context, .ondma = ondma }, 1.789773, 44100);
+    ref->apu.mix = mix;
+    ref->apu.mixContext = mixContext;
+    APU_SetSynthesis(&ref->apu, bandlimited ? APU_SYNTH_BANDLIMITED : APU_SYNTH_POINT);
+    APU_PowerOn(&ref->apu);
+    return ref;
+}
+
+void RefAPU_Free(RefAPU* ref) { free(ref); }
+
+uint8_t RefAPU_Read(RefAPU* ref, uint16_t addr) { return APU_Read(&ref->apu, addr); }
+void RefAPU_Write(RefAPU* ref, uint16_t addr, uint8_t data) { APU_Write(&ref->apu, addr, data); }
+void RefAPU_CPUCycle(RefAPU* ref) { APU_CPUCycle(&ref->apu); }
+void RefAPU_DMCLoadSample(RefAPU* ref, uint8_t sample) { APU_DMCLoadSample(&ref->apu, sample); }
+bool RefAPU_IRQSignal(RefAPU* ref) { return APU_IRQSignal(&ref->apu); }
+unsigned RefAPU_CyclesUntilFrameStep(RefAPU* ref) { return APU_CyclesUntilFrameStep(&ref->apu); }
+void RefAPU_FrameCounterStep(RefAPU* ref) { APU_FrameCounterStep(&ref->apu); }
+uint8_t RefAPU_ChannelOutput(RefAPU* ref, int channel) { return _APU_ChannelOutput(&ref->apu, (APU_Channel)channel); }
+void RefAPU_SetChannelVolume(RefAPU* ref, int channel, double volume) { APU_SetChannelVolume(&ref->apu, (APU_Channel)channel, volume); }
+
+void RefAPU_SetSkipOutput(RefAPU* ref, bool skip) { ref->apu.skipOutput = skip; }
+void RefAPU_EndFrame(RefAPU* ref) { APU_EndFrame(&ref->apu); }
+void* RefAPU_GetAudioBuffer(RefAPU* ref, size_t* len) { return APU_GetAudioBuffer(&ref->apu, len); }
+void RefAPU_ClearAudioBuffer(RefAPU* ref) { APU_ClearAudioBuffer(&ref->apu); }
@@ -0,0 +1,37 @@
+#ifndef REFERENCE_APU_H
+#define REFERENCE_APU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+* The per-cycle APU from before it ran lazily (reference/apu.c), behind its own names so a test can run it beside the
+* real APU. The functions do what their APU_ counterparts did. Channel outputs are mixed by the mix function given, so
+* the reference follows changes to the mixer.
+*/
+typedef struct RefAPU RefAPU;
+
+typedef int16_t (*RefAPUMixFn)(void* context, const uint8_t outputs[5]);
+
+RefAPU* RefAPU_Create(void (*ondma)(void* context, uint16_t addr), void* context, RefAPUMixFn mix, void* mixContext,
+    bool bandlimited);
+void RefAPU_Free(RefAPU* apu);
+
+uint8_t RefAPU_Read(RefAPU* apu, uint16_t addr);
+void RefAPU_Write(RefAPU* apu, uint16_t addr, uint8_t data);
+void RefAPU_CPUCycle(RefAPU* apu);
+void RefAPU_DMCLoadSample(RefAPU* apu, uint8_t sample);
+bool RefAPU_IRQSignal(RefAPU* apu);
+unsigned RefAPU_CyclesUntilFrameStep(RefAPU* apu);
+void RefAPU_FrameCounterStep(RefAPU* apu);
+uint8_t RefAPU_ChannelOutput(RefAPU* apu, int channel);
+//Set a channel's volume, 5 for the master volume. Mixing is up to the mix function, this only remixes the output.
+void RefAPU_SetChannelVolume(RefAPU* apu, int channel, double volume);
+
+void RefAPU_SetSkipOutput(RefAPU* apu, bool skip);
+void RefAPU_EndFrame(RefAPU* apu);
+void* RefAPU_GetAudioBuffer(RefAPU* apu, size_t* len);
+void RefAPU_ClearAudioBuffer(RefAPU* apu);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+* Checks that the resampler holds the output buffer at its target fill when the source's clock doesn't match the sound
+* card's. A source running 0.3% fast or slow queues 735-sample frames 60 times per second of its own clock, in blocks
+* of 256 like SDLAudioBuffer does. A simulated sound card drains 1024 samples at a time at 44.1 kHz. After the loop has
+* settled, the average fill the resampler sees before each block must be at the target, and the buffer must never have
+* run dry.
+*/
+#include "resampler.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RATE 44100
+#define FRAME_SAMPLES 735
+#define BLOCK 256
+#define CALLBACK_SAMPLES 1024
+#define TARGET_FILL 1764 //40 ms
+#define SECONDS 600
+#define MEASURE_SECONDS 120 //The average fill is taken over the last part of the run
+#define TOLERANCE 0.03 //Of the target fill
+
+static int Run(double clockError) {
+    Resampler resampler;
+    Resampler_Init(&resampler, RATE, RATE, TARGET_FILL);
+
+    int16_t in[FRAME_SAMPLES];
+    int16_t out[BLOCK * 2];
+    long fill = TARGET_FILL; //The callback waits until the target is buffered before it starts playing
+    double phase = 0;
+    double frameTime = 1.0 / (60 * (1 + clockError));
+    double callbackTime = (double)CALLBACK_SAMPLES / RATE;
+    double nextFrame = 0, nextCallback = callbackTime;
+    double fillSum = 0;
+    long fillCount = 0;
+    bool underrun = false;
+
+    while (nextFrame < SECONDS) {
+        //Sound card callbacks due before the next frame is queued
+        while (nextCallback <= nextFrame) {
+            if (fill < CALLBACK_SAMPLES)
+                underrun = true;
+            fill = fill > CALLBACK_SAMPLES ? fill - CALLBACK_SAMPLES : 0;
+            nextCallback += callbackTime;
+        }
+
+        for (int i = 0; i < FRAME_SAMPLES; i++, phase += 0.05)
+            in[i] = (int16_t)(8000 * sin(phase));
+        for (int i = 0; i < FRAME_SAMPLES; i += BLOCK) {
+            int n = FRAME_SAMPLES - i < BLOCK ? FRAME_SAMPLES - i : BLOCK;
+            if (nextFrame >= SECONDS - MEASURE_SECONDS) {
+                fillSum += fill;
+                fillCount++;
+            }
+            fill += (long)Resampler_Process(&resampler, in + i, n, out, BLOCK * 2, (size_t)fill);
+        }
+        nextFrame += frameTime;
+    }
+
+    double average = fillSum / fillCount;
+    bool ok = !underrun && fabs(average - TARGET_FILL) <= TARGET_FILL * TOLERANCE;
+    printf("%s: Source %+.1f%%: Average fill %.0f samples, target %d%s\n", ok ? "PASS" : "FAIL", clockError * 100,
+        average, TARGET_FILL, underrun ? ", ran dry" : "");
+    return ok ? 0 : 1;
+}
+
+int main() {
+    int failed = 0;
+    failed += Run(0.003);
+    failed += Run(-0.003);
+    failed += Run(0);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,213 @@
+/*
+* Differential test for the CPU block cache. Runs the official opcode part of nestest.nes on a CPU with the block cache
+* and an interpreter CPU side by side and compares the CPU state, memory and a hash of all bus accesses after every
+* CPU_ExecBlock() call. NMIs are raised at fixed bus cycles to exit blocks early, and PRG ROM is patched halfway through
+* to test invalidation.
+* Then a loop that modifies the operand of an instruction at the end of a page, which is in the next page, is compared.
+*/
+#include "cpu.h"
+#include "cpu_block_cache.h"
+#include "rom.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//nestest runs 5003 official opcodes before the first illegal opcode test
+#define NESTEST_OFFICIAL_INSTRUCTIONS 5003
+#define ROUNDS 40
+//Pulse NMI every NMI_INTERVAL bus cycles
+#define NMI_INTERVAL 7919
+
+//Self-modifying code at a page edge: LDA #imm at $80FF has its operand at $8100, which the loop increments
+static const uint8_t PAGE_EDGE_CODE[] = {
+    0xEE, 0x00, 0x81,   //$80FA: INC $8100
+    0xEA,               //$80FD: NOP
+    0xEA,               //$80FE: NOP
+    0xA9, 0x00,         //$80FF: LDA #$00
+    0x95, 0x00,         //$8101: STA $00,X
+    0xE8,               //$8103: INX
+    0x4C, 0xFA, 0x80    //$8104: JMP $80FA
+};
+#define PAGE_EDGE_ADDR 0x80FA
+#define PAGE_EDGE_INSTRUCTIONS 3000
+
+typedef struct {
+    CPU cpu;
+    uint8_t memory[0x10000];
+    uint64_t bus_hash; //FNV-1a hash of all bus accesses
+    unsigned long long accesses;
+} TestBus;
+
+static CPUDecodeCache decodeCache;
+static uint8_t* codePages[0x100];
+static bool romPages[0x100];
+
+static void BusAccess(TestBus* bus, char type, uint16_t addr, uint8_t data) {
+    uint8_t access[4] = { type, addr & 0xFF, addr >> 8, data };
+    for (int i = 0; i < 4; i++) {
+        bus->bus_hash ^= access[i];
+        bus->bus_hash *= 0x100000001B3ULL;
+    }
+    bus->accesses++;
+    if (bus->accesses % NMI_INTERVAL == 0)
+        CPU_SetNMISignal(&bus->cpu, true);
+    else if (bus->accesses % NMI_INTERVAL == 1)
+        CPU_SetNMISignal(&bus->cpu, false);
+}
+
+static uint16_t MirrorAddr(uint16_t addr) {
+    return (addr < 0x2000) ? addr % 0x800 : addr;
+}
+
+static uint8_t TestRead(void* context, uint16_t addr) {
+    TestBus* bus = context;
+    uint8_t data = bus->memory[MirrorAddr(addr)];
+    BusAccess(bus, 'r', addr, data);
+    return data;
+}
+
+static void TestWrite(void* context, uint16_t addr, uint8_t data) {
+    TestBus* bus = context;
+    bus->memory[MirrorAddr(addr)] = data;
+    BusAccess(bus, 'w', addr, data);
+    if (bus->cpu.decode_cache != NULL && bus->cpu.decode_cache->page_has_code[addr >> 8])
+        CPU_InvalidateDecodedMemory(&bus->cpu, addr);
+}
+
+//Fetch from the decode cache: Same bus access as a read, without the memory read
+static void TestTick(void* context, uint16_t addr) {
+    TestBus* bus = context;
+    BusAccess(bus, 'r', addr, bus->memory[MirrorAddr(addr)]);
+}
+
+static void InitBus(TestBus* bus) {
+    memset(bus, 0, sizeof(TestBus));
+    CPU_Init(&bus->cpu, (CPUCallbacks){
+        .context = bus,
+        .onread = &TestRead,
+        .onwrite = &TestWrite,
+        .ontick = &TestTick
+    });
+}
+
+//Clear memory, load code at addr and reset the CPU there
+static void ResetBus(TestBus* bus, uint16_t addr, const void* code, size_t size) {
+    memset(bus->memory, 0, sizeof(bus->memory));
+    memcpy(bus->memory + addr, code, size);
+    bus->memory[0xFFFC] = addr & 0xFF;
+    bus->memory[0xFFFD] = addr >> 8;
+    bus->bus_hash = 0xCBF29CE484222325ULL;
+    bus->accesses = 0;
+    CPU_PowerOn(&bus->cpu);
+}
+
+static int CompareBuses(TestBus* blk, TestBus* ref, int round) {
+    CPUState* a = &blk->cpu.state;
+    CPUState* b = &ref->cpu.state;
+    if (a->pc != b->pc || a->a != b->a || a->x != b->x || a->y != b->y || a->s != b->s || a->p != b->p || a->cycles != b->cycles) {
+        printf("FAIL: CPU state differs in round %d.\n", round);
+        printf("Block cache - PC: $%04X, A: $%02X, X: $%02X, Y: $%02X, S: $%02X, P: $%02X, CYC: %llu\n", a->pc, a->a, a->x, a->y, a->s, a->p, a->cycles);
+        printf("Interpreter - PC: $%04X, A: $%02X, X: $%02X, Y: $%02X, S: $%02X, P: $%02X, CYC: %llu\n", b->pc, b->a, b->x, b->y, b->s, b->p, b->cycles);
+        return -1;
+    }
+    if (blk->bus_hash != ref->bus_hash) {
+        printf("FAIL: Bus accesses differ in round %d at CYC %llu.\n", round, a->cycles);
+        return -1;
+    }
+    if (memcmp(blk->memory, ref->memory, sizeof(blk->memory)) != 0) {
+        printf("FAIL: Memory differs in round %d at CYC %llu.\n", round, a->cycles);
+        return -1;
+    }
+    return 0;
+}
+
+//Run both CPUs until the interpreter has run maxInstructions or both crashed, comparing them after every CPU_ExecBlock().
+//Returns the number of CPU_ExecBlock() calls, or -1 if the CPUs differ.
+static long long RunLockstep(TestBus* blk, TestBus* ref, int round, int maxInstructions) {
+    long long blocks = 0;
+    int instructions = 0;
+    while (instructions < maxInstructions) {
+        int blockResult = CPU_ExecBlock(&blk->cpu);
+        int refResult = 0;
+        blocks++;
+        while (refResult == 0 && ref->cpu.state.cycles < blk->cpu.state.cycles) {
+            refResult = CPU_Exec(&ref->cpu);
+            instructions++;
+        }
+
+        if (CompareBuses(blk, ref, round) != 0)
+            return -1;
+        if (blockResult != refResult) {
+            printf("FAIL: Only one CPU crashed in round %d at $%04X.\n", round, blk->cpu.state.pc);
+            return -1;
+        }
+        if (blockResult != 0)
+            break;
+    }
+    return blocks;
+}
+
+int main() {
+    FILE* romFile = fopen("nestest.nes", "rb");
+    if (romFile == NULL) {
+        perror("Error opening file nestest.nes");
+        return 1;
+    }
+    INESHeader ines;
+    if (INES_ReadHeader(&ines, romFile)) {
+        fprintf(stderr, "Error reading nestest.nes: Invalid iNES ROM file format.\n");
+        return 1;
+    }
+    char* prg = INES_ReadPRG(&ines, romFile);
+    fclose(romFile);
+
+    static TestBus blk, ref;
+    InitBus(&blk);
+    InitBus(&ref);
+
+    //Block cache CPU: RAM and its mirrors, and ROM at $8000-$FFFF
+    for (int p = 0; p < 0x100; p++) {
+        codePages[p] = &blk.memory[(p < 0x20) ? (p * 0x100) % 0x800 : p * 0x100];
+        romPages[p] = (p >= 0x80);
+    }
+    CPU_SetDecodeCache(&blk.cpu, &decodeCache, codePages);
+    CPUBlockCache* blockCache = CPUBlockCache_Create();
+    if (blockCache == NULL) {
+        printf("FAIL: Could not create the block cache.\n");
+        return 1;
+    }
+    CPU_SetBlockCache(&blk.cpu, blockCache, romPages);
+
+    long long blocks = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        //Halfway through, change the immediate operand of the first LDX ($C5F5: LDX #$00) while its block is cached
+        if (round == ROUNDS / 2)
+            prg[0x05F6] = 0x01;
+
+        //The reset vector for nestest.nes on "automation" is $C000.
+        ResetBus(&blk, 0xC000, prg, ines.prg_bytes);
+        ResetBus(&ref, 0xC000, prg, ines.prg_bytes);
+        CPU_InvalidateDecodeCache(&blk.cpu, 0x00, 0x1F);
+        if (round == ROUNDS / 2)
+            CPU_InvalidateDecodeCache(&blk.cpu, 0xC5, 0xC5);
+
+        long long roundBlocks = RunLockstep(&blk, &ref, round, NESTEST_OFFICIAL_INSTRUCTIONS);
+        if (roundBlocks < 0)
+            return 1;
+        blocks += roundBlocks;
+    }
+
+    ResetBus(&blk, PAGE_EDGE_ADDR, PAGE_EDGE_CODE, sizeof(PAGE_EDGE_CODE));
+    ResetBus(&ref, PAGE_EDGE_ADDR, PAGE_EDGE_CODE, sizeof(PAGE_EDGE_CODE));
+    CPU_InvalidateDecodeCache(&blk.cpu, 0x00, 0xFF);
+    long long edgeBlocks = RunLockstep(&blk, &ref, ROUNDS, PAGE_EDGE_INSTRUCTIONS);
+    if (edgeBlocks < 0)
+        return 1;
+    blocks += edgeBlocks;
+
+    printf("Block cache and interpreter match after %lld CPU_ExecBlock() calls.\n", blocks);
+    CPU_SetBlockCache(&blk.cpu, NULL, NULL);
+    CPUBlockCache_Free(blockCache);
+    free(prg);
+    return 0;
+}
@@ -0,0 +1,41 @@
+# Runs EpicNESHeadless twice on the same ROM with different options and checks that every frame's video and audio
+# hash, the final hashes, the CPU cycle count and the idle loop statistics are the same.
+#
+#   cmake -DHEADLESS=<EpicNESHeadless> -DROM=<rom.nes> -DOPTIONS=<options for both>
+#         -DOPTIONS_A=<options for run A> -DOPTIONS_B=<options for run B> -P compare_frame_hashes.cmake
+
+cmake_minimum_required(VERSION 3.5.0)
+
+separate_arguments(OPTIONS UNIX_COMMAND "${OPTIONS}")
+foreach(run A B)
+    set(NAME_${run} "${OPTIONS_${run}}")
+    separate_arguments(OPTIONS_${run} UNIX_COMMAND "${OPTIONS_${run}}")
+    execute_process(
+        COMMAND ${HEADLESS} ${OPTIONS} ${OPTIONS_${run}} --frame-hashes ${ROM}
+        RESULT_VARIABLE result
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE errors)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "EpicNESHeadless ${NAME_${run}} failed (${result}): ${errors}")
+    endif()
+    # Drop the run time and speed
+    string(REGEX REPLACE " CPU cycles in [^\n]*" " CPU cycles" output "${output}")
+    set(output_${run} "${output}")
+endforeach()
+
+if(NOT output_A STREQUAL output_B)
+    string(REPLACE "\n" ";" lines_A "${output_A}")
+    string(REPLACE "\n" ";" lines_B "${output_B}")
+    list(LENGTH lines_A count_A)
+    list(LENGTH lines_B count_B)
+    foreach(line IN LISTS lines_A)
+        list(FIND lines_B "${line}" found)
+        if(found EQUAL -1)
+            message(FATAL_ERROR "Outputs differ, ${NAME_A} printed:\n  ${line}\nwhich ${NAME_B} didn't")
+        endif()
+    endforeach()
+    message(FATAL_ERROR "Outputs differ: ${count_A} lines with ${NAME_A}, ${count_B} with ${NAME_B}")
+endif()
+
+string(REGEX MATCH "[0-9]+ frames, [0-9]+ CPU cycles" summary "${output_A}")
+message(STATUS "${NAME_A} and ${NAME_B} match: ${summary}")
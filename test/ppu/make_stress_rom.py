@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+"""
+Builds ppu_stress.nes, the ROM TestPPUSync runs to compare the catch-up PPU with the dot-by-dot one.
+
+An NROM game with 8 KB of CHR-RAM. It fills the nametables, palette, OAM and pattern tables with random bytes, then
+every frame writes the APU registers at random, waits a random number of scanlines and does one of these:
+  - Waits for sprite 0 hit and writes $2005 twice (a scroll split)
+  - Writes $2006 twice, which reloads the VRAM address in the middle of a scanline
+  - Writes $2001 and $2000 (rendering on or off, pattern tables, sprite size)
+  - Turns rendering off, writes a tile to CHR-RAM and turns it back on
+  - Writes $2007 with rendering on, which corrupts the VRAM address the way the PPU's increments do
+The NMI handler does OAM DMA and writes a random nametable byte and CHR-RAM tile.
+
+Run it from this directory to build the ROM again: python3 make_stress_rom.py
+"""
+import random
+
+OPS = {
+    ('LDA', 'imm'): 0xA9, ('LDA', 'zp'): 0xA5, ('LDA', 'abs'): 0xAD,
+    ('LDX', 'imm'): 0xA2, ('LDY', 'imm'): 0xA0,
+    ('STA', 'zp'): 0x85, ('STA', 'abs'): 0x8D, ('STA', 'abx'): 0x9D, ('STA', 'aby'): 0x99,
+    ('INX', 'imp'): 0xE8, ('INY', 'imp'): 0xC8, ('DEX', 'imp'): 0xCA, ('DEY', 'imp'): 0x88, ('INC', 'zp'): 0xE6,
+    ('AND', 'imm'): 0x29, ('ORA', 'imm'): 0x09, ('EOR', 'imm'): 0x49, ('EOR', 'zp'): 0x45,
+    ('ASL', 'zp'): 0x06, ('ROL', 'zp'): 0x26, ('CMP', 'imm'): 0xC9,
+    ('BNE', 'rel'): 0xD0, ('BEQ', 'rel'): 0xF0, ('BPL', 'rel'): 0x10, ('BCC', 'rel'): 0x90,
+    ('BVC', 'rel'): 0x50, ('BVS', 'rel'): 0x70,
+    ('JMP', 'abs'): 0x4C, ('JSR', 'abs'): 0x20, ('RTS', 'imp'): 0x60, ('RTI', 'imp'): 0x40,
+    ('SEI', 'imp'): 0x78, ('CLI', 'imp'): 0x58, ('CLD', 'imp'): 0xD8,
+    ('PHA', 'imp'): 0x48, ('PLA', 'imp'): 0x68, ('TXA', 'imp'): 0x8A, ('TAX', 'imp'): 0xAA,
+    ('TYA', 'imp'): 0x98, ('TAY', 'imp'): 0xA8, ('TXS', 'imp'): 0x9A, ('BIT', 'abs'): 0x2C,
+}
+SIZES = {'imp': 1, 'imm': 2, 'zp': 2, 'rel': 2, 'abs': 3, 'abx': 3, 'aby': 3}
+
+
+class Assembler:
+    """Just enough of a 6502 assembler for this ROM. Operands can be numbers or labels."""
+
+    def __init__(self, org):
+        self.org = org
+        self.items = []
+        self.labels = {}
+
+    def label(self, name):
+        self.items.append((name,))
+
+    def __call__(self, mnemonic, mode='imp', arg=None):
+        self.items.append((mnemonic, mode, arg))
+
+    def assemble(self):
+        # The first pass finds the labels, the second one encodes the branches to them
+        for final in (False, True):
+            pc = self.org
+            out = bytearray()
+            for item in self.items:
+                if len(item) == 1:
+                    self.labels[item[0]] = pc
+                    continue
+                mnemonic, mode, arg = item
+                if isinstance(arg, str):
+                    arg = self.labels[arg] if final else self.labels.get(arg, pc)
+                out.append(OPS[(mnemonic, mode)])
+                if mode == 'rel':
+                    offset = arg - (pc + 2)
+                    assert not final or -128 <= offset <= 127, (mnemonic, item[2])
+                    out.append(offset & 0xFF)
+                elif SIZES[mode] == 2:
+                    out.append(arg & 0xFF)
+                elif SIZES[mode] == 3:
+                    out += bytes([arg & 0xFF, arg >> 8])
+                pc += SIZES[mode]
+        return bytes(out)
+
+
+def vram_address(a, high, low):
+    a('LDA', 'imm', high); a('STA', 'abs', 0x2006)
+    a('LDA', 'imm', low); a('STA', 'abs', 0x2006)
+
+
+def build():
+    SEEDLO, SEEDHI, FLAG, SCROLLX, CTRL = 0x10, 0x11, 0x12, 0x13, 0x14
+    a = Assembler(0xC000)
+
+    a.label('reset'); a('SEI'); a('CLD'); a('LDX', 'imm', 0xFF); a('TXS')
+    a('LDA', 'imm', 0); a('STA', 'abs', 0x2000); a('STA', 'abs', 0x2001)
+    a.label('vblank1'); a('BIT', 'abs', 0x2002); a('BPL', 'rel', 'vblank1')
+    a.label('vblank2'); a('BIT', 'abs', 0x2002); a('BPL', 'rel', 'vblank2')
+    a('LDA', 'imm', 0xA5); a('STA', 'zp', SEEDLO); a('LDA', 'imm', 0x3C); a('STA', 'zp', SEEDHI)
+    # Pattern tables, then nametables
+    vram_address(a, 0x00, 0x00)
+    a('LDY', 'imm', 0x20); a('LDX', 'imm', 0)
+    a.label('fillchr'); a('JSR', 'abs', 'rand'); a('STA', 'abs', 0x2007)
+    a('INX'); a('BNE', 'rel', 'fillchr'); a('DEY'); a('BNE', 'rel', 'fillchr')
+    vram_address(a, 0x20, 0x00)
+    a('LDY', 'imm', 8)
+    a.label('fillnt'); a('JSR', 'abs', 'rand'); a('STA', 'abs', 0x2007)
+    a('INX'); a('BNE', 'rel', 'fillnt'); a('DEY'); a('BNE', 'rel', 'fillnt')
+    vram_address(a, 0x3F, 0x00)
+    a('LDX', 'imm', 32)
+    a.label('fillpal'); a('JSR', 'abs', 'rand'); a('AND', 'imm', 0x3F); a('STA', 'abs', 0x2007)
+    a('DEX'); a('BNE', 'rel', 'fillpal')
+    a.label('filloam'); a('JSR', 'abs', 'rand'); a('STA', 'abx', 0x0200); a('INX'); a('BNE', 'rel', 'filloam')
+    # Sprite 0 near the top, where the random background is likely to be opaque
+    a('LDA', 'imm', 40); a('STA', 'abs', 0x0200); a('LDA', 'imm', 60); a('STA', 'abs', 0x0203)
+    a('LDA', 'imm', 0x0F); a('STA', 'abs', 0x4015)
+    a('LDA', 'imm', 0x80); a('STA', 'zp', CTRL); a('STA', 'abs', 0x2000)
+    a('LDA', 'imm', 0x1E); a('STA', 'abs', 0x2001)
+    a('CLI')
+
+    a.label('main')
+    a('LDX', 'imm', 8)
+    a.label('apu'); a('JSR', 'abs', 'rand'); a('AND', 'imm', 0x0F); a('TAY')
+    a('JSR', 'abs', 'rand'); a('STA', 'aby', 0x4000); a('DEX'); a('BNE', 'rel', 'apu')
+    # Wait up to about 180 scanlines
+    a('JSR', 'abs', 'rand'); a('AND', 'imm', 0x0F); a('TAY'); a('INY')
+    a.label('delay'); a('DEX'); a('BNE', 'rel', 'delay'); a('DEY'); a('BNE', 'rel', 'delay')
+
+    a('JSR', 'abs', 'rand'); a('AND', 'imm', 0x07)
+    a('BNE', 'rel', 'not_sprite0')
+    a.label('sprite0_clear'); a('BIT', 'abs', 0x2002); a('BVS', 'rel', 'sprite0_clear')
+    a.label('sprite0'); a('INX'); a('BEQ', 'rel', 'done'); a('BIT', 'abs', 0x2002); a('BVC', 'rel', 'sprite0')
+    a('JSR', 'abs', 'rand'); a('STA', 'abs', 0x2005); a('STA', 'abs', 0x2005)
+    a('JMP', 'abs', 'done')
+    a.label('not_sprite0'); a('CMP', 'imm', 2); a('BCC', 'rel', 'address')
+    a('BEQ', 'rel', 'mask')
+    a('CMP', 'imm', 5); a('BCC', 'rel', 'chr')
+    a('BEQ', 'rel', 'data')
+    a('JMP', 'abs', 'done')
+
+    a.label('address')
+    a('JSR', 'abs', 'rand'); a('AND', 'imm', 0x2F); a('STA', 'abs', 0x2006)
+    a('JSR', 'abs', 'rand'); a('STA', 'abs', 0x2006)
+    a('JMP', 'abs', 'done')
+
+    a.label('mask')
+    a('JSR', 'abs', 'rand'); a('AND', 'imm', 0x1E); a('STA', 'abs', 0x2001)
+    a('JSR', 'abs', 'rand'); a('AND', 'imm', 0x38); a('ORA', 'imm', 0x80); a('STA', 'zp', CTRL); a('STA', 'abs', 0x2000)
+    a('JMP', 'abs', 'done')
+
+    a.label('chr')
+    a('LDA', 'imm', 0); a('STA', 'abs', 0x2001)
+    a('JSR', 'abs', 'chrtile')
+    a('LDA', 'imm', 0x1E); a('STA', 'abs', 0x2001)
+    a('JMP', 'abs', 'done')
+
+    a.label('data')
+    a('JSR', 'abs', 'rand'); a('STA', 'abs', 0x2007)
+
+    a.label('done')
+    a.label('wait'); a('LDA', 'zp', FLAG); a('BEQ', 'rel', 'wait')
+    a('LDA', 'imm', 0); a('STA', 'zp', FLAG)
+    a('JMP', 'abs', 'main')
+
+    # Write 16 random bytes to a random tile of the pattern tables
+    a.label('chrtile')
+    a('JSR', 'abs', 'rand'); a('AND', 'imm', 0x1F); a('STA', 'abs', 0x2006)
+    a('JSR', 'abs', 'rand'); a('AND', 'imm', 0xF0); a('STA', 'abs', 0x2006)
+    a('LDX', 'imm', 16)
+    a.label('chrbyte'); a('JSR', 'abs', 'rand'); a('STA', 'abs', 0x2007); a('DEX'); a('BNE', 'rel', 'chrbyte')
+    a('RTS')
+
+    # 16-bit Galois LFSR
+    a.label('rand')
+    a('ASL', 'zp', SEEDLO); a('ROL', 'zp', SEEDHI); a('BCC', 'rel', 'rand_done')
+    a('LDA', 'zp', SEEDLO); a('EOR', 'imm', 0x2D); a('STA', 'zp', SEEDLO)
+    a.label('rand_done'); a('LDA', 'zp', SEEDLO); a('EOR', 'zp', SEEDHI); a('RTS')
+
+    a.label('nmi')
+    a('PHA'); a('TXA'); a('PHA'); a('TYA'); a('PHA')
+    a('LDA', 'imm', 0x02); a('STA', 'abs', 0x4014)
+    a('JSR', 'abs', 'chrtile')
+    a('LDA', 'imm', 0x21); a('STA', 'abs', 0x2006); a('JSR', 'abs', 'rand'); a('STA', 'abs', 0x2006)
+    a('JSR', 'abs', 'rand'); a('STA', 'abs', 0x2007)
+    a('INC', 'zp', SCROLLX); a('LDA', 'zp', SCROLLX); a('STA', 'abs', 0x2005)
+    a('LDA', 'imm', 0); a('STA', 'abs', 0x2005)
+    a('LDA', 'zp', CTRL); a('STA', 'abs', 0x2000)
+    a('LDA', 'imm', 1); a('STA', 'zp', FLAG)
+    a('PLA'); a('TAY'); a('PLA'); a('TAX'); a('PLA')
+    a.label('irq'); a('RTI')
+
+    code = a.assemble()
+    prg = bytearray(random.Random(7).randbytes(0x4000))
+    prg[:len(code)] = code
+    for vector, label in ((0xFFFA, 'nmi'), (0xFFFC, 'reset'), (0xFFFE, 'irq')):
+        prg[vector - 0xC000] = a.labels[label] & 0xFF
+        prg[vector - 0xC000 + 1] = a.labels[label] >> 8
+    # 1 16 KB PRG-ROM bank, no CHR-ROM (so 8 KB of CHR-RAM), mapper 0, vertical mirroring
+    header = bytes([0x4E, 0x45, 0x53, 0x1A, 1, 0, 0x01, 0]) + bytes(8)
+    return header + bytes(prg)
+
+
+if __name__ == '__main__':
+    with open('ppu_stress.nes', 'wb') as f:
+        f.write(build())
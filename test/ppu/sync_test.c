@@ -0,0 +1,109 @@
+/*
+* Checks that the catch-up PPU (PPU_Run(), which renders whole scanlines with RunScanline()) gives the same results as
+* running it dot by dot with PPU_Cycle(). Two emulators run each ROM side by side, one in PPU_SYNC_CATCHUP mode and one
+* in PPU_SYNC_CYCLE mode, with the same random buttons. After every frame their pictures, audio, PPU state and save
+* states (CPU, APU, RAM, VRAM and CHR-RAM) must match.
+*
+* nestest.nes draws text with a few scroll writes. ppu_stress.nes (see make_stress_rom.py) writes $2000, $2001, $2005,
+* $2006 and $2007 in the middle of scanlines, splits the screen at sprite 0 hit and updates CHR-RAM every frame.
+*/
+#include "emulator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned seed = 1;
+
+static unsigned Random() {
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 8;
+}
+
+static const char* ComparePPU(const PPU* a, const PPU* b) {
+    const PPUState* sa = &a->state;
+    const PPUState* sb = &b->state;
+    if (memcmp(a->pixelBuffer, b->pixelBuffer, sizeof(a->pixelBuffer)) != 0)
+        return "Pictures";
+    if (sa->scanline != sb->scanline || sa->cycle != sb->cycle || sa->frames != sb->frames)
+        return "PPU positions";
+    if (sa->ppuctrl != sb->ppuctrl || sa->ppumask != sb->ppumask || sa->ppustatus != sb->ppustatus
+        || sa->oamaddr != sb->oamaddr || sa->readBuffer != sb->readBuffer)
+        return "PPU registers";
+    if (sa->v != sb->v || sa->t != sb->t || sa->x != sb->x || sa->w != sb->w)
+        return "PPU scroll registers";
+    if (memcmp(sa->paletteRam, sb->paletteRam, sizeof(sa->paletteRam)) != 0 || memcmp(sa->oam, sb->oam, sizeof(sa->oam)) != 0)
+        return "Palette or OAM";
+    return NULL;
+}
+
+static int Run(const char* path, int frames, uint8_t buttonMask) {
+    Emulator* emus[2] = { Emu_Create(), Emu_Create() };
+    Emu_SetPPUSyncMode(emus[0], PPU_SYNC_CATCHUP);
+    Emu_SetPPUSyncMode(emus[1], PPU_SYNC_CYCLE);
+    for (int i = 0; i < 2; i++) {
+        if (Emu_LoadROM(emus[i], path) != 0) {
+            printf("FAIL: Could not load %s\n", path);
+            return 1;
+        }
+    }
+    size_t stateSize = Emu_SaveStateSize(emus[0]);
+    uint8_t* states[2] = { malloc(stateSize), malloc(stateSize) };
+    if (states[0] == NULL || states[1] == NULL) {
+        printf("FAIL: Out of memory\n");
+        return 1;
+    }
+
+    seed = 1;
+    uint8_t buttons = 0;
+    const char* failure = NULL;
+    int frame;
+    for (frame = 0; frame < frames && failure == NULL; frame++) {
+        //Hold random buttons for a few frames at a time, so menus see them pressed and released
+        if (frame % 8 == 0)
+            buttons = (Random() % 3 == 0) ? (uint8_t)Random() & buttonMask : 0;
+        int results[2];
+        for (int i = 0; i < 2; i++) {
+            Emu_SetButtons(emus[i], 0, buttons);
+            results[i] = Emu_RunFrame(emus[i]);
+        }
+        if (results[0] != 0 || results[1] != 0) {
+            failure = (results[0] != results[1]) ? "Emu_RunFrame() results" : "Both emulators stopped, so no more frames";
+            break;
+        }
+
+        size_t lens[2];
+        void* audio[2];
+        for (int i = 0; i < 2; i++)
+            audio[i] = Emu_GetAudioBuffer(emus[i], &lens[i]);
+        if (lens[0] != lens[1] || memcmp(audio[0], audio[1], lens[0]) != 0)
+            failure = "Audio";
+        for (int i = 0; i < 2; i++)
+            Emu_ClearAudioBuffer(emus[i]);
+
+        //Saving brings the catch-up PPU up to date, so its state is compared after
+        for (int i = 0; i < 2; i++)
+            Emu_SaveState(emus[i], states[i], stateSize);
+        if (failure == NULL)
+            failure = ComparePPU(&emus[0]->ppu, &emus[1]->ppu);
+        if (failure == NULL && memcmp(states[0], states[1], stateSize) != 0)
+            failure = "Save states";
+    }
+
+    if (failure != NULL)
+        printf("FAIL: %s: %s differ in frame %d.\n", path, failure, frame);
+    else
+        printf("%s: %d frames match\n", path, frames);
+    for (int i = 0; i < 2; i++) {
+        free(states[i]);
+        Emu_Free(emus[i]);
+    }
+    return failure != NULL;
+}
+
+int main() {
+    int failed = 0;
+    //Select would switch nestest to its page of unofficial opcodes, which the CPU doesn't support all of
+    failed += Run("cpu/nestest.nes", 300, (uint8_t)~BUTTON_SELECT);
+    failed += Run("ppu/ppu_stress.nes", 600, 0xFF);
+    return failed == 0 ? 0 : 1;
+}
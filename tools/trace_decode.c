@@ -0,0 +1,66 @@
+/*
+* Decode a binary CPU trace (see trace.h) to the text format of the CPU log:
+*     c000 JMP A:00 X:00 Y:00 S:fd P:24 CYC:8
+* NMIs and IRQs are printed as "NMI" and "IRQ", and bus accesses as "  read $2002 = $80 CYC:30" below their instruction.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "cpu.h"
+#include "trace.h"
+
+#define BLOCK_RECORDS 65536
+
+static void PrintRecord(FILE* out, const TraceRecord* r) {
+    unsigned long long cycle = TRACE_RECORD_CYCLE(r);
+    switch (TRACE_RECORD_TYPE(r)) {
+        case TRACE_INSTR:
+            fprintf(out, "%04x %s A:%02x X:%02x Y:%02x S:%02x P:%02x CYC:%llu\n", r->addr,
+                OPCODE_NAMES[r->data] ? OPCODE_NAMES[r->data] : "Null", r->a, r->x, r->y, r->s, r->p, cycle);
+            break;
+        case TRACE_NMI: fprintf(out, "NMI\n"); break;
+        case TRACE_IRQ: fprintf(out, "IRQ\n"); break;
+        case TRACE_READ: fprintf(out, "  read $%04x = $%02x CYC:%llu\n", r->addr, r->data, cycle); break;
+        case TRACE_WRITE: fprintf(out, "  write $%04x = $%02x CYC:%llu\n", r->addr, r->data, cycle); break;
+        default: fprintf(out, "Unknown record type %d\n", TRACE_RECORD_TYPE(r)); break;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage: %s <trace file> [output file]\n", argv[0]);
+        printf("Decodes a binary CPU trace to text. Prints to stdout if no output file is given.\n");
+        return 1;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        perror("Error opening trace file");
+        return 1;
+    }
+    TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "Error: %s is not a version %d CPU trace.\n", argv[1], TRACE_VERSION);
+        fclose(in);
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (argc > 2 && (out = fopen(argv[2], "w")) == NULL) {
+        perror("Error opening output file");
+        fclose(in);
+        return 1;
+    }
+
+    static TraceRecord records[BLOCK_RECORDS];
+    size_t count;
+    while ((count = fread(records, sizeof(TraceRecord), BLOCK_RECORDS, in)) > 0) {
+        for (size_t i = 0; i < count; i++)
+            PrintRecord(out, &records[i]);
+    }
+
+    fclose(in);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}